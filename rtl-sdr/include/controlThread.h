@@ -23,17 +23,29 @@
 extern "C" {
 #endif
 
+#define MAX_I2C_REGISTERS  RTLSDR_MAX_I2C_REGISTERS
+#define TX_BUF_LEN (5+MAX_I2C_REGISTERS) //1 command, 2 tuner_gain, 2 len
+
+typedef void (*ctrl_report_cb)(void *ctx, const unsigned char *frame, int len);
+
 typedef struct
 {
 	rtlsdr_dev_t *dev;
 	int port;
-	int wait;
+	int wait;		/* report period in us */
+	int sample_wait;	/* register sampling period in us, 0 = off */
 	int report_i2c;
 	char *addr;
 	int* pDoExit;
+	volatile int *pListeners;	/* response clients, no sampling without */
+	ctrl_report_cb report;	/* receives the REPORT_I2C_REGS frames */
+	void *report_ctx;
+	rtlsdr_ctrl_cb_t sampled;	/* completion of a register sampling, its duration */
+	void *sampled_ctx;
 }
 ctrl_thread_data_t;
 void *ctrl_thread_fn(void *arg);
+void ctrl_thread_stop(ctrl_thread_data_t *data);
 
 #ifdef __cplusplus
 }
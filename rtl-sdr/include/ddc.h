@@ -0,0 +1,78 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DDC_H
+#define __DDC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Digital downconverter for the 8 bit unsigned IQ stream of the dongle:
+ * the channel at a given offset from the tuned frequency is mixed down to
+ * baseband by a numerically controlled oscillator and low pass filtered
+ * and decimated by an integer factor with a polyphase FIR, which only
+ * evaluates the filter for the samples kept.
+ */
+#define DDC_MAX_DECIM	64
+
+typedef struct ddc ddc_t;
+
+/*!
+ * Create a downconverter.
+ *
+ * \param decim decimation factor, 2 to DDC_MAX_DECIM
+ * \param format output format, one of SAMPLE_FORMAT_* in sampleFormat.h
+ * \return downconverter handle, NULL on invalid parameters or no memory
+ */
+ddc_t *ddc_create(uint32_t decim, int format);
+
+void ddc_destroy(ddc_t *ddc);
+
+/*!
+ * Set the channel to be extracted. Cheap if nothing changed, so it may be
+ * called for every buffer to follow sample rate changes.
+ *
+ * \param offset channel center relative to the tuned frequency in Hz
+ * \param samp_rate input sample rate in Hz
+ */
+void ddc_tune(ddc_t *ddc, int32_t offset, uint32_t samp_rate);
+
+/*!
+ * \return maximum number of output bytes for len input bytes
+ */
+uint32_t ddc_max_output(ddc_t *ddc, uint32_t len);
+
+/*!
+ * Downconvert a block of input samples. The filter state is kept between
+ * calls, so consecutive blocks form a continuous stream.
+ *
+ * \param in 8 bit unsigned I/Q samples
+ * \param len length of in in bytes
+ * \param out output buffer of at least ddc_max_output(len) bytes
+ * \return number of bytes written to out
+ */
+uint32_t ddc_process(ddc_t *ddc, const unsigned char *in, uint32_t len, unsigned char *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IQ_REPLAY_H
+#define __IQ_REPLAY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sample source playing back CU8 recordings instead of a dongle. Each
+ * recording is a segment with a center frequency and a sample rate, either
+ * a raw file as written by rtl_sdr or a WAV file with an auxi chunk as
+ * written by wavewrite.c. The files are memory mapped and handed out
+ * without copying.
+ *
+ * Tuning and setting the sample rate select the segment recorded at that
+ * rate whose center is closest to the frequency, as long as the frequency
+ * lies within its band. The samples are not shifted, the recording plays
+ * as it is. Without a matching segment the stream carries silence (0x80).
+ *
+ * All segments play from one common time position, which wraps at the end
+ * of the segment playing, so switching between recordings made at the same
+ * time stays in step.
+ */
+typedef struct iq_replay iq_replay_t;
+
+#define IQ_REPLAY_MAX_SEGMENTS	32
+
+/*!
+ * Allocate a replay source.
+ *
+ * \param max_len maximum number of bytes returned by iq_replay_read()
+ * \return replay handle, NULL if the allocation failed
+ */
+iq_replay_t *iq_replay_create(uint32_t max_len);
+
+/*!
+ * Unmap all segments and free the replay source. Pointers returned by
+ * iq_replay_read() are invalid afterwards.
+ */
+void iq_replay_destroy(iq_replay_t *rp);
+
+/*!
+ * Map a recording as a new segment.
+ *
+ * \param path raw CU8 or WAV file
+ * \param freq center frequency in Hz, 0 to take it from the WAV auxi chunk
+ * \param rate sample rate in Hz, 0 to take it from the WAV fmt chunk
+ * \return segment index, -1 if the file could not be mapped or is no
+ *	   8 bit I/Q recording, -2 if frequency or rate are unknown
+ */
+int iq_replay_add(iq_replay_t *rp, const char *path, uint32_t freq, uint32_t rate);
+
+/*!
+ * Details of a segment.
+ *
+ * \return 0 on success, -1 if there is no such segment
+ */
+int iq_replay_get_segment(iq_replay_t *rp, int index, uint32_t *freq, uint32_t *rate,
+			  uint64_t *samples);
+
+/*!
+ * Playback speed relative to the recorded sample rate, 0 for as fast as
+ * the readers take the samples.
+ */
+void iq_replay_set_speed(iq_replay_t *rp, double speed);
+
+/*!
+ * Select the segment for a center frequency.
+ *
+ * \return segment index, -1 if silence is playing
+ */
+int iq_replay_tune(iq_replay_t *rp, uint32_t freq);
+
+/*!
+ * Select the segment for a sample rate. The time position is kept, the
+ * pacing starts over with the new rate.
+ *
+ * \return segment index, -1 if silence is playing
+ */
+int iq_replay_set_rate(iq_replay_t *rp, uint32_t rate);
+
+/*!
+ * Take the next samples of the playing segment. The chunk ends early at
+ * the end of the segment, the following call continues at its start.
+ *
+ * \param len maximum number of bytes, limited to max_len
+ * \param buf set to the samples, which stay valid until the replay source
+ *	      is destroyed
+ * \return number of bytes in buf
+ */
+uint32_t iq_replay_read(iq_replay_t *rp, uint32_t len, const unsigned char **buf);
+
+/*!
+ * Wait until the samples taken so far are due at the playback speed. The
+ * due times follow from the start of the playback, so the waits don't
+ * accumulate drift.
+ *
+ * \param len number of bytes taken by the last iq_replay_read()
+ * \return due time of the last sample in ns, on the clock of stats_time_ns()
+ */
+uint64_t iq_replay_pace(iq_replay_t *rp, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
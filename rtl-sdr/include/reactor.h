@@ -0,0 +1,128 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET reactor_fd_t;
+typedef WSABUF reactor_iov_t;
+#define REACTOR_IOV_SET(v, p, n)	do { (v)->buf = (char *)(p); (v)->len = (ULONG)(n); } while (0)
+#else
+#include <sys/uio.h>
+typedef int reactor_fd_t;
+typedef struct iovec reactor_iov_t;
+#define REACTOR_IOV_SET(v, p, n)	do { (v)->iov_base = (void *)(p); (v)->iov_len = (n); } while (0)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Single threaded socket event loop for rtl_tcp.
+ *
+ * On Linux the sockets are registered edge-triggered with epoll, elsewhere
+ * a select() loop is used. Handlers must therefore always read or write
+ * until the socket would block, and only ask for REACTOR_WRITE after a
+ * send() did not go through completely.
+ */
+#define REACTOR_READ	0x01
+#define REACTOR_WRITE	0x02
+#define REACTOR_ERROR	0x04
+
+/* result of reactor_io_status() */
+#define REACTOR_IO_ERROR	0
+#define REACTOR_IO_AGAIN	1
+#define REACTOR_IO_RETRY	2
+
+typedef struct reactor reactor_t;
+
+typedef void (*reactor_cb_t)(reactor_t *reactor, int events, void *ctx);
+
+/*!
+ * Create an event loop.
+ *
+ * \param max_fds maximum number of sockets registered at the same time
+ * \return reactor handle, NULL on error
+ */
+reactor_t *reactor_create(int max_fds);
+
+void reactor_destroy(reactor_t *reactor);
+
+/*!
+ * Register a non-blocking socket.
+ *
+ * \param fd socket, see reactor_set_nonblocking()
+ * \param events REACTOR_READ and/or REACTOR_WRITE
+ * \param cb handler called from reactor_poll() with the pending events
+ * \param ctx passed to the handler
+ * \return 0 on success, -1 if the table is full or the socket was refused
+ */
+int reactor_add(reactor_t *reactor, reactor_fd_t fd, int events, reactor_cb_t cb, void *ctx);
+
+/*!
+ * Change the events a registered socket is interested in.
+ */
+void reactor_set(reactor_t *reactor, reactor_fd_t fd, int events);
+
+/*!
+ * Unregister a socket, may be called from within a handler.
+ * The socket itself is not closed.
+ */
+void reactor_del(reactor_t *reactor, reactor_fd_t fd);
+
+/*!
+ * Wait for events and dispatch them to the handlers.
+ *
+ * \param timeout_ms maximum time to wait, -1 for no limit
+ * \return number of sockets dispatched, 0 on timeout or wakeup, -1 on error
+ */
+int reactor_poll(reactor_t *reactor, int timeout_ms);
+
+/*!
+ * Make a pending or the next reactor_poll() return immediately.
+ * Safe to call from any thread and from signal handlers.
+ */
+void reactor_wakeup(reactor_t *reactor);
+
+int reactor_set_nonblocking(reactor_fd_t fd);
+
+/*!
+ * Gathered send of several buffers with a single syscall
+ * (sendmsg() or WSASend()).
+ *
+ * \param iov buffers, filled in with REACTOR_IOV_SET()
+ * \param cnt number of buffers
+ * \return number of bytes sent, -1 on error, see reactor_io_status()
+ */
+int reactor_sendv(reactor_fd_t fd, reactor_iov_t *iov, int cnt);
+
+/*!
+ * Classify the error of the last failed send() or recv().
+ *
+ * \return REACTOR_IO_AGAIN if the socket would block, REACTOR_IO_RETRY if
+ *	   the call was interrupted, REACTOR_IO_ERROR otherwise
+ */
+int reactor_io_status(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
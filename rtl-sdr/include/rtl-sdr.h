@@ -66,8 +66,67 @@ RTLSDR_API int rtlsdr_get_device_usb_strings(uint32_t index,
  */
 RTLSDR_API int rtlsdr_get_index_by_serial(const char *serial);
 
+/* a device of a snapshot taken by rtlsdr_enumerate() */
+typedef struct rtlsdr_devinfo {
+	uint32_t index;		/* for rtlsdr_open() while nothing is plugged */
+	uint16_t vid;
+	uint16_t pid;
+	const char *name;	/* see rtlsdr_get_device_name() */
+	char manufact[256];
+	char product[256];
+	char serial[256];	/* empty if the device couldn't be opened */
+	char path[32];		/* bus and ports, like "1-2.4" */
+} rtlsdr_devinfo_t;
+
+typedef struct rtlsdr_devlist {
+	uint32_t count;
+	rtlsdr_devinfo_t *devs;
+} rtlsdr_devlist_t;
+
+/*!
+ * Take a snapshot of the supported devices in a single pass over the
+ * USB devices. Unlike rtlsdr_get_device_usb_strings(), which walks the
+ * list and opens the device again on every call, the strings of all
+ * devices are read once here.
+ *
+ * \param out the snapshot, free with rtlsdr_free_devlist()
+ * \return number of devices found, < 0 on error
+ */
+RTLSDR_API int rtlsdr_enumerate(rtlsdr_devlist_t **out);
+
+RTLSDR_API void rtlsdr_free_devlist(rtlsdr_devlist_t *list);
+
+enum rtlsdr_serial_match {
+	RTLSDR_MATCH_EXACT = 1,
+	RTLSDR_MATCH_PREFIX = 2,
+	RTLSDR_MATCH_SUFFIX = 4,
+	RTLSDR_MATCH_ANY = 7
+};
+
+/*!
+ * Look up a serial number in a snapshot. An exact match on any device is
+ * preferred over a prefix match, which is preferred over a suffix match.
+ *
+ * \param list snapshot from rtlsdr_enumerate()
+ * \param serial serial number, or a part of it
+ * \param match RTLSDR_MATCH_* flags of the matches to try
+ * \return index into list->devs, -1 if not found
+ */
+RTLSDR_API int rtlsdr_devlist_find(const rtlsdr_devlist_t *list,
+				   const char *serial, int match);
+
 RTLSDR_API int rtlsdr_open(rtlsdr_dev_t **dev, uint32_t index);
 
+/*!
+ * Open the device of a snapshot entry. It is found by its USB port, so
+ * devices plugged or unplugged since the snapshot don't matter.
+ *
+ * \param dev the device handle
+ * \param info entry of a snapshot from rtlsdr_enumerate()
+ * \return 0 on success, -1 if the device is gone
+ */
+RTLSDR_API int rtlsdr_open_devinfo(rtlsdr_dev_t **dev, const rtlsdr_devinfo_t *info);
+
 RTLSDR_API int rtlsdr_close(rtlsdr_dev_t *dev);
 
 /* configuration functions */
@@ -157,6 +216,32 @@ RTLSDR_API int rtlsdr_read_eeprom(rtlsdr_dev_t *dev, uint8_t *data,
  */
 RTLSDR_API int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq);
 
+/*!
+ * Set the frequencies for rtlsdr_hop().
+ *
+ * For R820T/R828D tuners the PLL and filter settings of every frequency
+ * are computed here, so a hop writes the changed tuner registers with a
+ * single I2C transfer. Other tuners, direct sampling and a changed offset
+ * tuning setting fall back to rtlsdr_set_center_freq(). Changing the
+ * sideband, IF bandwidth or frequency correction afterwards is detected
+ * and handled the same way, set the table again to restore fast hops.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param freqs frequencies in Hz, copied
+ * \param num number of frequencies, 0 to clear the table
+ * \return 0 on success, -2 if a frequency could not be prepared
+ */
+RTLSDR_API int rtlsdr_set_hop_table(rtlsdr_dev_t *dev, const uint32_t *freqs, int num);
+
+/*!
+ * Tune to a frequency of the hop table.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param index position in the table given to rtlsdr_set_hop_table()
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_hop(rtlsdr_dev_t *dev, int index);
+
 /*!
  * Get actual frequency the device is tuned to.
  *
@@ -406,10 +491,12 @@ RTLSDR_API int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, v
  * \param cb callback function to return received samples
  * \param ctx user specific context to pass via the callback function
  * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
- *		  set to 0 for default buffer count (15)
+ *		  set to 0 for default buffer count (15), or for the count
+ *		  derived by rtlsdr_set_xfer_policy()
  * \param buf_len optional buffer length, must be multiple of 512,
  *		  should be a multiple of 16384 (URB size), set to 0
- *		  for default buffer length (16 * 32 * 512)
+ *		  for default buffer length (16 * 32 * 512), or for the
+ *		  length derived by rtlsdr_set_xfer_policy()
  * \return 0 on success
  */
 RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
@@ -418,6 +505,221 @@ RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+enum rtlsdr_xfer_prefer {
+	RTLSDR_XFER_LOW_CPU = 0,	/* few large transfers, fewer wakeups */
+	RTLSDR_XFER_NO_OVERRUN		/* short transfers, deep queue */
+};
+
+/*!
+ * Size the USB transfers from the sample rate instead of fixed defaults.
+ * When the asynchronous read functions are given 0 for the buffer count
+ * or length, the length is chosen so that a transfer completes within
+ * latency_us (a quarter of it when preferring no overruns) and the count
+ * so that the transfers in flight cover 100 ms of samples (500 ms when
+ * preferring no overruns). If rtlsdr_set_sample_rate() changes the rate
+ * while streaming, the transfers are cancelled and set up again with the
+ * sizes derived for the new rate; the samples in flight are lost.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param latency_us latency budget of a transfer, 0 to use the defaults
+ * \param prefer see enum rtlsdr_xfer_prefer
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_xfer_policy(rtlsdr_dev_t *dev, uint32_t latency_us,
+				      int prefer);
+
+typedef struct rtlsdr_xfer_info {
+	uint32_t buf_num;	/* transfers in flight */
+	uint32_t buf_len;	/* bytes per transfer */
+	uint32_t jitter_avg_us;	/* mean deviation of completion intervals */
+	uint32_t jitter_max_us;	/* from the sample time of a transfer */
+	uint32_t restarts;	/* transfers set up again after a rate change */
+} rtlsdr_xfer_info_t;
+
+/*!
+ * Get the transfer sizes of the current or last stream and the jitter of
+ * the transfer completions measured since it was started.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param info filled in
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_xfer_info(rtlsdr_dev_t *dev, rtlsdr_xfer_info_t *info);
+
+typedef struct rtlsdr_held_buf rtlsdr_held_buf_t;
+
+typedef void(*rtlsdr_read_held_cb_t)(rtlsdr_held_buf_t *hbuf, unsigned char *buf,
+				     uint32_t len, void *ctx);
+
+/*!
+ * Read samples from the device asynchronously without copying them.
+ * Unlike rtlsdr_read_async(), the buffer passed to the callback stays owned
+ * by the caller until it is given back with rtlsdr_release_buf(), which may
+ * happen later and from any thread. A completed transfer is resubmitted
+ * right away with a buffer from the spare pool, or as soon as a buffer is
+ * released if the pool is exhausted. On Linux the buffers are allocated
+ * from usbfs, so samples are sent on straight from the DMA memory.
+ *
+ * This function will block until it is being canceled using
+ * rtlsdr_cancel_async(). Buffers still held at that point remain valid,
+ * they must be released before rtlsdr_close() is called.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional number of transfers in flight, 0 for default (15)
+ * \param buf_len optional buffer length, see rtlsdr_read_async()
+ * \param spare_num number of additional buffers the caller may hold
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_read_async_held(rtlsdr_dev_t *dev,
+				      rtlsdr_read_held_cb_t cb,
+				      void *ctx,
+				      uint32_t buf_num,
+				      uint32_t buf_len,
+				      uint32_t spare_num);
+
+/*!
+ * Give a buffer received by a rtlsdr_read_async_held() callback back to
+ * the device.
+ *
+ * \param hbuf buffer handle passed to the callback
+ */
+RTLSDR_API void rtlsdr_release_buf(rtlsdr_held_buf_t *hbuf);
+
+/* a buffer taken from the queue of rtlsdr_stream_start() */
+typedef struct rtlsdr_stream_buf {
+	rtlsdr_held_buf_t *hbuf;	/* give back with rtlsdr_release_buf() */
+	unsigned char *buf;
+	uint32_t len;
+	uint64_t time_ns;	/* capture time, see rtlsdr_get_buffer_time() */
+	int segment;		/* see rtlsdr_get_buffer_segment() */
+	uint32_t settled;
+} rtlsdr_stream_buf_t;
+
+/*!
+ * Stream from an event thread of the library instead of a callback. The
+ * thread, at real time priority where permitted, only handles the USB
+ * events and resubmits the transfers. Completed buffers go into a lock-free
+ * queue, taken out with rtlsdr_stream_get() by one consumer thread, so a
+ * slow consumer never delays the transfers. If the queue is full, a
+ * buffer is dropped and counted, see rtlsdr_stream_overruns(). Buffers
+ * work like those of rtlsdr_read_async_held().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf_num optional number of transfers in flight, 0 for default (15)
+ * \param buf_len optional buffer length, see rtlsdr_read_async()
+ * \param queue_len buffers the queue holds, rounded up to a power of two,
+ *        0 for default (30). As many spare buffers are allocated; the
+ *        consumer should hold a few at most beyond that.
+ * \return 0 on success, -2 if already streaming
+ */
+RTLSDR_API int rtlsdr_stream_start(rtlsdr_dev_t *dev, uint32_t buf_num,
+				   uint32_t buf_len, uint32_t queue_len);
+
+/*!
+ * Take the next buffer of the stream.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param buf filled in
+ * \param timeout_ms time to wait for a buffer, 0 to return at once
+ * \return 0 on success, 1 on timeout, -1 if streaming has ended, e.g.
+ *         after rtlsdr_cancel_async() or a lost device
+ */
+RTLSDR_API int rtlsdr_stream_get(rtlsdr_dev_t *dev, rtlsdr_stream_buf_t *buf, int timeout_ms);
+
+/*!
+ * Get a descriptor to poll for the stream: readable when buffers may be
+ * waiting, reset by rtlsdr_stream_get(). Linux only (eventfd).
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return file descriptor, -1 if not available
+ */
+RTLSDR_API int rtlsdr_stream_fd(rtlsdr_dev_t *dev);
+
+/*!
+ * \param dev the device handle given by rtlsdr_open()
+ * \return buffers dropped because the queue was full
+ */
+RTLSDR_API uint32_t rtlsdr_stream_overruns(rtlsdr_dev_t *dev);
+
+/*!
+ * Stop streaming and end the event thread. Buffers left in the queue are
+ * released, those taken must still be released before rtlsdr_close().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return result of the streaming, 0 on success
+ */
+RTLSDR_API int rtlsdr_stream_stop(rtlsdr_dev_t *dev);
+
+/*!
+ * Get the capture time of the buffer passed to the running async callback,
+ * taken when its USB transfer completed. Only valid within the callback.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return monotonic host time in nanoseconds, unrelated to the wall clock
+ */
+RTLSDR_API uint64_t rtlsdr_get_buffer_time(rtlsdr_dev_t *dev);
+
+/*!
+ * Visit a list of frequencies in turn while streaming. The retunes are
+ * done by the async event thread between two transfers, outside of the
+ * transfer callbacks, through the hop table, which this replaces (see
+ * rtlsdr_set_hop_table()). A segment is left at the first transfer
+ * boundary after its dwell time of settled samples. Each delivered buffer
+ * is tagged, see rtlsdr_get_buffer_segment(). The schedule starts with the
+ * first segment with the next streaming run, or right away while streaming.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param freqs frequencies in Hz
+ * \param dwell_us settled time to receive at each frequency, in us
+ * \param num length of the lists, 0 to stop hopping
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_hop_schedule(rtlsdr_dev_t *dev, const uint32_t *freqs,
+				       const uint32_t *dwell_us, int num);
+
+/*!
+ * Get the hop schedule segment of the buffer passed to the running async
+ * callback. Only valid within the callback.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param settled set to the byte offset in the buffer where the samples
+ *        taken after the retune has settled begin, the buffer length if
+ *        none of them did, may be NULL
+ * \return index of the segment in the schedule, -1 if not hopping
+ */
+RTLSDR_API int rtlsdr_get_buffer_segment(rtlsdr_dev_t *dev, uint32_t *settled);
+
+/*!
+ * Get the time the tuner takes to settle after a retune, a default for its
+ * type unless measured with rtlsdr_calibrate_hop_settle().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return settling time in us
+ */
+RTLSDR_API uint32_t rtlsdr_get_hop_settle(rtlsdr_dev_t *dev);
+
+/*!
+ * Measure the settling time of the tuner after a retune, from the power of
+ * the samples following a few retunes at the current sample rate. Takes
+ * about 200 ms and can't be done while streaming; the frequency is set
+ * back afterwards.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return settling time in us, as returned by rtlsdr_get_hop_settle(),
+ *         negative on error
+ */
+RTLSDR_API int rtlsdr_calibrate_hop_settle(rtlsdr_dev_t *dev);
+
+/*!
+ * Get the number of failed USB transfers since the device was opened.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return transfers completed with an error status
+ */
+RTLSDR_API uint32_t rtlsdr_get_xfer_errors(rtlsdr_dev_t *dev);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -478,6 +780,9 @@ RTLSDR_API int rtlsdr_set_bias_tee_gpio(rtlsdr_dev_t *dev, int gpio, int on);
  *   '0' to deactivate, '1' or 'i' for I-ADC input, '2' or 'q' for Q-ADC input
  * option 't' or 'T' for enabling bias tee on GPIO PIN 0 as with rtlsdr_set_bias_tee():
  *   '1' for Bias T on. '0' for Bias T off.
+ * option 'shadowcheck' (debug) compares the host side copy of the RTL2832
+ *   registers with the device, now and from then on whenever it is used,
+ *   and reports differences to stderr. Returns -1 if one was found.
  *
  * \param dev the device handle given by rtlsdr_open()
  * \param opts described option string
@@ -497,10 +802,69 @@ RTLSDR_API int rtlsdr_set_opt_string(rtlsdr_dev_t *dev, const char *opts, int ve
  */
 RTLSDR_API int rtlsdr_set_tuner_i2c_register(rtlsdr_dev_t *dev, unsigned i2c_register, unsigned mask, unsigned data);
 
+/* size of the buffer for rtlsdr_get_tuner_i2c_register() */
+#define RTLSDR_MAX_I2C_REGISTERS	256
+
+/*!
+ * Get the tuner registers from the snapshot taken by
+ * rtlsdr_sample_tuner_i2c_register(), without any USB traffic. Registers
+ * the driver keeps a shadow copy of follow every write right away.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param data buffer of RTLSDR_MAX_I2C_REGISTERS bytes
+ * \param len set to the number of registers
+ * \param strength set to the tuner gain in tenth dB
+ * \return 0 on success, 1 if no snapshot was taken yet
+ */
 RTLSDR_API int rtlsdr_get_tuner_i2c_register(rtlsdr_dev_t *dev, unsigned char* data, int *len, int *strength);
 
+/*!
+ * Refresh the register snapshot from the tuner. Meant to be called
+ * periodically by a low priority thread: it steps back for control
+ * operations, which wait for a few register accesses at most. Call it on
+ * a thread of its own rather than through RTLSDR_OP_SAMPLE_REGS: the bus
+ * is released while the detector settles, which only lets queued control
+ * operations in when the queue thread is free.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, 1 if skipped because of a control operation,
+ *         negative on error
+ */
+RTLSDR_API int rtlsdr_sample_tuner_i2c_register(rtlsdr_dev_t *dev);
+
 RTLSDR_API void rtlsdr_cal_imr(const int cal_imr);
 
+/*!
+ * Configure the cache of the R820T/R828D image rejection calibration
+ * enabled with rtlsdr_cal_imr(). Entries are keyed by USB serial, tuner
+ * chip and crystal frequency; a current entry makes rtlsdr_open() skip
+ * the search, which takes a few seconds. Must be called before
+ * rtlsdr_open(). Without a call the path is taken from the environment
+ * variable RTLSDR_IMR_CACHE, else ~/.rtlsdr_imr (%APPDATA%\rtlsdr_imr.txt
+ * on Windows), and entries expire after 30 days. Processes sharing the
+ * file serialize their updates by the lock file <path>.lock.
+ *
+ * Stock dongles all carry the serial "00000001", so they share one entry
+ * and thus one calibration; give each dongle its own serial (rtl_eeprom -s)
+ * before calibrating several of them.
+ *
+ * \param path cache file, NULL for the default, "" to disable the cache
+ * \param max_age seconds after which an entry is calibrated again,
+ *        0 for never
+ */
+RTLSDR_API void rtlsdr_set_imr_cache(const char *path, int max_age);
+
+/*!
+ * Run the image rejection calibration now, e.g. once the dongle has
+ * reached its working temperature, and update the cache. Tuner settings
+ * and frequency are restored afterwards.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 0 on success, -2 if not supported by the tuner or while in
+ *         direct sampling mode
+ */
+RTLSDR_API int rtlsdr_recalibrate_imr(rtlsdr_dev_t *dev);
+
 RTLSDR_API int rtlsdr_reset_demod(rtlsdr_dev_t *dev);
 
 /*!
@@ -514,6 +878,135 @@ RTLSDR_API int rtlsdr_reset_demod(rtlsdr_dev_t *dev);
  */
 RTLSDR_API int rtlsdr_set_dithering(rtlsdr_dev_t *dev, int dither);
 
+/* settings of rtlsdr_set_tuning() */
+#define RTLSDR_TUNING_BANDWIDTH		0x01
+#define RTLSDR_TUNING_FREQ		0x02
+#define RTLSDR_TUNING_AGC_MODE		0x04
+#define RTLSDR_TUNING_GAIN_MODE		0x08
+#define RTLSDR_TUNING_GAIN		0x10
+
+typedef struct rtlsdr_tuning {
+	uint32_t flags;		/* RTLSDR_TUNING_*, the settings to apply */
+	uint32_t bandwidth;	/* as rtlsdr_set_tuner_bandwidth() */
+	uint32_t freq;		/* as rtlsdr_set_center_freq() */
+	int agc_mode;		/* as rtlsdr_set_agc_mode() */
+	int gain_mode;		/* as rtlsdr_set_tuner_gain_mode() */
+	int gain;		/* as rtlsdr_set_tuner_gain() */
+} rtlsdr_tuning_t;
+
+/*!
+ * Apply several tuner settings at once, in the order bandwidth, frequency,
+ * AGC mode, gain mode and gain, so that the frequency is programmed only
+ * once with the new IF. The tuner is accessed in a single I2C repeater
+ * session, so no register sampling or other control operation comes in
+ * between.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param tuning the settings
+ * \return 0 on success, else the failures of the single settings or'ed
+ */
+RTLSDR_API int rtlsdr_set_tuning(rtlsdr_dev_t *dev, const rtlsdr_tuning_t *tuning);
+
+/* control queue */
+
+/*
+ * Requests are executed one at a time by a control thread of the device,
+ * the classes in order of priority, each in order of submission.
+ */
+enum rtlsdr_ctrl_class {
+	RTLSDR_CTRL_TUNE = 0,	/* retune and gain */
+	RTLSDR_CTRL_TELEMETRY,	/* register sampling */
+	RTLSDR_CTRL_IR,		/* remote control receiver */
+	RTLSDR_CTRL_CLASSES
+};
+
+enum rtlsdr_ctrl_op {
+	RTLSDR_OP_CENTER_FREQ = 0,	/* rtlsdr_set_center_freq(), param in Hz */
+	RTLSDR_OP_HOP,			/* rtlsdr_hop(), param the index */
+	RTLSDR_OP_FREQ_CORRECTION,	/* rtlsdr_set_freq_correction(), param in ppm */
+	RTLSDR_OP_TUNER_GAIN_MODE,	/* rtlsdr_set_tuner_gain_mode() */
+	RTLSDR_OP_TUNER_GAIN,		/* rtlsdr_set_tuner_gain(), param in tenth dB */
+	RTLSDR_OP_TUNER_IF_GAIN,	/* rtlsdr_set_tuner_if_gain(), param stage << 16 | gain */
+	RTLSDR_OP_AGC_MODE,		/* rtlsdr_set_agc_mode() */
+	RTLSDR_OP_SAMPLE_REGS,		/* rtlsdr_sample_tuner_i2c_register() */
+	RTLSDR_OP_IR_QUERY,		/* rtlsdr_ir_query() into buf */
+	RTLSDR_OP_TUNING,		/* rtlsdr_set_tuning(), buf the rtlsdr_tuning_t */
+	RTLSDR_OP_NUM
+};
+
+/* result of a request replaced by a later one before it was executed */
+#define RTLSDR_CTRL_SUPERSEDED	(-20)
+/* result of the requests still queued when the device is closed */
+#define RTLSDR_CTRL_CANCELLED	(-21)
+
+/*!
+ * Completion of a queued request, called by the control thread.
+ *
+ * \param result return value of the operation, or RTLSDR_CTRL_SUPERSEDED,
+ *        RTLSDR_CTRL_CANCELLED
+ * \param latency_us time from the submission to the completion
+ * \param ctx the context given to rtlsdr_ctrl_submit()
+ */
+typedef void(*rtlsdr_ctrl_cb_t)(int result, uint32_t latency_us, void *ctx);
+
+/*!
+ * Queue an operation for the control thread, which is started with the
+ * first request. A request still waiting is superseded by a later one
+ * setting the same thing, e.g. the center frequency, unless that would
+ * reorder it against other requests of its kind: only the latest tuning
+ * is executed. Settings and IR queries of the same device made directly
+ * are serialized with the queue, but not prioritized.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param op operation, its class follows from it
+ * \param param argument of the operation
+ * \param buf buffer of RTLSDR_OP_IR_QUERY, which must stay valid until
+ *        the completion, NULL otherwise
+ * \param buf_len size of buf
+ * \param cb completion callback, may be NULL
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success, -1 if the queue is full or the thread could not
+ *         be started
+ */
+RTLSDR_API int rtlsdr_ctrl_submit(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_op op,
+				  uint32_t param, uint8_t *buf, size_t buf_len,
+				  rtlsdr_ctrl_cb_t cb, void *ctx);
+
+/*!
+ * Queue an operation and wait for its completion, see rtlsdr_ctrl_submit().
+ *
+ * \return the result of the operation
+ */
+RTLSDR_API int rtlsdr_ctrl_call(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_op op,
+				uint32_t param, uint8_t *buf, size_t buf_len);
+
+/*!
+ * Wait until all queued requests have been completed, before a setting
+ * made directly that must not overtake them.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ */
+RTLSDR_API void rtlsdr_ctrl_flush(rtlsdr_dev_t *dev);
+
+typedef struct rtlsdr_ctrl_stats {
+	uint32_t completed;	/* requests executed */
+	uint32_t superseded;	/* requests replaced before execution */
+	uint32_t pending;	/* requests waiting now */
+	uint64_t latency_sum_us;	/* submission to completion, of completed */
+	uint32_t latency_max_us;
+	uint32_t wait_max_us;	/* time in the queue, of completed */
+} rtlsdr_ctrl_stats_t;
+
+/*!
+ * Get the statistics of a request class since rtlsdr_open().
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param cls enum rtlsdr_ctrl_class
+ * \param stats filled in
+ * \return 0 on success, -1 for an invalid class
+ */
+RTLSDR_API int rtlsdr_get_ctrl_stats(rtlsdr_dev_t *dev, int cls, rtlsdr_ctrl_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,8 @@
 #ifndef __RTL_TCP_H
 #define __RTL_TCP_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -29,6 +31,11 @@ extern "C" {
  * commands 0x01..0x0E are compatible to osmocom's rtlsdr
  * see https://github.com/osmocom/rtl-sdr/blob/master/src/rtl_tcp.c
  * commands >= 0x40 are extensions
+ *
+ * Started with -H, the server announces SET_DDC, SET_SAMPLE_FORMAT and SET_FRAMING by
+ * the magic "RTL1" instead of "RTL0" in the header, and holds the samples back until
+ * the client's first command. Without these commands a client gets plain CU8
+ * samples, as always.
  */
 enum RTL_TCP_COMMANDS {
     SET_FREQUENCY             = 0x01,
@@ -69,9 +76,68 @@ enum RTL_TCP_COMMANDS {
     REPORT_I2C_REGS           = 0x48,   /* perodically report I2C registers
                                          * - if reverse channel is enabled */
     SET_DITHERING			  = 0x49,   /* Enable or disable frequency dithering for R820T */
+    SET_DDC                   = 0x4A,   /* server side downconversion for this client only:
+                                         * 31 .. 24: decimation (2 .. 64, 0 = off),
+                                         *           output rate = sample rate / decimation
+                                         * 23 .. 22: output format as with SET_SAMPLE_FORMAT
+                                         * 21 ..  0: channel offset from the tuned
+                                         *           frequency in Hz (signed) */
+    SET_SAMPLE_FORMAT         = 0x4B,   /* wire format for this client only, little endian:
+                                         * 0 = CU8 (default), 1 = CS16, 2 = CS8, 3 = CF32 */
+    SET_FRAMING               = 0x4C,   /* 1: precede the samples by rtl_tcp_frame_t headers,
+                                         * 0: plain stream (default), for this client only */
+    REPORT_STATS              = 0x4D,   /* response port: request metrics frames, see
+                                         * serverStats.h, every param ms, 0 = once;
+                                         * "GET /metrics" there gives Prometheus text */
+    CALIBRATE_IMR             = 0x4E,   /* R820T/R828D: run the image rejection calibration
+                                         * again and update the cache, param unused */
+    SET_PREROLL               = 0x4F,   /* with persistent streaming (-K): start this client's
+                                         * stream param ms back in time, at most the -K
+                                         * pre-roll; only before its first samples are sent,
+                                         * i.e. as first command */
+    SET_BATCH                 = 0x50,   /* apply the following commands at once:
+                                         * 31 .. 24: number of commands (1 .. 8), which may be
+                                         *           SET_FREQUENCY, SET_GAIN_MODE, SET_GAIN,
+                                         *           SET_TUNER_GAIN_BY_INDEX, SET_AGC_MODE and
+                                         *           SET_TUNER_BANDWIDTH; a gain alone
+                                         *           implies manual gain mode
+                                         * 23 ..  0: tag, repeated in the acknowledgement
+                                         * acknowledged on the response port by a frame of
+                                         * type SET_BATCH, see RTL_TCP_BATCH_ACK_LEN */
 
 };
 
+/*
+ * Body of the SET_BATCH acknowledgement, six 32 bit values in network byte
+ * order: tag, result (0 on success), seq and sample offset within that
+ * transfer where the new settings took effect, i.e. the tuner settled,
+ * then the center frequency in Hz and the tuner gain in tenth dB in effect.
+ * seq counts the transfers like the seq of rtl_tcp_frame_t. A response
+ * client falling more than 16 acknowledgements behind misses the oldest
+ * ones, counted in rtl_tcp_batch_acks_lost_total.
+ */
+#define RTL_TCP_BATCH_ACK_LEN     24
+
+/*
+ * Header in front of every block of samples with SET_FRAMING enabled,
+ * all fields in network byte order like the dongle_info header.
+ * A block is one USB transfer (-l option), 32 header bytes add 0.1 % to
+ * the default of 32 KiB. With SET_DDC a frame carries all transfers
+ * downconverted at once.
+ */
+#define RTL_TCP_FRAME_LOST        0x01  /* samples were lost right before this frame */
+
+typedef struct {
+    unsigned char magic[4];     /* "RTLF" */
+    uint32_t seq;               /* number of the first transfer in this frame */
+    uint32_t samples;           /* I/Q samples following, in the client's format */
+    uint32_t flags;             /* RTL_TCP_FRAME_LOST */
+    uint32_t time_hi;           /* capture time in ns, i.e. completion of the */
+    uint32_t time_lo;           /* (last) transfer, monotonic clock of the server */
+    uint32_t freq;              /* center frequency in Hz */
+    int32_t gain;               /* tuner gain in tenth dB */
+} rtl_tcp_frame_t;
+
 #ifdef __cplusplus
 }
 #endif
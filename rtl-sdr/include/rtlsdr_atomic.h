@@ -0,0 +1,130 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTLSDR_ATOMIC_H
+#define __RTLSDR_ATOMIC_H
+
+/*
+ * Minimal set of atomic operations on 32 bit counters, shared by the
+ * lock-free queues of the library and the tools, plus 64 bit variants for
+ * statistics.
+ * MSVC (C mode) has no <stdatomic.h>, so the Interlocked intrinsics are
+ * used there and the GCC/Clang __atomic builtins everywhere else.
+ */
+
+#include <stdint.h>
+
+#define RTLSDR_CACHE_LINE	64
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+#define RTLSDR_ATOMIC_INLINE static __inline
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_load(volatile uint32_t *p)
+{
+	uint32_t v = *p;	/* volatile access has acquire semantics */
+	_ReadWriteBarrier();
+	return v;
+}
+
+RTLSDR_ATOMIC_INLINE void rtlsdr_atomic_store(volatile uint32_t *p, uint32_t v)
+{
+	_ReadWriteBarrier();
+	*p = v;			/* volatile access has release semantics */
+}
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_xchg(volatile uint32_t *p, uint32_t v)
+{
+	return (uint32_t)_InterlockedExchange((volatile long *)p, (long)v);
+}
+
+RTLSDR_ATOMIC_INLINE int rtlsdr_atomic_cas(volatile uint32_t *p, uint32_t expected, uint32_t desired)
+{
+	return (uint32_t)_InterlockedCompareExchange((volatile long *)p,
+			(long)desired, (long)expected) == expected;
+}
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_add(volatile uint32_t *p, uint32_t v)
+{
+	return (uint32_t)_InterlockedExchangeAdd((volatile long *)p, (long)v) + v;
+}
+
+RTLSDR_ATOMIC_INLINE uint64_t rtlsdr_atomic_load64(volatile uint64_t *p)
+{
+	/* a plain 64 bit read may tear on 32 bit targets */
+	return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)p, 0, 0);
+}
+
+RTLSDR_ATOMIC_INLINE void rtlsdr_atomic_store64(volatile uint64_t *p, uint64_t v)
+{
+	_InterlockedExchange64((volatile __int64 *)p, (__int64)v);
+}
+
+RTLSDR_ATOMIC_INLINE uint64_t rtlsdr_atomic_add64(volatile uint64_t *p, uint64_t v)
+{
+	return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)p, (__int64)v) + v;
+}
+
+#else
+
+#define RTLSDR_ATOMIC_INLINE static inline
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_load(volatile uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+RTLSDR_ATOMIC_INLINE void rtlsdr_atomic_store(volatile uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_xchg(volatile uint32_t *p, uint32_t v)
+{
+	return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+RTLSDR_ATOMIC_INLINE int rtlsdr_atomic_cas(volatile uint32_t *p, uint32_t expected, uint32_t desired)
+{
+	return __atomic_compare_exchange_n(p, &expected, desired, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+RTLSDR_ATOMIC_INLINE uint32_t rtlsdr_atomic_add(volatile uint32_t *p, uint32_t v)
+{
+	return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+RTLSDR_ATOMIC_INLINE uint64_t rtlsdr_atomic_load64(volatile uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+RTLSDR_ATOMIC_INLINE void rtlsdr_atomic_store64(volatile uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+RTLSDR_ATOMIC_INLINE uint64_t rtlsdr_atomic_add64(volatile uint64_t *p, uint64_t v)
+{
+	return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+#endif /* __RTLSDR_ATOMIC_H */
@@ -7,4 +7,7 @@ uint32_t rtlsdr_get_tuner_clock(void *dev);
 int rtlsdr_i2c_write_fn(void *dev, uint8_t addr, uint8_t reg, uint8_t *buf, int len);
 int rtlsdr_i2c_read_fn (void *dev, uint8_t addr, uint8_t reg, uint8_t *buf, int len);
 
+/* for get_i2c_register(): wait with the I2C bus released, nonzero if it was used meanwhile */
+int rtlsdr_i2c_yield(void *dev, int usec);
+
 #endif
@@ -0,0 +1,75 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTLSDR_SIM_H
+#define __RTLSDR_SIM_H
+
+/*
+ * Virtual device: answers the register accesses of librtlsdr from memory
+ * and generates deterministic samples instead of USB transfers. It is
+ * selected by a serial starting with "sim:", followed by comma separated
+ * options:
+ *
+ *   tone=F[@dB]	carrier at F Hz (F with k/M/G suffix, relative to the
+ *			center frequency if it starts with + or -)
+ *   fm=F[@dB]		carrier, FM with a 1 kHz tone and 75 kHz deviation
+ *   am=F[@dB]		carrier, AM with a 1 kHz tone at 50%
+ *   adsb[=@dB]		DF17 squitter at 1090 MHz every 10 ms
+ *   noise=dB		gaussian noise, -40 dBFS by default
+ *   counter		byte counter as in test mode, also when not enabled
+ *   fast		deliver as fast as possible instead of in real time
+ *   settle=us		signals are muted for this long after a retune
+ *   tune=us		time a retune takes
+ *   seed=N		noise seed
+ *
+ * Levels are dBFS at a gain of 30 dB. "sim:" alone is a tone 100 kHz
+ * above the center frequency in noise.
+ */
+
+#include <stdint.h>
+
+#define RTLSDR_SIM_PREFIX	"sim:"
+#define RTLSDR_SIM_INDEX	0x40000000	/* device indexes of virtual devices */
+#define RTLSDR_SIM_MAX		16
+
+typedef struct rtlsdr_sim rtlsdr_sim_t;
+
+/* returns the device index for a "sim:..." serial, < 0 if invalid */
+int rtlsdr_sim_register(const char *serial);
+
+/* returns the serial of a device index, NULL if it's not a virtual device */
+const char *rtlsdr_sim_serial(uint32_t index);
+
+rtlsdr_sim_t *rtlsdr_sim_open(const char *serial);
+void rtlsdr_sim_close(rtlsdr_sim_t *sim);
+
+/* a vendor request of librtlsdr, returns len like libusb_control_transfer() */
+int rtlsdr_sim_control(rtlsdr_sim_t *sim, uint8_t type, uint16_t value,
+		       uint16_t index, unsigned char *data, uint16_t len);
+
+/* the next len bytes of the stream, buf may be NULL to skip them */
+void rtlsdr_sim_read(rtlsdr_sim_t *sim, uint32_t rate, unsigned char *buf, uint32_t len);
+
+int rtlsdr_sim_realtime(rtlsdr_sim_t *sim);
+uint32_t rtlsdr_sim_settle_us(rtlsdr_sim_t *sim);
+
+/* tuner */
+int rtlsdr_sim_set_freq(rtlsdr_sim_t *sim, uint32_t freq);
+int rtlsdr_sim_set_gain(rtlsdr_sim_t *sim, int gain);
+int rtlsdr_sim_set_gain_mode(rtlsdr_sim_t *sim, int manual);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SAMPLE_FORMAT_H
+#define __SAMPLE_FORMAT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * I/Q sample formats served by rtl_tcp, see SET_SAMPLE_FORMAT in rtl_tcp.h.
+ * Multi byte formats are little endian. With v = x - 127.5 for a dongle
+ * sample x:
+ *   CU8	x, as delivered by the dongle
+ *   CS16	v * 256
+ *   CS8	x - 128
+ *   CF32	v / 128
+ */
+#define SAMPLE_FORMAT_CU8	0
+#define SAMPLE_FORMAT_CS16	1
+#define SAMPLE_FORMAT_CS8	2
+#define SAMPLE_FORMAT_CF32	3
+#define SAMPLE_FORMAT_NUM	4
+
+extern const char *sample_format_names[SAMPLE_FORMAT_NUM];
+
+/*!
+ * \return bytes per I or Q value, 0 for an unknown format
+ */
+uint32_t sample_format_size(int format);
+
+/*!
+ * Convert dongle samples.
+ *
+ * \param in 8 bit unsigned I/Q samples
+ * \param len length of in in bytes
+ * \param out len * sample_format_size() bytes, aligned to the value size
+ */
+void sample_format_convert(int format, const unsigned char *in, uint32_t len, void *out);
+
+/*!
+ * Convert processed samples, scaled like v above.
+ *
+ * \param i, q n values each
+ * \param out 2 * n * sample_format_size() bytes, aligned to the value size
+ */
+void sample_format_from_float(int format, const float *i, const float *q, uint32_t n, void *out);
+
+/*
+ * Cache of converted buffers, keyed by the sequence number of the source
+ * buffer, so a buffer is converted only once for all readers asking for
+ * the same format. Entries are reference counted while a reader sends
+ * them, unreferenced entries are kept for readers lagging behind, up to a
+ * limit. Not thread safe, all readers must run on the same thread.
+ */
+typedef struct sample_conv_cache sample_conv_cache_t;
+typedef struct sample_conv sample_conv_t;
+
+/*!
+ * \param format target format, not SAMPLE_FORMAT_CU8
+ * \param max_len maximum length of a source buffer in bytes
+ * \param max_idle number of unreferenced entries kept
+ */
+sample_conv_cache_t *sample_conv_cache_create(int format, uint32_t max_len, uint32_t max_idle);
+
+void sample_conv_cache_destroy(sample_conv_cache_t *cache);
+
+/*!
+ * Look up the converted buffer seq, converting in if it is not cached.
+ *
+ * \return referenced entry, NULL if out of memory
+ */
+sample_conv_t *sample_conv_get(sample_conv_cache_t *cache, uint32_t seq,
+			       const unsigned char *in, uint32_t len);
+
+/*!
+ * Access a referenced entry.
+ *
+ * \param len set to the length of the converted data in bytes
+ */
+unsigned char *sample_conv_data(sample_conv_t *conv, uint32_t *len);
+
+/*!
+ * Drop a reference taken by sample_conv_get().
+ */
+void sample_conv_put(sample_conv_cache_t *cache, sample_conv_t *conv);
+
+/*!
+ * \param hits set to the number of lookups served from the cache
+ * \param misses set to the number of conversions
+ */
+void sample_conv_cache_stats(sample_conv_cache_t *cache, uint32_t *hits, uint32_t *misses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
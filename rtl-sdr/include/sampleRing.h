@@ -0,0 +1,235 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SAMPLE_RING_H
+#define __SAMPLE_RING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size ring of preallocated sample buffers with a single producer
+ * (the librtlsdr async callback) and any number of readers, each with its
+ * own read position. The producer never blocks and never allocates, it
+ * always overwrites the oldest buffer. A reader which falls more than the
+ * ring size behind loses the overwritten buffers, without affecting the
+ * producer or the other readers.
+ *
+ * Readers claim buffers and send them straight out of the ring memory.
+ * Claimed buffers are pinned by a reference count: if the producer wraps
+ * around onto a pinned buffer, it swaps in a spare one instead and the
+ * pinned buffer goes back to the spare pool once the last reader lets go.
+ */
+typedef struct sample_ring sample_ring_t;
+typedef struct sample_ring_reader sample_ring_reader_t;
+
+typedef struct
+{
+	uint32_t num_slots;	/* capacity of the ring in buffers */
+	uint32_t readers;	/* number of attached readers */
+	uint32_t pushed;	/* buffers queued since creation/reset */
+	uint32_t dropped;	/* buffers lost because no spare buffer was left */
+}
+sample_ring_stats_t;
+
+/* buffers were dropped by the producer right before this one */
+#define SAMPLE_RING_LOST	0x01
+
+/* capture details travelling with a buffer */
+typedef struct
+{
+	uint64_t time_ns;	/* capture time, monotonic */
+	uint32_t freq;		/* center frequency in Hz */
+	int32_t gain;		/* tuner gain in tenth dB */
+	uint32_t flags;		/* SAMPLE_RING_LOST */
+}
+sample_ring_meta_t;
+
+typedef struct
+{
+	uint32_t queued;	/* buffers waiting for this reader (lag) */
+	uint32_t high_water;	/* maximum of queued since attaching */
+	uint32_t dropped;	/* buffers overwritten before they were read */
+	uint32_t sent;		/* buffers released after reading */
+}
+sample_ring_reader_stats_t;
+
+/*!
+ * Allocate a sample ring.
+ *
+ * \param num_slots number of buffers, rounded up to a power of two
+ * \param slot_len size of a single buffer in bytes, 0 if the ring only
+ *		  takes buffers with sample_ring_push_ref()
+ * \param max_readers maximum number of readers attached at the same time
+ * \param max_claim maximum number of buffers a reader claims at once
+ * \return ring handle, NULL if the allocation failed
+ */
+sample_ring_t *sample_ring_create(uint32_t num_slots, uint32_t slot_len,
+				  uint32_t max_readers, uint32_t max_claim);
+
+void sample_ring_destroy(sample_ring_t *ring);
+
+/*!
+ * Discard all queued buffers and clear the statistics, buffers queued with
+ * sample_ring_push_ref() are released.
+ * Must only be called while the producer is stopped and no reader is attached.
+ */
+void sample_ring_reset(sample_ring_t *ring);
+
+/*!
+ * Copy a buffer into the ring (producer side, wait-free).
+ *
+ * \param buf samples to be queued, truncated to the slot length
+ * \param len length of buf in bytes
+ * \param meta capture details, may be NULL
+ * \return 0 if queued, -1 if the buffer was dropped
+ */
+int sample_ring_push(sample_ring_t *ring, const unsigned char *buf, uint32_t len,
+		     const sample_ring_meta_t *meta);
+
+typedef void (*sample_ring_release_cb)(void *handle, void *ctx);
+
+/*!
+ * Install the callback which gives buffers queued with sample_ring_push_ref()
+ * back to the producer. It is called from the producer or from a reader
+ * dropping its last reference, so it must be thread safe.
+ * Must be set before the producer is started.
+ */
+void sample_ring_set_release(sample_ring_t *ring, sample_ring_release_cb cb, void *ctx);
+
+/*!
+ * Queue a buffer without copying it (producer side, wait-free).
+ * The ring takes ownership of the buffer, also if it is dropped, and
+ * passes handle to the release callback when it is no longer used.
+ *
+ * \param buf samples to be queued
+ * \param len length of buf in bytes
+ * \param handle producer's reference to buf, must not be NULL
+ * \param meta capture details, may be NULL
+ * \return 0 if queued, -1 if the buffer was dropped
+ */
+int sample_ring_push_ref(sample_ring_t *ring, unsigned char *buf, uint32_t len,
+			 void *handle, const sample_ring_meta_t *meta);
+
+/*!
+ * Attach a new reader, which starts with the next buffer pushed.
+ *
+ * \return reader handle, NULL if max_readers are attached already
+ */
+sample_ring_reader_t *sample_ring_attach(sample_ring_t *ring);
+
+/*!
+ * Move a new reader back to buffers queued before it attached, e.g. to
+ * hand a client the samples of the last moments. Only possible before the
+ * reader claimed its first buffer.
+ *
+ * \param n number of buffers to go back
+ * \return number of buffers the reader went back, limited to the buffers
+ *	   still queued
+ */
+uint32_t sample_ring_rewind(sample_ring_reader_t *reader, uint32_t n);
+
+/*!
+ * Detach a reader, dropping all buffers it still has claimed.
+ */
+void sample_ring_detach(sample_ring_reader_t *reader);
+
+/*!
+ * Claim queued buffers for sending (reader side).
+ * The reader holds a contiguous window of claimed buffers, which this
+ * extends by the buffers queued meanwhile. The claimed buffers stay valid
+ * until they are released with sample_ring_release(). Buffers already
+ * overwritten are skipped and counted as dropped.
+ *
+ * \param max maximum size of the window, limited to max_claim
+ * \param first set to the sequence number of the first claimed buffer
+ * \return number of claimed buffers, 0 if nothing is queued
+ */
+uint32_t sample_ring_claim(sample_ring_reader_t *reader, uint32_t max, uint32_t *first);
+
+/*!
+ * Access a claimed buffer.
+ *
+ * \param seq sequence number of the buffer
+ * \param len set to the number of valid bytes in the buffer
+ * \return pointer to the buffer data, aligned to a cache line unless it
+ *	   was queued with sample_ring_push_ref()
+ */
+unsigned char *sample_ring_slot(sample_ring_reader_t *reader, uint32_t seq, uint32_t *len);
+
+/*!
+ * Access the capture details of a claimed buffer.
+ */
+const sample_ring_meta_t *sample_ring_meta(sample_ring_reader_t *reader, uint32_t seq);
+
+/*!
+ * Release the claimed buffers before end, the rest stays claimed.
+ *
+ * \param end sequence number following the last buffer which was sent
+ */
+void sample_ring_release(sample_ring_reader_t *reader, uint32_t end);
+
+/*!
+ * Block until buffers are queued for the reader or the timeout expires.
+ *
+ * \param timeout_ms timeout in milliseconds
+ * \return 0 if buffers are available, ETIMEDOUT otherwise
+ */
+int sample_ring_wait(sample_ring_reader_t *reader, int timeout_ms);
+
+typedef void (*sample_ring_notify_cb)(void *ctx);
+
+/*!
+ * Install a callback for readers which do not block in sample_ring_wait(),
+ * e.g. an event loop. It is called from the producer, so it must not block.
+ * Must be set before the producer is started.
+ */
+void sample_ring_set_notify(sample_ring_t *ring, sample_ring_notify_cb cb, void *ctx);
+
+/*!
+ * Request the notify callback with the next buffer pushed.
+ *
+ * \return nonzero if buffers are queued for the reader already, in which
+ *	   case the notification may or may not come
+ */
+int sample_ring_arm(sample_ring_reader_t *reader);
+
+/*!
+ * Wake up all readers blocked in sample_ring_wait(), e.g. on shutdown.
+ */
+void sample_ring_wakeup(sample_ring_t *ring);
+
+/*!
+ * Lock free, unlike sample_ring_get_stats(), so the producer may call it.
+ *
+ * \return sequence number of the next buffer pushed, the pushed count
+ */
+uint32_t sample_ring_head(sample_ring_t *ring);
+
+void sample_ring_get_stats(sample_ring_t *ring, sample_ring_stats_t *stats);
+
+void sample_ring_get_reader_stats(sample_ring_reader_t *reader,
+				  sample_ring_reader_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
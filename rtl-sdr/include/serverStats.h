@@ -0,0 +1,117 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SERVER_STATS_H
+#define __SERVER_STATS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process wide metrics of rtl_tcp. Values and histograms are updated with
+ * atomic operations, so any thread may update them without locking, and
+ * are read out as REPORT_STATS frame or as Prometheus text.
+ *
+ * REPORT_STATS frame, network byte order:
+ *   1 byte   REPORT_STATS
+ *   2 bytes  length of the rest of the frame
+ *   1 byte   number of values (STATS_NUM)
+ *   1 byte   number of histograms (STATS_HIST_NUM)
+ *   1 byte   number of buckets per histogram (STATS_BUCKETS)
+ *   1 byte   0
+ *   8 bytes  per value, in the order of the enum below
+ *   per histogram: 8 bytes count, 8 bytes sum in us, then 4 bytes per
+ *   bucket, not cumulative, bucket k counting values up to
+ *   STATS_BUCKET_US << k us and the last one all larger values
+ * Values and histograms may be added at the end in later versions.
+ */
+enum stats_value {
+	STATS_USB_TRANSFERS,	/* counters */
+	STATS_USB_BYTES,
+	STATS_USB_ERRORS,
+	STATS_RING_DROPPED,
+	STATS_CLIENT_DROPPED,
+	STATS_TX_BYTES,
+	STATS_TX_CALLS,
+	STATS_TX_BLOCKED,
+	STATS_CLIENTS_ACCEPTED,
+	STATS_CLIENTS,		/* gauges */
+	STATS_QUEUE_DEPTH,
+	STATS_QUEUE_HIGH_WATER,
+	STATS_SAMPLE_RATE,
+	STATS_CPU_US,		/* counter, process CPU time, user and system */
+	STATS_ACKS_LOST,	/* counter, SET_BATCH acknowledgements not sent */
+	STATS_NUM
+};
+
+enum stats_hist {
+	STATS_HIST_USB_INTERVAL,	/* time between USB transfers */
+	STATS_HIST_SEND_LATENCY,	/* capture until handed to the socket */
+	STATS_HIST_CTRL_TUNE,		/* retune and gain commands, queued until done */
+	STATS_HIST_CTRL_TELEMETRY,	/* register sampling, queued until done */
+	STATS_HIST_NUM
+};
+
+#define STATS_BUCKETS		17
+#define STATS_BUCKET_US		125
+
+#define STATS_FRAME_LEN		(7 + 8 * STATS_NUM + STATS_HIST_NUM * (16 + 4 * STATS_BUCKETS))
+
+void stats_add(int value, uint64_t n);
+
+void stats_set(int value, uint64_t v);
+
+/*!
+ * Count a sample in a histogram.
+ *
+ * \param us duration in microseconds
+ */
+void stats_observe(int hist, uint64_t us);
+
+/*!
+ * \return monotonic time in ns, the clock of rtlsdr_get_buffer_time()
+ */
+uint64_t stats_time_ns(void);
+
+/*!
+ * \return CPU time used by the process in microseconds, user and system
+ */
+uint64_t stats_cpu_us(void);
+
+/*!
+ * \param buf STATS_FRAME_LEN bytes
+ * \return length of the REPORT_STATS frame
+ */
+int stats_frame(unsigned char *buf);
+
+/*!
+ * Render the metrics in the Prometheus text exposition format.
+ *
+ * \param buf text buffer, may be NULL if len is 0
+ * \return length of the whole text; if it is len or more, buf was too small
+ *         and holds the text truncated
+ */
+int stats_prometheus(char *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
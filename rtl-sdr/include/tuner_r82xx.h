@@ -70,7 +70,9 @@ struct r82xx_priv {
 	int16_t						abs_gain;
 	uint8_t						input;
 	uint8_t						old_gain;
-	uint8_t						reg8[16];
+	uint8_t						reg8[16];	/* IMR gain per mixer gain */
+	uint8_t						reg9[16];	/* IMR phase per mixer gain */
+	int							imr_probes;
 	int							has_lock;
 	int							imr_done;
 	int							init_done;
@@ -87,9 +89,29 @@ struct r82xx_freq_range {
 	uint8_t		tf_c;
 };
 
+/* registers written by r82xx_hop() */
+#define R82XX_HOP_FIRST		0x10
+#define R82XX_HOP_LEN		12
+
+/* retune to freq, precomputed by r82xx_prepare_hop() */
+struct r82xx_hop {
+	uint32_t	freq;
+	uint8_t		val[R82XX_HOP_LEN];
+	uint8_t		mask[R82XX_HOP_LEN];
+	uint8_t		input;
+	int16_t		abs_gain;
+	/* settings the values were computed for */
+	uint32_t	xtal;
+	uint32_t	int_freq;
+	int			sideband;
+};
+
 int r82xx_standby(struct r82xx_priv *priv);
 int r82xx_init(struct r82xx_priv *priv);
+int r82xx_calibrate_imr(struct r82xx_priv *priv);
 int r82xx_set_freq(struct r82xx_priv *priv, uint32_t freq);
+int r82xx_prepare_hop(struct r82xx_priv *priv, struct r82xx_hop *hop, uint32_t freq);
+int r82xx_hop(struct r82xx_priv *priv, const struct r82xx_hop *hop);
 int r82xx_set_gain(struct r82xx_priv *priv, int gain);
 int r82xx_set_gain_mode(struct r82xx_priv *priv, int set_manual_gain);
 int r82xx_set_bandwidth(struct r82xx_priv *priv, int bandwidth,  uint32_t * applied_bw, int apply);
@@ -64,158 +64,120 @@ typedef int socklen_t;
 #define SOCKET_ERROR -1
 #endif
 
-#define MAX_I2C_REGISTERS  256
-#define TX_BUF_LEN (5+MAX_I2C_REGISTERS) //1 command, 2 tuner_gain, 2 len
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
 
+/* sleep for usec microseconds, or until ctrl_thread_stop() is called */
+static void ctrl_sleep(ctrl_thread_data_t *data, int usec)
+{
+	struct timespec ts;
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+	ts.tv_sec  = tp.tv_sec + usec / 1000000;
+	ts.tv_nsec = (tp.tv_usec + usec % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
 
-ctrl_thread_data_t ctrl_thread_data;
+	pthread_mutex_lock(&sleep_lock);
+	if (!*data->pDoExit)
+		pthread_cond_timedwait(&sleep_cond, &sleep_lock, &ts);
+	pthread_mutex_unlock(&sleep_lock);
+}
 
+void ctrl_thread_stop(ctrl_thread_data_t *data)
+{
+	pthread_mutex_lock(&sleep_lock);
+	*data->pDoExit = 1;
+	pthread_cond_broadcast(&sleep_cond);
+	pthread_mutex_unlock(&sleep_lock);
+}
+
+/*
+ * Refreshes the register snapshot of the library every sample_wait while
+ * response clients are connected, and hands REPORT_I2C_REGS frames built
+ * from it to data->report. The response port itself is served by the caller.
+ *
+ * The sampling runs on this thread, not on the control queue of the library:
+ * it gives way to control operations and releases the bus while the
+ * detector settles, so the queue thread executes retunes meanwhile.
+ */
 void *ctrl_thread_fn(void *arg)
 {
 	unsigned char reg_values [MAX_I2C_REGISTERS];
 	unsigned char txbuf [TX_BUF_LEN];
-	int r = 1;
-	struct timeval tv = { 1,0 };
-	struct linger ling = { 1,0 };
-	SOCKET listensocket;
-	SOCKET controlSocket;
-	int haveControlSocket = 0;
-	struct sockaddr_in local, remote;
-	socklen_t rlen;
-
-	int error = 0;
-	int len, result, tuner_gain;
-	fd_set connfds;
-	fd_set writefds;
-	int bytesleft, bytessent, index;
+	int len, result, tuner_gain, gain_db;
 	int old_gain = 0;
+	struct timeval start, end;
+	int since_sample = 0, since_report = 0;
 
 	ctrl_thread_data_t *data = (ctrl_thread_data_t *)arg;
 
 	rtlsdr_dev_t *dev = data->dev;
-	int port = data->port;
-	int wait = data->wait;
-	int report_i2c = data->report_i2c;
-	char *addr = data->addr;
+	int wait = data->wait;	/* tick */
 	int* do_exit = data->pDoExit;
-	u_long blockmode = 1;
-	int retval;
 
 	memset(reg_values, 0, MAX_I2C_REGISTERS);
+	if (data->sample_wait && data->sample_wait < wait)
+		wait = data->sample_wait;
+
+	while (!*do_exit) {
+		if (data->pListeners && !*data->pListeners)
+			goto sleep;
+
+		since_sample += wait;
+		if (data->sample_wait && since_sample >= data->sample_wait) {
+			gettimeofday(&start, NULL);
+			result = rtlsdr_sample_tuner_i2c_register(dev);
+			gettimeofday(&end, NULL);
+			/* skipped for a control operation: again with the next tick */
+			if (result != 1) {
+				since_sample = 0;
+				if (data->sampled)
+					data->sampled(result, (uint32_t)((end.tv_sec - start.tv_sec) * 1000000 +
+							(end.tv_usec - start.tv_usec)), data->sampled_ctx);
+			}
+		}
 
-	memset(&local, 0, sizeof(local));
-	local.sin_family = AF_INET;
-	local.sin_port = htons(port);
-	local.sin_addr.s_addr = inet_addr(addr);
-
-	listensocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		since_report += wait;
+		if (since_report < data->wait)
+			goto sleep;
+		since_report = 0;
 
-	setsockopt(listensocket, SOL_SOCKET, SO_REUSEADDR, (char *)&r, sizeof(int));
-	setsockopt(listensocket, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
-	retval = bind(listensocket, (struct sockaddr *)&local, sizeof(local));
-	if (retval == SOCKET_ERROR)
-		error = 1;
-#ifdef _WIN32
-	ioctlsocket(listensocket, FIONBIO, &blockmode);
-#else
-	r = fcntl(listensocket, F_GETFL, 0);
-	r = fcntl(listensocket, F_SETFL, r | O_NONBLOCK);
-#endif
+		len = 0;
+		result = rtlsdr_get_tuner_i2c_register(dev, reg_values, &len, &tuner_gain);
+		if (result)
+			goto sleep;
 
-	while (1) {
-		//printf("listening on Control port %d...\n", port);
-		retval = listen(listensocket, 1);
-		if (retval == SOCKET_ERROR)
-			error = 1;
-		while (1) {
-			FD_ZERO(&connfds);
-			FD_SET(listensocket, &connfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(listensocket + 1, &connfds, NULL, NULL, &tv);
-			if (*do_exit) {
-				goto close;
-			}
-			else if (r) {
-				rlen = sizeof(remote);
-				controlSocket = accept(listensocket, (struct sockaddr *)&remote, &rlen);
-				haveControlSocket = 1;
-				break;
-			}
-			result = rtlsdr_get_tuner_i2c_register(dev, reg_values, &len, &tuner_gain);
-			tuner_gain = (tuner_gain + 5) / 10;
-			if(old_gain != tuner_gain)
-			{
-				printf("gain = %2d dB\r", tuner_gain);
-				old_gain = tuner_gain;
-			}
+		gain_db = (tuner_gain + 5) / 10;
+		if(old_gain != gain_db)
+		{
+			printf("gain = %2d dB\r", gain_db);
+			old_gain = gain_db;
 		}
 
-		setsockopt(controlSocket, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
-
-		printf("Control client accepted!\n");
-		usleep(5000000);
-
-		while (1) {
-
-			/* check if i2c reporting is to be (de)activated */
-			if ( report_i2c && !data->report_i2c )
-				report_i2c = 0;
-			else if ( !report_i2c && data->report_i2c )
-				report_i2c = 1;
-
-			/* @TODO: check if something else has to be transmitted */
-			if ( !report_i2c )
-				goto sleep;
-
-			len = 0;
-			result = rtlsdr_get_tuner_i2c_register(dev, reg_values, &len, &tuner_gain);
-			memset(txbuf, 0, TX_BUF_LEN);
-			if (result)
-				goto sleep;
-
-			//Big Endian / Network Byte Order
-			txbuf[0] = REPORT_I2C_REGS;
-			txbuf[1] = ((len+2) >> 8) & 0xff;
-			txbuf[2] = (len+2) & 0xff;
-			txbuf[3] = (tuner_gain >> 8) & 0xff;
-			txbuf[4] = tuner_gain & 0xff;
-			/* now the message contents */
-			memcpy(&txbuf[5], reg_values, len);
-			len += 5;
-
-			/* now start (possibly blocking) transmission */
-			bytessent = 0;
-			bytesleft = len;
-			index = 0;
-
-			while (bytesleft > 0) {
-				FD_ZERO(&writefds);
-				FD_SET(controlSocket, &writefds);
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				r = select(controlSocket + 1, NULL, &writefds, NULL, &tv);
-				if (r) {
-					bytessent = send(controlSocket, (const char*)&txbuf[index], bytesleft, 0);
-					bytesleft -= bytessent;
-					index += bytessent;
-				}
-				if (bytessent == SOCKET_ERROR || *do_exit) {
-					goto close;
-				}
-			}
+		/* @TODO: check if something else has to be transmitted */
+		if ( !data->report_i2c || !data->report )
+			goto sleep;
+
+		memset(txbuf, 0, TX_BUF_LEN);
+
+		//Big Endian / Network Byte Order
+		txbuf[0] = REPORT_I2C_REGS;
+		txbuf[1] = ((len+2) >> 8) & 0xff;
+		txbuf[2] = (len+2) & 0xff;
+		txbuf[3] = (tuner_gain >> 8) & 0xff;
+		txbuf[4] = tuner_gain & 0xff;
+		/* now the message contents */
+		memcpy(&txbuf[5], reg_values, len);
+		len += 5;
+
+		data->report(data->report_ctx, txbuf, len);
 sleep:
-			usleep(wait);
-		}
-close:
-		if (haveControlSocket)
-			closesocket(controlSocket);
-		if (*do_exit)
-		{
-			closesocket(listensocket);
-			printf("Control Thread terminates\n");
-			break;
-		}
+		ctrl_sleep(data, wait);
 	}
+	printf("Control Thread terminates\n");
 	return 0;
 }
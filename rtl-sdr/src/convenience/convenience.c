@@ -301,60 +301,52 @@ int verbose_reset_buffer(rtlsdr_dev_t *dev)
 
 int verbose_device_search(char *s)
 {
-	int i, device_count, device, offset;
+	int i, device_count, device;
 	char *s2;
-	char vendor[256], product[256], serial[256];
-	device_count = rtlsdr_get_device_count();
-	if (!device_count) {
+	rtlsdr_devlist_t *list;
+	rtlsdr_devinfo_t *info;
+
+	/* virtual devices aren't enumerated */
+	if (!strncmp(s, "sim:", 4)) {
+		device = rtlsdr_get_index_by_serial(s);
+		if (device < 0) {
+			fprintf(stderr, "Too many virtual devices.\n");
+			return -1;
+		}
+		fprintf(stderr, "Using virtual device %s\n", s);
+		return device;
+	}
+
+	device_count = rtlsdr_enumerate(&list);
+	if (device_count <= 0) {
+		rtlsdr_free_devlist(list);
 		fprintf(stderr, "No supported devices found.\n");
 		return -1;
 	}
 	fprintf(stderr, "Found %d device(s):\n", device_count);
 	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i, vendor, product, serial);
+		info = &list->devs[i];
+		fprintf(stderr, "  %d:  %s, %s, SN: %s\n", i, info->manufact,
+			info->product, info->serial);
 	}
 	fprintf(stderr, "\n");
 	/* does string look like raw id number */
 	device = (int)strtol(s, &s2, 0);
 	if (s2[0] == '\0' && device >= 0 && device < device_count) {
 		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
-	}
-	/* does string exact match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strcmp(s, serial) != 0) {
-			continue;}
-		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
+			device, list->devs[device].name);
+		rtlsdr_free_devlist(list);
 		return device;
 	}
-	/* does string prefix match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		if (strncmp(s, serial, strlen(s)) != 0) {
-			continue;}
-		device = i;
-		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
-		return device;
-	}
-	/* does string suffix match a serial */
-	for (i = 0; i < device_count; i++) {
-		rtlsdr_get_device_usb_strings(i, vendor, product, serial);
-		offset = strlen(serial) - strlen(s);
-		if (offset < 0) {
-			continue;}
-		if (strncmp(s, serial+offset, strlen(s)) != 0) {
-			continue;}
-		device = i;
+	/* does string exact, prefix or suffix match a serial */
+	device = rtlsdr_devlist_find(list, s, RTLSDR_MATCH_ANY);
+	if (device >= 0) {
 		fprintf(stderr, "Using device %d: %s\n",
-			device, rtlsdr_get_device_name((uint32_t)device));
+			device, list->devs[device].name);
+		rtlsdr_free_devlist(list);
 		return device;
 	}
+	rtlsdr_free_devlist(list);
 	fprintf(stderr, "No matching devices found.\n");
 	return -1;
 }
@@ -151,7 +151,8 @@ int verbose_ppm_set(rtlsdr_dev_t *dev, int ppm_error);
 int verbose_reset_buffer(rtlsdr_dev_t *dev);
 
 /*!
- * Find the closest matching device.
+ * Find the closest matching device. A string starting with "sim:"
+ * selects a virtual device, see rtlsdr_sim.h.
  *
  * \param s a string to be parsed
  * \return dev_index int, -1 on error
@@ -0,0 +1,220 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddc.h"
+#include "sampleFormat.h"
+
+#define DDC_PI		3.14159265358979323846
+
+/* input samples mixed per pass, also the length of the NCO table */
+#define DDC_BLOCK	1024
+
+/* filter taps per polyphase branch, i.e. per output sample */
+#define DDC_TAPS_PER_PHASE	24
+
+/*
+ * The mixed samples are kept in separate I and Q arrays and the NCO works
+ * on whole blocks: a fixed table of e^(j*step*k) is rotated by the phase at
+ * the start of the block. All inner loops are plain element wise float
+ * loops without dependencies between iterations, which the compiler turns
+ * into SIMD code for whatever the target offers.
+ */
+struct ddc
+{
+	uint32_t decim;
+	uint32_t num_taps;
+	int format;
+	float *taps;
+
+	/* mixed samples not yet consumed by the filter */
+	float *buf_i;
+	float *buf_q;
+	uint32_t fill;
+	uint32_t pos;		/* first sample of the next output's window */
+
+	/* filter output of one block */
+	float out_i[DDC_BLOCK / 2 + 1];
+	float out_q[DDC_BLOCK / 2 + 1];
+
+	/* NCO */
+	int32_t offset;
+	uint32_t samp_rate;
+	double step;		/* radians per sample, 0 for no mixing */
+	double phase;
+	float rot_i[DDC_BLOCK];
+	float rot_q[DDC_BLOCK];
+};
+
+/* windowed sinc low pass, -6 dB at the output Nyquist frequency */
+static void design_lowpass(float *taps, uint32_t n, uint32_t decim)
+{
+	double fc = 0.5 / decim;
+	double m = (n - 1) / 2.0;
+	double sum = 0, x, w;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		x = i - m;
+		w = 0.42 - 0.5 * cos(2 * DDC_PI * i / (n - 1)) +
+			0.08 * cos(4 * DDC_PI * i / (n - 1));
+		taps[i] = (float)(w * 2 * fc * (x == 0 ? 1.0 : sin(2 * DDC_PI * fc * x) / (2 * DDC_PI * fc * x)));
+		sum += taps[i];
+	}
+	for (i = 0; i < n; i++)
+		taps[i] = (float)(taps[i] / sum);
+}
+
+ddc_t *ddc_create(uint32_t decim, int format)
+{
+	ddc_t *ddc;
+
+	if (decim < 2 || decim > DDC_MAX_DECIM)
+		return NULL;
+	if (!sample_format_size(format))
+		return NULL;
+
+	ddc = calloc(1, sizeof(ddc_t));
+	if (!ddc)
+		return NULL;
+
+	ddc->decim = decim;
+	ddc->num_taps = DDC_TAPS_PER_PHASE * decim;
+	ddc->format = format;
+	ddc->taps = malloc(ddc->num_taps * sizeof(float));
+	ddc->buf_i = malloc((ddc->num_taps + DDC_BLOCK) * sizeof(float));
+	ddc->buf_q = malloc((ddc->num_taps + DDC_BLOCK) * sizeof(float));
+	if (!ddc->taps || !ddc->buf_i || !ddc->buf_q) {
+		ddc_destroy(ddc);
+		return NULL;
+	}
+
+	design_lowpass(ddc->taps, ddc->num_taps, decim);
+	return ddc;
+}
+
+void ddc_destroy(ddc_t *ddc)
+{
+	if (!ddc)
+		return;
+
+	free(ddc->taps);
+	free(ddc->buf_i);
+	free(ddc->buf_q);
+	free(ddc);
+}
+
+void ddc_tune(ddc_t *ddc, int32_t offset, uint32_t samp_rate)
+{
+	uint32_t k;
+
+	if (offset == ddc->offset && samp_rate == ddc->samp_rate)
+		return;
+
+	ddc->offset = offset;
+	ddc->samp_rate = samp_rate;
+	ddc->step = (offset && samp_rate) ? -2 * DDC_PI * offset / samp_rate : 0;
+	for (k = 0; k < DDC_BLOCK; k++) {
+		ddc->rot_i[k] = (float)cos(ddc->step * k);
+		ddc->rot_q[k] = (float)sin(ddc->step * k);
+	}
+}
+
+uint32_t ddc_max_output(ddc_t *ddc, uint32_t len)
+{
+	uint32_t n = len / 2 / ddc->decim + 1;
+
+	return n * 2 * sample_format_size(ddc->format);
+}
+
+/* convert and mix n samples into the filter buffer */
+static void ddc_mix(ddc_t *ddc, const unsigned char *in, uint32_t n)
+{
+	float *bi = ddc->buf_i + ddc->fill;
+	float *bq = ddc->buf_q + ddc->fill;
+	float x, y, ci, cq, pi, pq;
+	uint32_t k;
+
+	if (ddc->step == 0) {
+		for (k = 0; k < n; k++) {
+			bi[k] = in[2 * k] - 127.5f;
+			bq[k] = in[2 * k + 1] - 127.5f;
+		}
+	} else {
+		pi = (float)cos(ddc->phase);
+		pq = (float)sin(ddc->phase);
+		for (k = 0; k < n; k++) {
+			ci = ddc->rot_i[k] * pi - ddc->rot_q[k] * pq;
+			cq = ddc->rot_i[k] * pq + ddc->rot_q[k] * pi;
+			x = in[2 * k] - 127.5f;
+			y = in[2 * k + 1] - 127.5f;
+			bi[k] = x * ci - y * cq;
+			bq[k] = x * cq + y * ci;
+		}
+		ddc->phase = fmod(ddc->phase + ddc->step * n, 2 * DDC_PI);
+	}
+	ddc->fill += n;
+}
+
+static float dot(const float *a, const float *b, uint32_t n)
+{
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	uint32_t i;
+
+	/* num_taps is a multiple of 4 */
+	for (i = 0; i < n; i += 4) {
+		s0 += a[i] * b[i];
+		s1 += a[i + 1] * b[i + 1];
+		s2 += a[i + 2] * b[i + 2];
+		s3 += a[i + 3] * b[i + 3];
+	}
+	return (s0 + s1) + (s2 + s3);
+}
+
+uint32_t ddc_process(ddc_t *ddc, const unsigned char *in, uint32_t len, unsigned char *out)
+{
+	unsigned char *o = out;
+	uint32_t n, m, rest;
+
+	len /= 2;
+	while (len) {
+		n = len < DDC_BLOCK ? len : DDC_BLOCK;
+		ddc_mix(ddc, in, n);
+		in += 2 * n;
+		len -= n;
+
+		for (m = 0; ddc->pos + ddc->num_taps <= ddc->fill; m++) {
+			ddc->out_i[m] = dot(ddc->taps, ddc->buf_i + ddc->pos, ddc->num_taps);
+			ddc->out_q[m] = dot(ddc->taps, ddc->buf_q + ddc->pos, ddc->num_taps);
+			ddc->pos += ddc->decim;
+		}
+		sample_format_from_float(ddc->format, ddc->out_i, ddc->out_q, m, o);
+		o += m * 2 * sample_format_size(ddc->format);
+
+		/* keep what the next outputs still need */
+		rest = ddc->fill - ddc->pos;
+		memmove(ddc->buf_i, ddc->buf_i + ddc->pos, rest * sizeof(float));
+		memmove(ddc->buf_q, ddc->buf_q + ddc->pos, rest * sizeof(float));
+		ddc->fill = rest;
+		ddc->pos = 0;
+	}
+
+	return (uint32_t)(o - out);
+}
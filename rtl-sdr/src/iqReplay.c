@@ -0,0 +1,387 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <windows.h>
+#endif
+
+#ifdef NEED_PTHREADS_WORKARROUND
+#define HAVE_STRUCT_TIMESPEC
+#endif
+#include <pthread.h>
+
+#include "iqReplay.h"
+#include "serverStats.h"
+
+/* falling behind further than this skips ahead instead of catching up */
+#define MAX_LAG_NS	1000000000ULL
+
+struct segment
+{
+	const unsigned char *data;	/* samples within the mapping */
+	uint64_t len;			/* even number of bytes */
+	uint32_t freq;
+	uint32_t rate;
+	void *map;
+	uint64_t map_len;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+struct iq_replay
+{
+	struct segment segs[IQ_REPLAY_MAX_SEGMENTS];
+	int num_segs;
+	int cur;		/* playing segment, -1 for silence */
+	uint32_t freq;
+	uint32_t rate;
+	uint64_t pos;		/* bytes played since the start, at rate */
+	double speed;
+	uint64_t base_ns;	/* start of the pacing, 0 to start with the next chunk */
+	uint64_t paced;		/* bytes paced since base_ns */
+	uint32_t max_len;
+	unsigned char *silence;
+	pthread_mutex_t lock;
+};
+
+static void replay_sleep_until(uint64_t due)
+{
+	uint64_t now;
+
+	while ((now = stats_time_ns()) < due) {
+#ifdef _WIN32
+		Sleep((DWORD)((due - now + 999999) / 1000000));
+#else
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)((due - now) / 1000000000);
+		ts.tv_nsec = (long)((due - now) % 1000000000);
+		nanosleep(&ts, NULL);
+#endif
+	}
+}
+
+static uint32_t le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int map_file(struct segment *seg, const char *path)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	seg->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (seg->file == INVALID_HANDLE_VALUE)
+		return -1;
+	if (!GetFileSizeEx(seg->file, &size) || size.QuadPart <= 0)
+		goto fail;
+	seg->map_len = (uint64_t)size.QuadPart;
+	seg->mapping = CreateFileMapping(seg->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!seg->mapping)
+		goto fail;
+	seg->map = MapViewOfFile(seg->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!seg->map) {
+		CloseHandle(seg->mapping);
+		goto fail;
+	}
+	return 0;
+fail:
+	CloseHandle(seg->file);
+	return -1;
+#else
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > (size_t)-1) {
+		close(fd);
+		return -1;
+	}
+	seg->map_len = (uint64_t)st.st_size;
+	seg->map = mmap(NULL, (size_t)seg->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg->map == MAP_FAILED)
+		return -1;
+	madvise(seg->map, (size_t)seg->map_len, MADV_SEQUENTIAL);
+	return 0;
+#endif
+}
+
+static void unmap_file(struct segment *seg)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(seg->map);
+	CloseHandle(seg->mapping);
+	CloseHandle(seg->file);
+#else
+	munmap(seg->map, (size_t)seg->map_len);
+#endif
+}
+
+/*
+ * Find the samples of a WAV file: 8 bit PCM with two channels, the rate
+ * from the fmt chunk, the center frequency from the auxi chunk if there is
+ * one. A data chunk of size 0 or reaching past the end of the file is
+ * taken to the end, as of a recording which was not closed properly.
+ * Returns 1 for a WAV file, 0 for a raw file and -1 for an unsupported WAV.
+ */
+static int parse_wav(struct segment *seg, uint32_t *freq, uint32_t *rate)
+{
+	const unsigned char *p = (const unsigned char *)seg->map;
+	uint64_t size = seg->map_len, off = 12, body;
+	uint32_t id_len;
+	int have_fmt = 0;
+
+	if (size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+		return 0;
+
+	while (off + 8 <= size) {
+		id_len = le32(p + off + 4);
+		body = off + 8;
+		if (!memcmp(p + off, "fmt ", 4)) {
+			if (id_len < 16 || body + 16 > size)
+				return -1;
+			if (le16(p + body) != 1 || le16(p + body + 2) != 2 ||
+			    le16(p + body + 14) != 8)
+				return -1;
+			*rate = le32(p + body + 4);
+			have_fmt = 1;
+		} else if (!memcmp(p + off, "auxi", 4)) {
+			if (id_len >= 36 && body + 36 <= size)
+				*freq = le32(p + body + 32);
+		} else if (!memcmp(p + off, "data", 4)) {
+			if (!have_fmt)
+				return -1;
+			seg->data = p + body;
+			seg->len = size - body;
+			if (id_len && id_len < seg->len)
+				seg->len = id_len;
+			return 1;
+		}
+		if (id_len > size - body)
+			break;
+		off = body + id_len + (id_len & 1);
+	}
+	return -1;
+}
+
+/* call with lock held */
+static void replay_select(iq_replay_t *rp)
+{
+	uint32_t d, best = 0;
+	int i;
+
+	rp->cur = -1;
+	for (i = 0; i < rp->num_segs; i++) {
+		if (rp->segs[i].rate != rp->rate)
+			continue;
+		d = rp->freq > rp->segs[i].freq ? rp->freq - rp->segs[i].freq :
+						  rp->segs[i].freq - rp->freq;
+		if (d > rp->rate / 2 || (rp->cur >= 0 && d >= best))
+			continue;
+		rp->cur = i;
+		best = d;
+	}
+}
+
+iq_replay_t *iq_replay_create(uint32_t max_len)
+{
+	iq_replay_t *rp;
+
+	rp = calloc(1, sizeof(iq_replay_t));
+	if (!rp)
+		return NULL;
+	rp->max_len = max_len & ~1;
+	rp->silence = malloc(rp->max_len);
+	if (!rp->silence) {
+		free(rp);
+		return NULL;
+	}
+	memset(rp->silence, 0x80, rp->max_len);
+	rp->cur = -1;
+	rp->speed = 1.0;
+	pthread_mutex_init(&rp->lock, NULL);
+	return rp;
+}
+
+void iq_replay_destroy(iq_replay_t *rp)
+{
+	int i;
+
+	if (!rp)
+		return;
+	for (i = 0; i < rp->num_segs; i++)
+		unmap_file(&rp->segs[i]);
+	pthread_mutex_destroy(&rp->lock);
+	free(rp->silence);
+	free(rp);
+}
+
+int iq_replay_add(iq_replay_t *rp, const char *path, uint32_t freq, uint32_t rate)
+{
+	struct segment *seg;
+	uint32_t wav_freq = 0, wav_rate = 0;
+	int r;
+
+	if (rp->num_segs >= IQ_REPLAY_MAX_SEGMENTS)
+		return -1;
+	seg = &rp->segs[rp->num_segs];
+	memset(seg, 0, sizeof(*seg));
+	if (map_file(seg, path))
+		return -1;
+
+	r = parse_wav(seg, &wav_freq, &wav_rate);
+	if (r == 0) {
+		seg->data = (const unsigned char *)seg->map;
+		seg->len = seg->map_len;
+	}
+	seg->len &= ~(uint64_t)1;
+	seg->freq = freq ? freq : wav_freq;
+	seg->rate = rate ? rate : wav_rate;
+	if (r < 0 || !seg->len || !seg->freq || !seg->rate) {
+		unmap_file(seg);
+		return r < 0 || !seg->len ? -1 : -2;
+	}
+
+	pthread_mutex_lock(&rp->lock);
+	rp->num_segs++;
+	replay_select(rp);
+	pthread_mutex_unlock(&rp->lock);
+	return rp->num_segs - 1;
+}
+
+int iq_replay_get_segment(iq_replay_t *rp, int index, uint32_t *freq, uint32_t *rate,
+			  uint64_t *samples)
+{
+	if (index < 0 || index >= rp->num_segs)
+		return -1;
+	if (freq)
+		*freq = rp->segs[index].freq;
+	if (rate)
+		*rate = rp->segs[index].rate;
+	if (samples)
+		*samples = rp->segs[index].len / 2;
+	return 0;
+}
+
+void iq_replay_set_speed(iq_replay_t *rp, double speed)
+{
+	pthread_mutex_lock(&rp->lock);
+	rp->speed = speed > 0 ? speed : 0;
+	rp->base_ns = 0;
+	pthread_mutex_unlock(&rp->lock);
+}
+
+int iq_replay_tune(iq_replay_t *rp, uint32_t freq)
+{
+	int cur;
+
+	pthread_mutex_lock(&rp->lock);
+	rp->freq = freq;
+	replay_select(rp);
+	cur = rp->cur;
+	pthread_mutex_unlock(&rp->lock);
+	return cur;
+}
+
+int iq_replay_set_rate(iq_replay_t *rp, uint32_t rate)
+{
+	int cur;
+
+	pthread_mutex_lock(&rp->lock);
+	/* keep the time position, in bytes at the new rate */
+	if (rp->rate && rate)
+		rp->pos = (uint64_t)((double)rp->pos * rate / rp->rate) & ~(uint64_t)1;
+	rp->rate = rate;
+	rp->base_ns = 0;
+	replay_select(rp);
+	cur = rp->cur;
+	pthread_mutex_unlock(&rp->lock);
+	return cur;
+}
+
+uint32_t iq_replay_read(iq_replay_t *rp, uint32_t len, const unsigned char **buf)
+{
+	struct segment *seg;
+	uint64_t off;
+
+	len &= ~1;
+	if (len > rp->max_len)
+		len = rp->max_len;
+
+	pthread_mutex_lock(&rp->lock);
+	if (rp->cur < 0) {
+		*buf = rp->silence;
+	} else {
+		seg = &rp->segs[rp->cur];
+		off = rp->pos % seg->len;
+		if (len > seg->len - off)
+			len = (uint32_t)(seg->len - off);
+		*buf = seg->data + off;
+	}
+	rp->pos += len;
+	pthread_mutex_unlock(&rp->lock);
+	return len;
+}
+
+uint64_t iq_replay_pace(iq_replay_t *rp, uint32_t len)
+{
+	uint64_t now, due;
+
+	now = stats_time_ns();
+	pthread_mutex_lock(&rp->lock);
+	if (rp->speed <= 0 || !rp->rate) {
+		pthread_mutex_unlock(&rp->lock);
+		return now;
+	}
+	if (!rp->base_ns) {
+		rp->base_ns = now;
+		rp->paced = 0;
+	}
+	rp->paced += len;
+	due = rp->base_ns + (uint64_t)((double)rp->paced * 5e8 / (rp->rate * rp->speed));
+	if (now > due + MAX_LAG_NS) {
+		/* stalled, e.g. suspended: don't send the backlog in a burst */
+		rp->base_ns = now;
+		rp->paced = 0;
+		due = now;
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	replay_sleep_until(due);
+	return due;
+}
@@ -18,19 +18,31 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <sched.h>
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#else
+#include <windows.h>
+#include <io.h>
 #endif
 
 #include <libusb.h>
 #include <pthread.h>
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 /*
  * All libusb callback functions should be marked with the LIBUSB_CALL macro
  * to ensure that they are compiled with the same calling convention as libusb.
@@ -52,6 +64,8 @@
 #define TWO_POW(n)	((double)(1ULL<<(n)))
 
 #include "rtl-sdr.h"
+#include "rtlsdr_atomic.h"
+#include "rtlsdr_sim.h"
 #include "tuner_e4k.h"
 #include "tuner_fc001x.h"
 #include "tuner_fc2580.h"
@@ -101,6 +115,47 @@ static const int fir_default[FIR_LEN] = {
 };
 static int cal_imr = 0;
 
+/* IMR calibration cache, see rtlsdr_set_imr_cache() */
+#define IMR_CACHE_MAX_AGE	(30 * 24 * 3600)
+static char imr_cache_path[1024];
+static int imr_cache_set = 0;
+static int imr_cache_age = IMR_CACHE_MAX_AGE;
+
+struct rtlsdr_hold_pool;
+struct rtlsdr_stream;
+
+/* longest run of demod registers written with one control transfer */
+#define DEMOD_TXN_MAX	16
+
+/* register shadow, see sys_shadow_regs[] */
+#define SYS_SHADOW_LEN		18
+#define DEMOD_SHADOW_PAGES	5
+
+/* settling of each tuner after a retune, us, see rtlsdr_calibrate_hop_settle() */
+static const uint16_t tuner_settle_us[] = {
+	5000,	/* RTLSDR_TUNER_UNKNOWN */
+	1500,	/* RTLSDR_TUNER_E4000 */
+	2500,	/* RTLSDR_TUNER_FC0012 */
+	2500,	/* RTLSDR_TUNER_FC0013 */
+	2000,	/* RTLSDR_TUNER_FC2580 */
+	1000,	/* RTLSDR_TUNER_R820T */
+	1000,	/* RTLSDR_TUNER_R828D */
+};
+
+/* requests the control queue holds, see rtlsdr_ctrl_submit() */
+#define CTRL_QUEUE_LEN	32
+
+struct rtlsdr_ctrl_req {
+	enum rtlsdr_ctrl_op op;
+	uint32_t param;
+	uint8_t *buf;
+	size_t buf_len;
+	rtlsdr_ctrl_cb_t cb;
+	void *ctx;
+	uint64_t queued;	/* ns */
+	struct rtlsdr_ctrl_req *next;
+};
+
 struct rtlsdr_dev {
 	libusb_context *ctx;
 	struct libusb_device_handle *devh;
@@ -109,10 +164,16 @@ struct rtlsdr_dev {
 	struct libusb_transfer **xfer;
 	unsigned char **xfer_buf;
 	rtlsdr_read_async_cb_t cb;
+	rtlsdr_read_held_cb_t held_cb;
 	void *cb_ctx;
 	enum rtlsdr_async_status async_status;
 	int async_cancel;
 	int use_zerocopy;
+	struct rtlsdr_hold_pool *hold_pool;
+	struct rtlsdr_stream *stream;	/* see rtlsdr_stream_start() */
+	rtlsdr_sim_t *sim;	/* virtual device, no USB */
+	uint32_t sim_index;
+	uint64_t xfer_time; /* completion of the transfer being delivered, ns */
 	/* rtl demod context */
 	uint32_t rate; /* Hz */
 	uint32_t rtl_xtal; /* Hz */
@@ -136,11 +197,83 @@ struct rtlsdr_dev {
 	/* -cs- Concurrent lock for the periodic reading of I2C registers */
 	pthread_mutex_t cs_mutex;
 	pthread_mutexattr_t cs_mutex_attr;
+	volatile uint32_t ctrl_waiting;	/* control operations waiting for cs_mutex */
+	uint32_t ctrl_gen;	/* control operations completed, under cs_mutex */
+	int i2c_repeater_depth;	/* nested repeater sessions, under cs_mutex */
+
+	/* demod write transaction, see rtlsdr_demod_begin() */
+	int txn_depth;
+	pthread_t txn_owner;
+	int txn_err;
+	int txn_sync;		/* writes not yet followed by the dummy read */
+	uint8_t txn_page;
+	uint16_t txn_addr;	/* register of txn_buf[0] */
+	int txn_len;
+	uint8_t txn_buf[DEMOD_TXN_MAX];
+
+	/* hop table, see rtlsdr_set_hop_table() */
+	struct r82xx_hop *hops;
+	int num_hops;
+	int hops_prepared;	/* hops hold R82xx register values */
+	uint32_t hop_offs;	/* offs_freq when the table was computed */
+
+	/* host side copy of the RTL2832 registers, see rtlsdr_shadow_load() */
+	uint8_t sys_shadow[SYS_SHADOW_LEN];
+	uint8_t sys_known[SYS_SHADOW_LEN];
+	uint8_t demod_shadow[DEMOD_SHADOW_PAGES][256];
+	uint8_t demod_known[DEMOD_SHADOW_PAGES][256 / 8];
+	int shadow_check;	/* compare the shadow with the hardware on use */
+
+	/* hop schedule, see rtlsdr_set_hop_schedule() */
+	pthread_mutex_t sched_lock;
+	uint32_t *sched_dwell;	/* us of settled samples per segment */
+	int sched_num;
+	int sched_index;	/* segment being received */
+	int sched_restart;	/* new schedule, start with segment 0 */
+	uint64_t sched_pos;	/* samples delivered in this streaming run */
+	uint64_t sched_settled;	/* stream position where the segment has settled */
+	uint64_t sched_end;	/* stream position to retune at */
+	int buf_segment;	/* tags of the buffer being delivered */
+	uint32_t buf_settled;
+	uint32_t settle_us;
+
+	/* transfer sizing, see rtlsdr_set_xfer_policy() */
+	uint32_t xfer_latency_us;	/* 0: fixed defaults */
+	int xfer_prefer;
+	int xfer_auto;		/* XFER_AUTO_* of the running stream */
+	volatile int xfer_restart;	/* set up the transfers again on cancel */
+	uint32_t xfer_restarts;
+	uint64_t xfer_prev;	/* completion before xfer_time, ns */
+	uint64_t jitter_sum;	/* ns */
+	uint64_t jitter_max;	/* ns */
+	uint32_t jitter_count;
+
+	/* control queue, see rtlsdr_ctrl_submit() */
+	pthread_mutex_t ctrl_lock;
+	pthread_cond_t ctrl_cond;	/* new request, or exit */
+	pthread_cond_t ctrl_done;	/* a request completed */
+	pthread_t ctrl_thread;
+	int ctrl_running;
+	int ctrl_exit;
+	int ctrl_busy;		/* a request is being executed */
+	struct rtlsdr_ctrl_req ctrl_pool[CTRL_QUEUE_LEN];
+	struct rtlsdr_ctrl_req *ctrl_free;
+	struct rtlsdr_ctrl_req *ctrl_head[RTLSDR_CTRL_CLASSES];
+	struct rtlsdr_ctrl_req *ctrl_tail[RTLSDR_CTRL_CLASSES];
+	rtlsdr_ctrl_stats_t ctrl_stats[RTLSDR_CTRL_CLASSES];
+
+	/* register snapshot served by rtlsdr_get_tuner_i2c_register() */
+	pthread_mutex_t snap_lock;
+	unsigned char snap_regs[RTLSDR_MAX_I2C_REGISTERS];
+	int snap_len;
+	int snap_strength;
+	int snap_valid;
 
 	/* status */
 	int dev_lost;
 	int driver_active;
 	unsigned int xfer_errors;
+	unsigned int xfer_errors_total;
 	int rc_active;
 	int verbose;
 };
@@ -148,6 +281,7 @@ struct rtlsdr_dev {
 static int rtlsdr_set_if_freq(rtlsdr_dev_t *dev, uint32_t freq);
 static int rtlsdr_update_ds(rtlsdr_dev_t *dev, uint32_t freq);
 static int rtlsdr_set_spectrum_inversion(rtlsdr_dev_t *dev, int sideband);
+static void rtlsdr_ctrl_stop(rtlsdr_dev_t *dev);
 
 /* generic tuner interface functions, shall be moved to the tuner implementations */
 int e4000_init(void *dev) {
@@ -192,8 +326,190 @@ int e4000_get_i2c_register(void *dev, unsigned char *data, int *len, int *streng
 	return e4k_get_i2c_register(&devt->e4k_s, data, len, strength);
 }
 
+/*
+ * IMR calibration cache: a text file with one line per dongle,
+ * "<serial> <chip> <xtal> <unix time> <16 hex values of reg8[]> <16 of reg9[]>",
+ * the IMR gain and phase per mixer gain.
+ */
+static int imr_cache_file(char *path, int len)
+{
+	const char *dir;
+
+	if (imr_cache_set) {
+		snprintf(path, len, "%s", imr_cache_path);
+		return path[0] ? 0 : -1;
+	}
+	dir = getenv("RTLSDR_IMR_CACHE");
+	if (dir) {
+		snprintf(path, len, "%s", dir);
+		return path[0] ? 0 : -1;
+	}
+#ifdef _WIN32
+	dir = getenv("APPDATA");
+	if (!dir)
+		return -1;
+	snprintf(path, len, "%s\\rtlsdr_imr.txt", dir);
+#else
+	dir = getenv("HOME");
+	if (!dir)
+		return -1;
+	snprintf(path, len, "%s/.rtlsdr_imr", dir);
+#endif
+	return 0;
+}
+
+static void imr_cache_key(rtlsdr_dev_t *dev, char *key, int len)
+{
+	char serial[256];
+	int i;
+
+	if (rtlsdr_get_usb_strings(dev, NULL, NULL, serial) || !serial[0])
+		strcpy(serial, "-");
+	for (i = 0; serial[i]; i++)
+		if (isspace((unsigned char)serial[i]))
+			serial[i] = '_';
+	snprintf(key, len, "%s %d %u", serial, dev->r82xx_c.rafael_chip, dev->tun_xtal);
+}
+
+/* 0 if a current entry was found, -2 if it is outdated */
+static int imr_cache_load(rtlsdr_dev_t *dev, struct r82xx_priv *priv)
+{
+	char path[1024], key[320], line[512];
+	unsigned long v[32];
+	long long stamp;
+	char *p, *end;
+	int i, keylen, r = -1;
+	FILE *f;
+
+	if (imr_cache_file(path, sizeof(path)) < 0)
+		return -1;
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	imr_cache_key(dev, key, sizeof(key));
+	keylen = strlen(key);
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, keylen) || line[keylen] != ' ')
+			continue;
+		stamp = strtoll(line + keylen, &end, 10);
+		for (i = 0; i < 32 && end != line + keylen; i++) {
+			p = end;
+			v[i] = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+		}
+		/* lines without the phase are from an older version */
+		if (i < 32)
+			continue;
+		if (imr_cache_age > 0 && (long long)time(NULL) - stamp > imr_cache_age) {
+			r = -2;
+			continue;
+		}
+		for (i = 0; i < 16; i++) {
+			priv->reg8[i] = v[i] & 0x3f;
+			priv->reg9[i] = v[16 + i] & 0x3f;
+		}
+		r = 0;
+	}
+	fclose(f);
+	return r;
+}
+
+/* a lock file older than this was left by a crashed writer */
+#define IMR_CACHE_LOCK_STALE	10
+/* give up waiting for the lock after this many ms */
+#define IMR_CACHE_LOCK_WAIT	3000
+
+/*
+ * Several processes may calibrate their dongles at the same time, e.g. one
+ * rtl_tcp per dongle of a rack. The lock file serializes the updates, so
+ * every writer merges the entries the others stored before.
+ */
+static int imr_cache_lock(const char *lock)
+{
+	struct stat st;
+	int fd, ms;
+
+	for (ms = 0; ms < IMR_CACHE_LOCK_WAIT; ms += 10) {
+		fd = open(lock, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd >= 0) {
+			close(fd);
+			return 0;
+		}
+		if (errno != EEXIST)
+			return -1;
+		if (!stat(lock, &st) && time(NULL) - st.st_mtime > IMR_CACHE_LOCK_STALE)
+			remove(lock);
+		else
+			usleep(10000);
+	}
+	return -1;
+}
+
+static unsigned imr_cache_pid(void)
+{
+#ifdef _WIN32
+	return (unsigned)GetCurrentProcessId();
+#else
+	return (unsigned)getpid();
+#endif
+}
+
+/* replace the entry of the dongle, through a temporary file */
+static void imr_cache_store(rtlsdr_dev_t *dev, const struct r82xx_priv *priv)
+{
+	char path[1024], tmp[1060], lock[1040], key[320], line[512];
+	int i, keylen;
+	FILE *in, *out;
+
+	if (imr_cache_file(path, sizeof(path)) < 0)
+		return;
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	if (imr_cache_lock(lock)) {
+		fprintf(stderr, "Can't lock IMR calibration cache %s\n", lock);
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%u.tmp", path, imr_cache_pid());
+	out = fopen(tmp, "w");
+	if (!out) {
+		fprintf(stderr, "Can't write IMR calibration cache %s\n", tmp);
+		remove(lock);
+		return;
+	}
+
+	imr_cache_key(dev, key, sizeof(key));
+	keylen = strlen(key);
+	in = fopen(path, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in))
+			if (strncmp(line, key, keylen) || line[keylen] != ' ')
+				fputs(line, out);
+		fclose(in);
+	}
+
+	fprintf(out, "%s %lld", key, (long long)time(NULL));
+	for (i = 0; i < 16; i++)
+		fprintf(out, " %02x", priv->reg8[i]);
+	for (i = 0; i < 16; i++)
+		fprintf(out, " %02x", priv->reg9[i]);
+	fprintf(out, "\n");
+	if (fclose(out)) {
+		remove(tmp);
+		remove(lock);
+		return;
+	}
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (rename(tmp, path))
+		remove(tmp);
+	remove(lock);
+}
+
 int r820t_init(void *dev) {
 	rtlsdr_dev_t* devt = (rtlsdr_dev_t*)dev;
+	int r, calibrate;
 	devt->r82xx_p.rtl_dev = dev;
 
 	if (devt->tuner_type == RTLSDR_TUNER_R828D) {
@@ -210,7 +526,22 @@ int r820t_init(void *dev) {
 	devt->r82xx_c.cal_imr = cal_imr;
 	devt->r82xx_p.cfg = &devt->r82xx_c;
 
-	return r82xx_init(&devt->r82xx_p);
+	/* calibrate once per open, from the cache if there */
+	if (cal_imr && !devt->r82xx_p.imr_done) {
+		r = imr_cache_load(devt, &devt->r82xx_p);
+		if (!r) {
+			devt->r82xx_p.imr_done = 1;
+			devt->r82xx_p.old_gain = 255;
+			fprintf(stderr, "IMR calibration loaded from cache\n");
+		} else if (r == -2)
+			fprintf(stderr, "IMR calibration in cache is outdated\n");
+	}
+	calibrate = cal_imr && !devt->r82xx_p.imr_done;
+
+	r = r82xx_init(&devt->r82xx_p);
+	if (!r && calibrate && devt->r82xx_p.imr_done)
+		imr_cache_store(devt, &devt->r82xx_p);
+	return r;
 }
 int r820t_exit(void *dev) {
 	rtlsdr_dev_t* devt = (rtlsdr_dev_t*)dev;
@@ -271,6 +602,31 @@ int r820t_set_sideband(void *dev, int sideband) {
 	return rtlsdr_set_center_freq(devt, devt->freq);
 }
 
+static int sim_set_freq(void *dev, uint32_t freq) {
+	return rtlsdr_sim_set_freq(((rtlsdr_dev_t *)dev)->sim, freq);
+}
+
+static int sim_set_bw(void *dev, int bw, uint32_t *applied_bw, int apply) {
+	(void)dev;
+	(void)apply;
+	*applied_bw = bw;
+	return 0;
+}
+
+static int sim_set_gain(void *dev, int gain) {
+	return rtlsdr_sim_set_gain(((rtlsdr_dev_t *)dev)->sim, gain);
+}
+
+static int sim_set_gain_mode(void *dev, int manual) {
+	return rtlsdr_sim_set_gain_mode(((rtlsdr_dev_t *)dev)->sim, manual);
+}
+
+/* tuner of a virtual device, with the gains of the R820T */
+static rtlsdr_tuner_iface_t sim_tuner = {
+	NULL, NULL, sim_set_freq, sim_set_bw, sim_set_gain, NULL,
+	sim_set_gain_mode, NULL, NULL, NULL, r82xx_get_gains
+};
+
 /* definition order must match enum rtlsdr_tuner */
 static rtlsdr_tuner_iface_t tuners[] = {
 	{
@@ -380,6 +736,13 @@ static rtlsdr_dongle_t known_devices[] = {
  */
 
 
+#define XFER_AUTO_NUM		1
+#define XFER_AUTO_LEN		2
+#define XFER_MIN_LENGTH		4096
+#define XFER_MAX_LENGTH		(4 * 1024 * 1024)
+#define XFER_MIN_NUMBER		4
+#define XFER_MAX_NUMBER		128
+
 #define DEF_RTL_XTAL_FREQ	28800000
 #define MIN_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ - 1000)
 #define MAX_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ + 1000)
@@ -526,30 +889,198 @@ enum blocks {
 	IICB 	= 0x0600
 };
 
+/*
+ * Register shadow: the value last written to or read from a register, so
+ * masked writes need no read over USB and writing the value a register
+ * already holds is skipped, like the tuner drivers do with their own
+ * registers. Only registers which read back what was written are kept:
+ * the USB and system registers listed below, loaded in rtlsdr_open(), and
+ * the demod registers of pages 0 to 4, learned as they are written. The
+ * USB and the system block index the same address space.
+ */
+static const uint16_t sys_shadow_regs[SYS_SHADOW_LEN] = {
+	USB_SYSCTL, USB_CTRL, USB_EPA_CFG, USB_EPA_CTL, USB_EPA_CTL + 1,
+	USB_EPA_MAXPKT, USB_EPA_MAXPKT + 1, USB_EPA_FIFO_CFG,
+	DEMOD_CTL, GPO, GPOE, GPD, SYSINTE, GP_CFG0, GP_CFG1, SYSINTE_1,
+	DEMOD_CTL_1, IR_SUSPEND
+};
+
+static int sys_shadow_slot(uint16_t index, uint16_t addr)
+{
+	int i;
+
+	if (index != USBB && index != SYSB)
+		return -1;
+	for (i = 0; i < SYS_SHADOW_LEN; i++)
+		if (sys_shadow_regs[i] == addr)
+			return i;
+	return -1;
+}
+
+static int demod_shadow_known(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr)
+{
+	return page < DEMOD_SHADOW_PAGES && addr < 256 &&
+		(dev->demod_known[page][addr >> 3] & (1 << (addr & 7)));
+}
+
+/* record len bytes written to or read from page/addr, or forget them */
+static void demod_shadow_set(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr,
+		const uint8_t *data, int len)
+{
+	for (; len > 0 && page < DEMOD_SHADOW_PAGES && addr < 256; len--, addr++) {
+		if (data) {
+			dev->demod_shadow[page][addr] = *data++;
+			dev->demod_known[page][addr >> 3] |= 1 << (addr & 7);
+		} else
+			dev->demod_known[page][addr >> 3] &= ~(1 << (addr & 7));
+	}
+}
+
+/* 1 if all len bytes at page/addr are known to hold data */
+static int demod_shadow_equal(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr,
+		const uint8_t *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (!demod_shadow_known(dev, page, addr + i) ||
+				dev->demod_shadow[page][addr + i] != data[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Demod register transactions: between rtlsdr_demod_begin() and
+ * rtlsdr_demod_commit() the demod writes of the calling thread are queued.
+ * Writes to adjacent registers of a page go out as one control transfer,
+ * and the dummy read which follows every single write otherwise is done
+ * once at the end. Any other access to the device sends the queued writes
+ * first, so the order of all accesses is kept. Transactions nest and hold
+ * cs_mutex, like a control operation on the tuner.
+ */
+static int rtlsdr_demod_queued(rtlsdr_dev_t *dev)
+{
+	return dev->txn_depth && pthread_equal(dev->txn_owner, pthread_self());
+}
+
+/* vendor request, served by the virtual device if it is one */
+static int rtlsdr_usb_control(rtlsdr_dev_t *dev, uint8_t type, uint16_t value,
+			      uint16_t index, unsigned char *data, uint16_t len)
+{
+	if (dev->sim)
+		return rtlsdr_sim_control(dev->sim, type, value, index, data, len);
+
+	return libusb_control_transfer(dev->devh, type, 0, value, index, data, len,
+				       CTRL_TIMEOUT);
+}
+
+static void rtlsdr_demod_flush(rtlsdr_dev_t *dev)
+{
+	int r;
+
+	if (!dev->txn_len || !rtlsdr_demod_queued(dev))
+		return;
+
+	r = rtlsdr_usb_control(dev, CTRL_OUT,
+			(dev->txn_addr << 8) | RTL2832_DEMOD_ADDR, dev->txn_page | 0x10,
+			dev->txn_buf, dev->txn_len);
+	if (r != dev->txn_len) {
+		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
+		demod_shadow_set(dev, dev->txn_page, dev->txn_addr, NULL, dev->txn_len);
+		dev->txn_err = -1;
+	}
+	dev->txn_len = 0;
+	dev->txn_sync = 1;
+}
+
+static void rtlsdr_demod_begin(rtlsdr_dev_t *dev)
+{
+	rtlsdr_atomic_add(&dev->ctrl_waiting, 1);
+	pthread_mutex_lock(&dev->cs_mutex);
+	rtlsdr_atomic_add(&dev->ctrl_waiting, (uint32_t)-1);
+
+	if (!dev->txn_depth++) {
+		dev->txn_owner = pthread_self();
+		dev->txn_err = 0;
+		dev->txn_sync = 0;
+		dev->txn_len = 0;
+	}
+}
+
+static uint16_t rtlsdr_demod_read_reg_raw(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr, uint8_t len);
+
+/* returns 0 if all writes of the transaction succeeded */
+static int rtlsdr_demod_commit(rtlsdr_dev_t *dev)
+{
+	int r = 0;
+
+	if (dev->txn_depth == 1) {
+		rtlsdr_demod_flush(dev);
+		if (dev->txn_sync)
+			rtlsdr_demod_read_reg_raw(dev, DUMMY_PAGE, DUMMY_ADDR, 1);
+		r = dev->txn_err;
+	}
+	dev->txn_depth--;
+	pthread_mutex_unlock(&dev->cs_mutex);
+	return r;
+}
+
+static void rtlsdr_demod_queue(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint8_t *data, uint8_t len)
+{
+	if (dev->txn_len && (page != dev->txn_page ||
+			addr != dev->txn_addr + dev->txn_len ||
+			dev->txn_len + len > DEMOD_TXN_MAX))
+		rtlsdr_demod_flush(dev);
+
+	if (!dev->txn_len) {
+		dev->txn_page = page;
+		dev->txn_addr = addr;
+	}
+	memcpy(dev->txn_buf + dev->txn_len, data, len);
+	dev->txn_len += len;
+}
+
 static inline int rtlsdr_read_array(rtlsdr_dev_t *dev, uint16_t index, uint16_t addr, uint8_t *array, uint8_t len)
 {
-	return libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, array, len, CTRL_TIMEOUT);
+	rtlsdr_demod_flush(dev);
+	return rtlsdr_usb_control(dev, CTRL_IN, addr, index, array, len);
 }
 
 static inline int rtlsdr_write_array(rtlsdr_dev_t *dev, uint16_t index, uint16_t addr, uint8_t *array, uint8_t len)
 {
-	return libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index | 0x10, array, len, CTRL_TIMEOUT);
+	rtlsdr_demod_flush(dev);
+	return rtlsdr_usb_control(dev, CTRL_OUT, addr, index | 0x10, array, len);
 }
 
 static uint8_t rtlsdr_read_reg(rtlsdr_dev_t *dev, uint16_t index, uint16_t addr)
 {
 	uint8_t data;
+	int r, slot = sys_shadow_slot(index, addr);
 
-	int r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, &data, 1, CTRL_TIMEOUT);
-	if (r != 1)
+	if (slot >= 0 && dev->sys_known[slot] && !dev->shadow_check)
+		return dev->sys_shadow[slot];
+
+	rtlsdr_demod_flush(dev);
+	r = rtlsdr_usb_control(dev, CTRL_IN, addr, index, &data, 1);
+	if (r != 1) {
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
+		return data;
+	}
+
+	if (slot >= 0) {
+		if (dev->sys_known[slot] && dev->sys_shadow[slot] != data)
+			fprintf(stderr, "register %04x: shadow %02x, device %02x\n",
+					addr, dev->sys_shadow[slot], data);
+		dev->sys_shadow[slot] = data;
+		dev->sys_known[slot] = 1;
+	}
 
 	return data;
 }
 
 static int rtlsdr_write_reg(rtlsdr_dev_t *dev, uint16_t index, uint16_t addr, uint16_t val, uint8_t len)
 {
-	int r;
+	int r, i, slot[2], same = 1;
 	unsigned char data[2];
 
 	if (len == 1)
@@ -558,10 +1089,28 @@ static int rtlsdr_write_reg(rtlsdr_dev_t *dev, uint16_t index, uint16_t addr, ui
 		data[0] = val >> 8;
 		data[1] = val & 0xff;
 	}
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index | 0x10, data, len, CTRL_TIMEOUT);
+
+	for (i = 0; i < len; i++) {
+		slot[i] = sys_shadow_slot(index, addr + i);
+		if (slot[i] < 0 || !dev->sys_known[slot[i]] ||
+				dev->sys_shadow[slot[i]] != data[i])
+			same = 0;
+	}
+	if (same)
+		return len;
+
+	rtlsdr_demod_flush(dev);
+	r = rtlsdr_usb_control(dev, CTRL_OUT, addr, index | 0x10, data, len);
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
 
+	for (i = 0; i < len; i++) {
+		if (slot[i] < 0)
+			continue;
+		dev->sys_shadow[slot[i]] = data[i];
+		dev->sys_known[slot[i]] = (r == len);
+	}
+
 	return r;
 }
 
@@ -570,7 +1119,7 @@ static int rtlsdr_write_reg_mask(rtlsdr_dev_t *d, uint16_t block, uint16_t reg,
 {
 	uint8_t tmp;
 
-	/* no need for read if whole reg is written */
+	/* no need for read if whole reg is written, the shadow answers else */
 	if (mask != 0xff) {
 		tmp = rtlsdr_read_reg(d, block, reg);
 		val &= mask;
@@ -585,7 +1134,8 @@ static uint8_t check_tuner(rtlsdr_dev_t *dev, uint8_t i2c_addr, uint8_t reg)
 {
 	uint8_t data = 0;
 
-	libusb_control_transfer(dev->devh, CTRL_IN, 0, reg << 8 | i2c_addr, TUNB, &data, 1, CTRL_TIMEOUT);
+	rtlsdr_demod_flush(dev);
+	rtlsdr_usb_control(dev, CTRL_IN, reg << 8 | i2c_addr, TUNB, &data, 1);
 	return data;
 }
 
@@ -603,12 +1153,12 @@ int rtlsdr_i2c_read_fn(void *dev, uint8_t addr, uint8_t reg, uint8_t *buf, int l
 	return rtlsdr_read_array((rtlsdr_dev_t *)dev, TUNB, reg << 8 | addr, buf, len);
 }
 
-uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr, uint8_t len)
+static uint16_t rtlsdr_demod_read_reg_raw(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr, uint8_t len)
 {
 	unsigned char data[2];
 
-	int r = libusb_control_transfer(dev->devh, CTRL_IN, 0, (addr << 8) | RTL2832_DEMOD_ADDR,
-									page, data, len, CTRL_TIMEOUT);
+	int r = rtlsdr_usb_control(dev, CTRL_IN, (addr << 8) | RTL2832_DEMOD_ADDR,
+									page, data, len);
 	if (r != len)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
 
@@ -618,10 +1168,19 @@ uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr,
 		return (data[0] << 8) | data[1];
 }
 
+uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr, uint8_t len)
+{
+	rtlsdr_demod_flush(dev);
+	return rtlsdr_demod_read_reg_raw(dev, page, addr, len);
+}
+
 int rtlsdr_demod_read_regs(rtlsdr_dev_t *dev, uint16_t page, uint16_t addr, unsigned char *data, uint8_t len)
 {
-	int r = libusb_control_transfer(dev->devh, CTRL_IN, 0, (addr << 8) | RTL2832_DEMOD_ADDR,
-									page, data, len, CTRL_TIMEOUT);
+	int r;
+
+	rtlsdr_demod_flush(dev);
+	r = rtlsdr_usb_control(dev, CTRL_IN, (addr << 8) | RTL2832_DEMOD_ADDR,
+									page, data, len);
 	if (r != len)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
 
@@ -633,8 +1192,6 @@ int rtlsdr_demod_write_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint1
 	int r;
 	unsigned char data[2];
 
-	addr = (addr << 8) | RTL2832_DEMOD_ADDR;
-
 	if (len == 1)
 		data[0] = val & 0xff;
 	else {
@@ -642,15 +1199,100 @@ int rtlsdr_demod_write_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint1
 		data[1] = val & 0xff;
 	}
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, page | 0x10, data, len, CTRL_TIMEOUT);
+	if (demod_shadow_equal(dev, page, addr, data, len))
+		return 0;
+
+	if (rtlsdr_demod_queued(dev)) {
+		rtlsdr_demod_queue(dev, page, addr, data, len);
+		demod_shadow_set(dev, page, addr, data, len);
+		return 0;
+	}
+
+	r = rtlsdr_usb_control(dev, CTRL_OUT, (addr << 8) | RTL2832_DEMOD_ADDR,
+			page | 0x10, data, len);
 	if (r != len)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
+	demod_shadow_set(dev, page, addr, (r == len) ? data : NULL, len);
 
 	rtlsdr_demod_read_reg(dev, DUMMY_PAGE, DUMMY_ADDR, 1);
 
 	return (r == len) ? 0 : -1;
 }
 
+/* demod register value from the shadow, read from the device if unknown */
+static uint8_t rtlsdr_demod_shadow_read(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr)
+{
+	uint8_t data;
+
+	if (demod_shadow_known(dev, page, addr) && !dev->shadow_check)
+		return dev->demod_shadow[page][addr];
+
+	data = (uint8_t)rtlsdr_demod_read_reg(dev, page, addr, 1);
+	if (demod_shadow_known(dev, page, addr) && dev->demod_shadow[page][addr] != data)
+		fprintf(stderr, "demod register %d:%02x: shadow %02x, device %02x\n",
+				page, addr, dev->demod_shadow[page][addr], data);
+	demod_shadow_set(dev, page, addr, &data, 1);
+	return data;
+}
+
+static int rtlsdr_demod_write_reg_mask(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr,
+		uint8_t val, uint8_t mask)
+{
+	uint8_t tmp;
+
+	if (mask != 0xff) {
+		tmp = rtlsdr_demod_shadow_read(dev, page, addr);
+		val = (tmp & ~mask) | (val & mask);
+	}
+	return rtlsdr_demod_write_reg(dev, page, addr, val, 1);
+}
+
+/* read all USB and system registers of the shadow from the device */
+static void rtlsdr_shadow_load(rtlsdr_dev_t *dev)
+{
+	int i;
+
+	memset(dev->sys_known, 0, sizeof(dev->sys_known));
+	for (i = 0; i < SYS_SHADOW_LEN; i++)
+		rtlsdr_read_reg(dev, SYSB, sys_shadow_regs[i]);
+}
+
+/*
+ * Compare every known shadow register with the device.
+ * Returns the number of mismatches, which are reported and corrected.
+ */
+static int rtlsdr_shadow_verify(rtlsdr_dev_t *dev)
+{
+	int i, page, addr, check, bad = 0;
+	uint8_t data;
+
+	/* rtlsdr_read_reg() reports and corrects in check mode */
+	check = dev->shadow_check;
+	dev->shadow_check = 1;
+	for (i = 0; i < SYS_SHADOW_LEN; i++) {
+		if (!dev->sys_known[i])
+			continue;
+		data = dev->sys_shadow[i];
+		bad += (rtlsdr_read_reg(dev, SYSB, sys_shadow_regs[i]) != data);
+	}
+	dev->shadow_check = check;
+
+	for (page = 0; page < DEMOD_SHADOW_PAGES; page++) {
+		for (addr = 0; addr < 256; addr++) {
+			if (!demod_shadow_known(dev, page, addr))
+				continue;
+			data = (uint8_t)rtlsdr_demod_read_reg(dev, page, addr, 1);
+			if (data == dev->demod_shadow[page][addr])
+				continue;
+			fprintf(stderr, "demod register %d:%02x: shadow %02x, device %02x\n",
+					page, addr, dev->demod_shadow[page][addr], data);
+			demod_shadow_set(dev, page, addr, &data, 1);
+			bad++;
+		}
+	}
+	return bad;
+}
+
 void rtlsdr_set_gpio_bit(rtlsdr_dev_t *dev, uint8_t gpio, int val)
 {
 	uint8_t r;
@@ -672,15 +1314,59 @@ static void rtlsdr_set_gpio_output(rtlsdr_dev_t *dev, uint8_t gpio)
 	rtlsdr_write_reg(dev, SYSB, GPOE, r | gpio, 1);
 }
 
+/* copy the register shadow of the tuner driver into the snapshot */
+static void rtlsdr_update_snapshot(rtlsdr_dev_t *dev)
+{
+	if (dev->tuner_type != RTLSDR_TUNER_R820T &&
+			dev->tuner_type != RTLSDR_TUNER_R828D)
+		return;
+
+	pthread_mutex_lock(&dev->snap_lock);
+	if (dev->snap_valid && dev->snap_len >= REG_SHADOW_START + NUM_REGS)
+		memcpy(dev->snap_regs + REG_SHADOW_START, dev->r82xx_p.regs, NUM_REGS);
+	pthread_mutex_unlock(&dev->snap_lock);
+}
+
+/*
+ * Brackets every control operation on the tuner. ctrl_waiting makes the
+ * register sampler step back while an operation waits for the lock.
+ * Brackets nest: only the outermost one switches the repeater, so the
+ * settings of rtlsdr_set_tuning() share one session.
+ */
 static void rtlsdr_set_i2c_repeater(rtlsdr_dev_t *dev, int on)
 {
-	if (on)
+	if (on) {
+		rtlsdr_atomic_add(&dev->ctrl_waiting, 1);
 		pthread_mutex_lock(&dev->cs_mutex);
+		rtlsdr_atomic_add(&dev->ctrl_waiting, (uint32_t)-1);
+		if (dev->i2c_repeater_depth++)
+			return;
+	} else if (--dev->i2c_repeater_depth) {
+		pthread_mutex_unlock(&dev->cs_mutex);
+		return;
+	}
 
 	rtlsdr_demod_write_reg(dev, 1, 0x01, on ? 0x18 : 0x10, 1);
 
-	if (!on)
+	if (!on) {
+		dev->ctrl_gen++;
+		rtlsdr_update_snapshot(dev);
 		pthread_mutex_unlock(&dev->cs_mutex);
+	}
+}
+
+int rtlsdr_i2c_yield(void *dev, int usec)
+{
+	rtlsdr_dev_t *d = (rtlsdr_dev_t *)dev;
+	uint32_t gen = d->ctrl_gen;
+
+	rtlsdr_demod_write_reg(d, 1, 0x01, 0x10, 1);
+	pthread_mutex_unlock(&d->cs_mutex);
+	usleep(usec);
+	pthread_mutex_lock(&d->cs_mutex);
+	rtlsdr_demod_write_reg(d, 1, 0x01, 0x18, 1);
+
+	return d->ctrl_gen != gen;
 }
 
 static int rtlsdr_set_fir(rtlsdr_dev_t *dev)
@@ -708,20 +1394,18 @@ static int rtlsdr_set_fir(rtlsdr_dev_t *dev)
 		fir[8+i*3/2+2] = val1;
 	}
 
-	for (i = 0; i < (int)sizeof(fir); i++) {
-		if (rtlsdr_demod_write_reg(dev, 1, 0x1c + i, fir[i], 1))
-				return -1;
-	}
+	rtlsdr_demod_begin(dev);
+	for (i = 0; i < (int)sizeof(fir); i++)
+		rtlsdr_demod_write_reg(dev, 1, 0x1c + i, fir[i], 1);
 
-	return 0;
+	return rtlsdr_demod_commit(dev) ? -1 : 0;
 }
 
 int rtlsdr_reset_demod(rtlsdr_dev_t *dev)
 {
 	/* reset demod (bit 3, soft_rst) */
-	uint8_t r = rtlsdr_demod_read_reg(dev, 1, 0x01, 1);
-	rtlsdr_demod_write_reg(dev, 1, 0x01, r | 0x04, 1);
-	rtlsdr_demod_write_reg(dev, 1, 0x01, r & 0xfb, 1);
+	rtlsdr_demod_write_reg_mask(dev, 1, 0x01, 0x04, 0x04);
+	rtlsdr_demod_write_reg_mask(dev, 1, 0x01, 0x00, 0x04);
 	return 0;
 }
 
@@ -745,6 +1429,8 @@ static void rtlsdr_init_baseband(rtlsdr_dev_t *dev)
 
 	rtlsdr_reset_demod(dev);
 
+	rtlsdr_demod_begin(dev);
+
 	/* disable spectrum inversion and adjacent channel rejection */
 	rtlsdr_demod_write_reg(dev, 1, 0x15, 0x00, 1);
 
@@ -780,6 +1466,7 @@ static void rtlsdr_init_baseband(rtlsdr_dev_t *dev)
 	/* disable 4.096 MHz clock output on pin TP_CK0 */
 	rtlsdr_demod_write_reg(dev, 0, 0x0d, 0x83, 1);
 
+	rtlsdr_demod_commit(dev);
 }
 
 static int rtlsdr_deinit_baseband(rtlsdr_dev_t *dev)
@@ -837,12 +1524,14 @@ static int rtlsdr_set_if_freq(rtlsdr_dev_t *dev, uint32_t freq)
 
 	if_freq = ((freq * TWO_POW(22)) / rtl_xtal) * (-1);
 
+	rtlsdr_demod_begin(dev);
 	tmp = (if_freq >> 16) & 0x3f;
-	r = rtlsdr_demod_write_reg(dev, 1, 0x19, tmp, 1);
+	rtlsdr_demod_write_reg(dev, 1, 0x19, tmp, 1);
 	tmp = (if_freq >> 8) & 0xff;
-	r |= rtlsdr_demod_write_reg(dev, 1, 0x1a, tmp, 1);
+	rtlsdr_demod_write_reg(dev, 1, 0x1a, tmp, 1);
 	tmp = if_freq & 0xff;
-	r |= rtlsdr_demod_write_reg(dev, 1, 0x1b, tmp, 1);
+	rtlsdr_demod_write_reg(dev, 1, 0x1b, tmp, 1);
+	r = rtlsdr_demod_commit(dev);
 
 	return r;
 }
@@ -921,6 +1610,10 @@ int rtlsdr_get_usb_strings(rtlsdr_dev_t *dev, char *manufact, char *product,
 	const int buf_max = 256;
 	int r = 0;
 
+	if (dev && dev->sim)
+		return rtlsdr_get_device_usb_strings(dev->sim_index, manufact,
+						     product, serial);
+
 	if (!dev || !dev->devh)
 		return -1;
 
@@ -1037,6 +1730,61 @@ int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 	return r;
 }
 
+int rtlsdr_set_hop_table(rtlsdr_dev_t *dev, const uint32_t *freqs, int num)
+{
+	struct r82xx_hop *hops = NULL;
+	int i, r = 0;
+
+	if (!dev || !dev->tuner || num < 0 || (num && !freqs))
+		return -1;
+
+	if (num) {
+		hops = calloc(num, sizeof(struct r82xx_hop));
+		if (!hops)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&dev->cs_mutex);
+	free(dev->hops);
+	dev->hops = hops;
+	dev->num_hops = num;
+	dev->hop_offs = dev->offs_freq;
+	dev->hops_prepared = (dev->tuner_type == RTLSDR_TUNER_R820T ||
+			dev->tuner_type == RTLSDR_TUNER_R828D);
+
+	for (i = 0; i < num; i++) {
+		hops[i].freq = freqs[i] - dev->hop_offs;
+		if (dev->hops_prepared &&
+				r82xx_prepare_hop(&dev->r82xx_p, &hops[i], freqs[i] - dev->hop_offs))
+			r = -2;
+	}
+	pthread_mutex_unlock(&dev->cs_mutex);
+
+	return r;
+}
+
+int rtlsdr_hop(rtlsdr_dev_t *dev, int index)
+{
+	struct r82xx_hop *hop;
+	int r;
+
+	if (!dev || index < 0 || index >= dev->num_hops)
+		return -1;
+
+	hop = &dev->hops[index];
+	if (!dev->hops_prepared || dev->direct_sampling ||
+			dev->direct_sampling_mode > RTLSDR_DS_Q ||
+			dev->offs_freq != dev->hop_offs)
+		return rtlsdr_set_center_freq(dev, hop->freq + dev->hop_offs);
+
+	rtlsdr_set_i2c_repeater(dev, 1);
+	r = r82xx_hop(&dev->r82xx_p, hop);
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	dev->freq = r ? 0 : hop->freq + dev->hop_offs;
+	return r;
+}
+
 uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
 {
 	if (!dev)
@@ -1140,6 +1888,29 @@ int rtlsdr_set_tuner_bandwidth(rtlsdr_dev_t *dev, uint32_t bw )
 
 
 
+int rtlsdr_set_tuning(rtlsdr_dev_t *dev, const rtlsdr_tuning_t *tuning)
+{
+	int r = 0;
+
+	if (!dev || !dev->tuner || !tuning)
+		return -1;
+
+	rtlsdr_set_i2c_repeater(dev, 1);
+	if (tuning->flags & RTLSDR_TUNING_BANDWIDTH)
+		r |= rtlsdr_set_tuner_bandwidth(dev, tuning->bandwidth);
+	if (tuning->flags & RTLSDR_TUNING_FREQ)
+		r |= rtlsdr_set_center_freq(dev, tuning->freq);
+	if (tuning->flags & RTLSDR_TUNING_AGC_MODE)
+		r |= rtlsdr_set_agc_mode(dev, tuning->agc_mode);
+	if (tuning->flags & RTLSDR_TUNING_GAIN_MODE)
+		r |= rtlsdr_set_tuner_gain_mode(dev, tuning->gain_mode);
+	if (tuning->flags & RTLSDR_TUNING_GAIN)
+		r |= rtlsdr_set_tuner_gain(dev, tuning->gain);
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	return r;
+}
+
 int rtlsdr_set_tuner_gain(rtlsdr_dev_t *dev, int gain)
 {
 	int r = 0;
@@ -1232,33 +2003,130 @@ int rtlsdr_set_tuner_i2c_register(rtlsdr_dev_t *dev, unsigned i2c_register, unsi
 
 int rtlsdr_get_tuner_i2c_register(rtlsdr_dev_t *dev, unsigned char *data, int *len, int *strength)
 {
-	int r = 0;
+	int r = 1;
 
 	if (!dev || !dev->tuner)
 		return -1;
 
-	if (dev->tuner->get_i2c_register) {
-		rtlsdr_set_i2c_repeater(dev, 1);
-		r = dev->tuner->get_i2c_register((void *)dev, data, len, strength);
-		rtlsdr_set_i2c_repeater(dev, 0);
+	pthread_mutex_lock(&dev->snap_lock);
+	if (dev->snap_valid) {
+		memcpy(data, dev->snap_regs, dev->snap_len);
+		*len = dev->snap_len;
+		*strength = dev->snap_strength;
+		r = 0;
 	}
+	pthread_mutex_unlock(&dev->snap_lock);
 	return r;
 }
 
-int rtlsdr_set_dithering(rtlsdr_dev_t *dev, int dither)
+int rtlsdr_sample_tuner_i2c_register(rtlsdr_dev_t *dev)
 {
-	int r = 0;
-	if ((dev->tuner_type == RTLSDR_TUNER_R820T) ||
-				(dev->tuner_type == RTLSDR_TUNER_R828D)) {
-		rtlsdr_set_i2c_repeater(dev, 1);
-		r = r82xx_set_dither(&dev->r82xx_p, dither);
+	unsigned char data[RTLSDR_MAX_I2C_REGISTERS];
+	int r, len = 0, strength = 0;
+
+	if (!dev || !dev->tuner || !dev->tuner->get_i2c_register)
+		return -1;
+
+	/* never delay a control operation, try again later instead */
+	if (rtlsdr_atomic_load(&dev->ctrl_waiting) ||
+			pthread_mutex_trylock(&dev->cs_mutex))
+		return 1;
+	rtlsdr_demod_write_reg(dev, 1, 0x01, 0x18, 1);
+	r = dev->tuner->get_i2c_register((void *)dev, data, &len, &strength);
+	rtlsdr_demod_write_reg(dev, 1, 0x01, 0x10, 1);
+	pthread_mutex_unlock(&dev->cs_mutex);
+	if (r < 0)
+		return r;
+
+	pthread_mutex_lock(&dev->snap_lock);
+	memcpy(dev->snap_regs, data, len);
+	dev->snap_len = len;
+	dev->snap_strength = strength;
+	dev->snap_valid = 1;
+	pthread_mutex_unlock(&dev->snap_lock);
+	return 0;
+}
+
+int rtlsdr_set_dithering(rtlsdr_dev_t *dev, int dither)
+{
+	int r = 0;
+	if ((dev->tuner_type == RTLSDR_TUNER_R820T) ||
+				(dev->tuner_type == RTLSDR_TUNER_R828D)) {
+		rtlsdr_set_i2c_repeater(dev, 1);
+		r = r82xx_set_dither(&dev->r82xx_p, dither);
 		rtlsdr_set_i2c_repeater(dev, 0);
 	}
 	return r;
 }
 
+/* transfer count and length for the rate, see rtlsdr_set_xfer_policy() */
+static void rtlsdr_xfer_derive(rtlsdr_dev_t *dev, uint32_t *buf_num, uint32_t *buf_len)
+{
+	uint64_t bps = (uint64_t)dev->rate * 2;	/* 8 bit I/Q */
+	uint64_t len, num, queue_ms;
+
+	if (!dev->xfer_latency_us || !dev->rate) {
+		*buf_num = DEFAULT_BUF_NUMBER;
+		*buf_len = DEFAULT_BUF_LENGTH;
+		return;
+	}
+
+	len = bps * dev->xfer_latency_us / 1000000;
+	if (dev->xfer_prefer == RTLSDR_XFER_NO_OVERRUN)
+		len /= 4;
+	/* whole URBs where it is that long */
+	if (len >= 16384)
+		len -= len % 16384;
+	else
+		len -= len % 512;
+	if (len < XFER_MIN_LENGTH)
+		len = XFER_MIN_LENGTH;
+	if (len > XFER_MAX_LENGTH)
+		len = XFER_MAX_LENGTH;
+
+	queue_ms = (dev->xfer_prefer == RTLSDR_XFER_NO_OVERRUN) ? 500 : 100;
+	num = (bps * queue_ms / 1000 + len - 1) / len;
+	if (num < XFER_MIN_NUMBER)
+		num = XFER_MIN_NUMBER;
+	if (num > XFER_MAX_NUMBER)
+		num = XFER_MAX_NUMBER;
+
+	*buf_num = (uint32_t)num;
+	*buf_len = (uint32_t)len;
+}
+
+int rtlsdr_set_xfer_policy(rtlsdr_dev_t *dev, uint32_t latency_us, int prefer)
+{
+	if (!dev)
+		return -1;
+
+	if (prefer != RTLSDR_XFER_LOW_CPU && prefer != RTLSDR_XFER_NO_OVERRUN)
+		return -EINVAL;
+
+	dev->xfer_latency_us = latency_us;
+	dev->xfer_prefer = prefer;
+	return 0;
+}
+
+int rtlsdr_get_xfer_info(rtlsdr_dev_t *dev, rtlsdr_xfer_info_t *info)
+{
+	uint32_t count;
+
+	if (!dev || !info)
+		return -1;
+
+	count = dev->jitter_count;
+	info->buf_num = dev->xfer_buf_num;
+	info->buf_len = dev->xfer_buf_len;
+	info->jitter_avg_us = count ? (uint32_t)(dev->jitter_sum / count / 1000) : 0;
+	info->jitter_max_us = (uint32_t)(dev->jitter_max / 1000);
+	info->restarts = dev->xfer_restarts;
+	return 0;
+}
+
 int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 {
+	uint32_t buf_num, buf_len;
 	int r = 0;
 	uint16_t tmp;
 	uint32_t rsamp_ratio, real_rsamp_ratio;
@@ -1285,12 +2153,14 @@ int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 
 	dev->rate = (uint32_t)real_rate;
 
+	rtlsdr_demod_begin(dev);
 	tmp = (rsamp_ratio >> 16);
-	r |= rtlsdr_demod_write_reg(dev, 1, 0x9f, tmp, 2);
+	rtlsdr_demod_write_reg(dev, 1, 0x9f, tmp, 2);
 	tmp = rsamp_ratio & 0xffff;
-	r |= rtlsdr_demod_write_reg(dev, 1, 0xa1, tmp, 2);
+	rtlsdr_demod_write_reg(dev, 1, 0xa1, tmp, 2);
 
-	r |= rtlsdr_set_sample_freq_correction(dev, dev->corr);
+	rtlsdr_set_sample_freq_correction(dev, dev->corr);
+	r |= rtlsdr_demod_commit(dev);
 
 	/* reset demod (bit 3, soft_rst) */
 	r |= rtlsdr_demod_write_reg(dev, 1, 0x01, 0x14, 1);
@@ -1300,6 +2170,17 @@ int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t samp_rate)
 	if (dev->offs_freq)
 		rtlsdr_set_offset_tuning(dev, 1);
 
+	/* derived transfer sizes which no longer fit: set them up again */
+	if (dev->xfer_auto && RTLSDR_RUNNING == dev->async_status) {
+		rtlsdr_xfer_derive(dev, &buf_num, &buf_len);
+		if (((dev->xfer_auto & XFER_AUTO_NUM) && buf_num != dev->xfer_buf_num) ||
+		    ((dev->xfer_auto & XFER_AUTO_LEN) && buf_len != dev->xfer_buf_len)) {
+			dev->xfer_restart = 1;
+			dev->async_status = RTLSDR_CANCELING;
+			dev->async_cancel = 1;
+		}
+	}
+
 	return r;
 }
 
@@ -1340,17 +2221,21 @@ int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
 			rtlsdr_set_i2c_repeater(dev, 0);
 		}
 
+		rtlsdr_demod_begin(dev);
+
 		/* disable Zero-IF mode */
-		r |= rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1a, 1);
+		rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1a, 1);
 
 		/* disable spectrum inversion */
-		r |= rtlsdr_demod_write_reg(dev, 1, 0x15, 0x00, 1);
+		rtlsdr_demod_write_reg(dev, 1, 0x15, 0x00, 1);
 
 		/* only enable In-phase ADC input */
-		r |= rtlsdr_demod_write_reg(dev, 0, 0x08, 0x4d, 1);
+		rtlsdr_demod_write_reg(dev, 0, 0x08, 0x4d, 1);
 
 		/* swap I and Q ADC, this allows to select between two inputs */
-		r |= rtlsdr_demod_write_reg(dev, 0, 0x06, (on > 1) ? 0x90 : 0x80, 1);
+		rtlsdr_demod_write_reg(dev, 0, 0x06, (on > 1) ? 0x90 : 0x80, 1);
+
+		r |= rtlsdr_demod_commit(dev);
 
 		fprintf(stderr, "Enabled direct sampling mode, input %i\n", on);
 		dev->direct_sampling = on;
@@ -1361,21 +2246,23 @@ int rtlsdr_set_direct_sampling(rtlsdr_dev_t *dev, int on)
 			rtlsdr_set_i2c_repeater(dev, 0);
 		}
 
+		rtlsdr_demod_begin(dev);
 		if ((dev->tuner_type == RTLSDR_TUNER_R820T) ||
 				(dev->tuner_type == RTLSDR_TUNER_R828D)) {
 			r |= rtlsdr_set_if_freq(dev, R82XX_IF_FREQ);
 
 			/* enable spectrum inversion */
-			r |= rtlsdr_demod_write_reg(dev, 1, 0x15, 0x01, 1);
+			rtlsdr_demod_write_reg(dev, 1, 0x15, 0x01, 1);
 		} else {
 			r |= rtlsdr_set_if_freq(dev, 0);
 
 			/* enable In-phase + Quadrature ADC input */
-			r |= rtlsdr_demod_write_reg(dev, 0, 0x08, 0xcd, 1);
+			rtlsdr_demod_write_reg(dev, 0, 0x08, 0xcd, 1);
 
 			/* Enable Zero-IF mode */
-			r |= rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1b, 1);
+			rtlsdr_demod_write_reg(dev, 1, 0xb1, 0x1b, 1);
 		}
+		r |= rtlsdr_demod_commit(dev);
 
 		/* opt_adc_iq = 0, default ADC_I/ADC_Q datapath */
 		//r |= rtlsdr_demod_write_reg(dev, 0, 0x06, 0x80, 1);
@@ -1552,6 +2439,9 @@ const char *rtlsdr_get_device_name(uint32_t index)
 	uint32_t device_count = 0;
 	ssize_t cnt;
 
+	if (rtlsdr_sim_serial(index))
+		return "Virtual RTL2832U";
+
 	r = libusb_init(&ctx);
 	if(r < 0)
 		return "";
@@ -1593,6 +2483,21 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 	rtlsdr_dev_t devt;
 	uint32_t device_count = 0;
 	ssize_t cnt;
+	const char *sim_serial = rtlsdr_sim_serial(index);
+	const int buf_max = 256;
+
+	if (sim_serial) {
+		if (manufact)
+			snprintf(manufact, buf_max, "Realtek");
+		if (product)
+			snprintf(product, buf_max, "Virtual RTL2832U");
+		if (serial)
+			snprintf(serial, buf_max, "%s", sim_serial);
+		return 0;
+	}
+
+	/* only devh is set, rtlsdr_get_usb_strings() also reads sim */
+	memset(&devt, 0, sizeof(devt));
 
 	r = libusb_init(&ctx);
 	if(r < 0)
@@ -1631,28 +2536,153 @@ int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact,
 
 int rtlsdr_get_index_by_serial(const char *serial)
 {
-	int i, cnt, r;
-	char str[256];
+	rtlsdr_devlist_t *list;
+	int r;
 
 	if (!serial)
 		return -1;
 
-	cnt = rtlsdr_get_device_count();
+	if (!strncmp(serial, RTLSDR_SIM_PREFIX, strlen(RTLSDR_SIM_PREFIX)))
+		return rtlsdr_sim_register(serial);
 
-	if (!cnt)
+	if (rtlsdr_enumerate(&list) <= 0)
 		return -2;
 
+	r = rtlsdr_devlist_find(list, serial, RTLSDR_MATCH_EXACT);
+	rtlsdr_free_devlist(list);
+
+	return r < 0 ? -3 : r;
+}
+
+/* bus and port numbers of the device, like "1-2.4" */
+static int rtlsdr_usb_path(libusb_device *device, char *path, size_t len)
+{
+	uint8_t ports[8];
+	int i, n, pos;
+
+	n = libusb_get_port_numbers(device, ports, sizeof(ports));
+	if (n < 0)
+		return -1;
+
+	pos = snprintf(path, len, "%u", libusb_get_bus_number(device));
+	for (i = 0; i < n && pos > 0 && (size_t)pos < len; i++)
+		pos += snprintf(path + pos, len - pos, "%c%u",
+				i ? '.' : '-', ports[i]);
+
+	return (pos > 0 && (size_t)pos < len) ? 0 : -1;
+}
+
+int rtlsdr_enumerate(rtlsdr_devlist_t **out)
+{
+	int i, r;
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	rtlsdr_dongle_t *known;
+	rtlsdr_devlist_t *dl;
+	rtlsdr_devinfo_t *info;
+	rtlsdr_dev_t devt;
+	ssize_t cnt;
+
+	if (!out)
+		return -1;
+	*out = NULL;
+	memset(&devt, 0, sizeof(devt));
+
+	dl = calloc(1, sizeof(rtlsdr_devlist_t));
+	if (!dl)
+		return -ENOMEM;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		free(dl);
+		return r;
+	}
+
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt > 0)
+		dl->devs = calloc(cnt, sizeof(rtlsdr_devinfo_t));
+	if (cnt > 0 && !dl->devs) {
+		libusb_free_device_list(list, 1);
+		libusb_exit(ctx);
+		free(dl);
+		return -ENOMEM;
+	}
+
+	/* one walk, one open per device for its strings */
 	for (i = 0; i < cnt; i++) {
-		r = rtlsdr_get_device_usb_strings(i, NULL, NULL, str);
-		if (!r && !strcmp(serial, str))
-			return i;
+		libusb_get_device_descriptor(list[i], &dd);
+
+		known = find_known_device(dd.idVendor, dd.idProduct);
+		if (!known)
+			continue;
+
+		info = &dl->devs[dl->count];
+		info->index = dl->count++;
+		info->vid = dd.idVendor;
+		info->pid = dd.idProduct;
+		info->name = known->name;
+		rtlsdr_usb_path(list[i], info->path, sizeof(info->path));
+
+		if (!libusb_open(list[i], &devt.devh)) {
+			rtlsdr_get_usb_strings(&devt, info->manufact,
+					       info->product, info->serial);
+			libusb_close(devt.devh);
+		}
 	}
 
-	return -3;
+	libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	*out = dl;
+	return (int)dl->count;
 }
 
-int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+void rtlsdr_free_devlist(rtlsdr_devlist_t *list)
+{
+	if (!list)
+		return;
+
+	free(list->devs);
+	free(list);
+}
+
+int rtlsdr_devlist_find(const rtlsdr_devlist_t *list, const char *serial, int match)
+{
+	uint32_t i;
+	size_t len, slen;
+
+	if (!list || !serial)
+		return -1;
+
+	len = strlen(serial);
+
+	/* a better match on any device wins over a weaker one */
+	if (match & RTLSDR_MATCH_EXACT)
+		for (i = 0; i < list->count; i++)
+			if (!strcmp(serial, list->devs[i].serial))
+				return (int)i;
+
+	if (match & RTLSDR_MATCH_PREFIX)
+		for (i = 0; i < list->count; i++)
+			if (!strncmp(serial, list->devs[i].serial, len))
+				return (int)i;
+
+	if (match & RTLSDR_MATCH_SUFFIX)
+		for (i = 0; i < list->count; i++) {
+			slen = strlen(list->devs[i].serial);
+			if (slen >= len &&
+			    !strcmp(serial, list->devs[i].serial + slen - len))
+				return (int)i;
+		}
+
+	return -1;
+}
+
+static int _rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index,
+			const rtlsdr_devinfo_t *info)
 {
+	char path[32];
 	int r;
 	int i;
 	libusb_device **list;
@@ -1670,18 +2700,38 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 	memset(dev, 0, sizeof(rtlsdr_dev_t));
 	memcpy(dev->fir, fir_default, sizeof(fir_default));
 
-	r = libusb_init(&dev->ctx);
-	if(r < 0){
-		free(dev);
-		return -1;
+	if (!info && rtlsdr_sim_serial(index)) {
+		dev->sim = rtlsdr_sim_open(rtlsdr_sim_serial(index));
+		dev->sim_index = index;
+		if (!dev->sim) {
+			free(dev);
+			return -1;
+		}
+	} else {
+		r = libusb_init(&dev->ctx);
+		if(r < 0){
+			free(dev);
+			return -1;
+		}
 	}
 
 	pthread_mutexattr_init(&dev->cs_mutex_attr);
 	pthread_mutexattr_settype(&dev->cs_mutex_attr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&dev->cs_mutex, &dev->cs_mutex_attr);
+	pthread_mutex_init(&dev->snap_lock, NULL);
+	pthread_mutex_init(&dev->sched_lock, NULL);
+	pthread_mutex_init(&dev->ctrl_lock, NULL);
+	pthread_cond_init(&dev->ctrl_cond, NULL);
+	pthread_cond_init(&dev->ctrl_done, NULL);
+	for (i = 0; i < CTRL_QUEUE_LEN - 1; i++)
+		dev->ctrl_pool[i].next = &dev->ctrl_pool[i + 1];
+	dev->ctrl_free = dev->ctrl_pool;
 
 	dev->dev_lost = 1;
 
+	if (dev->sim)
+		goto sim;
+
 	cnt = libusb_get_device_list(dev->ctx, &list);
 
 	for (i = 0; i < cnt; i++) {
@@ -1689,6 +2739,17 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 
 		libusb_get_device_descriptor(list[i], &dd);
 
+		/* an entry of a snapshot is found by its port, not its index */
+		if (info) {
+			if (dd.idVendor == info->vid && dd.idProduct == info->pid &&
+			    !rtlsdr_usb_path(device, path, sizeof(path)) &&
+			    !strcmp(path, info->path))
+				break;
+
+			device = NULL;
+			continue;
+		}
+
 		if (find_known_device(dd.idVendor, dd.idProduct)) {
 			device_count++;
 		}
@@ -1742,6 +2803,7 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 		goto err;
 	}
 
+sim:
 	dev->rtl_xtal = DEF_RTL_XTAL_FREQ;
 
 	/* perform a dummy write, if it fails, reset the device */
@@ -1749,6 +2811,7 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 		fprintf(stderr, "Resetting device...\n");
 		libusb_reset_device(dev->devh);
 	}
+	rtlsdr_shadow_load(dev);
 	rtlsdr_init_baseband(dev);
 
 	dev->dev_lost = 0;
@@ -1756,6 +2819,12 @@ int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
 	/* Probe tuners */
 	rtlsdr_set_i2c_repeater(dev, 1);
 
+	if (dev->sim) {
+		fprintf(stderr, "Found virtual device %s\n",
+				rtlsdr_sim_serial(dev->sim_index));
+		goto found;
+	}
+
 	reg = check_tuner(dev, E4K_I2C_ADDR, E4K_CHECK_ADDR);
 	if (reg == E4K_CHECK_VAL) {
 		fprintf(stderr, "Found Elonics E4000 tuner\n");
@@ -1809,7 +2878,13 @@ found:
 	/* use the rtl clock value by default */
 	dev->tun_xtal = dev->rtl_xtal;
 	dev->tuner = &tuners[dev->tuner_type];
+	dev->settle_us = tuner_settle_us[dev->tuner_type];
+	if (dev->sim) {
+		dev->tuner = &sim_tuner;
+		dev->settle_us = rtlsdr_sim_settle_us(dev->sim);
+	}
 
+	rtlsdr_demod_begin(dev);
 	switch (dev->tuner_type) {
 	case RTLSDR_TUNER_FC2580:
 		dev->tun_xtal = FC2580_XTAL_FREQ;
@@ -1897,12 +2972,15 @@ found:
 		rtlsdr_demod_write_reg(dev, 1, 0x15, 0x01, 1);
 		break;
 	case RTLSDR_TUNER_UNKNOWN:
+		if (dev->sim)
+			break;
 		fprintf(stderr, "No supported tuner found\n");
 		rtlsdr_set_direct_sampling(dev, 1);
 		break;
 	default:
 		break;
 	}
+	rtlsdr_demod_commit(dev);
 
 	if (dev->tuner->init)
 		r = dev->tuner->init(dev);
@@ -1920,16 +2998,34 @@ err:
 		if (dev->ctx)
 			libusb_exit(dev->ctx);
 
+		rtlsdr_sim_close(dev->sim);
 		free(dev);
 	}
 	return r;
 }
 
+int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+{
+	return _rtlsdr_open(out_dev, index, NULL);
+}
+
+int rtlsdr_open_devinfo(rtlsdr_dev_t **out_dev, const rtlsdr_devinfo_t *info)
+{
+	if (!info)
+		return -1;
+
+	return _rtlsdr_open(out_dev, 0, info);
+}
+
 int rtlsdr_close(rtlsdr_dev_t *dev)
 {
 	if (!dev)
 		return -1;
 
+	if (dev->stream)
+		rtlsdr_stream_stop(dev);
+	rtlsdr_ctrl_stop(dev);
+
 	/* automatic de-activation of bias-T */
 	rtlsdr_set_bias_tee(dev, 0);
 
@@ -1942,6 +3038,19 @@ int rtlsdr_close(rtlsdr_dev_t *dev)
 		rtlsdr_deinit_baseband(dev);
 	}
 	pthread_mutex_destroy(&dev->cs_mutex);
+	pthread_mutex_destroy(&dev->snap_lock);
+	pthread_mutex_destroy(&dev->sched_lock);
+	pthread_mutex_destroy(&dev->ctrl_lock);
+	pthread_cond_destroy(&dev->ctrl_cond);
+	pthread_cond_destroy(&dev->ctrl_done);
+	free(dev->hops);
+	free(dev->sched_dwell);
+
+	if (dev->sim) {
+		rtlsdr_sim_close(dev->sim);
+		free(dev);
+		return 0;
+	}
 
 	libusb_release_interface(dev->devh, 0);
 
@@ -1979,132 +3088,486 @@ int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
 	if (!dev)
 		return -1;
 
+	if (dev->sim) {
+		if (rtlsdr_sim_realtime(dev->sim) && dev->rate)
+			usleep((uint64_t)len * 500000 / dev->rate);
+		rtlsdr_sim_read(dev->sim, dev->rate, buf, len);
+		*n_read = len;
+		return 0;
+	}
+
 	return libusb_bulk_transfer(dev->devh, 0x81, buf, len, n_read, BULK_TIMEOUT);
 }
 
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+static uint64_t _rtlsdr_monotonic_ns(void)
 {
-	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
-
-	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		if (dev->cb)
-			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
 
-		libusb_submit_transfer(xfer); /* resubmit transfer */
-		dev->xfer_errors = 0;
-	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
-#ifndef _WIN32
-		if (LIBUSB_TRANSFER_ERROR == xfer->status)
-			dev->xfer_errors++;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
 
-		if (dev->xfer_errors >= dev->xfer_buf_num ||
-				LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
-			dev->dev_lost = 1;
-			rtlsdr_cancel_async(dev);
-			fprintf(stderr, "cb transfer status: %d, "
-				"canceling...\n", xfer->status);
-#ifndef _WIN32
-		}
-#endif
-	}
 }
 
-int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx)
+uint64_t rtlsdr_get_buffer_time(rtlsdr_dev_t *dev)
 {
-	return rtlsdr_read_async(dev, cb, ctx, 0, 0);
+	if (!dev)
+		return 0;
+
+	return dev->xfer_time;
 }
 
-static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
+int rtlsdr_set_hop_schedule(rtlsdr_dev_t *dev, const uint32_t *freqs,
+			    const uint32_t *dwell_us, int num)
 {
-	unsigned int i;
+	uint32_t *dwell = NULL;
+	int r;
 
-	if (!dev)
+	if (!dev || num < 0 || (num && (!freqs || !dwell_us)))
 		return -1;
 
-	if (!dev->xfer) {
-		dev->xfer = malloc(dev->xfer_buf_num *
-					 sizeof(struct libusb_transfer *));
+	if (num) {
+		dwell = malloc(num * sizeof(uint32_t));
+		if (!dwell)
+			return -ENOMEM;
+		memcpy(dwell, dwell_us, num * sizeof(uint32_t));
+	}
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer[i] = libusb_alloc_transfer(0);
+	/* stop hopping before the table goes */
+	pthread_mutex_lock(&dev->sched_lock);
+	free(dev->sched_dwell);
+	dev->sched_dwell = NULL;
+	dev->sched_num = 0;
+	pthread_mutex_unlock(&dev->sched_lock);
+
+	r = rtlsdr_set_hop_table(dev, freqs, num);
+	if (r < 0 && r != -2) {
+		free(dwell);
+		return r;
 	}
 
-	if (dev->xfer_buf)
-		return -2;
+	pthread_mutex_lock(&dev->sched_lock);
+	dev->sched_dwell = dwell;
+	dev->sched_num = num;
+	dev->sched_restart = 1;
+	pthread_mutex_unlock(&dev->sched_lock);
+	return 0;
+}
 
-	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
-	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+int rtlsdr_get_buffer_segment(rtlsdr_dev_t *dev, uint32_t *settled)
+{
+	if (!dev)
+		return -1;
 
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+	if (settled)
+		*settled = dev->buf_settled;
+	return dev->buf_segment;
+}
 
-	dev->use_zerocopy = 1;
-	for (i = 0; i < dev->xfer_buf_num; ++i) {
-		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+uint32_t rtlsdr_get_hop_settle(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
 
-		if (!dev->xfer_buf[i]) {
-			fprintf(stderr, "Failed to allocate zero-copy "
-					"buffer for transfer %d\nFalling "
-					"back to buffers in userspace\n", i);
+	return dev->settle_us;
+}
 
-			dev->use_zerocopy = 0;
-			break;
-		}
-	}
+/* samples per power estimate of rtlsdr_calibrate_hop_settle() */
+#define SETTLE_BLOCK	256
+#define SETTLE_READ	(1 << 17)
+#define SETTLE_TRIALS	6
 
-	/* zero-copy buffer allocation failed (partially or completely)
-	 * we need to free the buffers again if already allocated */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				libusb_dev_mem_free(dev->devh,
-						    dev->xfer_buf[i],
-						    dev->xfer_buf_len);
-		}
-	}
-#endif
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
 
-	/* no zero-copy available, allocate buffers in userspace */
-	if (!dev->use_zerocopy) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+	return x < y ? -1 : x > y;
+}
 
-			if (!dev->xfer_buf[i])
-				return -ENOMEM;
+/*
+ * Samples from the start of buf until the power stays within 25 % of the
+ * median of the second half, taken as the settled level.
+ */
+static int settle_samples(const uint8_t *buf, int len)
+{
+	uint32_t power[SETTLE_READ / 2 / SETTLE_BLOCK];
+	uint32_t sorted[SETTLE_READ / 2 / SETTLE_BLOCK];
+	int i, b, num = len / 2 / SETTLE_BLOCK, tail, last = -1;
+	uint32_t ref;
+
+	if (num < 4)
+		return 0;
+	for (b = 0; b < num; b++) {
+		power[b] = 0;
+		for (i = 0; i < 2 * SETTLE_BLOCK; i++) {
+			int v = buf[b * 2 * SETTLE_BLOCK + i] - 127;
+
+			power[b] += v * v;
 		}
 	}
-
-	return 0;
+	tail = num - num / 2;
+	memcpy(sorted, &power[num / 2], tail * sizeof(uint32_t));
+	qsort(sorted, tail, sizeof(uint32_t), cmp_uint32);
+	ref = sorted[tail / 2];
+
+	for (b = 0; b < num / 2; b++)
+		if (power[b] * 4 > ref * 5 || power[b] * 4 < ref * 3)
+			last = b;
+	return (last + 1) * SETTLE_BLOCK;
 }
 
-static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
+int rtlsdr_calibrate_hop_settle(rtlsdr_dev_t *dev)
 {
-	unsigned int i;
+	uint8_t *buf;
+	uint64_t t0, t1;
+	uint32_t f0;
+	int k, n_read, us, worst = 0, r = 0;
 
-	if (!dev)
+	if (!dev || !dev->tuner || !dev->rate)
 		return -1;
+	if (RTLSDR_INACTIVE != dev->async_status)
+		return -2;
 
-	if (dev->xfer) {
-		for(i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer[i]) {
-				libusb_free_transfer(dev->xfer[i]);
-			}
-		}
+	buf = malloc(SETTLE_READ);
+	if (!buf)
+		return -ENOMEM;
 
-		free(dev->xfer);
-		dev->xfer = NULL;
+	f0 = dev->freq ? dev->freq : 100000000;
+	for (k = 0; k < SETTLE_TRIALS; k++) {
+		/* the samples from the reset on, with the retune first */
+		rtlsdr_reset_buffer(dev);
+		t0 = _rtlsdr_monotonic_ns();
+		r = rtlsdr_set_center_freq(dev, f0 + ((k & 1) ? 0 : 2000000));
+		t1 = _rtlsdr_monotonic_ns();
+		if (r < 0)
+			break;
+		r = rtlsdr_read_sync(dev, buf, SETTLE_READ, &n_read);
+		if (r < 0)
+			break;
+
+		us = (int)((uint64_t)settle_samples(buf, n_read) * 1000000 / dev->rate) -
+			(int)((t1 - t0) / 1000);
+		if (us > worst)
+			worst = us;
 	}
+	free(buf);
+	if (dev->freq != f0)
+		rtlsdr_set_center_freq(dev, f0);
+	if (r < 0)
+		return r;
 
-	if (dev->xfer_buf) {
-		for (i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i]) {
-				if (dev->use_zerocopy) {
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-					libusb_dev_mem_free(dev->devh,
-							    dev->xfer_buf[i],
-							    dev->xfer_buf_len);
+	/* one block more, it may have ended anywhere within the last */
+	dev->settle_us = worst + (int)((uint64_t)SETTLE_BLOCK * 1000000 / dev->rate);
+	return dev->settle_us;
+}
+
+uint32_t rtlsdr_get_xfer_errors(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->xfer_errors_total;
+}
+
+static void _libusb_transfer_failed(rtlsdr_dev_t *dev, struct libusb_transfer *xfer)
+{
+	dev->xfer_errors_total++;
+
+#ifndef _WIN32
+	if (LIBUSB_TRANSFER_ERROR == xfer->status)
+		dev->xfer_errors++;
+
+	if (dev->xfer_errors >= dev->xfer_buf_num ||
+			LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
+#endif
+		dev->dev_lost = 1;
+		rtlsdr_cancel_async(dev);
+		fprintf(stderr, "cb transfer status: %d, "
+			"canceling...\n", xfer->status);
+#ifndef _WIN32
+	}
+#endif
+}
+
+/*
+ * Hop schedule: buffers are tagged with the segment they belong to and the
+ * offset where its settled samples begin by rtlsdr_sched_buffer(), before
+ * they are delivered. Once a segment has been received for its dwell time,
+ * rtlsdr_sched_next() retunes between two transfers. With libusb it runs
+ * from the event loop of rtlsdr_read_async(), after the transfer callbacks
+ * returned: libusb fails synchronous transfers made from a callback with
+ * LIBUSB_ERROR_BUSY. The next transfer starts with the first sample taken
+ * after the completion of the last one, so the samples up to the end of
+ * the retune plus the settling time of the tuner are the unsettled ones.
+ */
+static void rtlsdr_sched_buffer(rtlsdr_dev_t *dev, uint32_t len)
+{
+	uint64_t start = dev->sched_pos;
+
+	dev->sched_pos += len / 2;
+	dev->buf_segment = -1;
+	dev->buf_settled = 0;
+	if (!dev->sched_num || dev->sched_restart)
+		return;
+
+	dev->buf_segment = dev->sched_index;
+	if (dev->sched_settled >= dev->sched_pos)
+		dev->buf_settled = len;
+	else if (dev->sched_settled > start)
+		dev->buf_settled = (uint32_t)(dev->sched_settled - start) * 2;
+}
+
+static void rtlsdr_sched_next(rtlsdr_dev_t *dev)
+{
+	uint64_t done;
+	uint32_t dwell;
+	int index;
+
+	pthread_mutex_lock(&dev->sched_lock);
+	if (!dev->sched_num || (!dev->sched_restart && dev->sched_pos < dev->sched_end)) {
+		pthread_mutex_unlock(&dev->sched_lock);
+		return;
+	}
+	index = dev->sched_restart ? 0 : (dev->sched_index + 1) % dev->sched_num;
+	dwell = dev->sched_dwell[index];
+	dev->sched_index = index;
+	dev->sched_restart = 0;
+	pthread_mutex_unlock(&dev->sched_lock);
+
+	/* the hop table can't be replaced meanwhile */
+	pthread_mutex_lock(&dev->cs_mutex);
+	if (rtlsdr_hop(dev, index) < 0)
+		fprintf(stderr, "hop to segment %d failed\n", index);
+	pthread_mutex_unlock(&dev->cs_mutex);
+	done = _rtlsdr_monotonic_ns();
+
+	dev->sched_settled = dev->sched_pos +
+		((done - dev->xfer_time) / 1000 + dev->settle_us) * dev->rate / 1000000;
+	dev->sched_end = dev->sched_settled + (uint64_t)dwell * dev->rate / 1000000;
+}
+
+/* completion time of a transfer of len bytes, and its deviation from the sample time */
+static void rtlsdr_xfer_completed(rtlsdr_dev_t *dev, uint32_t len)
+{
+	uint64_t now = _rtlsdr_monotonic_ns();
+	uint64_t expect, interval, dev_ns;
+
+	dev->xfer_prev = dev->xfer_time;
+	dev->xfer_time = now;
+	if (!dev->xfer_prev || !dev->rate)
+		return;
+
+	expect = (uint64_t)len * 500000000 / dev->rate;
+	interval = now - dev->xfer_prev;
+	dev_ns = interval > expect ? interval - expect : expect - interval;
+	dev->jitter_sum += dev_ns;
+	dev->jitter_count++;
+	if (dev_ns > dev->jitter_max)
+		dev->jitter_max = dev_ns;
+}
+
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		rtlsdr_xfer_completed(dev, xfer->actual_length);
+		rtlsdr_sched_buffer(dev, xfer->actual_length);
+		if (dev->cb)
+			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+
+		libusb_submit_transfer(xfer); /* resubmit transfer */
+		dev->xfer_errors = 0;
+	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		_libusb_transfer_failed(dev, xfer);
+	}
+}
+
+/*
+ * Buffers of rtlsdr_read_async_held(). A buffer handed to the application
+ * is owned by it until rtlsdr_release_buf(). Completed transfers are
+ * resubmitted with a buffer from free_list, or parked in idle until a
+ * buffer comes back. The pool outlives the streaming run while the
+ * application still holds buffers, the last reference frees it.
+ */
+struct rtlsdr_held_buf {
+	struct rtlsdr_hold_pool *pool;
+	unsigned char *data;
+	struct rtlsdr_held_buf *next;
+};
+
+struct rtlsdr_hold_pool {
+	rtlsdr_dev_t *dev;
+	pthread_mutex_t lock;
+	int refs;		/* buffers held by the application, +1 while streaming */
+	int running;		/* transfers may be (re)submitted */
+	int use_zerocopy;
+	uint32_t buf_num;
+	uint32_t buf_len;
+	struct rtlsdr_held_buf *bufs;
+	struct rtlsdr_held_buf *free_list;
+	struct libusb_transfer **idle;
+	uint32_t num_idle;
+};
+
+static int _rtlsdr_submit_held(struct libusb_transfer *xfer, struct rtlsdr_held_buf *hbuf)
+{
+	xfer->buffer = hbuf->data;
+	xfer->user_data = hbuf;
+	return libusb_submit_transfer(xfer);
+}
+
+static void LIBUSB_CALL _libusb_held_callback(struct libusb_transfer *xfer)
+{
+	struct rtlsdr_held_buf *hbuf = (struct rtlsdr_held_buf *)xfer->user_data;
+	struct rtlsdr_hold_pool *pool = hbuf->pool;
+	rtlsdr_dev_t *dev = pool->dev;
+	struct rtlsdr_held_buf *next;
+	uint32_t len = xfer->actual_length;
+	int deliver = 0;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		rtlsdr_xfer_completed(dev, len);
+		pthread_mutex_lock(&pool->lock);
+		if (pool->running) {
+			/* keep the transfer busy while the application holds hbuf */
+			next = pool->free_list;
+			if (!next) {
+				pool->idle[pool->num_idle++] = xfer;
+			} else {
+				pool->free_list = next->next;
+				if (_rtlsdr_submit_held(xfer, next) < 0) {
+					next->next = pool->free_list;
+					pool->free_list = next;
+				}
+			}
+			pool->refs++;
+			deliver = 1;
+		} else {
+			hbuf->next = pool->free_list;
+			pool->free_list = hbuf;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		dev->xfer_errors = 0;
+		if (deliver) {
+			rtlsdr_sched_buffer(dev, len);
+			dev->held_cb(hbuf, hbuf->data, len, dev->cb_ctx);
+		}
+	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		_libusb_transfer_failed(dev, xfer);
+	}
+}
+
+int rtlsdr_wait_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx)
+{
+	return rtlsdr_read_async(dev, cb, ctx, 0, 0);
+}
+
+static void _rtlsdr_alloc_transfers(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev->xfer) {
+		dev->xfer = malloc(dev->xfer_buf_num *
+					 sizeof(struct libusb_transfer *));
+
+		for(i = 0; i < dev->xfer_buf_num; ++i)
+			dev->xfer[i] = libusb_alloc_transfer(0);
+	}
+}
+
+static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	_rtlsdr_alloc_transfers(dev);
+
+	if (dev->xfer_buf)
+		return -2;
+
+	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
+	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
+
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
+
+	dev->use_zerocopy = 1;
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		dev->xfer_buf[i] = libusb_dev_mem_alloc(dev->devh, dev->xfer_buf_len);
+
+		if (!dev->xfer_buf[i]) {
+			fprintf(stderr, "Failed to allocate zero-copy "
+					"buffer for transfer %d\nFalling "
+					"back to buffers in userspace\n", i);
+
+			dev->use_zerocopy = 0;
+			break;
+		}
+	}
+
+	/* zero-copy buffer allocation failed (partially or completely)
+	 * we need to free the buffers again if already allocated */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_buf[i])
+				libusb_dev_mem_free(dev->devh,
+						    dev->xfer_buf[i],
+						    dev->xfer_buf_len);
+		}
+	}
+#endif
+
+	/* no zero-copy available, allocate buffers in userspace */
+	if (!dev->use_zerocopy) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+
+			if (!dev->xfer_buf[i])
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	if (dev->xfer) {
+		for(i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer[i]) {
+				libusb_free_transfer(dev->xfer[i]);
+			}
+		}
+
+		free(dev->xfer);
+		dev->xfer = NULL;
+	}
+
+	if (dev->xfer_buf) {
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (dev->xfer_buf[i]) {
+				if (dev->use_zerocopy) {
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+					libusb_dev_mem_free(dev->devh,
+							    dev->xfer_buf[i],
+							    dev->xfer_buf_len);
 #endif
 				} else {
 					free(dev->xfer_buf[i]);
@@ -2119,11 +3582,200 @@ static int _rtlsdr_free_async_buffers(rtlsdr_dev_t *dev)
 	return 0;
 }
 
-int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
-				uint32_t buf_num, uint32_t buf_len)
+static void _rtlsdr_free_hold_pool(struct rtlsdr_hold_pool *pool)
+{
+	uint32_t i;
+
+	if (pool->bufs) {
+		for (i = 0; i < pool->buf_num; ++i) {
+			if (!pool->bufs[i].data)
+				continue;
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+			if (pool->use_zerocopy) {
+				libusb_dev_mem_free(pool->dev->devh,
+						    pool->bufs[i].data,
+						    pool->buf_len);
+				continue;
+			}
+#endif
+			free(pool->bufs[i].data);
+		}
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->idle);
+	free(pool->bufs);
+	free(pool);
+}
+
+static struct rtlsdr_hold_pool *_rtlsdr_alloc_hold_pool(rtlsdr_dev_t *dev, uint32_t buf_num)
+{
+	struct rtlsdr_hold_pool *pool;
+	uint32_t i;
+
+	pool = calloc(1, sizeof(struct rtlsdr_hold_pool));
+	if (!pool)
+		return NULL;
+
+	pool->dev = dev;
+	pool->buf_num = buf_num;
+	pool->buf_len = dev->xfer_buf_len;
+	pool->refs = 1;
+	pool->running = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pool->bufs = calloc(buf_num, sizeof(struct rtlsdr_held_buf));
+	pool->idle = calloc(dev->xfer_buf_num, sizeof(struct libusb_transfer *));
+	if (!pool->bufs || !pool->idle) {
+		_rtlsdr_free_hold_pool(pool);
+		return NULL;
+	}
+
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	fprintf(stderr, "Allocating %d zero-copy buffers\n", buf_num);
+
+	pool->use_zerocopy = !dev->sim;
+	for (i = 0; i < buf_num && pool->use_zerocopy; ++i) {
+		pool->bufs[i].data = libusb_dev_mem_alloc(dev->devh, pool->buf_len);
+
+		if (!pool->bufs[i].data) {
+			fprintf(stderr, "Failed to allocate zero-copy "
+					"buffer %d\nFalling back to buffers "
+					"in userspace\n", i);
+
+			pool->use_zerocopy = 0;
+			break;
+		}
+	}
+
+	if (!pool->use_zerocopy) {
+		for (i = 0; i < buf_num; ++i) {
+			if (pool->bufs[i].data)
+				libusb_dev_mem_free(dev->devh,
+						    pool->bufs[i].data,
+						    pool->buf_len);
+			pool->bufs[i].data = NULL;
+		}
+	}
+#endif
+
+	for (i = 0; i < buf_num; ++i) {
+		if (!pool->use_zerocopy) {
+			pool->bufs[i].data = malloc(pool->buf_len);
+			if (!pool->bufs[i].data) {
+				_rtlsdr_free_hold_pool(pool);
+				return NULL;
+			}
+		}
+		pool->bufs[i].pool = pool;
+		pool->bufs[i].next = (i + 1 < buf_num) ? &pool->bufs[i + 1] : NULL;
+	}
+	pool->free_list = pool->bufs;
+
+	return pool;
+}
+
+/* no more submissions, the transfers are about to be canceled */
+static void _rtlsdr_stop_hold_pool(struct rtlsdr_hold_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->running = 0;
+	pool->num_idle = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void rtlsdr_release_buf(rtlsdr_held_buf_t *hbuf)
+{
+	struct rtlsdr_hold_pool *pool;
+	struct libusb_transfer *xfer = NULL;
+	int last;
+
+	if (!hbuf)
+		return;
+
+	pool = hbuf->pool;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->running && pool->num_idle) {
+		xfer = pool->idle[--pool->num_idle];
+		if (_rtlsdr_submit_held(xfer, hbuf) < 0)
+			xfer = NULL;
+	}
+	if (!xfer) {
+		hbuf->next = pool->free_list;
+		pool->free_list = hbuf;
+	}
+	last = (--pool->refs == 0);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (last)
+		_rtlsdr_free_hold_pool(pool);
+}
+
+/*
+ * Transfers of a virtual device: the callbacks get the buffers of the
+ * generator, in real time unless the device runs as fast as possible. If
+ * no held buffer is free, the samples are lost like on the device.
+ */
+static int _rtlsdr_sim_stream(rtlsdr_dev_t *dev)
+{
+	struct rtlsdr_hold_pool *pool = dev->hold_pool;
+	struct rtlsdr_held_buf *hbuf = NULL;
+	unsigned char *buf = NULL, *data;
+	uint32_t len = dev->xfer_buf_len;
+	uint64_t due, now;
+
+	if (!pool) {
+		buf = malloc(len);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	due = _rtlsdr_monotonic_ns();
+	while (RTLSDR_RUNNING == dev->async_status) {
+		if (rtlsdr_sim_realtime(dev->sim) && dev->rate) {
+			due += (uint64_t)len * 500000000 / dev->rate;
+			now = _rtlsdr_monotonic_ns();
+			if (due > now)
+				usleep((due - now) / 1000);
+		}
+
+		data = buf;
+		if (pool) {
+			pthread_mutex_lock(&pool->lock);
+			hbuf = pool->free_list;
+			if (hbuf) {
+				pool->free_list = hbuf->next;
+				pool->refs++;
+			}
+			pthread_mutex_unlock(&pool->lock);
+			if (!hbuf) {
+				rtlsdr_sim_read(dev->sim, dev->rate, NULL, len);
+				continue;
+			}
+			data = hbuf->data;
+		}
+
+		rtlsdr_sim_read(dev->sim, dev->rate, data, len);
+		rtlsdr_xfer_completed(dev, len);
+		rtlsdr_sched_buffer(dev, len);
+		if (pool)
+			dev->held_cb(hbuf, data, len, dev->cb_ctx);
+		else if (dev->cb)
+			dev->cb(data, len, dev->cb_ctx);
+		rtlsdr_sched_next(dev);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int _rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb,
+			      rtlsdr_read_held_cb_t held_cb, void *ctx,
+			      uint32_t buf_num, uint32_t buf_len, uint32_t spare_num)
 {
+	struct rtlsdr_held_buf *hbuf;
 	unsigned int i;
-	int r = 0;
+	int last, r = 0;
 	struct timeval tv = { 1, 0 };
 	struct timeval zerotv = { 0, 0 };
 	enum rtlsdr_async_status next_status = RTLSDR_INACTIVE;
@@ -2138,22 +3790,75 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 	dev->async_cancel = 0;
 
 	dev->cb = cb;
+	dev->held_cb = held_cb;
 	dev->cb_ctx = ctx;
 
+	dev->xfer_auto = 0;
+	if (dev->xfer_latency_us) {
+		if (!buf_num)
+			dev->xfer_auto |= XFER_AUTO_NUM;
+		if (!buf_len)
+			dev->xfer_auto |= XFER_AUTO_LEN;
+	}
+	dev->xfer_restart = 0;
+	dev->xfer_restarts = 0;
+	dev->jitter_sum = 0;
+	dev->jitter_max = 0;
+	dev->jitter_count = 0;
+
+restart:
+	dev->xfer_time = 0;
+
+	/* a schedule set before starts over with the stream */
+	pthread_mutex_lock(&dev->sched_lock);
+	dev->sched_pos = 0;
+	dev->sched_restart = (dev->sched_num > 0);
+	dev->sched_end = 0;
+	pthread_mutex_unlock(&dev->sched_lock);
+
+	rtlsdr_xfer_derive(dev, &dev->xfer_buf_num, &dev->xfer_buf_len);
+
 	if (buf_num > 0)
 		dev->xfer_buf_num = buf_num;
-	else
-		dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
 
 	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
 		dev->xfer_buf_len = buf_len;
-	else
+	else if (buf_len > 0)
 		dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
 
-	_rtlsdr_alloc_async_buffers(dev);
+	if (held_cb) {
+		if (!dev->sim)
+			_rtlsdr_alloc_transfers(dev);
+		dev->hold_pool = _rtlsdr_alloc_hold_pool(dev,
+						dev->xfer_buf_num + spare_num);
+		if (!dev->hold_pool) {
+			_rtlsdr_free_async_buffers(dev);
+			dev->async_status = RTLSDR_INACTIVE;
+			return -ENOMEM;
+		}
+	} else if (!dev->sim) {
+		_rtlsdr_alloc_async_buffers(dev);
+	}
+
+	if (dev->sim) {
+		r = _rtlsdr_sim_stream(dev);
+		goto done;
+	}
 
 	for(i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
+		if (dev->hold_pool) {
+			hbuf = dev->hold_pool->free_list;
+			dev->hold_pool->free_list = hbuf->next;
+			libusb_fill_bulk_transfer(dev->xfer[i],
+						dev->devh,
+						0x81,
+						hbuf->data,
+						dev->xfer_buf_len,
+						_libusb_held_callback,
+						(void *)hbuf,
+						BULK_TIMEOUT);
+		} else {
+			libusb_fill_bulk_transfer(dev->xfer[i],
 						dev->devh,
 						0x81,
 						dev->xfer_buf[i],
@@ -2161,6 +3866,7 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 						_libusb_callback,
 						(void *)dev,
 						BULK_TIMEOUT);
+		}
 
 		r = libusb_submit_transfer(dev->xfer[i]);
 		if (r < 0) {
@@ -2185,9 +3891,16 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 			break;
 		}
 
+		/* no transfer callback is running here */
+		if (RTLSDR_RUNNING == dev->async_status)
+			rtlsdr_sched_next(dev);
+
 		if (RTLSDR_CANCELING == dev->async_status) {
 			next_status = RTLSDR_INACTIVE;
 
+			if (dev->hold_pool)
+				_rtlsdr_stop_hold_pool(dev->hold_pool);
+
 			if (!dev->xfer)
 				break;
 
@@ -2221,18 +3934,59 @@ int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
 		}
 	}
 
+done:
+	if (dev->hold_pool) {
+		_rtlsdr_stop_hold_pool(dev->hold_pool);
+		pthread_mutex_lock(&dev->hold_pool->lock);
+		last = (--dev->hold_pool->refs == 0);
+		pthread_mutex_unlock(&dev->hold_pool->lock);
+		if (last)
+			_rtlsdr_free_hold_pool(dev->hold_pool);
+		dev->hold_pool = NULL;
+	}
+
 	_rtlsdr_free_async_buffers(dev);
 
+	/* cancelled by a rate change, not by rtlsdr_cancel_async() */
+	if (dev->xfer_restart && RTLSDR_INACTIVE == next_status && !dev->dev_lost) {
+		dev->xfer_restart = 0;
+		dev->xfer_restarts++;
+		dev->async_status = RTLSDR_RUNNING;
+		dev->async_cancel = 0;
+		next_status = RTLSDR_INACTIVE;
+		r = 0;
+		goto restart;
+	}
+	dev->xfer_restart = 0;
+
 	dev->async_status = next_status;
 
 	return r;
 }
 
+int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
+				uint32_t buf_num, uint32_t buf_len)
+{
+	return _rtlsdr_read_async(dev, cb, NULL, ctx, buf_num, buf_len, 0);
+}
+
+int rtlsdr_read_async_held(rtlsdr_dev_t *dev, rtlsdr_read_held_cb_t cb, void *ctx,
+			   uint32_t buf_num, uint32_t buf_len, uint32_t spare_num)
+{
+	if (!cb)
+		return -1;
+
+	return _rtlsdr_read_async(dev, NULL, cb, ctx, buf_num, buf_len, spare_num);
+}
+
 int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
 {
 	if (!dev)
 		return -1;
 
+	/* a restart for a new rate is pending: end the stream instead */
+	dev->xfer_restart = 0;
+
 	/* if streaming, try to cancel gracefully */
 	if (RTLSDR_RUNNING == dev->async_status) {
 		dev->async_status = RTLSDR_CANCELING;
@@ -2250,6 +4004,252 @@ int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
 	return -2;
 }
 
+/*
+ * Streaming with an event thread of the library: the thread does nothing
+ * but handle the USB events, resubmit the transfers and put the completed
+ * buffers into a single producer, single consumer queue. The consumer
+ * takes them out without locking, it only sleeps on the condition or
+ * polls the eventfd when the queue is empty.
+ */
+struct rtlsdr_stream {
+	rtlsdr_dev_t *dev;
+	pthread_t thread;
+	uint32_t buf_num;
+	uint32_t buf_len;
+	uint32_t mask;		/* queue length - 1 */
+	rtlsdr_stream_buf_t *slots;
+	char pad0[RTLSDR_CACHE_LINE];
+	volatile uint32_t head;	/* written by the event thread only */
+	char pad1[RTLSDR_CACHE_LINE - sizeof(uint32_t)];
+	volatile uint32_t tail;	/* written by the consumer only */
+	char pad2[RTLSDR_CACHE_LINE - sizeof(uint32_t)];
+	volatile uint32_t waiting;	/* the consumer sleeps on cond */
+	volatile uint32_t overruns;
+	volatile uint32_t ended;
+	int result;		/* of rtlsdr_read_async_held() */
+	int efd;		/* eventfd, -1 if not available */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void rtlsdr_stream_wake(struct rtlsdr_stream *st)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	/* the counter can't overflow with one per buffer */
+	if (st->efd >= 0)
+		(void)!write(st->efd, &one, sizeof(one));
+#endif
+	if (rtlsdr_atomic_xchg(&st->waiting, 0)) {
+		pthread_mutex_lock(&st->lock);
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+	}
+}
+
+static void rtlsdr_stream_cb(rtlsdr_held_buf_t *hbuf, unsigned char *buf,
+			     uint32_t len, void *ctx)
+{
+	struct rtlsdr_stream *st = (struct rtlsdr_stream *)ctx;
+	rtlsdr_stream_buf_t *slot;
+	uint32_t head = st->head;
+
+	if (head - rtlsdr_atomic_load(&st->tail) > st->mask) {
+		/* the consumer is behind, keep the transfers going */
+		rtlsdr_atomic_add(&st->overruns, 1);
+		rtlsdr_release_buf(hbuf);
+		return;
+	}
+
+	slot = &st->slots[head & st->mask];
+	slot->hbuf = hbuf;
+	slot->buf = buf;
+	slot->len = len;
+	slot->time_ns = st->dev->xfer_time;
+	slot->segment = st->dev->buf_segment;
+	slot->settled = st->dev->buf_settled;
+	rtlsdr_atomic_store(&st->head, head + 1);
+	rtlsdr_stream_wake(st);
+}
+
+static void *rtlsdr_stream_thread(void *arg)
+{
+	struct rtlsdr_stream *st = (struct rtlsdr_stream *)arg;
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+	struct sched_param param;
+
+	/* needs the privilege, else the thread keeps the normal policy */
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+
+	st->result = rtlsdr_read_async_held(st->dev, rtlsdr_stream_cb, st,
+			st->buf_num, st->buf_len, st->mask + 1);
+	rtlsdr_atomic_store(&st->ended, 1);
+	rtlsdr_atomic_xchg(&st->waiting, 1);
+	rtlsdr_stream_wake(st);
+	return NULL;
+}
+
+int rtlsdr_stream_start(rtlsdr_dev_t *dev, uint32_t buf_num, uint32_t buf_len,
+			uint32_t queue_len)
+{
+	struct rtlsdr_stream *st;
+	uint32_t size = 1;
+
+	if (!dev)
+		return -1;
+	if (dev->stream || RTLSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	if (!queue_len)
+		queue_len = DEFAULT_BUF_NUMBER * 2;
+	while (size < queue_len)
+		size <<= 1;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return -ENOMEM;
+	st->slots = calloc(size, sizeof(rtlsdr_stream_buf_t));
+	if (!st->slots) {
+		free(st);
+		return -ENOMEM;
+	}
+	st->dev = dev;
+	st->buf_num = buf_num;
+	st->buf_len = buf_len;
+	st->mask = size - 1;
+	st->efd = -1;
+#ifdef __linux__
+	st->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	dev->stream = st;
+	if (pthread_create(&st->thread, NULL, rtlsdr_stream_thread, st)) {
+		dev->stream = NULL;
+		pthread_mutex_destroy(&st->lock);
+		pthread_cond_destroy(&st->cond);
+#ifdef __linux__
+		if (st->efd >= 0)
+			close(st->efd);
+#endif
+		free(st->slots);
+		free(st);
+		return -1;
+	}
+	return 0;
+}
+
+int rtlsdr_stream_get(rtlsdr_dev_t *dev, rtlsdr_stream_buf_t *buf, int timeout_ms)
+{
+	struct rtlsdr_stream *st;
+	struct timespec ts;
+	uint32_t tail;
+
+	if (!dev || !dev->stream)
+		return -1;
+	st = dev->stream;
+	tail = st->tail;
+
+#ifdef __linux__
+	/* reset before looking, a later push makes it readable again */
+	if (st->efd >= 0) {
+		uint64_t cnt;
+
+		/* fails with EAGAIN if nothing was pushed since the last call */
+		(void)!read(st->efd, &cnt, sizeof(cnt));
+	}
+#endif
+
+	if (rtlsdr_atomic_load(&st->head) == tail) {
+		if (rtlsdr_atomic_load(&st->ended))
+			return -1;
+		if (!timeout_ms)
+			return 1;
+
+		pthread_mutex_lock(&st->lock);
+		rtlsdr_atomic_xchg(&st->waiting, 1);
+		if (rtlsdr_atomic_load(&st->head) == tail && !rtlsdr_atomic_load(&st->ended)) {
+#ifdef _WIN32
+			timespec_get(&ts, TIME_UTC);
+#else
+			clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+			ts.tv_sec += timeout_ms / 1000;
+			ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&st->cond, &st->lock, &ts);
+		}
+		pthread_mutex_unlock(&st->lock);
+
+		if (rtlsdr_atomic_load(&st->head) == tail)
+			return rtlsdr_atomic_load(&st->ended) ? -1 : 1;
+	}
+
+	*buf = st->slots[tail & st->mask];
+	rtlsdr_atomic_store(&st->tail, tail + 1);
+	return 0;
+}
+
+int rtlsdr_stream_fd(rtlsdr_dev_t *dev)
+{
+	if (!dev || !dev->stream)
+		return -1;
+
+	return dev->stream->efd;
+}
+
+uint32_t rtlsdr_stream_overruns(rtlsdr_dev_t *dev)
+{
+	if (!dev || !dev->stream)
+		return 0;
+
+	return rtlsdr_atomic_load(&dev->stream->overruns);
+}
+
+int rtlsdr_stream_stop(rtlsdr_dev_t *dev)
+{
+	struct rtlsdr_stream *st;
+	rtlsdr_stream_buf_t buf;
+	int r;
+
+	if (!dev || !dev->stream)
+		return -1;
+	st = dev->stream;
+
+	/* the thread may not have started streaming yet */
+	while (!rtlsdr_atomic_load(&st->ended)) {
+		rtlsdr_cancel_async(dev);
+		usleep(1000);
+	}
+	pthread_join(st->thread, NULL);
+
+	/* buffers the consumer hasn't taken */
+	while (!rtlsdr_stream_get(dev, &buf, 0))
+		rtlsdr_release_buf(buf.hbuf);
+
+	r = st->result;
+	dev->stream = NULL;
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+#ifdef __linux__
+	if (st->efd >= 0)
+		close(st->efd);
+#endif
+	free(st->slots);
+	free(st);
+	return r;
+}
+
 uint32_t rtlsdr_get_tuner_clock(void *dev)
 {
 	uint32_t tuner_freq;
@@ -2423,6 +4423,12 @@ int rtlsdr_set_opt_string(rtlsdr_dev_t *dev, const char *opts, int verbose)
 			fprintf(stderr, "\nrtlsdr_set_opt_string(): parsed option verbose\n");
 			dev->verbose = 1;
 		}
+		else if (!strcmp(optPart, "shadowcheck")) {
+			if (verbose)
+				fprintf(stderr, "rtlsdr_set_opt_string(): parsed option shadowcheck\n");
+			dev->shadow_check = 1;
+			ret = rtlsdr_shadow_verify(dev) ? -1 : 0;
+		}
 		else if (!strncmp(optPart, "f=", 2)) {
 			uint32_t freq = (uint32_t)atol(optPart + 2);
 			if (verbose)
@@ -2486,3 +4492,359 @@ void rtlsdr_cal_imr(const int val)
 	cal_imr = val;
 }
 
+void rtlsdr_set_imr_cache(const char *path, int max_age)
+{
+	imr_cache_set = (path != NULL);
+	if (path)
+		snprintf(imr_cache_path, sizeof(imr_cache_path), "%s", path);
+	imr_cache_age = max_age;
+}
+
+int rtlsdr_recalibrate_imr(rtlsdr_dev_t *dev)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+	if ((dev->tuner_type != RTLSDR_TUNER_R820T &&
+			dev->tuner_type != RTLSDR_TUNER_R828D) || dev->direct_sampling)
+		return -2;
+
+	rtlsdr_set_i2c_repeater(dev, 1);
+	r = r82xx_calibrate_imr(&dev->r82xx_p);
+	if (!r)
+		imr_cache_store(dev, &dev->r82xx_p);
+	/* the calibration tuned to the ring oscillator */
+	if (dev->freq)
+		r |= dev->tuner->set_freq(dev, dev->freq - dev->offs_freq);
+	rtlsdr_set_i2c_repeater(dev, 0);
+
+	return r;
+}
+
+/*
+ * Control queue: one FIFO per class, served by rtlsdr_ctrl_worker() in the
+ * order of the classes. Requests of one family change related settings,
+ * so they must keep their order; requests with the same key set the same
+ * thing, so the later one supersedes the earlier.
+ */
+enum ctrl_family {
+	CTRL_FAMILY_FREQ,
+	CTRL_FAMILY_CORR,
+	CTRL_FAMILY_GAIN,
+	CTRL_FAMILY_REGS,
+	CTRL_FAMILY_NONE	/* never superseded */
+};
+
+static const struct {
+	uint8_t cls;
+	uint8_t family;
+} ctrl_ops[RTLSDR_OP_NUM] = {
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_FREQ },		/* RTLSDR_OP_CENTER_FREQ */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_FREQ },		/* RTLSDR_OP_HOP */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_CORR },		/* RTLSDR_OP_FREQ_CORRECTION */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_GAIN },		/* RTLSDR_OP_TUNER_GAIN_MODE */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_GAIN },		/* RTLSDR_OP_TUNER_GAIN */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_GAIN },		/* RTLSDR_OP_TUNER_IF_GAIN */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_GAIN },		/* RTLSDR_OP_AGC_MODE */
+	{ RTLSDR_CTRL_TELEMETRY, CTRL_FAMILY_REGS },	/* RTLSDR_OP_SAMPLE_REGS */
+	{ RTLSDR_CTRL_IR, CTRL_FAMILY_NONE },		/* RTLSDR_OP_IR_QUERY */
+	{ RTLSDR_CTRL_TUNE, CTRL_FAMILY_NONE },		/* RTLSDR_OP_TUNING */
+};
+
+/* the setting a request changes, see ctrl_family */
+static uint32_t ctrl_key(enum rtlsdr_ctrl_op op, uint32_t param)
+{
+	switch (op) {
+	case RTLSDR_OP_CENTER_FREQ:
+	case RTLSDR_OP_HOP:
+		return 0;	/* both set the frequency */
+	case RTLSDR_OP_TUNER_IF_GAIN:
+		return ((uint32_t)op << 16) | (param >> 16);	/* per stage */
+	default:
+		return (uint32_t)op << 16;
+	}
+}
+
+static int rtlsdr_ctrl_exec(rtlsdr_dev_t *dev, struct rtlsdr_ctrl_req *req)
+{
+	int r;
+
+	switch (req->op) {
+	case RTLSDR_OP_CENTER_FREQ:
+		return rtlsdr_set_center_freq(dev, req->param);
+	case RTLSDR_OP_HOP:
+		return rtlsdr_hop(dev, (int)req->param);
+	case RTLSDR_OP_FREQ_CORRECTION:
+		return rtlsdr_set_freq_correction(dev, (int)req->param);
+	case RTLSDR_OP_TUNER_GAIN_MODE:
+		return rtlsdr_set_tuner_gain_mode(dev, (int)req->param);
+	case RTLSDR_OP_TUNER_GAIN:
+		return rtlsdr_set_tuner_gain(dev, (int)req->param);
+	case RTLSDR_OP_TUNER_IF_GAIN:
+		return rtlsdr_set_tuner_if_gain(dev, req->param >> 16, (int16_t)(req->param & 0xffff));
+	case RTLSDR_OP_AGC_MODE:
+		return rtlsdr_set_agc_mode(dev, (int)req->param);
+	case RTLSDR_OP_SAMPLE_REGS:
+		return rtlsdr_sample_tuner_i2c_register(dev);
+	case RTLSDR_OP_TUNING:
+		return rtlsdr_set_tuning(dev, (const rtlsdr_tuning_t *)req->buf);
+	case RTLSDR_OP_IR_QUERY:
+		/* not bracketed by the repeater like the tuner operations */
+		pthread_mutex_lock(&dev->cs_mutex);
+		r = rtlsdr_ir_query(dev, req->buf, req->buf_len);
+		pthread_mutex_unlock(&dev->cs_mutex);
+		return r;
+	default:
+		return -1;
+	}
+}
+
+static void *rtlsdr_ctrl_worker(void *arg)
+{
+	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)arg;
+	struct rtlsdr_ctrl_req req, *q;
+	rtlsdr_ctrl_stats_t *st;
+	uint64_t start, now;
+	uint32_t latency;
+	int c, r;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	while (!dev->ctrl_exit) {
+		for (c = 0; c < RTLSDR_CTRL_CLASSES; c++)
+			if (dev->ctrl_head[c])
+				break;
+		if (c == RTLSDR_CTRL_CLASSES) {
+			pthread_cond_wait(&dev->ctrl_cond, &dev->ctrl_lock);
+			continue;
+		}
+
+		q = dev->ctrl_head[c];
+		dev->ctrl_head[c] = q->next;
+		if (!q->next)
+			dev->ctrl_tail[c] = NULL;
+		req = *q;
+		q->next = dev->ctrl_free;
+		dev->ctrl_free = q;
+		dev->ctrl_stats[c].pending--;
+		dev->ctrl_busy = 1;
+		pthread_mutex_unlock(&dev->ctrl_lock);
+
+		start = _rtlsdr_monotonic_ns();
+		r = rtlsdr_ctrl_exec(dev, &req);
+		now = _rtlsdr_monotonic_ns();
+		latency = (uint32_t)((now - req.queued) / 1000);
+		if (req.cb)
+			req.cb(r, latency, req.ctx);
+
+		pthread_mutex_lock(&dev->ctrl_lock);
+		st = &dev->ctrl_stats[c];
+		st->completed++;
+		st->latency_sum_us += latency;
+		if (latency > st->latency_max_us)
+			st->latency_max_us = latency;
+		if ((start - req.queued) / 1000 > st->wait_max_us)
+			st->wait_max_us = (uint32_t)((start - req.queued) / 1000);
+		dev->ctrl_busy = 0;
+		pthread_cond_broadcast(&dev->ctrl_done);
+	}
+	pthread_mutex_unlock(&dev->ctrl_lock);
+	return NULL;
+}
+
+/* end the control thread and cancel the requests left */
+static void rtlsdr_ctrl_stop(rtlsdr_dev_t *dev)
+{
+	struct rtlsdr_ctrl_req *q, *next;
+	uint64_t now;
+	int c;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	dev->ctrl_exit = 1;
+	pthread_cond_broadcast(&dev->ctrl_cond);
+	pthread_mutex_unlock(&dev->ctrl_lock);
+	if (dev->ctrl_running)
+		pthread_join(dev->ctrl_thread, NULL);
+	dev->ctrl_running = 0;
+
+	now = _rtlsdr_monotonic_ns();
+	for (c = 0; c < RTLSDR_CTRL_CLASSES; c++) {
+		for (q = dev->ctrl_head[c]; q; q = next) {
+			next = q->next;
+			if (q->cb)
+				q->cb(RTLSDR_CTRL_CANCELLED, (uint32_t)((now - q->queued) / 1000), q->ctx);
+		}
+		dev->ctrl_head[c] = dev->ctrl_tail[c] = NULL;
+		dev->ctrl_stats[c].pending = 0;
+	}
+}
+
+int rtlsdr_ctrl_submit(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_op op,
+		       uint32_t param, uint8_t *buf, size_t buf_len,
+		       rtlsdr_ctrl_cb_t cb, void *ctx)
+{
+	struct rtlsdr_ctrl_req *q, *prev, *old = NULL, *old_prev = NULL;
+	rtlsdr_ctrl_cb_t old_cb = NULL;
+	void *old_ctx = NULL;
+	rtlsdr_ctrl_stats_t *st;
+	uint64_t now, old_queued = 0;
+	uint32_t key;
+	int c, family;
+
+	if (!dev || (unsigned)op >= RTLSDR_OP_NUM)
+		return -1;
+	c = ctrl_ops[op].cls;
+	family = ctrl_ops[op].family;
+	key = ctrl_key(op, param);
+	now = _rtlsdr_monotonic_ns();
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	if (dev->ctrl_exit) {
+		pthread_mutex_unlock(&dev->ctrl_lock);
+		return -1;
+	}
+	if (!dev->ctrl_running) {
+		if (pthread_create(&dev->ctrl_thread, NULL, rtlsdr_ctrl_worker, dev)) {
+			pthread_mutex_unlock(&dev->ctrl_lock);
+			return -1;
+		}
+		dev->ctrl_running = 1;
+	}
+
+	/* the latest pending request of the family, if it sets the same */
+	if (family != CTRL_FAMILY_NONE) {
+		for (prev = NULL, q = dev->ctrl_head[c]; q; prev = q, q = q->next) {
+			if (ctrl_ops[q->op].family != family)
+				continue;
+			old = q;
+			old_prev = prev;
+		}
+		if (old && ctrl_key(old->op, old->param) != key)
+			old = NULL;
+	}
+
+	st = &dev->ctrl_stats[c];
+	if (old) {
+		/* unlinked and queued again at the tail, with the new arguments */
+		if (old_prev)
+			old_prev->next = old->next;
+		else
+			dev->ctrl_head[c] = old->next;
+		if (dev->ctrl_tail[c] == old)
+			dev->ctrl_tail[c] = old_prev;
+		st->superseded++;
+		q = old;
+		old_cb = q->cb;
+		old_ctx = q->ctx;
+		old_queued = q->queued;
+	} else {
+		q = dev->ctrl_free;
+		if (!q) {
+			pthread_mutex_unlock(&dev->ctrl_lock);
+			return -1;
+		}
+		dev->ctrl_free = q->next;
+		st->pending++;
+	}
+
+	q->op = op;
+	q->param = param;
+	q->buf = buf;
+	q->buf_len = buf_len;
+	q->cb = cb;
+	q->ctx = ctx;
+	q->queued = now;
+	q->next = NULL;
+	if (dev->ctrl_tail[c])
+		dev->ctrl_tail[c]->next = q;
+	else
+		dev->ctrl_head[c] = q;
+	dev->ctrl_tail[c] = q;
+	pthread_cond_signal(&dev->ctrl_cond);
+	pthread_mutex_unlock(&dev->ctrl_lock);
+
+	if (old_cb)
+		old_cb(RTLSDR_CTRL_SUPERSEDED, (uint32_t)((now - old_queued) / 1000), old_ctx);
+	return 0;
+}
+
+struct ctrl_call {
+	rtlsdr_dev_t *dev;
+	int done;
+	int result;
+};
+
+static void ctrl_call_done(int result, uint32_t latency_us, void *ctx)
+{
+	struct ctrl_call *call = (struct ctrl_call *)ctx;
+
+	(void)latency_us;
+	pthread_mutex_lock(&call->dev->ctrl_lock);
+	call->result = result;
+	call->done = 1;
+	pthread_cond_broadcast(&call->dev->ctrl_done);
+	pthread_mutex_unlock(&call->dev->ctrl_lock);
+}
+
+int rtlsdr_ctrl_call(rtlsdr_dev_t *dev, enum rtlsdr_ctrl_op op,
+		     uint32_t param, uint8_t *buf, size_t buf_len)
+{
+	struct rtlsdr_ctrl_req req;
+	struct ctrl_call call;
+	int r;
+
+	if (!dev || (unsigned)op >= RTLSDR_OP_NUM)
+		return -1;
+
+	/* from a completion callback: the control thread can't wait for itself */
+	if (dev->ctrl_running && pthread_equal(dev->ctrl_thread, pthread_self())) {
+		req.op = op;
+		req.param = param;
+		req.buf = buf;
+		req.buf_len = buf_len;
+		return rtlsdr_ctrl_exec(dev, &req);
+	}
+
+	call.dev = dev;
+	call.done = 0;
+	call.result = -1;
+	r = rtlsdr_ctrl_submit(dev, op, param, buf, buf_len, ctrl_call_done, &call);
+	if (r < 0)
+		return r;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	while (!call.done)
+		pthread_cond_wait(&dev->ctrl_done, &dev->ctrl_lock);
+	pthread_mutex_unlock(&dev->ctrl_lock);
+	return call.result;
+}
+
+void rtlsdr_ctrl_flush(rtlsdr_dev_t *dev)
+{
+	int c;
+
+	if (!dev || (dev->ctrl_running && pthread_equal(dev->ctrl_thread, pthread_self())))
+		return;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	while (dev->ctrl_running && !dev->ctrl_exit) {
+		for (c = 0; c < RTLSDR_CTRL_CLASSES; c++)
+			if (dev->ctrl_head[c])
+				break;
+		if (c == RTLSDR_CTRL_CLASSES && !dev->ctrl_busy)
+			break;
+		pthread_cond_wait(&dev->ctrl_done, &dev->ctrl_lock);
+	}
+	pthread_mutex_unlock(&dev->ctrl_lock);
+}
+
+int rtlsdr_get_ctrl_stats(rtlsdr_dev_t *dev, int cls, rtlsdr_ctrl_stats_t *stats)
+{
+	if (!dev || cls < 0 || cls >= RTLSDR_CTRL_CLASSES)
+		return -1;
+
+	pthread_mutex_lock(&dev->ctrl_lock);
+	*stats = dev->ctrl_stats[cls];
+	pthread_mutex_unlock(&dev->ctrl_lock);
+	return 0;
+}
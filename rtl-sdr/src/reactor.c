@@ -0,0 +1,442 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+/* the default of 64 sockets is too small for MAX_CLIENTS */
+#define FD_SETSIZE 256
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#ifdef __linux__
+#define REACTOR_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#endif
+
+#include "reactor.h"
+
+#define MAX_EVENTS	64
+
+enum entry_state
+{
+	ENTRY_FREE = 0,
+	ENTRY_USED,
+	ENTRY_DEAD	/* deleted, reusable after the current dispatch */
+};
+
+struct reactor_entry
+{
+	reactor_fd_t fd;
+	int events;
+	enum entry_state state;
+	reactor_cb_t cb;
+	void *ctx;
+};
+
+struct reactor
+{
+	int max_fds;
+	struct reactor_entry *entries;
+#ifdef REACTOR_EPOLL
+	int epfd;
+	int wakefd;
+#else
+	reactor_fd_t wake_rx;
+	reactor_fd_t wake_tx;
+#endif
+};
+
+int reactor_set_nonblocking(reactor_fd_t fd)
+{
+#ifdef _WIN32
+	u_long blockmode = 1;
+
+	return ioctlsocket(fd, FIONBIO, &blockmode) ? -1 : 0;
+#else
+	int r = fcntl(fd, F_GETFL, 0);
+
+	if (r < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, r | O_NONBLOCK) < 0 ? -1 : 0;
+#endif
+}
+
+int reactor_sendv(reactor_fd_t fd, reactor_iov_t *iov, int cnt)
+{
+#ifdef _WIN32
+	DWORD sent = 0;
+
+	if (WSASend(fd, iov, cnt, &sent, 0, NULL, NULL))
+		return -1;
+	return (int)sent;
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+#ifdef MSG_NOSIGNAL
+	return (int)sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+	return (int)sendmsg(fd, &msg, 0);
+#endif
+#endif
+}
+
+int reactor_io_status(void)
+{
+#ifdef _WIN32
+	int err = WSAGetLastError();
+
+	if (err == WSAEWOULDBLOCK)
+		return REACTOR_IO_AGAIN;
+	if (err == WSAEINTR)
+		return REACTOR_IO_RETRY;
+#else
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return REACTOR_IO_AGAIN;
+	if (errno == EINTR)
+		return REACTOR_IO_RETRY;
+#endif
+	return REACTOR_IO_ERROR;
+}
+
+#ifdef _WIN32
+/* there are no pipes for select() on Windows, use a connected loopback UDP pair */
+static int wake_pair(reactor_fd_t *rx, reactor_fd_t *tx)
+{
+	struct sockaddr_in addr;
+	int len = sizeof(addr);
+
+	*rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	*tx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (*rx == INVALID_SOCKET || *tx == INVALID_SOCKET)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (bind(*rx, (struct sockaddr *)&addr, sizeof(addr)) ||
+			getsockname(*rx, (struct sockaddr *)&addr, &len) ||
+			connect(*tx, (struct sockaddr *)&addr, sizeof(addr)))
+		return -1;
+
+	reactor_set_nonblocking(*rx);
+	reactor_set_nonblocking(*tx);
+	return 0;
+}
+#endif
+
+reactor_t *reactor_create(int max_fds)
+{
+	reactor_t *reactor = calloc(1, sizeof(reactor_t));
+#if !defined(REACTOR_EPOLL) && !defined(_WIN32)
+	int fds[2];
+#endif
+#ifdef REACTOR_EPOLL
+	struct epoll_event ev;
+#endif
+
+	if (!reactor)
+		return NULL;
+
+	reactor->max_fds = max_fds;
+	reactor->entries = calloc(max_fds, sizeof(struct reactor_entry));
+	if (!reactor->entries) {
+		free(reactor);
+		return NULL;
+	}
+
+#ifdef REACTOR_EPOLL
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+	if (reactor->epfd < 0 || reactor->wakefd < 0 ||
+			epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev)) {
+		reactor_destroy(reactor);
+		return NULL;
+	}
+#elif defined(_WIN32)
+	if (wake_pair(&reactor->wake_rx, &reactor->wake_tx)) {
+		reactor_destroy(reactor);
+		return NULL;
+	}
+#else
+	if (pipe(fds)) {
+		free(reactor->entries);
+		free(reactor);
+		return NULL;
+	}
+	reactor->wake_rx = fds[0];
+	reactor->wake_tx = fds[1];
+	reactor_set_nonblocking(reactor->wake_rx);
+	reactor_set_nonblocking(reactor->wake_tx);
+#endif
+
+	return reactor;
+}
+
+void reactor_destroy(reactor_t *reactor)
+{
+	if (!reactor)
+		return;
+
+#ifdef REACTOR_EPOLL
+	if (reactor->wakefd >= 0)
+		close(reactor->wakefd);
+	if (reactor->epfd >= 0)
+		close(reactor->epfd);
+#elif defined(_WIN32)
+	if (reactor->wake_rx != INVALID_SOCKET)
+		closesocket(reactor->wake_rx);
+	if (reactor->wake_tx != INVALID_SOCKET)
+		closesocket(reactor->wake_tx);
+#else
+	close(reactor->wake_rx);
+	close(reactor->wake_tx);
+#endif
+	free(reactor->entries);
+	free(reactor);
+}
+
+static struct reactor_entry *find_entry(reactor_t *reactor, reactor_fd_t fd)
+{
+	int i;
+
+	for (i = 0; i < reactor->max_fds; i++)
+		if (reactor->entries[i].state == ENTRY_USED && reactor->entries[i].fd == fd)
+			return &reactor->entries[i];
+	return NULL;
+}
+
+int reactor_add(reactor_t *reactor, reactor_fd_t fd, int events, reactor_cb_t cb, void *ctx)
+{
+	struct reactor_entry *e = NULL;
+	int i;
+#ifdef REACTOR_EPOLL
+	struct epoll_event ev;
+#endif
+
+	for (i = 0; i < reactor->max_fds; i++) {
+		if (reactor->entries[i].state == ENTRY_FREE) {
+			e = &reactor->entries[i];
+			break;
+		}
+	}
+	if (!e)
+		return -1;
+
+#ifdef REACTOR_EPOLL
+	/* registered once for everything, edge-triggered; the interest
+	 * mask is applied when dispatching, so changing it costs no syscall */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = e;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev))
+		return -1;
+#endif
+
+	e->fd = fd;
+	e->events = events;
+	e->cb = cb;
+	e->ctx = ctx;
+	e->state = ENTRY_USED;
+	return 0;
+}
+
+void reactor_set(reactor_t *reactor, reactor_fd_t fd, int events)
+{
+	struct reactor_entry *e = find_entry(reactor, fd);
+
+	if (e)
+		e->events = events;
+}
+
+void reactor_del(reactor_t *reactor, reactor_fd_t fd)
+{
+	struct reactor_entry *e = find_entry(reactor, fd);
+
+	if (!e)
+		return;
+#ifdef REACTOR_EPOLL
+	epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	e->state = ENTRY_DEAD;
+}
+
+void reactor_wakeup(reactor_t *reactor)
+{
+#ifdef REACTOR_EPOLL
+	uint64_t one = 1;
+
+	if (write(reactor->wakefd, &one, sizeof(one)) < 0)
+		return;	/* counter saturated, a wakeup is pending anyway */
+#elif defined(_WIN32)
+	send(reactor->wake_tx, "w", 1, 0);
+#else
+	if (write(reactor->wake_tx, "w", 1) < 0)
+		return;	/* pipe full, a wakeup is pending anyway */
+#endif
+}
+
+static void drain_wakeup(reactor_t *reactor)
+{
+#ifdef REACTOR_EPOLL
+	uint64_t cnt;
+
+	while (read(reactor->wakefd, &cnt, sizeof(cnt)) > 0)
+		;
+#elif defined(_WIN32)
+	char buf[16];
+
+	while (recv(reactor->wake_rx, buf, sizeof(buf), 0) > 0)
+		;
+#else
+	char buf[16];
+
+	while (read(reactor->wake_rx, buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+static void release_dead(reactor_t *reactor)
+{
+	int i;
+
+	for (i = 0; i < reactor->max_fds; i++)
+		if (reactor->entries[i].state == ENTRY_DEAD)
+			reactor->entries[i].state = ENTRY_FREE;
+}
+
+#ifdef REACTOR_EPOLL
+
+int reactor_poll(reactor_t *reactor, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct reactor_entry *e;
+	int i, n, ev, dispatched = 0;
+
+	n = epoll_wait(reactor->epfd, events, MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		e = (struct reactor_entry *)events[i].data.ptr;
+		if (!e) {
+			drain_wakeup(reactor);
+			continue;
+		}
+		if (e->state != ENTRY_USED)
+			continue;
+
+		ev = 0;
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+			ev |= REACTOR_READ;
+		if (events[i].events & EPOLLOUT)
+			ev |= REACTOR_WRITE;
+		ev &= e->events;
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+			ev |= REACTOR_ERROR;
+		if (ev) {
+			e->cb(reactor, ev, e->ctx);
+			dispatched++;
+		}
+	}
+
+	release_dead(reactor);
+	return dispatched;
+}
+
+#else
+
+int reactor_poll(reactor_t *reactor, int timeout_ms)
+{
+	struct timeval tv, *ptv = NULL;
+	fd_set readfds, writefds, exceptfds;
+	reactor_fd_t maxfd = reactor->wake_rx;
+	struct reactor_entry *e;
+	int i, n, ev, dispatched = 0;
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&exceptfds);
+	FD_SET(reactor->wake_rx, &readfds);
+
+	for (i = 0; i < reactor->max_fds; i++) {
+		e = &reactor->entries[i];
+		if (e->state != ENTRY_USED)
+			continue;
+		if (e->events & REACTOR_READ)
+			FD_SET(e->fd, &readfds);
+		if (e->events & REACTOR_WRITE)
+			FD_SET(e->fd, &writefds);
+		FD_SET(e->fd, &exceptfds);
+		if (e->fd > maxfd)
+			maxfd = e->fd;
+	}
+
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		ptv = &tv;
+	}
+
+	n = select((int)maxfd + 1, &readfds, &writefds, &exceptfds, ptv);
+	if (n < 0)
+		return (reactor_io_status() == REACTOR_IO_RETRY) ? 0 : -1;
+
+	if (FD_ISSET(reactor->wake_rx, &readfds))
+		drain_wakeup(reactor);
+
+	for (i = 0; i < reactor->max_fds; i++) {
+		e = &reactor->entries[i];
+		if (e->state != ENTRY_USED)
+			continue;
+
+		ev = 0;
+		if (FD_ISSET(e->fd, &readfds))
+			ev |= REACTOR_READ;
+		if (FD_ISSET(e->fd, &writefds))
+			ev |= REACTOR_WRITE;
+		ev &= e->events;
+		if (FD_ISSET(e->fd, &exceptfds))
+			ev |= REACTOR_ERROR;
+		if (ev) {
+			e->cb(reactor, ev, e->ctx);
+			dispatched++;
+		}
+	}
+
+	release_dead(reactor);
+	return dispatched;
+}
+
+#endif
@@ -1338,10 +1338,28 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 	safe_cond_signal(&d->ready, &d->ready_m);
 }
 
+/* the conversion runs here, apart from the event thread resubmitting transfers */
 static void *dongle_thread_fn(void *arg)
 {
 	struct dongle_state *s = arg;
-	rtlsdr_read_async(s->dev, rtlsdr_callback, s, 0, s->buf_len);
+	rtlsdr_stream_buf_t sb;
+	int r;
+
+	r = rtlsdr_stream_start(s->dev, 0, s->buf_len, 0);
+	if (r < 0) {
+		fprintf(stderr, "Failed to start streaming: %d\n", r);
+		return 0;
+	}
+	while ((r = rtlsdr_stream_get(s->dev, &sb, 100)) >= 0) {
+		if (r)
+			continue;
+		rtlsdr_callback(sb.buf, sb.len, s);
+		rtlsdr_release_buf(sb.hbuf);
+	}
+	if (rtlsdr_stream_overruns(s->dev))
+		fprintf(stderr, "%u buffers dropped, demodulation too slow\n",
+			rtlsdr_stream_overruns(s->dev));
+	rtlsdr_stream_stop(s->dev);
 	return 0;
 }
 
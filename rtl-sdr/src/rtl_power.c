@@ -72,7 +72,7 @@
 
 #define DEFAULT_BUF_LENGTH		(1 * 16384)
 #define AUTO_GAIN				-100
-#define BUFFER_DUMP				(1<<12)
+#define BUFFER_DUMP				(1<<16)
 
 #define MAXIMUM_RATE			2800000
 #define MINIMUM_RATE			1000000
@@ -536,12 +536,18 @@ void frequency_range(char *arg, double crop)
 void retune(rtlsdr_dev_t *d, int freq)
 {
 	uint8_t dump[BUFFER_DUMP];
-	int n_read;
+	int n_read, len;
 	rtlsdr_set_center_freq(d, (uint32_t)freq);
-	/* wait for settling and flush buffer */
-	usleep(5000);
-	rtlsdr_read_sync(d, &dump, BUFFER_DUMP, &n_read);
-	if (n_read != BUFFER_DUMP) {
+	/* flush the samples from before the retune, drop those until settled */
+	rtlsdr_reset_buffer(d);
+	len = (int)((uint64_t)rtlsdr_get_hop_settle(d) * rtlsdr_get_sample_rate(d) / 1000000) * 2;
+	len = (len + 511) & ~511;
+	if (len > BUFFER_DUMP) {
+		len = BUFFER_DUMP;}
+	if (!len) {
+		return;}
+	rtlsdr_read_sync(d, &dump, len, &n_read);
+	if (n_read != len) {
 		fprintf(stderr, "Error: bad retune.\n");}
 }
 
@@ -970,6 +976,11 @@ int main(int argc, char **argv)
 
 	/* actually do stuff */
 	rtlsdr_set_sample_rate(dev, (uint32_t)tunes[0].rate);
+	/* measure the settling of this tuner, it decides the discard of retune() */
+	r = rtlsdr_calibrate_hop_settle(dev);
+	if (r > 0) {
+		fprintf(stderr, "Tuner settles in %d us.\n", r);}
+	rtlsdr_reset_buffer(dev);
 	sine_table(tunes[0].bin_e);
 	next_tick = time(NULL) + interval;
 	if (exit_time) {
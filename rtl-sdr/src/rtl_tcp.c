@@ -18,7 +18,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-//#define TIME_MEAS
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -63,6 +62,13 @@ void formattedTimeOutput(char* s, const double tim);
 
 #include "rtl-sdr.h"
 #include "rtl_tcp.h"
+#include "sampleRing.h"
+#include "reactor.h"
+#include "ddc.h"
+#include "sampleFormat.h"
+#include "serverStats.h"
+#include "iqReplay.h"
+#include "rtlsdr_atomic.h"
 #include "convenience/convenience.h"
 
 #ifdef _WIN32
@@ -75,359 +81,2049 @@ typedef int socklen_t;
 #define SOCKADDR struct sockaddr
 #define SOCKET int
 #define SOCKET_ERROR -1
+#define INVALID_SOCKET -1
+#endif
+
+#ifndef SHUT_WR
+#define SHUT_WR SD_SEND
 #endif
 
 #include "controlThread.h"
 
-static ctrl_thread_data_t ctrldata;
+static ctrl_thread_data_t ctrldata;
+
+#define MAX_CLIENTS	32
+/* idle time after which an arbitrated control floor is released */
+#define CTRL_HOLD_MS	2000
+
+typedef enum
+{
+	CTRL_PRIMARY = 0,	/* oldest client controls, the others observe */
+	CTRL_SHARED,		/* every client controls, last command wins */
+	CTRL_ARBITRATE,		/* first commanding client holds control until idle */
+	CTRL_OBSERVE		/* all clients are read-only */
+}
+ctrl_policy_t;
+
+static const char *ctrl_policy_names[] = { "primary", "shared", "arbitrate", "observe" };
+
+/* no samples for this long while streaming: the dongle is gone */
+#define STALL_TIMEOUT_MS	1000
+/* delay between accepting a response client and the first report */
+#define RESP_DELAY_MS	5000
+/* commands waiting for command_worker */
+#define CMD_QUEUE_LEN	64
+/* most commands in a SET_BATCH */
+#define BATCH_MAX	8
+/* SET_BATCH acknowledgements in flight */
+#define ACK_QUEUE_LEN	16
+/* maximum number of ring buffers gathered into one send */
+#define SEND_BATCH	16
+/* time for a new client to choose its format before streaming starts */
+#define FORMAT_HOLD_MS	250
+/* converted buffers kept for clients lagging behind, per format */
+#define CONV_CACHE_IDLE	(4 * SEND_BATCH)
+/* interval of the -v transmit statistics */
+#define STATS_INTERVAL_MS	5000
+/* response port buffer, large enough for the Prometheus text */
+#define RESP_BUF_LEN	8192
+/* a HTTP client gets this long to close the connection after the answer */
+#define HTTP_CLOSE_MS	2000
+
+#ifdef _WIN32
+#define __attribute__(x)
+#pragma pack(push, 1)
+#endif
+struct command{
+	unsigned char cmd;
+	unsigned int param;
+}__attribute__((packed));
+#ifdef _WIN32
+#pragma pack(pop)
+#endif
+
+/* a queued command, a SET_BATCH with the commands belonging to it */
+struct queued_command {
+	struct command cmd;
+	struct command batch[BATCH_MAX];
+	int batch_len;
+};
+
+/*
+ * All sockets are served by the reactor in the main thread. Samples go
+ * out of the ring through a partial-write state machine per client,
+ * received commands are queued for command_worker.
+ */
+typedef struct
+{
+	SOCKET sock;
+	int id;
+	sample_ring_reader_t *reader;
+	uint32_t offset;	/* bytes of the first claimed buffer sent already */
+	int blocked;		/* waiting for the socket to become writable */
+	int hold;		/* RTL1: streaming held back until the first command,
+				 * FORMAT_HOLD_MS at most */
+	struct timeval connected;
+	int sndbuf;		/* socket send buffer size, limits a batch */
+	int format;		/* wire format, see SET_SAMPLE_FORMAT */
+	ddc_t *ddc;		/* server side downconversion, see SET_DDC */
+	int32_t ddc_offset;
+	/* settings waiting for a buffer boundary of the outgoing stream */
+	int reconfig;
+	int new_format;
+	uint32_t ddc_param;
+	unsigned char *out;	/* downconverted samples being sent */
+	uint32_t out_len;
+	sample_conv_t *conv[SEND_BATCH];	/* converted buffers being sent */
+	uint32_t num_conv;
+	int framed;		/* see SET_FRAMING */
+	int new_framed;
+	rtl_tcp_frame_t hdr[SEND_BATCH];	/* headers of the buffers being sent */
+	uint64_t capture[SEND_BATCH];	/* capture times of conv, or of out */
+	uint32_t num_hdr;
+	uint32_t last_dropped;	/* reader drops already flagged */
+	unsigned char cmd[sizeof(struct command)];
+	int cmd_len;
+	struct queued_command batch;	/* SET_BATCH being received */
+	int batch_left;		/* commands still belonging to it */
+	uint32_t ignored;	/* commands refused by the control policy */
+	uint64_t tx_bytes;
+	uint32_t tx_calls;	/* send syscalls */
+	uint64_t stat_bytes;	/* tx_bytes at stat_time */
+	uint32_t stat_calls;	/* tx_calls at stat_time */
+	struct timeval stat_time;
+	sample_ring_reader_stats_t last_stats;
+}
+client_t;
+
+typedef struct
+{
+	SOCKET sock;
+	unsigned char buf[RESP_BUF_LEN];
+	int len;
+	int offset;
+	uint32_t frame_seq;	/* report frame in buf */
+	struct timeval start;	/* no reports before this time */
+	unsigned char in[sizeof(struct command)];	/* partial request */
+	int in_len;
+	int stats_ms;		/* REPORT_STATS period, 0 once, -1 off */
+	struct timeval stats_time;	/* next REPORT_STATS frame */
+	int http;		/* 1: GET received, 2: answer queued, 3: sent, waiting
+				 * for the client to close until start */
+	char *text;		/* HTTP answer being sent in place of buf */
+	uint32_t ack_seq;	/* next SET_BATCH acknowledgement to send */
+}
+resp_client_t;
+
+static reactor_t *reactor = NULL;
+
+static client_t *clients[MAX_CLIENTS];
+static int num_clients = 0;
+static int max_clients = 1;
+static int next_client_id = 1;
+
+static resp_client_t *resp_clients[MAX_CLIENTS];
+/* the control thread samples the tuner registers only while this is set */
+static volatile int num_resp_clients = 0;
+
+/* latest register report of the control thread */
+static pthread_mutex_t resp_lock;
+static unsigned char resp_frame[TX_BUF_LEN];
+static int resp_frame_len = 0;
+static uint32_t resp_frame_seq = 0;
+
+static ctrl_policy_t ctrl_policy = CTRL_PRIMARY;
+static int ctrl_owner = 0;	/* client id holding the floor, CTRL_ARBITRATE */
+static struct timeval ctrl_time;
+
+static pthread_t command_thread;
+static pthread_mutex_t cmd_lock;
+static pthread_cond_t cmd_cond;
+static struct queued_command cmd_queue[CMD_QUEUE_LEN];
+static int cmd_head = 0, cmd_tail = 0;
+
+/*
+ * SET_BATCH acknowledgements, queued by the control thread once the
+ * settings are applied, resolved to a position in the stream by the usb
+ * thread and sent to every response client by the reactor. ack_lock keeps
+ * the control thread from reusing a slot the reactor is copying; the usb
+ * thread only fills in the slots no client reads yet and takes no lock.
+ */
+typedef struct
+{
+	uint32_t tag;
+	int32_t result;
+	uint64_t effect_ns;	/* the tuner has settled, capture clock */
+	uint32_t seq;		/* transfer the settings took effect in */
+	uint32_t offset;	/* samples into it */
+	uint32_t freq;
+	int32_t gain;
+}
+batch_ack_t;
+
+static batch_ack_t batch_acks[ACK_QUEUE_LEN];
+static volatile uint32_t acks_queued = 0;
+static volatile uint32_t acks_resolved = 0;
+static pthread_mutex_t ack_lock;
+
+static pthread_t usb_thread;
+static int usb_running = 0;
+/* the usb thread returned, e.g. the dongle is gone */
+static volatile int usb_ended = 0;
+/* -R: recordings stand in for the dongle, which is a virtual device then */
+static iq_replay_t *replay = NULL;
+static volatile int replay_running = 0;
+/* when the producer last pushed a buffer, the ring head then */
+static struct timeval last_progress;
+static uint32_t progress_head;
+
+static pthread_cond_t exit_cond;
+static pthread_mutex_t exit_cond_lock;
+
+typedef struct { /* structure size must be multiple of 2 bytes */
+	char magic[4];
+	uint32_t tuner_type;
+	uint32_t tuner_gain_count;
+} dongle_info_t;
+
+static rtlsdr_dev_t *dev = NULL;
+
+static int verbosity = 0;
+
+static sample_ring_t *ring = NULL;
+/* current sample rate of the dongle, input rate of the downconverters */
+static volatile uint32_t dongle_rate;
+/* buffers converted for the clients not using CU8, shared between them */
+static sample_conv_cache_t *conv_caches[SAMPLE_FORMAT_NUM];
+/* -H: announce the extensions by "RTL1" instead of "RTL0" */
+static int header_version = 0;
+static int llbuf_num = 500;
+/* queue the USB buffers themselves instead of copying them into the ring */
+static int zero_copy = 0;
+/* -K: keep streaming without clients, the ring holding the pre-roll */
+static int persistent = 0;
+static uint32_t preroll_ms = 0;
+/* drops of finished streaming runs and of closed clients, for the metrics */
+static uint64_t ring_dropped_done = 0;
+static uint64_t client_dropped_done = 0;
+/* completion of the previous USB transfer, for the interval histogram */
+static uint64_t usb_last_time;
+
+static uint32_t buf_num = 0;
+/* buf_len:
+ * must be multiple of 512 - else it will be overwritten
+ * in rtlsdr_read_async() in librtlsdr.c with DEFAULT_BUF_LENGTH (= 16*32 *512 = 512 *512)
+ *
+ * -> 512*512 -> 1048 ms @ 250 kS  or  81.92 ms @ 3.2 MS (internal default)
+ * ->  32*512 ->   65 ms @ 250 kS  or   5.12 ms @ 3.2 MS (new default)
+ *
+ */
+static uint32_t buf_len = 64 * 512;
+
+static volatile int do_exit = 0;
+
+void usage(void)
+{
+	printf("\n"
+		"Usage:\t[-a listen address]\n"
+		"\t[-b number of buffers (default: 15, set by library)]\n"
+		"\t[-d device index or serial (default: 0)]\n"
+		"\t[-f frequency to tune to [Hz]]\n"
+		"\t[-g gain in dB (default: 0 for auto)]\n"
+		"\t[-l length of single buffer in units of 512 samples (default: 64)]\n"
+		"\t[-m maximum number of concurrent clients (default: 1, max: %d)]\n"
+		"\t[-n number of buffers in the sample ring, rounded up to a power of 2 (default: 500)]\n"
+		"\t[-p listen port (default: 1234)]\n"
+		"\t[-r response port (default: listen port + 1)]\n"
+		"\t[-i tuner register sampling interval in ms (default: 500, 0 = off)]\n"
+		"\t[-s samplerate in Hz (default: 2048000 Hz)]\n"
+		"\t[-u upper sideband for R820T/R828D (default: lower sideband)]\n"
+		"\t[-v increase verbosity (default: 0)]\n"
+		"\t[-w rtlsdr tuner bandwidth [Hz]]\n"
+		"\t[-D direct_sampling_mode (default: 0, 1 = I, 2 = Q, 3 = I below threshold, 4 = Q below threshold)]\n"
+		"\t[-D direct_sampling_threshold_frequency (default: 0 use tuner specific frequency threshold for 3 and 4)]\n"
+		"\t[-P ppm_error (default: 0)]\n"
+		"\t[-C control policy with several clients (default: primary)]\n"
+		"\t[   primary: the oldest client controls, the others are read-only]\n"
+		"\t[   shared: every client controls, the last command wins]\n"
+		"\t[   arbitrate: a commanding client holds control until idle for %d ms]\n"
+		"\t[   observe: all clients are read-only]\n"
+		"\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3 dongles)]\n"
+		"\t[-Z send straight from the USB buffers, -n of them are held (default: off)]\n"
+		"\t[-R replay a CU8 or WAV recording instead of a dongle, file[@frequency[:samplerate]],\n"
+		"\t[   repeat for several frequencies or sample rates (default: WAV header, -f, -s)]\n"
+		"\t[-X replay speed relative to the recorded samplerate (default: 1, 0 = unthrottled)]\n"
+		"\t[-K keep streaming between clients, holding up to the given ms of pre-roll\n"
+		"\t[   which clients request with SET_PREROLL (default: off)]\n"
+		"\t[-H announce the extensions by the RTL1 header, the first samples wait\n"
+		"\t[   up to %d ms for the client's first command (default: RTL0)]\n",
+		MAX_CLIENTS, CTRL_HOLD_MS, FORMAT_HOLD_MS);
+	exit(1);
+}
+
+#ifdef _WIN32
+
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, exiting!\n");
+		do_exit = 1;
+		rtlsdr_cancel_async(dev);
+		if (reactor)
+			reactor_wakeup(reactor);
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	fprintf(stderr, "Signal caught, exiting!\n");
+	rtlsdr_cancel_async(dev);
+	do_exit = 1;
+	if (reactor)
+		reactor_wakeup(reactor);
+}
+#endif
+
+/*
+ * Called by the producer with the capture details of the buffer it is about
+ * to push: pin the acknowledgements which took effect by its end to it.
+ */
+static void batch_ack_resolve(const sample_ring_meta_t *meta, uint32_t len)
+{
+	uint32_t n = rtlsdr_atomic_load(&acks_resolved);
+	batch_ack_t *ack;
+	uint64_t start;
+	uint32_t seq;
+
+	if (n == rtlsdr_atomic_load(&acks_queued))
+		return;
+
+	/* the buffer ends at time_ns */
+	start = dongle_rate ? (uint64_t)len / 2 * 1000000000 / dongle_rate : 0;
+	start = meta->time_ns > start ? meta->time_ns - start : 0;
+	/* the producer thread: no ring lock */
+	seq = sample_ring_head(ring);
+	for (; n != rtlsdr_atomic_load(&acks_queued); n++) {
+		ack = &batch_acks[n % ACK_QUEUE_LEN];
+		if (ack->effect_ns > meta->time_ns)
+			break;
+		ack->seq = seq;
+		ack->offset = 0;
+		if (ack->effect_ns > start)
+			ack->offset = (uint32_t)((ack->effect_ns - start) * dongle_rate / 1000000000);
+		ack->freq = meta->freq;
+		ack->gain = meta->gain;
+		rtlsdr_atomic_store(&acks_resolved, n + 1);
+	}
+	reactor_wakeup(reactor);
+}
+
+static void capture_meta(sample_ring_meta_t *meta, uint64_t time_ns, uint32_t len)
+{
+	meta->time_ns = time_ns;
+	meta->freq = rtlsdr_get_center_freq(dev);
+	meta->gain = rtlsdr_get_tuner_gain(dev);
+	meta->flags = 0;
+
+	stats_add(STATS_USB_TRANSFERS, 1);
+	stats_add(STATS_USB_BYTES, len);
+	if (usb_last_time && meta->time_ns > usb_last_time)
+		stats_observe(STATS_HIST_USB_INTERVAL, (meta->time_ns - usb_last_time) / 1000);
+	usb_last_time = meta->time_ns;
+	batch_ack_resolve(meta, len);
+}
+
+static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	sample_ring_meta_t meta;
+
+	/* runs on the libusb event thread: no locks, no allocations */
+	if(!do_exit) {
+		capture_meta(&meta, rtlsdr_get_buffer_time(dev), len);
+		sample_ring_push(ring, buf, len, &meta);
+	}
+}
+
+/* -Z: the ring keeps the transfer buffer until all clients have sent it */
+static void rtlsdr_held_callback(rtlsdr_held_buf_t *hbuf, unsigned char *buf,
+				 uint32_t len, void *ctx)
+{
+	sample_ring_meta_t meta;
+
+	if(!do_exit) {
+		capture_meta(&meta, rtlsdr_get_buffer_time(dev), len);
+		sample_ring_push_ref(ring, buf, len, hbuf, &meta);
+	} else {
+		rtlsdr_release_buf(hbuf);
+	}
+}
+
+static void ring_release(void *handle, void *ctx)
+{
+	rtlsdr_release_buf((rtlsdr_held_buf_t *)handle);
+}
+
+/* -R -Z: the ring points into the mapped recordings, which stay until exit */
+static void replay_release(void *handle, void *ctx)
+{
+}
+
+/* the usb thread playing the recordings in place of rtlsdr_read_async() */
+static void replay_stream(void)
+{
+	sample_ring_meta_t meta;
+	const unsigned char *buf;
+	uint32_t len;
+
+	while (replay_running && !do_exit) {
+		len = iq_replay_read(replay, buf_len, &buf);
+		capture_meta(&meta, iq_replay_pace(replay, len), len);
+		if (zero_copy)
+			sample_ring_push_ref(ring, (unsigned char *)buf, len, replay, &meta);
+		else
+			sample_ring_push(ring, buf, len, &meta);
+	}
+}
+
+static void replay_report(int seg, uint32_t freq, uint32_t rate)
+{
+	if (seg < 0)
+		printf("replay: no recording at %u Hz with %u S/s, sending silence\n", freq, rate);
+	else if (verbosity)
+		printf("replay: playing recording %d\n", seg);
+}
+
+/* called by the producer after sample_ring_arm() */
+static void ring_notify(void *ctx)
+{
+	reactor_wakeup((reactor_t *)ctx);
+}
+
+static int ms_since(struct timeval *then, struct timeval *now)
+{
+	return (int)((now->tv_sec - then->tv_sec) * 1000 +
+			(now->tv_usec - then->tv_usec) / 1000);
+}
+
+static void print_reader_stats(client_t *cl)
+{
+	sample_ring_reader_stats_t stats;
+	sample_ring_reader_stats_t *last = &cl->last_stats;
+
+	sample_ring_get_reader_stats(cl->reader, &stats);
+	if (stats.high_water > last->high_water)
+		printf("client %d: ring+, high-water mark now %u buffers\n",
+				cl->id, stats.high_water);
+	if (stats.dropped != last->dropped)
+		printf("client %d: ring overrun, %u buffers dropped\n",
+				cl->id, stats.dropped - last->dropped);
+	*last = stats;
+}
+
+extern void print_demod_register(rtlsdr_dev_t *dev, uint8_t page);
+
+/* completion of a queued control request, ctx the histogram */
+static void ctrl_latency(int result, uint32_t latency_us, void *ctx)
+{
+	if (result != RTLSDR_CTRL_SUPERSEDED && result != RTLSDR_CTRL_CANCELLED)
+		stats_observe((int)(intptr_t)ctx, latency_us);
+}
+
+/* queue a retune or gain command, superseding one not executed yet */
+static int ctrl_tune(rtlsdr_dev_t *_dev, enum rtlsdr_ctrl_op op, uint32_t param)
+{
+	return rtlsdr_ctrl_submit(_dev, op, param, NULL, 0, ctrl_latency,
+			(void *)(intptr_t)STATS_HIST_CTRL_TUNE);
+}
+
+static int gain_from_index(rtlsdr_dev_t *_dev, unsigned int index, int *gain)
+{
+	int res = -1;
+	int* gains;
+	int count = rtlsdr_get_tuner_gains(_dev, NULL);
+
+	if (count > 0 && (unsigned int)count > index) {
+		gains = malloc(sizeof(int) * count);
+		count = rtlsdr_get_tuner_gains(_dev, gains);
+
+		*gain = gains[index];
+		res = 0;
+		if (verbosity)
+			fprintf(stderr, "set tuner gain to %.1f dB\n", gains[index] / 10.0);
+
+		free(gains);
+	}
+
+	return res;
+}
+
+/* decide whether a command of this client is executed, see ctrl_policy_t */
+static int may_control(client_t *cl)
+{
+	struct timeval now;
+	int i, r = 1;
+
+	switch (ctrl_policy) {
+	case CTRL_PRIMARY:
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i] && clients[i]->id < cl->id)
+				r = 0;
+		break;
+	case CTRL_ARBITRATE:
+		gettimeofday(&now, NULL);
+		if (ctrl_owner && ctrl_owner != cl->id &&
+				ms_since(&ctrl_time, &now) < CTRL_HOLD_MS) {
+			r = 0;
+		} else {
+			if (ctrl_owner != cl->id)
+				printf("client %d takes control\n", cl->id);
+			ctrl_owner = cl->id;
+			ctrl_time = now;
+		}
+		break;
+	case CTRL_OBSERVE:
+		r = 0;
+		break;
+	default:
+		break;
+	}
+
+	return r;
+}
+
+/* order in which the settings of coalesced commands are applied */
+enum {
+	RANK_MODE,		/* modes the tuning depends on */
+	RANK_RATE,		/* sample rate and frequency correction */
+	RANK_TUNING,		/* see apply_tuning() */
+	RANK_OTHER,
+	RANK_NUM
+};
+
+static int command_rank(unsigned char cmd)
+{
+	switch (cmd) {
+	case SET_TEST_MODE:
+	case SET_DIRECT_SAMPLING:
+	case SET_OFFSET_TUNING:
+	case SET_RTL_CRYSTAL:
+	case SET_TUNER_CRYSTAL:
+	case SET_BIAS_TEE:
+	case SET_SIDEBAND:
+	case SET_DITHERING:
+		return RANK_MODE;
+	case SET_SAMPLE_RATE:
+	case SET_FREQUENCY_CORRECTION:
+		return RANK_RATE;
+	case SET_FREQUENCY:
+	case SET_GAIN_MODE:
+	case SET_GAIN:
+	case SET_TUNER_GAIN_BY_INDEX:
+	case SET_AGC_MODE:
+	case SET_TUNER_BANDWIDTH:
+		return RANK_TUNING;
+	default:
+		return RANK_OTHER;
+	}
+}
+
+/* the setting a command changes, -1 if every command counts */
+static int command_key(const struct command *cmd)
+{
+	switch (cmd->cmd) {
+	case SET_I2C_TUNER_REGISTER:
+	case CALIBRATE_IMR:
+		return -1;
+	case SET_TUNER_GAIN_BY_INDEX:
+		return SET_GAIN;
+	case SET_IF_STAGE:
+		/* one per stage */
+		return 0x100 + (ntohl(cmd->param) >> 16);
+	default:
+		return cmd->cmd;
+	}
+}
+
+/* add a command of RANK_TUNING to t */
+static void tuning_add(rtlsdr_tuning_t *t, const struct command *cmd)
+{
+	uint32_t param = ntohl(cmd->param);
+
+	switch (cmd->cmd) {
+	case SET_FREQUENCY://0x01
+		t->flags |= RTLSDR_TUNING_FREQ;
+		t->freq = param;
+		break;
+	case SET_GAIN_MODE://0x03
+		t->flags |= RTLSDR_TUNING_GAIN_MODE;
+		t->gain_mode = (int)param;
+		break;
+	case SET_GAIN://0x04
+		t->flags |= RTLSDR_TUNING_GAIN;
+		t->gain = (int)param;
+		break;
+	case SET_AGC_MODE://0x08
+		t->flags |= RTLSDR_TUNING_AGC_MODE;
+		t->agc_mode = (int)param;
+		break;
+	case SET_TUNER_GAIN_BY_INDEX://0x0d
+		if (!gain_from_index(dev, param, &t->gain))
+			t->flags |= RTLSDR_TUNING_GAIN;
+		break;
+	case SET_TUNER_BANDWIDTH://0x40
+		t->flags |= RTLSDR_TUNING_BANDWIDTH;
+		t->bandwidth = param;
+		break;
+	default:
+		break;
+	}
+}
+
+/* the settings handed to the control thread, freed by tuning_done() */
+struct tuning_req {
+	rtlsdr_tuning_t tuning;
+	int batch;		/* acknowledge a SET_BATCH */
+	uint32_t tag;
+};
+
+/* queue the acknowledgement of a SET_BATCH, see batch_ack_resolve() */
+static void batch_ack_queue(uint32_t tag, int result)
+{
+	uint32_t n = rtlsdr_atomic_load(&acks_queued);
+	batch_ack_t *ack;
+
+	if (n - rtlsdr_atomic_load(&acks_resolved) >= ACK_QUEUE_LEN) {
+		printf("batch %u: acknowledgement queue full, dropped\n", tag);
+		stats_add(STATS_ACKS_LOST, 1);
+		return;
+	}
+	pthread_mutex_lock(&ack_lock);
+	ack = &batch_acks[n % ACK_QUEUE_LEN];
+	ack->tag = tag;
+	ack->result = result;
+	ack->effect_ns = stats_time_ns() + (uint64_t)rtlsdr_get_hop_settle(dev) * 1000;
+	rtlsdr_atomic_store(&acks_queued, n + 1);
+	pthread_mutex_unlock(&ack_lock);
+}
+
+/* completion of RTLSDR_OP_TUNING, on the control thread */
+static void tuning_done(int result, uint32_t latency_us, void *ctx)
+{
+	struct tuning_req *req = (struct tuning_req *)ctx;
+
+	ctrl_latency(result, latency_us, (void *)(intptr_t)STATS_HIST_CTRL_TUNE);
+	if (req->batch && result != RTLSDR_CTRL_CANCELLED)
+		batch_ack_queue(req->tag, result);
+	free(req);
+}
+
+/*
+ * A single setting goes through its own control operation, which a later
+ * one supersedes while it waits. Several settings, and a batch, are applied
+ * together by RTLSDR_OP_TUNING in one I2C repeater session, the frequency
+ * programmed once with the new bandwidth.
+ */
+static void apply_tuning(const rtlsdr_tuning_t *t, int batch, uint32_t tag)
+{
+	struct tuning_req *req;
+
+	if (t->flags & RTLSDR_TUNING_BANDWIDTH)
+		printf("set tuner bandwidth to %u Hz\n", t->bandwidth);
+	if (t->flags & RTLSDR_TUNING_FREQ)
+		printf("set freq %u\n", t->freq);
+	if (t->flags & RTLSDR_TUNING_AGC_MODE)
+		printf("set agc mode %d\n", t->agc_mode);
+	if (t->flags & RTLSDR_TUNING_GAIN_MODE)
+		printf("set gain mode %d\n", t->gain_mode);
+	if (t->flags & RTLSDR_TUNING_GAIN)
+		printf("set gain %d\n", t->gain);
+	if (replay && (t->flags & RTLSDR_TUNING_FREQ))
+		replay_report(iq_replay_tune(replay, t->freq), t->freq, dongle_rate);
+
+	if (!batch) {
+		switch (t->flags) {
+		case 0:
+			return;
+		case RTLSDR_TUNING_FREQ:
+			ctrl_tune(dev, RTLSDR_OP_CENTER_FREQ, t->freq);
+			return;
+		case RTLSDR_TUNING_AGC_MODE:
+			ctrl_tune(dev, RTLSDR_OP_AGC_MODE, t->agc_mode);
+			return;
+		case RTLSDR_TUNING_GAIN_MODE:
+			ctrl_tune(dev, RTLSDR_OP_TUNER_GAIN_MODE, t->gain_mode);
+			return;
+		case RTLSDR_TUNING_GAIN:
+			ctrl_tune(dev, RTLSDR_OP_TUNER_GAIN, t->gain);
+			return;
+		case RTLSDR_TUNING_BANDWIDTH:
+			rtlsdr_ctrl_flush(dev);
+			verbose_set_bandwidth(dev, t->bandwidth);
+			return;
+		default:
+			break;
+		}
+	}
+
+	req = malloc(sizeof(struct tuning_req));
+	if (!req)
+		return;
+	req->tuning = *t;
+	req->batch = batch;
+	req->tag = tag;
+	if (rtlsdr_ctrl_submit(dev, RTLSDR_OP_TUNING, 0, (uint8_t *)&req->tuning,
+			sizeof(req->tuning), tuning_done, req))
+		free(req);
+}
+
+/* a command other than RANK_TUNING */
+static void apply_command(const struct command *cmd)
+{
+	uint32_t param = ntohl(cmd->param);
+
+	/*
+	 * Retune and gain commands go through the control queue of the
+	 * library, ahead of the register sampling. Any other setting
+	 * waits for them, so it can't overtake them.
+	 */
+	switch(cmd->cmd) {
+	case SET_FREQUENCY_CORRECTION:
+	case SET_IF_STAGE:
+	case REPORT_I2C_REGS:
+		break;
+	default:
+		rtlsdr_ctrl_flush(dev);
+		break;
+	}
+	switch(cmd->cmd) {
+	case SET_SAMPLE_RATE://0x02
+		printf("set sample rate %u\n", param);
+		if (!rtlsdr_set_sample_rate(dev, param)) {
+			dongle_rate = param;
+			if (replay)
+				replay_report(iq_replay_set_rate(replay, param),
+						rtlsdr_get_center_freq(dev), param);
+		}
+		break;
+	case SET_FREQUENCY_CORRECTION://0x05
+		printf("set freq correction %d\n", (int)param);
+		ctrl_tune(dev, RTLSDR_OP_FREQ_CORRECTION, param);
+		break;
+	case SET_IF_STAGE://0x06
+		printf("set if stage %d gain %d\n", param >> 16, (short)(param & 0xffff));
+		ctrl_tune(dev, RTLSDR_OP_TUNER_IF_GAIN, param);
+		break;
+	case SET_TEST_MODE://0x07
+		printf("set test mode %u\n", param);
+		rtlsdr_set_testmode(dev, param);
+		break;
+	case SET_DIRECT_SAMPLING://0x09
+		printf("set direct sampling %u\n", param);
+		rtlsdr_set_direct_sampling(dev, param);
+		break;
+	case SET_OFFSET_TUNING://0x0a
+		printf("set offset tuning %d\n", (int)param);
+		rtlsdr_set_offset_tuning(dev, (int)param);
+		break;
+	case SET_RTL_CRYSTAL://0x0b
+		printf("set rtl xtal %u\n", param);
+		rtlsdr_set_xtal_freq(dev, param, 0);
+		break;
+	case SET_TUNER_CRYSTAL://0x0c
+		printf("set tuner xtal %u\n", param);
+		rtlsdr_set_xtal_freq(dev, 0, param);
+		break;
+	case SET_BIAS_TEE://0x0e
+		printf("set bias tee %u\n", param);
+		rtlsdr_set_bias_tee(dev, param);
+		break;
+	case SET_I2C_TUNER_REGISTER://0x43
+		printf("set i2c register x%03X to x%03X with mask x%02X\n", (param >> 20) & 0xfff, param & 0xfff, (param >> 12) & 0xff );
+		rtlsdr_set_tuner_i2c_register(dev, (param >> 20) & 0xfff, (param >> 12) & 0xff, param & 0xfff);
+		break;
+	case SET_SIDEBAND://0x46
+		printf("set to %s sideband\n", param ? "upper" : "lower");
+		rtlsdr_set_tuner_sideband(dev, param);
+		break;
+	case REPORT_I2C_REGS://0x48
+		if(param)
+			param = 1;
+		ctrldata.report_i2c = param;  /* (de)activate reporting */
+		printf("read registers %d\n", param);
+		printf("activating response channel on port %d with %s I2C reporting\n",
+				ctrldata.port, (param ? "active" : "inactive") );
+		break;
+	case SET_DITHERING://0x49
+		printf("%sable dithering\n", param ? "en" : "dis");
+		rtlsdr_set_dithering(dev, param);
+		break;
+	case CALIBRATE_IMR://0x4e
+		printf("recalibrate image rejection\n");
+		if (rtlsdr_recalibrate_imr(dev))
+			printf("image rejection calibration failed\n");
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Apply a run of commands received one after another, e.g. while a slider
+ * is dragged: only the latest command per setting is kept, and the settings
+ * are applied in the order of their dependencies, the tuning ones at once.
+ */
+static void apply_commands(const struct queued_command *qc, int n)
+{
+	rtlsdr_tuning_t tuning;
+	char keep[CMD_QUEUE_LEN];
+	int i, k, rank, coalesced = 0;
+
+	for (i = 0; i < n; i++) {
+		keep[i] = 1;
+		if (command_key(&qc[i].cmd) < 0)
+			continue;
+		for (k = i + 1; k < n && keep[i]; k++)
+			if (command_key(&qc[k].cmd) == command_key(&qc[i].cmd))
+				keep[i] = 0;
+		coalesced += !keep[i];
+	}
+	if (coalesced && verbosity)
+		printf("%d of %d commands coalesced\n", coalesced, n);
+
+	memset(&tuning, 0, sizeof(tuning));
+	for (rank = 0; rank < RANK_NUM; rank++) {
+		for (i = 0; i < n; i++) {
+			if (!keep[i] || command_rank(qc[i].cmd.cmd) != rank)
+				continue;
+			if (rank == RANK_TUNING)
+				tuning_add(&tuning, &qc[i].cmd);
+			else
+				apply_command(&qc[i].cmd);
+		}
+		if (rank == RANK_TUNING)
+			apply_tuning(&tuning, 0, 0);
+	}
+}
+
+static void apply_batch(const struct queued_command *qc)
+{
+	rtlsdr_tuning_t tuning;
+	uint32_t tag = ntohl(qc->cmd.param) & 0xffffff;
+	int i;
+
+	memset(&tuning, 0, sizeof(tuning));
+	for (i = 0; i < qc->batch_len; i++)
+		tuning_add(&tuning, &qc->batch[i]);
+	if ((tuning.flags & (RTLSDR_TUNING_GAIN | RTLSDR_TUNING_GAIN_MODE)) == RTLSDR_TUNING_GAIN) {
+		tuning.flags |= RTLSDR_TUNING_GAIN_MODE;
+		tuning.gain_mode = 1;
+	}
+	printf("batch %u\n", tag);
+	apply_tuning(&tuning, 1, tag);
+}
+
+static void *command_worker(void *arg)
+{
+	static struct queued_command pending[CMD_QUEUE_LEN];
+	int i, j, n;
+
+	while(1) {
+		pthread_mutex_lock(&cmd_lock);
+		while (cmd_head == cmd_tail && !do_exit)
+			pthread_cond_wait(&cmd_cond, &cmd_lock);
+		if (do_exit) {
+			pthread_mutex_unlock(&cmd_lock);
+			break;
+		}
+		/* take all commands received meanwhile */
+		for (n = 0; cmd_tail != cmd_head; n++) {
+			pending[n] = cmd_queue[cmd_tail];
+			cmd_tail = (cmd_tail + 1) % CMD_QUEUE_LEN;
+		}
+		pthread_mutex_unlock(&cmd_lock);
+
+		/* a batch is applied as sent, the runs in between are coalesced */
+		for (i = 0; i < n; i = j) {
+			j = i + 1;
+			if (pending[i].cmd.cmd == SET_BATCH) {
+				apply_batch(&pending[i]);
+				continue;
+			}
+			while (j < n && pending[j].cmd.cmd != SET_BATCH)
+				j++;
+			apply_commands(&pending[i], j - i);
+		}
+	}
+	return NULL;
+}
+
+static void command_queue(const struct queued_command *qc)
+{
+	pthread_mutex_lock(&cmd_lock);
+	if ((cmd_head + 1) % CMD_QUEUE_LEN == cmd_tail) {
+		printf("command queue full, 0x%02x dropped\n", qc->cmd.cmd);
+	} else {
+		cmd_queue[cmd_head] = *qc;
+		cmd_head = (cmd_head + 1) % CMD_QUEUE_LEN;
+		pthread_cond_signal(&cmd_cond);
+	}
+	pthread_mutex_unlock(&cmd_lock);
+}
+
+static void *usb_worker(void *arg)
+{
+	sample_ring_stats_t stats;
+	int r;
+
+	if (replay) {
+		replay_stream();
+		usb_ended = 1;
+		return NULL;
+	}
+
+	if (zero_copy) {
+		/* every buffer the ring may hold needs a spare transfer buffer */
+		sample_ring_get_stats(ring, &stats);
+		r = rtlsdr_read_async_held(dev, rtlsdr_held_callback, NULL, buf_num, buf_len,
+				stats.num_slots + max_clients * SEND_BATCH + 1);
+	} else {
+		r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, buf_len);
+	}
+
+	if (r < 0)
+		fprintf(stderr, "rtlsdr_read_async failed with %d\n", r);
+	usb_ended = 1;
+	return NULL;
+}
+
+static void usb_start(void)
+{
+	if (usb_running)
+		return;
+
+	gettimeofday(&last_progress, NULL);
+	progress_head = sample_ring_head(ring);
+	usb_last_time = 0;
+	usb_running = 1;
+	usb_ended = 0;
+	replay_running = 1;
+	pthread_create(&usb_thread, NULL, usb_worker, NULL);
+}
+
+static void usb_stop(void)
+{
+	sample_ring_stats_t stats;
+	uint32_t hits, misses;
+	void *status;
+	int i;
+
+	if (!usb_running)
+		return;
+
+	if (replay)
+		replay_running = 0;
+	else
+		rtlsdr_cancel_async(dev);
+	pthread_join(usb_thread, &status);
+	usb_running = 0;
+
+	sample_ring_get_stats(ring, &stats);
+	printf("all threads dead..\n");
+	if (stats.dropped)
+		printf("sample ring: %u of %u buffers dropped\n", stats.dropped, stats.pushed);
+	ring_dropped_done += stats.dropped;
+	sample_ring_reset(ring);
+
+	/* sequence numbers start over, no client is left to reference entries */
+	for (i = 0; i < SAMPLE_FORMAT_NUM; i++) {
+		if (conv_caches[i] && verbosity) {
+			sample_conv_cache_stats(conv_caches[i], &hits, &misses);
+			printf("%s conversion: %u buffers converted, %u shared\n",
+					sample_format_names[i], misses, hits);
+		}
+		sample_conv_cache_destroy(conv_caches[i]);
+		conv_caches[i] = NULL;
+	}
+}
+
+static void client_close(client_t *cl)
+{
+	sample_ring_reader_stats_t stats;
+	int i;
+
+	reactor_del(reactor, cl->sock);
+	closesocket(cl->sock);
+
+	sample_ring_get_reader_stats(cl->reader, &stats);
+	printf("client %d gone: %u buffers sent, %u dropped, high-water mark %u",
+			cl->id, stats.sent, stats.dropped, stats.high_water);
+	client_dropped_done += stats.dropped;
+	if (cl->tx_calls)
+		printf(", %u bytes/syscall", (uint32_t)(cl->tx_bytes / cl->tx_calls));
+	if (cl->ignored)
+		printf(", %u commands ignored", cl->ignored);
+	printf("\n");
+	sample_ring_detach(cl->reader);
+	ddc_destroy(cl->ddc);
+	free(cl->out);
+	for (i = 0; i < (int)cl->num_conv; i++)
+		sample_conv_put(conv_caches[cl->format], cl->conv[i]);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i] == cl)
+			clients[i] = NULL;
+	num_clients--;
+
+	if (ctrl_owner == cl->id)
+		ctrl_owner = 0;
+
+	free(cl);
+}
+
+static void client_sent(client_t *cl, int r)
+{
+	cl->tx_bytes += r;
+	cl->tx_calls++;
+	stats_add(STATS_TX_BYTES, r);
+	stats_add(STATS_TX_CALLS, 1);
+}
+
+/* samples captured at time_ns went out completely */
+static void observe_latency(uint64_t time_ns)
+{
+	uint64_t now = stats_time_ns();
+
+	if (time_ns && now > time_ns)
+		stats_observe(STATS_HIST_SEND_LATENCY, (now - time_ns) / 1000);
+}
+
+/*
+ * Error handling shared by the send functions after a failed
+ * reactor_sendv(). Returns 0 to retry, 1 if the client waits for
+ * writability and -1 if it was closed.
+ */
+static int client_send_failed(client_t *cl)
+{
+	int r = reactor_io_status();
+
+	if (r == REACTOR_IO_RETRY)
+		return 0;
+	if (r == REACTOR_IO_AGAIN) {
+		stats_add(STATS_TX_BLOCKED, 1);
+		cl->blocked = 1;
+		reactor_set(reactor, cl->sock, REACTOR_READ | REACTOR_WRITE);
+		return 1;
+	}
+	printf("worker socket bye\n");
+	client_close(cl);
+	return -1;
+}
+
+static void frame_header(client_t *cl, rtl_tcp_frame_t *h, uint32_t seq,
+			 uint32_t len, const sample_ring_meta_t *meta)
+{
+	sample_ring_reader_stats_t stats;
+
+	sample_ring_get_reader_stats(cl->reader, &stats);
+	memcpy(h->magic, "RTLF", 4);
+	h->seq = htonl(seq);
+	h->samples = htonl(len / 2 / sample_format_size(cl->format));
+	h->flags = 0;
+	if ((meta->flags & SAMPLE_RING_LOST) || stats.dropped != cl->last_dropped)
+		h->flags = htonl(RTL_TCP_FRAME_LOST);
+	cl->last_dropped = stats.dropped;
+	h->time_hi = htonl((uint32_t)(meta->time_ns >> 32));
+	h->time_lo = htonl((uint32_t)meta->time_ns);
+	h->freq = htonl(meta->freq);
+	h->gain = htonl(meta->gain);
+}
+
+/*
+ * Add the pending buffer k to iov, preceded by its frame header in framed
+ * mode, skipping the first skip bytes of both. Returns the iov entries used.
+ */
+static int iov_item(client_t *cl, reactor_iov_t *iov, uint32_t k,
+		    unsigned char *data, uint32_t len, uint32_t skip)
+{
+	int n = 0;
+
+	if (cl->framed) {
+		if (skip < sizeof(rtl_tcp_frame_t)) {
+			REACTOR_IOV_SET(&iov[n], (unsigned char *)&cl->hdr[k] + skip,
+					sizeof(rtl_tcp_frame_t) - skip);
+			n++;
+			skip = 0;
+		} else {
+			skip -= sizeof(rtl_tcp_frame_t);
+		}
+	}
+	REACTOR_IOV_SET(&iov[n], data + skip, len - skip);
+	return n + 1;
+}
+
+/* bytes on the wire for a buffer of len bytes */
+static uint32_t item_len(client_t *cl, uint32_t len)
+{
+	return cl->framed ? len + sizeof(rtl_tcp_frame_t) : len;
+}
+
+/* forget the headers of the first n pending buffers, which went out */
+static void drop_headers(client_t *cl, uint32_t n)
+{
+	if (n > cl->num_hdr)
+		n = cl->num_hdr;
+	cl->num_hdr -= n;
+	memmove(cl->hdr, cl->hdr + n, cl->num_hdr * sizeof(rtl_tcp_frame_t));
+}
+
+/*
+ * Send the raw samples straight out of the ring. All claimed buffers are
+ * gathered into one send, limited by the socket send buffer, and the
+ * buffers which went out completely are released at once.
+ */
+static int client_send_raw(client_t *cl)
+{
+	reactor_iov_t iov[2 * SEND_BATCH];
+	unsigned char *data;
+	uint32_t first, len, n, i, cnt, total;
+	int r, num_iov;
+
+	while (1) {
+		if (cl->reconfig && !cl->offset)
+			return 2;
+		n = sample_ring_claim(cl->reader, SEND_BATCH, &first);
+		if (!n)
+			return 0;
+
+		for (; cl->framed && cl->num_hdr < n; cl->num_hdr++) {
+			sample_ring_slot(cl->reader, first + cl->num_hdr, &len);
+			frame_header(cl, &cl->hdr[cl->num_hdr], first + cl->num_hdr, len,
+					sample_ring_meta(cl->reader, first + cl->num_hdr));
+		}
+
+		total = 0;
+		num_iov = 0;
+		for (cnt = 0; cnt < n; cnt++) {
+			data = sample_ring_slot(cl->reader, first + cnt, &len);
+			if (cnt && total + item_len(cl, len) > (uint32_t)cl->sndbuf)
+				break;
+			num_iov += iov_item(cl, iov + num_iov, cnt, data, len,
+					cnt ? 0 : cl->offset);
+			total += item_len(cl, len);
+		}
+
+		r = reactor_sendv(cl->sock, iov, num_iov);
+		if (r == SOCKET_ERROR) {
+			r = client_send_failed(cl);
+			if (r)
+				return r;
+			continue;
+		}
+		client_sent(cl, r);
+
+		/* find the first buffer which did not go out completely */
+		r += cl->offset;
+		for (i = 0; i < cnt; i++) {
+			sample_ring_slot(cl->reader, first + i, &len);
+			if ((uint32_t)r < item_len(cl, len))
+				break;
+			r -= item_len(cl, len);
+		}
+		cl->offset = r;
+		if (!i)
+			continue;
+
+		observe_latency(sample_ring_meta(cl->reader, first + i - 1)->time_ns);
+		drop_headers(cl, i);
+		sample_ring_release(cl->reader, first + i);
+
+		if (verbosity)
+			print_reader_stats(cl);
+	}
+}
+
+/*
+ * Downconvert all claimed buffers into cl->out, release them right away
+ * and send the result, cl->offset counts the bytes of cl->out sent.
+ */
+static int client_send_ddc(client_t *cl)
+{
+	reactor_iov_t iov;
+	unsigned char *data;
+	uint32_t first, len, n, i;
+	int r;
+
+	while (1) {
+		if (cl->offset == cl->out_len) {
+			if (cl->out_len)
+				observe_latency(cl->capture[0]);
+			cl->offset = cl->out_len = 0;
+			if (cl->reconfig)
+				return 2;
+			n = sample_ring_claim(cl->reader, SEND_BATCH, &first);
+			if (!n)
+				return 0;
+
+			ddc_tune(cl->ddc, cl->ddc_offset, dongle_rate);
+			if (cl->framed)
+				cl->out_len = sizeof(rtl_tcp_frame_t);
+			for (i = 0; i < n; i++) {
+				data = sample_ring_slot(cl->reader, first + i, &len);
+				cl->out_len += ddc_process(cl->ddc, data, len, cl->out + cl->out_len);
+			}
+			if (cl->framed)
+				frame_header(cl, (rtl_tcp_frame_t *)cl->out, first,
+						cl->out_len - sizeof(rtl_tcp_frame_t),
+						sample_ring_meta(cl->reader, first + n - 1));
+			cl->capture[0] = sample_ring_meta(cl->reader, first + n - 1)->time_ns;
+			sample_ring_release(cl->reader, first + n);
+			if (verbosity)
+				print_reader_stats(cl);
+			continue;
+		}
+
+		REACTOR_IOV_SET(&iov, cl->out + cl->offset, cl->out_len - cl->offset);
+		r = reactor_sendv(cl->sock, &iov, 1);
+		if (r == SOCKET_ERROR) {
+			r = client_send_failed(cl);
+			if (r)
+				return r;
+			continue;
+		}
+		client_sent(cl, r);
+		cl->offset += r;
+	}
+}
+
+/*
+ * Send the samples converted to cl->format. The claimed buffers are looked
+ * up in the conversion cache shared with the other clients using the same
+ * format and released right away, cl->conv holds the converted buffers
+ * until they went out.
+ */
+static int client_send_conv(client_t *cl)
+{
+	sample_conv_cache_t *cache = conv_caches[cl->format];
+	reactor_iov_t iov[2 * SEND_BATCH];
+	sample_conv_t *conv;
+	unsigned char *data;
+	uint32_t first, len, n, i, cnt, total;
+	int r, num_iov;
+
+	while (1) {
+		if (cl->num_conv < SEND_BATCH && !cl->reconfig) {
+			n = sample_ring_claim(cl->reader, SEND_BATCH - cl->num_conv, &first);
+			for (i = 0; i < n; i++) {
+				data = sample_ring_slot(cl->reader, first + i, &len);
+				conv = sample_conv_get(cache, first + i, data, len);
+				if (!conv)
+					break;
+				if (cl->framed) {
+					sample_conv_data(conv, &len);
+					frame_header(cl, &cl->hdr[cl->num_conv], first + i, len,
+							sample_ring_meta(cl->reader, first + i));
+				}
+				cl->capture[cl->num_conv] = sample_ring_meta(cl->reader, first + i)->time_ns;
+				cl->conv[cl->num_conv++] = conv;
+			}
+			if (i) {
+				sample_ring_release(cl->reader, first + i);
+				if (verbosity)
+					print_reader_stats(cl);
+			}
+		}
+		if (!cl->num_conv)
+			return cl->reconfig ? 2 : 0;
+
+		total = 0;
+		num_iov = 0;
+		for (cnt = 0; cnt < cl->num_conv; cnt++) {
+			data = sample_conv_data(cl->conv[cnt], &len);
+			if (cnt && total + item_len(cl, len) > (uint32_t)cl->sndbuf)
+				break;
+			num_iov += iov_item(cl, iov + num_iov, cnt, data, len,
+					cnt ? 0 : cl->offset);
+			total += item_len(cl, len);
+		}
+
+		r = reactor_sendv(cl->sock, iov, num_iov);
+		if (r == SOCKET_ERROR) {
+			r = client_send_failed(cl);
+			if (r)
+				return r;
+			continue;
+		}
+		client_sent(cl, r);
+
+		r += cl->offset;
+		for (i = 0; i < cnt; i++) {
+			sample_conv_data(cl->conv[i], &len);
+			if ((uint32_t)r < item_len(cl, len))
+				break;
+			r -= item_len(cl, len);
+			sample_conv_put(cache, cl->conv[i]);
+		}
+		cl->offset = r;
+		if (i)
+			observe_latency(cl->capture[i - 1]);
+		cl->num_conv -= i;
+		memmove(cl->conv, cl->conv + i, cl->num_conv * sizeof(sample_conv_t *));
+		memmove(cl->capture, cl->capture + i, cl->num_conv * sizeof(uint64_t));
+		if (cl->framed)
+			memmove(cl->hdr, cl->hdr + i, cl->num_conv * sizeof(rtl_tcp_frame_t));
+	}
+}
+
+/* apply SET_SAMPLE_FORMAT and SET_DDC at a sample boundary of the outgoing stream */
+static void client_reconfigure(client_t *cl)
+{
+	uint32_t decim = cl->ddc_param >> 24;
+	/* sign extend the 22 bit offset */
+	int32_t offset = (int32_t)(cl->ddc_param << 10) >> 10;
+	sample_ring_reader_stats_t stats;
+
+	cl->reconfig = 0;
+	ddc_destroy(cl->ddc);
+	free(cl->out);
+	cl->ddc = NULL;
+	cl->out = NULL;
+
+	/* headers of claimed buffers are rebuilt, drops so far are not reported */
+	cl->framed = cl->new_framed;
+	cl->num_hdr = 0;
+	sample_ring_get_reader_stats(cl->reader, &stats);
+	cl->last_dropped = stats.dropped;
+
+	cl->format = cl->new_format;
+	if (cl->format != SAMPLE_FORMAT_CU8 && !conv_caches[cl->format]) {
+		conv_caches[cl->format] = sample_conv_cache_create(cl->format,
+							buf_len, CONV_CACHE_IDLE);
+		if (!conv_caches[cl->format]) {
+			printf("client %d: no memory for %s conversion\n", cl->id,
+					sample_format_names[cl->format]);
+			cl->format = SAMPLE_FORMAT_CU8;
+		}
+	}
+
+	if (decim < 2)
+		return;
+	cl->ddc = ddc_create(decim, cl->format);
+	if (cl->ddc)
+		cl->out = malloc(sizeof(rtl_tcp_frame_t) +
+				SEND_BATCH * ddc_max_output(cl->ddc, buf_len));
+	if (!cl->out) {
+		printf("client %d: invalid downconverter setting 0x%08x\n", cl->id, cl->ddc_param);
+		ddc_destroy(cl->ddc);
+		cl->ddc = NULL;
+		return;
+	}
+	cl->ddc_offset = offset;
+}
+
+/*
+ * Send queued samples until the ring is empty for this client or the
+ * socket would block.
+ * Returns -1 if the client was closed, 1 if it waits for writability.
+ */
+static int client_send(client_t *cl)
+{
+	int r;
+
+	do {
+		if (cl->reconfig && !cl->offset && !cl->out_len && !cl->num_conv)
+			client_reconfigure(cl);
+		if (cl->ddc)
+			r = client_send_ddc(cl);
+		else if (cl->format != SAMPLE_FORMAT_CU8)
+			r = client_send_conv(cl);
+		else
+			r = client_send_raw(cl);
+	} while (r == 2);
+
+	return r;
+}
+
+static void print_tx_stats(client_t *cl, struct timeval *now)
+{
+	uint64_t bytes = cl->tx_bytes - cl->stat_bytes;
+	uint32_t calls = cl->tx_calls - cl->stat_calls;
+	int ms = ms_since(&cl->stat_time, now);
+
+	if (ms > 0 && calls)
+		printf("client %d: %.2f MB/s, %u bytes/syscall\n", cl->id,
+				bytes / (ms * 1000.0), (uint32_t)(bytes / calls));
+	cl->stat_bytes = cl->tx_bytes;
+	cl->stat_calls = cl->tx_calls;
+	cl->stat_time = *now;
+}
+
+/* start a new client's stream up to ms back in time, out of the ring */
+static void client_preroll(client_t *cl, uint32_t ms)
+{
+	uint64_t bytes;
+	uint32_t n;
+
+	if (!persistent) {
+		printf("client %d: no pre-roll without -K\n", cl->id);
+		return;
+	}
+	if (ms > preroll_ms)
+		ms = preroll_ms;
+	bytes = (uint64_t)dongle_rate * 2 * ms / 1000;
+	n = sample_ring_rewind(cl->reader, (uint32_t)((bytes + buf_len - 1) / buf_len));
+	printf("client %d: pre-roll of %u ms, %u buffers\n", cl->id, ms, n);
+}
+
+/* the commands SET_BATCH applies together */
+static int batch_member(unsigned char cmd)
+{
+	return cmd == SET_FREQUENCY || cmd == SET_GAIN_MODE || cmd == SET_GAIN ||
+		cmd == SET_TUNER_GAIN_BY_INDEX || cmd == SET_AGC_MODE ||
+		cmd == SET_TUNER_BANDWIDTH;
+}
+
+static int client_recv(client_t *cl)
+{
+	struct queued_command qc;
+	struct command cmd;
+	int r;
+
+	while (1) {
+		r = recv(cl->sock, (char *)cl->cmd + cl->cmd_len, sizeof(cl->cmd) - cl->cmd_len, 0);
+		if (r == SOCKET_ERROR) {
+			r = reactor_io_status();
+			if (r == REACTOR_IO_RETRY)
+				continue;
+			if (r == REACTOR_IO_AGAIN)
+				return 0;
+		}
+		if (r <= 0) {
+			printf("comm recv bye\n");
+			client_close(cl);
+			return -1;
+		}
+
+		cl->cmd_len += r;
+		if (cl->cmd_len < (int)sizeof(cl->cmd))
+			continue;
+		cl->cmd_len = 0;
+
+		memcpy(&cmd, cl->cmd, sizeof(cmd));
+		/* the commands received along with this one follow before the samples */
+		cl->hold = 0;
+		qc.cmd = cmd;
+		qc.batch_len = 0;
+		if (cl->batch_left) {
+			/* a member of SET_BATCH, queued with the last one */
+			if (batch_member(cmd.cmd))
+				cl->batch.batch[cl->batch.batch_len++] = cmd;
+			else
+				printf("client %d: command 0x%02x not allowed in a batch\n",
+						cl->id, cmd.cmd);
+			if (--cl->batch_left)
+				continue;
+			qc = cl->batch;
+		} else if (cmd.cmd == SET_BATCH) {
+			r = ntohl(cmd.param) >> 24;
+			if (!r || r > BATCH_MAX) {
+				printf("client %d: batch of %d commands refused\n", cl->id, r);
+				continue;
+			}
+			cl->batch.cmd = cmd;
+			cl->batch.batch_len = 0;
+			cl->batch_left = r;
+			continue;
+		}
+		/* these only affect this client's stream, always allowed */
+		if (cmd.cmd == SET_DDC) {
+			cl->ddc_param = ntohl(cmd.param);
+			cl->new_format = (cl->ddc_param >> 22) & 3;
+			cl->reconfig = 1;
+			printf("client %d: set downconverter decimation %u, offset %d Hz, %s\n",
+					cl->id, cl->ddc_param >> 24,
+					(int32_t)(cl->ddc_param << 10) >> 10,
+					sample_format_names[cl->new_format]);
+			continue;
+		}
+		if (cmd.cmd == SET_SAMPLE_FORMAT) {
+			if (ntohl(cmd.param) >= SAMPLE_FORMAT_NUM) {
+				printf("client %d: unknown sample format %u\n", cl->id, ntohl(cmd.param));
+				continue;
+			}
+			cl->new_format = ntohl(cmd.param);
+			cl->reconfig = 1;
+			printf("client %d: set sample format %s\n", cl->id,
+					sample_format_names[cl->new_format]);
+			continue;
+		}
+		if (cmd.cmd == SET_PREROLL) {
+			client_preroll(cl, ntohl(cmd.param));
+			continue;
+		}
+		if (cmd.cmd == SET_FRAMING) {
+			cl->new_framed = ntohl(cmd.param) ? 1 : 0;
+			cl->reconfig = 1;
+			printf("client %d: %s framing\n", cl->id, cl->new_framed ? "enable" : "disable");
+			continue;
+		}
+		if (!may_control(cl)) {
+			cl->ignored++;
+			if (verbosity)
+				printf("client %d: command 0x%02x ignored, %s policy\n",
+						cl->id, qc.cmd.cmd, ctrl_policy_names[ctrl_policy]);
+			continue;
+		}
+		command_queue(&qc);
+	}
+}
+
+static void client_event(reactor_t *r, int events, void *ctx)
+{
+	client_t *cl = (client_t *)ctx;
+
+	if (events & (REACTOR_READ | REACTOR_ERROR))
+		if (client_recv(cl) < 0)
+			return;
 
-static SOCKET s;
+	if (events & REACTOR_WRITE) {
+		cl->blocked = 0;
+		reactor_set(reactor, cl->sock, REACTOR_READ);
+		client_send(cl);
+	}
+}
 
-static pthread_t tcp_worker_thread;
-static pthread_t command_thread;
-static pthread_cond_t exit_cond;
-static pthread_mutex_t exit_cond_lock;
+static void client_add(SOCKET sock)
+{
+	struct linger ling = {1,0};
+	dongle_info_t dongle_info;
+	int gains[100];
+	client_t *cl;
+	socklen_t rlen;
+	int i, r, slot = -1;
 
-static pthread_mutex_t ll_mutex;
-static pthread_cond_t cond;
+	for (i = 0; i < max_clients; i++) {
+		if (!clients[i]) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		printf("client rejected, %d clients connected already\n", num_clients);
+		closesocket(sock);
+		return;
+	}
 
-struct llist {
-	char *data;
-	size_t len;
-	struct llist *next;
-};
+	cl = calloc(1, sizeof(client_t));
+	cl->sock = sock;
+	cl->id = next_client_id++;
+	gettimeofday(&cl->connected, NULL);
+	cl->stat_time = cl->connected;
+	/* an RTL1 client may change the format, let it do so before the first sample */
+	cl->hold = header_version;
+
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+	rlen = sizeof(cl->sndbuf);
+	if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&cl->sndbuf, &rlen) ||
+			cl->sndbuf <= 0)
+		cl->sndbuf = buf_len;
+
+	printf("client %d accepted!\n", cl->id);
+
+	memset(&dongle_info, 0, sizeof(dongle_info));
+	memcpy(&dongle_info.magic, header_version ? "RTL1" : "RTL0", 4);
+
+	r = rtlsdr_get_tuner_type(dev);
+	if (r >= 0)
+		dongle_info.tuner_type = htonl(r);
+	r = rtlsdr_get_tuner_gains(dev, gains);
+	if (r >= 0)
+		dongle_info.tuner_gain_count = htonl(r);
+	if (verbosity)
+	{
+		fprintf(stderr, "Supported gain values (%d): ", r);
+		for (i = 0; i < r; i++)
+			fprintf(stderr, "%.1f ", gains[i] / 10.0);
+		fprintf(stderr, "\n");
+	}
 
-typedef struct { /* structure size must be multiple of 2 bytes */
-	char magic[4];
-	uint32_t tuner_type;
-	uint32_t tuner_gain_count;
-} dongle_info_t;
+	/* still blocking, the header fits into any socket buffer */
+	r = send(sock, (const char *)&dongle_info, sizeof(dongle_info), 0);
+	if (sizeof(dongle_info) != r)
+		printf("failed to send dongle information\n");
+
+	reactor_set_nonblocking(sock);
+	if (reactor_add(reactor, sock, REACTOR_READ, client_event, cl)) {
+		printf("client %d rejected, too many sockets\n", cl->id);
+		closesocket(sock);
+		free(cl);
+		return;
+	}
+	cl->reader = sample_ring_attach(ring);
+	/* still streaming from before, the stall timer starts over */
+	if (!num_clients)
+		gettimeofday(&last_progress, NULL);
+	clients[slot] = cl;
+	num_clients++;
+	stats_add(STATS_CLIENTS_ACCEPTED, 1);
+
+	usb_start();
+}
 
-static rtlsdr_dev_t *dev = NULL;
+static void listen_event(reactor_t *r, int events, void *ctx)
+{
+	SOCKET listensocket = *(SOCKET *)ctx;
+	struct sockaddr_in remote;
+	socklen_t rlen;
+	SOCKET s;
 
-static int verbosity = 0;
+	while (1) {
+		rlen = sizeof(remote);
+		s = accept(listensocket, (struct sockaddr *)&remote, &rlen);
+		if (s == INVALID_SOCKET)
+			break;
+		client_add(s);
+	}
+}
 
-static int global_numq = 0;
-static struct llist *ll_buffers = 0;
-static int llbuf_num = 500;
+static void resp_close(resp_client_t *rc)
+{
+	int i;
+
+	reactor_del(reactor, rc->sock);
+	closesocket(rc->sock);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (resp_clients[i] == rc)
+			resp_clients[i] = NULL;
+	num_resp_clients--;
+	free(rc->text);
+	free(rc);
+}
 
-static volatile int do_exit = 0;
+/* returns -1 if the client was closed */
+static int resp_send(resp_client_t *rc)
+{
+	const char *data = rc->text ? rc->text : (const char *)rc->buf;
+	int r;
+
+	while (rc->offset < rc->len) {
+		r = send(rc->sock, data + rc->offset, rc->len - rc->offset, 0);
+		if (r == SOCKET_ERROR) {
+			r = reactor_io_status();
+			if (r == REACTOR_IO_RETRY)
+				continue;
+			if (r == REACTOR_IO_AGAIN) {
+				reactor_set(reactor, rc->sock, REACTOR_READ | REACTOR_WRITE);
+				return 0;
+			}
+			resp_close(rc);
+			return -1;
+		}
+		rc->offset += r;
+	}
+	if (rc->http == 2) {
+		/*
+		 * HTTP/1.0 answer complete: a close right away would reset the
+		 * connection while the request is unread, the client closes
+		 * once it has read the answer
+		 */
+		shutdown(rc->sock, SHUT_WR);
+		free(rc->text);
+		rc->text = NULL;
+		rc->http = 3;
+		gettimeofday(&rc->start, NULL);
+		rc->start.tv_sec += HTTP_CLOSE_MS / 1000;
+	}
+	reactor_set(reactor, rc->sock, REACTOR_READ);
+	return 0;
+}
 
-void usage(void)
+/*
+ * Requests on the response port: REPORT_STATS commands, or a HTTP GET,
+ * answered with the metrics in Prometheus format.
+ */
+static void resp_input(resp_client_t *rc, const char *data, int len)
 {
-	printf("\n"
-		"Usage:\t[-a listen address]\n"
-		"\t[-b number of buffers (default: 15, set by library)]\n"
-		"\t[-d device index or serial (default: 0)]\n"
-		"\t[-f frequency to tune to [Hz]]\n"
-		"\t[-g gain in dB (default: 0 for auto)]\n"
-		"\t[-l length of single buffer in units of 512 samples (default: 64)]\n"
-		"\t[-n max number of linked list buffers to keep (default: 500)]\n"
-		"\t[-p listen port (default: 1234)]\n"
-		"\t[-r response port (default: listen port + 1)]\n"
-		"\t[-s samplerate in Hz (default: 2048000 Hz)]\n"
-		"\t[-u upper sideband for R820T/R828D (default: lower sideband)]\n"
-		"\t[-v increase verbosity (default: 0)]\n"
-		"\t[-w rtlsdr tuner bandwidth [Hz]]\n"
-		"\t[-D direct_sampling_mode (default: 0, 1 = I, 2 = Q, 3 = I below threshold, 4 = Q below threshold)]\n"
-		"\t[-D direct_sampling_threshold_frequency (default: 0 use tuner specific frequency threshold for 3 and 4)]\n"
-		"\t[-P ppm_error (default: 0)]\n"
-		"\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3 dongles)]\n");
-	exit(1);
+	struct linger ling = {0,0};
+	struct command cmd;
+	int n;
+
+	while (len > 0 && !rc->http) {
+		n = (int)sizeof(rc->in) - rc->in_len;
+		if (n > len)
+			n = len;
+		memcpy(rc->in + rc->in_len, data, n);
+		rc->in_len += n;
+		data += n;
+		len -= n;
+
+		if (rc->in_len >= 4 && !memcmp(rc->in, "GET ", 4)) {
+			/* ends with an orderly close, see resp_send() */
+			setsockopt(rc->sock, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+			rc->http = 1;
+			break;
+		}
+		if (rc->in_len < (int)sizeof(rc->in))
+			break;
+		rc->in_len = 0;
+
+		memcpy(&cmd, rc->in, sizeof(cmd));
+		if (cmd.cmd != REPORT_STATS)
+			continue;
+		rc->stats_ms = (int)ntohl(cmd.param);
+		gettimeofday(&rc->stats_time, NULL);
+	}
 }
 
-#ifdef _WIN32
+/* sample the values kept elsewhere before the metrics are read out */
+static void stats_refresh(void)
+{
+	sample_ring_stats_t stats;
+	sample_ring_reader_stats_t rs;
+	uint64_t dropped = client_dropped_done;
+	uint32_t depth = 0, high = 0;
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (!clients[i])
+			continue;
+		sample_ring_get_reader_stats(clients[i]->reader, &rs);
+		dropped += rs.dropped;
+		if (rs.queued > depth)
+			depth = rs.queued;
+		if (rs.high_water > high)
+			high = rs.high_water;
+	}
+	sample_ring_get_stats(ring, &stats);
+
+	stats_set(STATS_USB_ERRORS, rtlsdr_get_xfer_errors(dev));
+	stats_set(STATS_RING_DROPPED, ring_dropped_done + stats.dropped);
+	stats_set(STATS_CLIENT_DROPPED, dropped);
+	stats_set(STATS_CLIENTS, num_clients);
+	stats_set(STATS_QUEUE_DEPTH, depth);
+	stats_set(STATS_QUEUE_HIGH_WATER, high);
+	stats_set(STATS_SAMPLE_RATE, dongle_rate);
+	stats_set(STATS_CPU_US, stats_cpu_us());
+}
 
-BOOL WINAPI
-sighandler(int signum)
+/* the oldest SET_BATCH acknowledgement rc has not got yet into its buffer */
+static int batch_ack_frame(resp_client_t *rc)
 {
-	if (CTRL_C_EVENT == signum) {
-		fprintf(stderr, "Signal caught, exiting!\n");
-		do_exit = 1;
-		rtlsdr_cancel_async(dev);
-		return TRUE;
+	uint32_t body[RTL_TCP_BATCH_ACK_LEN / 4];
+	uint32_t oldest, skipped;
+	batch_ack_t ack;
+
+	pthread_mutex_lock(&ack_lock);
+	/* the slots of the older ones hold queued, newer acknowledgements */
+	oldest = rtlsdr_atomic_load(&acks_queued) - ACK_QUEUE_LEN;
+	skipped = (int32_t)(oldest - rc->ack_seq) > 0 ? oldest - rc->ack_seq : 0;
+	rc->ack_seq += skipped;
+	ack = batch_acks[rc->ack_seq++ % ACK_QUEUE_LEN];
+	pthread_mutex_unlock(&ack_lock);
+
+	if (skipped) {
+		printf("response client lagging: %u batch acknowledgements skipped\n", skipped);
+		stats_add(STATS_ACKS_LOST, skipped);
 	}
-	return FALSE;
+
+	body[0] = htonl(ack.tag);
+	body[1] = htonl((uint32_t)ack.result);
+	body[2] = htonl(ack.seq);
+	body[3] = htonl(ack.offset);
+	body[4] = htonl(ack.freq);
+	body[5] = htonl((uint32_t)ack.gain);
+	rc->buf[0] = SET_BATCH;
+	rc->buf[1] = 0;
+	rc->buf[2] = RTL_TCP_BATCH_ACK_LEN;
+	memcpy(rc->buf + 3, body, RTL_TCP_BATCH_ACK_LEN);
+	return 3 + RTL_TCP_BATCH_ACK_LEN;
 }
-#else
-static void sighandler(int signum)
+
+/* the metrics as HTTP answer into rc->text, returns its length, -1 if out of memory */
+static int http_answer(resp_client_t *rc)
 {
-	fprintf(stderr, "Signal caught, exiting!\n");
-	rtlsdr_cancel_async(dev);
-	do_exit = 1;
+	char header[128];
+	int len, size = 0, hlen;
+
+	stats_refresh();
+	/* the counters may grow meanwhile, leave some room */
+	len = stats_prometheus(NULL, 0);
+	while (len >= size) {
+		size = len + 1024;
+		free(rc->text);
+		rc->text = malloc(sizeof(header) + size);
+		if (!rc->text)
+			return -1;
+		len = stats_prometheus(rc->text + sizeof(header), size);
+	}
+	hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: close\r\n\r\n", len);
+	memmove(rc->text + hlen, rc->text + sizeof(header), len);
+	memcpy(rc->text, header, hlen);
+	return hlen + len;
 }
-#endif
 
-static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+/* queue the next response for rc, whose buffer is free */
+static int resp_next(resp_client_t *rc, struct timeval *now)
 {
-	if(!do_exit) {
-		struct llist *rpt = (struct llist*)malloc(sizeof(struct llist));
-		rpt->data = (char*)malloc(len);
-		memcpy(rpt->data, buf, len);
-		rpt->len = len;
-		rpt->next = NULL;
-
-		pthread_mutex_lock(&ll_mutex);
-		if (ll_buffers == NULL) {
-			ll_buffers = rpt;
-		} else {
-			struct llist *cur = ll_buffers;
-			int num_queued = 0;
+	if (rc->http == 1) {
+		rc->len = http_answer(rc);
+		if (rc->len < 0) {
+			rc->len = 0;
+			return 0;
+		}
+		rc->http = 2;
+		return 1;
+	}
+	if (rc->http)
+		return 0;
 
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			if(llbuf_num && llbuf_num == num_queued-2){
-				struct llist *curelem;
+	if (rc->ack_seq != rtlsdr_atomic_load(&acks_resolved)) {
+		rc->len = batch_ack_frame(rc);
+		return 1;
+	}
 
-				free(ll_buffers->data);
-				curelem = ll_buffers->next;
-				free(ll_buffers);
-				ll_buffers = curelem;
+	if (rc->stats_ms >= 0 && ms_since(&rc->stats_time, now) >= 0) {
+		stats_refresh();
+		rc->len = stats_frame(rc->buf);
+		if (rc->stats_ms) {
+			rc->stats_time = *now;
+			rc->stats_time.tv_sec += rc->stats_ms / 1000;
+			rc->stats_time.tv_usec += (rc->stats_ms % 1000) * 1000;
+			if (rc->stats_time.tv_usec >= 1000000) {
+				rc->stats_time.tv_sec++;
+				rc->stats_time.tv_usec -= 1000000;
 			}
+		} else {
+			rc->stats_ms = -1;
+		}
+		return 1;
+	}
 
-			cur->next = rpt;
+	if (rc->frame_seq == resp_frame_seq || ms_since(&rc->start, now) < 0)
+		return 0;
+	pthread_mutex_lock(&resp_lock);
+	memcpy(rc->buf, resp_frame, resp_frame_len);
+	rc->len = resp_frame_len;
+	rc->frame_seq = resp_frame_seq;
+	pthread_mutex_unlock(&resp_lock);
+	return 1;
+}
 
-			if ( verbosity )
-			{
-				if (num_queued > global_numq)
-					printf("ll+, now %d\n", num_queued);
-				else if (num_queued < global_numq)
-					printf("ll-, now %d\n", num_queued);
+static void resp_event(reactor_t *r, int events, void *ctx)
+{
+	resp_client_t *rc = (resp_client_t *)ctx;
+	char buf[64];
+	int n;
+
+	if (events & (REACTOR_READ | REACTOR_ERROR)) {
+		/* notice the client leaving */
+		while (1) {
+			n = recv(rc->sock, buf, sizeof(buf), 0);
+			if (n > 0) {
+				resp_input(rc, buf, n);
+				continue;
 			}
-
-			global_numq = num_queued;
+			if (n == SOCKET_ERROR && reactor_io_status() != REACTOR_IO_ERROR)
+				break;
+			resp_close(rc);
+			return;
 		}
-		pthread_cond_signal(&cond);
-		pthread_mutex_unlock(&ll_mutex);
 	}
+
+	if (events & REACTOR_WRITE)
+		resp_send(rc);
 }
-static int count = 0;
-LARGE_INTEGER c1, c2;
-LARGE_INTEGER *Count1 = &c1, *Count2 = &c2;
 
-static void *tcp_worker(void *arg)
+static void resp_listen_event(reactor_t *r, int events, void *ctx)
 {
-	struct llist *curelem,*prev;
-	int bytesleft,bytessent, index;
-	struct timeval tv= {1,0};
-	struct timespec ts;
-	struct timeval tp;
-	fd_set writefds;
-	int r = 0;
+	SOCKET listensocket = *(SOCKET *)ctx;
+	struct linger ling = {1,0};
+	struct sockaddr_in remote;
+	resp_client_t *rc;
+	socklen_t rlen;
+	SOCKET s;
+	int i;
 
-	while(1) {
-		if(do_exit)
-			pthread_exit(0);
-
-		pthread_mutex_lock(&ll_mutex);
-		gettimeofday(&tp, NULL);
-		ts.tv_sec  = tp.tv_sec+1;
-		ts.tv_nsec = tp.tv_usec * 1000;
-		r = pthread_cond_timedwait(&cond, &ll_mutex, &ts);
-		if(r == ETIMEDOUT) {
-			pthread_mutex_unlock(&ll_mutex);
-			printf("worker cond timeout\n");
-			sighandler(0);
-			pthread_exit(NULL);
-		}
-
-		curelem = ll_buffers;
-		ll_buffers = 0;
-		pthread_mutex_unlock(&ll_mutex);
-
-		while(curelem != 0) {
-			bytesleft = curelem->len;
-			index = 0;
-			bytessent = 0;
-			while(bytesleft > 0) {
-				FD_ZERO(&writefds);
-				FD_SET(s, &writefds);
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				r = select(s+1, NULL, &writefds, NULL, &tv);
-				if(r) {
-					bytessent = send(s,  &curelem->data[index], bytesleft, 0);
-					bytesleft -= bytessent;
-					index += bytessent;
-				}
-				if(bytessent == SOCKET_ERROR || do_exit) {
-						printf("worker socket bye\n");
-						sighandler(0);
-						pthread_exit(NULL);
-				}
-			}
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
-#ifdef TIME_MEAS
-			count++;
-			if (count % 100 == 0)
-			{
-				QueryPerformanceCounter(Count2);
-				formattedTimeOutput("1000 sdrplay buffers (ms)", calcTimeDiff_in_ms(Count2, Count1));
-				QueryPerformanceCounter(Count1);
-			}
-#endif
+	while (1) {
+		rlen = sizeof(remote);
+		s = accept(listensocket, (struct sockaddr *)&remote, &rlen);
+		if (s == INVALID_SOCKET)
+			break;
+
+		for (i = 0; i < max_clients; i++)
+			if (!resp_clients[i])
+				break;
+		if (i == max_clients) {
+			closesocket(s);
+			continue;
+		}
 
+		rc = calloc(1, sizeof(resp_client_t));
+		rc->sock = s;
+		rc->frame_seq = resp_frame_seq;
+		rc->ack_seq = rtlsdr_atomic_load(&acks_resolved);
+		rc->stats_ms = -1;
+		gettimeofday(&rc->start, NULL);
+		rc->start.tv_sec += RESP_DELAY_MS / 1000;
+
+		setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+		reactor_set_nonblocking(s);
+		if (reactor_add(reactor, s, REACTOR_READ, resp_event, rc)) {
+			closesocket(s);
+			free(rc);
+			continue;
 		}
+		resp_clients[i] = rc;
+		num_resp_clients++;
+		printf("Control client accepted!\n");
 	}
-	return NULL;
 }
 
-extern void print_demod_register(rtlsdr_dev_t *dev, uint8_t page);
+/* called by the control thread with every register report */
+static void resp_report(void *ctx, const unsigned char *frame, int len)
+{
+	pthread_mutex_lock(&resp_lock);
+	memcpy(resp_frame, frame, len);
+	resp_frame_len = len;
+	resp_frame_seq++;
+	pthread_mutex_unlock(&resp_lock);
+	reactor_wakeup(reactor);
+}
 
-static int set_gain_by_index(rtlsdr_dev_t *_dev, unsigned int index)
+/*
+ * Work which is not triggered by socket events: new samples, new reports,
+ * stream start/stop and the stall check.
+ * Returns the time in ms after which it should be called again at the latest.
+ */
+static int service(void)
 {
-	int res = 0;
-	int* gains;
-	int count = rtlsdr_get_tuner_gains(_dev, NULL);
+	struct timeval now;
+	resp_client_t *rc;
+	client_t *cl;
+	int i, hold, timeout = 1000;
+	uint32_t head;
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		cl = clients[i];
+		if (!cl || cl->blocked)
+			continue;
+		if (cl->hold) {
+			hold = FORMAT_HOLD_MS - ms_since(&cl->connected, &now);
+			if (hold > 0) {
+				if (hold < timeout)
+					timeout = hold;
+				continue;
+			}
+			cl->hold = 0;
+		}
+		if (client_send(cl))
+			continue;
+		/* caught up, ask for a wakeup with the next buffer */
+		if (sample_ring_arm(cl->reader))
+			timeout = 0;
+	}
 
-	if (count > 0 && (unsigned int)count > index) {
-		gains = malloc(sizeof(int) * count);
-		count = rtlsdr_get_tuner_gains(_dev, gains);
+	if (verbosity) {
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			cl = clients[i];
+			if (cl && ms_since(&cl->stat_time, &now) >= STATS_INTERVAL_MS)
+				print_tx_stats(cl, &now);
+		}
+	}
 
-		res = rtlsdr_set_tuner_gain(_dev, gains[index]);
-		if (verbosity)
-			fprintf(stderr, "set tuner gain to %.1f dB\n", gains[index] / 10.0);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		rc = resp_clients[i];
+		if (rc && rc->http == 3 && ms_since(&rc->start, &now) >= 0) {
+			resp_close(rc);
+			continue;
+		}
+		if (!rc || rc->offset < rc->len || !resp_next(rc, &now))
+			continue;
+		rc->offset = 0;
+		resp_send(rc);
+	}
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		rc = resp_clients[i];
+		/* a busy client continues on writability */
+		if (rc && rc->offset >= rc->len && !rc->http &&
+				rc->ack_seq != rtlsdr_atomic_load(&acks_resolved))
+			timeout = 0;
+		if (rc && rc->stats_ms > 0 && rc->offset >= rc->len) {
+			hold = -ms_since(&rc->stats_time, &now);
+			if (hold < timeout)
+				timeout = hold > 0 ? hold : 0;
+		}
+	}
 
-		free(gains);
+	if (!usb_running)
+		return timeout;
+
+	/* only the dongle stalls the stream, a client not reading loses buffers */
+	head = sample_ring_head(ring);
+	if (head != progress_head) {
+		progress_head = head;
+		last_progress = now;
+	}
+	if (num_clients && ms_since(&last_progress, &now) > STALL_TIMEOUT_MS) {
+		printf("worker cond timeout\n");
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (clients[i])
+				client_close(clients[i]);
 	}
 
-	return res;
+	if (!num_clients && (!persistent || usb_ended)) {
+		/* last client gone, stop streaming until the next one */
+		if (persistent)
+			printf("streaming ended, restarting with the next client\n");
+		usb_stop();
+		return 1000;
+	}
+
+	return timeout;
 }
 
-#ifdef _WIN32
-#define __attribute__(x)
-#pragma pack(push, 1)
-#endif
-struct command{
-	unsigned char cmd;
-	unsigned int param;
-}__attribute__((packed));
-#ifdef _WIN32
-#pragma pack(pop)
-#endif
-static void *command_worker(void *arg)
+static SOCKET listen_on(char *addr, int port, int backlog)
 {
-	int left, received = 0;
-	fd_set readfds;
-	struct command cmd={0, 0};
-	struct timeval tv= {1, 0};
-	int r = 0;
-	uint32_t param;
+	struct sockaddr_in local;
+	struct linger ling = {1,0};
+	SOCKET sock;
+	int r = 1;
 
-	while(1) {
-		left=sizeof(cmd);
-		while(left >0) {
-			FD_ZERO(&readfds);
-			FD_SET(s, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(s+1, &readfds, NULL, NULL, &tv);
-			if(r) {
-				received = recv(s, (char*)&cmd+(sizeof(cmd)-left), left, 0);
-				left -= received;
-			}
-			if(received == SOCKET_ERROR || do_exit) {
-				printf("comm recv bye\n");
-				sighandler(0);
-				pthread_exit(NULL);
-			}
-		}
+	memset(&local,0,sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons(port);
+	local.sin_addr.s_addr = inet_addr(addr);
 
-		param = ntohl(cmd.param);
-		switch(cmd.cmd) {
-		case SET_FREQUENCY://0x01
-			printf("set freq %u\n", param);
-			rtlsdr_set_center_freq(dev, param);
-			break;
-		case SET_SAMPLE_RATE://0x02
-			printf("set sample rate %u\n", param);
-			rtlsdr_set_sample_rate(dev, param);
-			break;
-		case SET_GAIN_MODE://0x03
-			printf("set gain mode %u\n", param);
-			rtlsdr_set_tuner_gain_mode(dev, param);
-			break;
-		case SET_GAIN://0x04
-			printf("set gain %u\n", param);
-			rtlsdr_set_tuner_gain(dev, param);
-			break;
-		case SET_FREQUENCY_CORRECTION://0x05
-			printf("set freq correction %d\n", (int)param);
-			rtlsdr_set_freq_correction(dev, (int)param);
-			break;
-		case SET_IF_STAGE://0x06
-			printf("set if stage %d gain %d\n", param >> 16, (short)(param & 0xffff));
-			rtlsdr_set_tuner_if_gain(dev, param >> 16, (short)(param & 0xffff));
-			break;
-		case SET_TEST_MODE://0x07
-			printf("set test mode %u\n", param);
-			rtlsdr_set_testmode(dev, param);
-			break;
-		case SET_AGC_MODE://0x08
-			printf("set agc mode %u\n", param);
-			rtlsdr_set_agc_mode(dev, param);
-			break;
-		case SET_DIRECT_SAMPLING://0x09
-			printf("set direct sampling %u\n", param);
-			rtlsdr_set_direct_sampling(dev, param);
-			break;
-		case SET_OFFSET_TUNING://0x0a
-			printf("set offset tuning %d\n", (int)param);
-			rtlsdr_set_offset_tuning(dev, (int)param);
-			break;
-		case SET_RTL_CRYSTAL://0x0b
-			printf("set rtl xtal %u\n", param);
-			rtlsdr_set_xtal_freq(dev, param, 0);
-			break;
-		case SET_TUNER_CRYSTAL://0x0c
-			printf("set tuner xtal %u\n", param);
-			rtlsdr_set_xtal_freq(dev, 0, param);
-			break;
-		case SET_TUNER_GAIN_BY_INDEX://0x0d
-			printf("set tuner gain by index %u\n", param);
-			set_gain_by_index(dev, param);
-			break;
-		case SET_BIAS_TEE://0x0e
-			printf("set bias tee %u\n", param);
-			rtlsdr_set_bias_tee(dev, param);
-			break;
-		case SET_TUNER_BANDWIDTH://0x40
-			printf("set tuner bandwidth to %u Hz\n", param);
-			verbose_set_bandwidth(dev, param);
-			break;
-		case SET_I2C_TUNER_REGISTER://0x43
-			printf("set i2c register x%03X to x%03X with mask x%02X\n", (param >> 20) & 0xfff, param & 0xfff, (param >> 12) & 0xff );
-			rtlsdr_set_tuner_i2c_register(dev, (param >> 20) & 0xfff, (param >> 12) & 0xff, param & 0xfff);
-			break;
-		case SET_SIDEBAND://0x46
-			printf("set to %s sideband\n", param ? "upper" : "lower");
-			rtlsdr_set_tuner_sideband(dev, param);
-			break;
-		case REPORT_I2C_REGS://0x48
-			if(param)
-				param = 1;
-			ctrldata.report_i2c = param;  /* (de)activate reporting */
-			printf("read registers %d\n", param);
-			printf("activating response channel on port %d with %s I2C reporting\n",
-					ctrldata.port, (param ? "active" : "inactive") );
-			break;
-		case SET_DITHERING://0x49
-			printf("%sable dithering\n", param ? "en" : "dis");
-			rtlsdr_set_dithering(dev, param);
-			break;
-		default:
-			break;
-		}
-		cmd.cmd = 0xff;
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&r, sizeof(int));
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+	if (bind(sock,(struct sockaddr *)&local,sizeof(local)) == SOCKET_ERROR ||
+			listen(sock, backlog) == SOCKET_ERROR) {
+		fprintf(stderr, "failed to listen on %s:%d\n", addr, port);
+		closesocket(sock);
+		return INVALID_SOCKET;
 	}
-	return NULL;
+	reactor_set_nonblocking(sock);
+
+	return sock;
 }
 
+static void print_listening(char *addr, int port)
+{
+	printf("listening...\n");
+	printf("Use the device argument 'rtl_tcp=%s:%d' in OsmoSDR "
+	       "(gr-osmosdr) source\n"
+	       "to receive samples in GRC and control "
+	       "rtl_tcp parameters (frequency, gain, ...).\n",
+	       addr, port);
+}
 
 int main(int argc, char **argv)
 {
@@ -438,40 +2134,32 @@ int main(int argc, char **argv)
 	int port_resp = 1;
 	int report_i2c = 1;
 	int do_exit_thrd_ctrl = 0;
+	int sample_ms = 500;
 	int cal_imr = 1;
 
 	uint32_t frequency = 100000000, samp_rate = 2048000;
 	enum rtlsdr_ds_mode ds_mode = RTLSDR_DS_IQ;
 	uint32_t ds_temp, ds_threshold = 0;
-	struct sockaddr_in local, remote;
-	uint32_t buf_num = 0;
 	int sideband = 0;
-	/* buf_len:
-	 * must be multiple of 512 - else it will be overwritten
-	 * in rtlsdr_read_async() in librtlsdr.c with DEFAULT_BUF_LENGTH (= 16*32 *512 = 512 *512)
-	 *
-	 * -> 512*512 -> 1048 ms @ 250 kS  or  81.92 ms @ 3.2 MS (internal default)
-	 * ->  32*512 ->   65 ms @ 250 kS  or   5.12 ms @ 3.2 MS (new default)
-	 *
-	 */
-	uint32_t buf_len = 64 * 512;
 	int dev_index = 0;
 	int dev_given = 0;
 	int gain = 0;
 	int ppm_error = 0;
-	struct llist *curelem,*prev;
-	pthread_attr_t attr;
+	sample_ring_stats_t ring_stats;
 	void *status;
-	struct timeval tv = {1,0};
-	struct linger ling = {1,0};
 	SOCKET listensocket;
-	socklen_t rlen;
-	fd_set readfds;
-	u_long blockmode = 1;
-	dongle_info_t dongle_info;
-	int gains[100];
+	SOCKET resp_listensocket = INVALID_SOCKET;
+	int timeout = 1000, was_streaming;
 	uint32_t bandwidth = 0;
 	int enable_biastee = 0;
+	int freq_given = 0, rate_given = 0;
+	char *replay_path[IQ_REPLAY_MAX_SEGMENTS];
+	uint32_t replay_freq[IQ_REPLAY_MAX_SEGMENTS];
+	uint32_t replay_rate[IQ_REPLAY_MAX_SEGMENTS];
+	int num_replay = 0;
+	double replay_speed = 1.0;
+	uint32_t max_ms;
+	char *p, *q;
 
 #ifdef _WIN32
 	WSADATA wsd;
@@ -483,7 +2171,7 @@ int main(int argc, char **argv)
 	printf("rtl_tcp, an I/Q spectrum server for RTL2832 based DVB-T receivers\n"
 		   "Version 0.91 for QIRX, %s\n\n", __DATE__);
 
-	while ((opt = getopt(argc, argv, "a:b:d:f:g:l:n:O:p:us:vr:w:D:TP:")) != -1) {
+	while ((opt = getopt(argc, argv, "a:b:d:f:g:i:l:m:n:O:p:us:vr:w:C:D:HK:TP:R:X:Z")) != -1) {
 		switch (opt) {
 		case 'a':
 			addr = optarg;
@@ -497,6 +2185,7 @@ int main(int argc, char **argv)
 			break;
 		case 'f':
 			frequency = (uint32_t)atofs(optarg);
+			freq_given = 1;
 			break;
 		case 'g':
 			gain = (int)(atof(optarg) * 10); /* tenths of a dB */
@@ -504,6 +2193,11 @@ int main(int argc, char **argv)
 		case 'l':
 			buf_len = 512 * atoi(optarg);
 			break;
+		case 'm':
+			max_clients = atoi(optarg);
+			if (max_clients < 1 || max_clients > MAX_CLIENTS)
+				usage();
+			break;
 		case 'n':
 			llbuf_num = atoi(optarg);
 			break;
@@ -517,6 +2211,7 @@ int main(int argc, char **argv)
 			break;
 		case 's':
 			samp_rate = (uint32_t)atofs(optarg);
+			rate_given = 1;
 			break;
 		case 'u':
 			sideband = 1;
@@ -527,6 +2222,17 @@ int main(int argc, char **argv)
 		case 'w':
 			bandwidth = (uint32_t)atofs(optarg);
 			break;
+		case 'i':
+			sample_ms = atoi(optarg);
+			break;
+		case 'C':
+			for (i = 0; i <= CTRL_OBSERVE; i++)
+				if (!strcmp(optarg, ctrl_policy_names[i]))
+					break;
+			if (i > CTRL_OBSERVE)
+				usage();
+			ctrl_policy = (ctrl_policy_t)i;
+			break;
 		case 'D':
 			ds_temp = (uint32_t)( atofs(optarg) + 0.5 );
 			if (ds_temp <= RTLSDR_DS_Q_BELOW)
@@ -540,6 +2246,38 @@ int main(int argc, char **argv)
 		case 'T':
 			enable_biastee = 1;
 			break;
+		case 'R':
+			if (num_replay >= IQ_REPLAY_MAX_SEGMENTS)
+				usage();
+			replay_path[num_replay] = optarg;
+			replay_freq[num_replay] = 0;
+			replay_rate[num_replay] = 0;
+			p = strrchr(optarg, '@');
+			if (p) {
+				*p++ = '\0';
+				/* atofs() takes the suffix from the end of the string */
+				q = strchr(p, ':');
+				if (q) {
+					*q++ = '\0';
+					replay_rate[num_replay] = (uint32_t)atofs(q);
+				}
+				replay_freq[num_replay] = (uint32_t)atofs(p);
+			}
+			num_replay++;
+			break;
+		case 'X':
+			replay_speed = atof(optarg);
+			break;
+		case 'K':
+			persistent = 1;
+			preroll_ms = (uint32_t)atoi(optarg);
+			break;
+		case 'Z':
+			zero_copy = 1;
+			break;
+		case 'H':
+			header_version = 1;
+			break;
 		default:
 			usage();
 			break;
@@ -552,7 +2290,43 @@ int main(int argc, char **argv)
 	if (verbosity)
 		fprintf(stderr, "verbosity set to %d\n", verbosity);
 
-	if (!dev_given) {
+	/* the ring slots must hold a full USB transfer, see buf_len above */
+	if (!buf_len || buf_len % 512)
+		buf_len = 16 * 32 * 512;
+
+	if (num_replay) {
+		replay = iq_replay_create(buf_len);
+		if (!replay) {
+			fprintf(stderr, "Failed to allocate the replay source.\n");
+			exit(1);
+		}
+		for (i = 0; i < num_replay; i++) {
+			r = iq_replay_add(replay, replay_path[i], replay_freq[i], replay_rate[i]);
+			if (r == -2)
+				r = iq_replay_add(replay, replay_path[i],
+						replay_freq[i] ? replay_freq[i] : frequency,
+						replay_rate[i] ? replay_rate[i] : samp_rate);
+			if (r < 0) {
+				fprintf(stderr, "Failed to map %s as CU8 recording.\n", replay_path[i]);
+				exit(1);
+			}
+			iq_replay_get_segment(replay, r, &replay_freq[i], &replay_rate[i], NULL);
+			fprintf(stderr, "replay: %s at %u Hz with %u S/s\n",
+					replay_path[i], replay_freq[i], replay_rate[i]);
+		}
+		/* start where the first recording was made, unless told otherwise */
+		if (!freq_given)
+			frequency = replay_freq[0];
+		if (!rate_given)
+			samp_rate = replay_rate[0];
+		iq_replay_set_speed(replay, replay_speed);
+		iq_replay_tune(replay, frequency);
+		iq_replay_set_rate(replay, samp_rate);
+		/* a virtual device keeps the registers for the control protocol */
+		if (dev_given)
+			fprintf(stderr, "replay: ignoring -d\n");
+		dev_index = verbose_device_search("sim:");
+	} else if (!dev_given) {
 		dev_index = verbose_device_search("0");
 	}
 
@@ -585,6 +2359,7 @@ int main(int argc, char **argv)
 
 	/* Set the sample rate */
 	verbose_set_sample_rate(dev, samp_rate);
+	dongle_rate = samp_rate;
 
 	/* Set direct sampling with threshold */
 	rtlsdr_set_ds_mode(dev, ds_mode, ds_threshold);
@@ -623,10 +2398,51 @@ int main(int argc, char **argv)
 	verbose_reset_buffer(dev);
 
 	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_mutex_init(&ll_mutex, NULL);
-	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_cond_init(&cond, NULL);
 	pthread_cond_init(&exit_cond, NULL);
+	pthread_mutex_init(&resp_lock, NULL);
+	pthread_mutex_init(&cmd_lock, NULL);
+	pthread_mutex_init(&ack_lock, NULL);
+	pthread_cond_init(&cmd_cond, NULL);
+
+	reactor = reactor_create(2 + 2 * MAX_CLIENTS);
+	if (!reactor) {
+		fprintf(stderr, "Failed to create the socket event loop.\n");
+		rtlsdr_close(dev);
+		exit(1);
+	}
+
+	if (llbuf_num <= 0)
+		llbuf_num = 500;
+	ring = sample_ring_create(llbuf_num, zero_copy ? 0 : buf_len, max_clients, SEND_BATCH);
+	if (!ring) {
+		fprintf(stderr, "Failed to allocate sample ring of %d x %u bytes.\n",
+				llbuf_num, buf_len);
+		rtlsdr_close(dev);
+		exit(1);
+	}
+	sample_ring_set_notify(ring, ring_notify, reactor);
+	sample_ring_set_release(ring, replay ? replay_release : ring_release, NULL);
+	if (verbosity) {
+		sample_ring_get_stats(ring, &ring_stats);
+		fprintf(stderr, "sample ring: %u buffers of %u bytes%s\n",
+				ring_stats.num_slots, buf_len,
+				zero_copy ? ", held in the USB transfer buffers" : "");
+	}
+	if (persistent) {
+		/* the ring must cover the pre-roll, next to the clients' backlog */
+		sample_ring_get_stats(ring, &ring_stats);
+		max_ms = (uint32_t)((uint64_t)(ring_stats.num_slots / 2) * buf_len * 500 / samp_rate);
+		if (preroll_ms > max_ms) {
+			preroll_ms = max_ms;
+			fprintf(stderr, "pre-roll limited to %u ms by the ring size (-n)\n",
+					preroll_ms);
+		}
+		fprintf(stderr, "streaming continuously, pre-roll up to %u ms\n", preroll_ms);
+		usb_start();
+	}
+	if (max_clients > 1)
+		fprintf(stderr, "serving up to %d clients, %s control policy\n",
+				max_clients, ctrl_policy_names[ctrl_policy]);
 
 	if ( port_resp == 1 )
 		port_resp = port + 1;
@@ -634,119 +2450,74 @@ int main(int argc, char **argv)
 	ctrldata.dev = dev;
 	ctrldata.addr = addr;
 	ctrldata.wait = 500000; /* = 0.5 sec */
+	ctrldata.sample_wait = sample_ms * 1000;
+	ctrldata.pListeners = &num_resp_clients;
 	ctrldata.report_i2c = report_i2c;
 	ctrldata.pDoExit = &do_exit_thrd_ctrl;
+	ctrldata.report = resp_report;
+	ctrldata.report_ctx = NULL;
+	ctrldata.sampled = ctrl_latency;
+	ctrldata.sampled_ctx = (void *)(intptr_t)STATS_HIST_CTRL_TELEMETRY;
 	if( port_resp )
 	{
 		if ( port_resp != (port+1))
 			fprintf(stderr, "activating response channel on port %d with %s I2C reporting\n",
 					port_resp, (report_i2c ? "active" : "inactive") );
+		resp_listensocket = listen_on(addr, port_resp, max_clients);
+		if (resp_listensocket != INVALID_SOCKET)
+			reactor_add(reactor, resp_listensocket, REACTOR_READ,
+					resp_listen_event, &resp_listensocket);
 		pthread_create(&thread_ctrl, NULL, &ctrl_thread_fn, &ctrldata);
 	}
 
-	memset(&local,0,sizeof(local));
-	local.sin_family = AF_INET;
-	local.sin_port = htons(port);
-	local.sin_addr.s_addr = inet_addr(addr);
-
-	listensocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	r = 1;
-	setsockopt(listensocket, SOL_SOCKET, SO_REUSEADDR, (char *)&r, sizeof(int));
-	setsockopt(listensocket, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
-	bind(listensocket,(struct sockaddr *)&local,sizeof(local));
-
-#ifdef _WIN32
-	ioctlsocket(listensocket, FIONBIO, &blockmode);
-#else
-	r = fcntl(listensocket, F_GETFL, 0);
-	r = fcntl(listensocket, F_SETFL, r | O_NONBLOCK);
-#endif
-
-	while(1) {
-		printf("listening...\n");
-		printf("Use the device argument 'rtl_tcp=%s:%d' in OsmoSDR "
-		       "(gr-osmosdr) source\n"
-		       "to receive samples in GRC and control "
-		       "rtl_tcp parameters (frequency, gain, ...).\n",
-		       addr, port);
-		listen(listensocket,1);
-
-		while(1) {
-			FD_ZERO(&readfds);
-			FD_SET(listensocket, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(listensocket+1, &readfds, NULL, NULL, &tv);
-			if(do_exit) {
-				goto out;
-			} else if(r) {
-				rlen = sizeof(remote);
-				s = accept(listensocket,(struct sockaddr *)&remote, &rlen);
-				break;
-			}
-		}
-
-		setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
-
-		printf("client accepted!\n");
-
-		memset(&dongle_info, 0, sizeof(dongle_info));
-		memcpy(&dongle_info.magic, "RTL0", 4);
-
-		r = rtlsdr_get_tuner_type(dev);
-		if (r >= 0)
-			dongle_info.tuner_type = htonl(r);
-		r = rtlsdr_get_tuner_gains(dev, gains);
-		if (r >= 0)
-			dongle_info.tuner_gain_count = htonl(r);
-		if (verbosity)
-		{
-			fprintf(stderr, "Supported gain values (%d): ", r);
-			for (i = 0; i < r; i++)
-				fprintf(stderr, "%.1f ", gains[i] / 10.0);
-			fprintf(stderr, "\n");
-		}
-
-		r = send(s, (const char *)&dongle_info, sizeof(dongle_info), 0);
-		if (sizeof(dongle_info) != r)
-			printf("failed to send dongle information\n");
-
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		r = pthread_create(&tcp_worker_thread, &attr, tcp_worker, NULL);
-		r = pthread_create(&command_thread, &attr, command_worker, NULL);
-		pthread_attr_destroy(&attr);
+	pthread_create(&command_thread, NULL, command_worker, NULL);
 
-		r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, buf_len);
-
-		pthread_join(tcp_worker_thread, &status);
-		pthread_join(command_thread, &status);
+	listensocket = listen_on(addr, port, max_clients);
+	if (listensocket == INVALID_SOCKET) {
+		r = -1;
+		goto out;
+	}
+	reactor_add(reactor, listensocket, REACTOR_READ, listen_event, &listensocket);
+	print_listening(addr, port);
 
-		closesocket(s);
+	while(!do_exit) {
+		r = reactor_poll(reactor, timeout);
+		if (r < 0)
+			break;
+		was_streaming = usb_running;
+		timeout = service();
+		if (was_streaming && !usb_running && !do_exit)
+			print_listening(addr, port);
+	}
 
-		printf("all threads dead..\n");
-		curelem = ll_buffers;
-		ll_buffers = 0;
+out:
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i])
+			client_close(clients[i]);
+		if (resp_clients[i])
+			resp_close(resp_clients[i]);
+	}
+	usb_stop();
 
-		while(curelem != 0) {
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
-		}
+	pthread_mutex_lock(&cmd_lock);
+	do_exit = 1;
+	pthread_cond_signal(&cmd_cond);
+	pthread_mutex_unlock(&cmd_lock);
+	pthread_join(command_thread, &status);
 
-		do_exit = 0;
-		global_numq = 0;
+	if (port_resp) {
+		ctrl_thread_stop(&ctrldata);
+		pthread_join(thread_ctrl, &status);
 	}
 
-out:
 	rtlsdr_close(dev);
-	closesocket(listensocket);
-
-	do_exit_thrd_ctrl = 1;
-	ctrldata.pDoExit = &do_exit_thrd_ctrl;
-	pthread_join(thread_ctrl, &status);
-	closesocket(s);
+	if (listensocket != INVALID_SOCKET)
+		closesocket(listensocket);
+	if (resp_listensocket != INVALID_SOCKET)
+		closesocket(resp_listensocket);
+	reactor_destroy(reactor);
+	sample_ring_destroy(ring);
+	iq_replay_destroy(replay);
 #ifdef _WIN32
 	WSACleanup();
 #endif
@@ -0,0 +1,761 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for rtl_tcp: M clients stream at the same time, the
+ * commanding ones hop frequencies and change the gain, and the result is
+ * written as JSON report.
+ *
+ * With framing (RTL1 servers, i.e. rtl_tcp -H) every frame carries the
+ * sequence number of its transfer and the frequency and gain it was
+ * captured with: gaps in the sequence count as dropped transfers, and the
+ * time from sending a command until the first frame showing its effect is
+ * the command latency.
+ * With -c the dongle is put into test mode and the byte counter it sends
+ * is checked, every discontinuity counts as an error. This catches damaged
+ * or partial transfers; whole transfers are a multiple of 256 bytes, so
+ * their loss only shows in the sequence numbers.
+ *
+ * The CPU time of the server is taken from its REPORT_STATS frames on the
+ * response port, at the start and at the end of the run.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#else
+#include <winsock2.h>
+#include "getopt/getopt.h"
+#endif
+
+#ifdef NEED_PTHREADS_WORKARROUND
+#define HAVE_STRUCT_TIMESPEC
+#endif
+#include <pthread.h>
+
+#include "rtl-sdr.h"
+#include "rtl_tcp.h"
+#include "serverStats.h"
+#include "convenience/convenience.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#else
+#define closesocket close
+#define SOCKET int
+#define SOCKET_ERROR -1
+#define INVALID_SOCKET -1
+#endif
+
+#define MAX_CLIENTS	32
+#define MAX_HOPS	16
+#define RX_BUF_LEN	(256 * 1024)
+/* latencies kept per client and kind of command */
+#define MAX_LATENCIES	4096
+/* a command without visible effect after this long counts as timeout */
+#define EFFECT_TIMEOUT_NS	2000000000ULL
+#define FRAME_HDR_LEN	32
+#define RECV_TIMEOUT_MS	500
+/* correct counter bytes in a row before the counter check trusts the stream */
+#define COUNTER_LOCK	256
+
+typedef struct
+{
+	uint32_t num;
+	uint32_t timeouts;
+	uint64_t sent_ns;	/* pending command, 0 if none */
+	double ms[MAX_LATENCIES];
+}
+latency_t;
+
+typedef struct
+{
+	int id;
+	int commanding;
+	pthread_t thread;
+	SOCKET sock;
+	char magic[5];
+	uint32_t tuner_type;
+	uint32_t gain_count;
+	int error;
+	double connect_ms;
+
+	uint64_t first_ns;	/* first sample byte */
+	uint64_t last_ns;
+	uint64_t bytes;
+	uint64_t frames;
+	uint64_t dropped;	/* transfers missing in the sequence */
+	uint64_t lost;		/* frames flagged RTL_TCP_FRAME_LOST */
+	uint64_t counter_errors;
+
+	/* frame parser */
+	int framing;
+	unsigned char hdr[FRAME_HDR_LEN];
+	int hdr_len;
+	uint64_t payload_left;
+	int have_seq;
+	uint32_t next_seq;
+	uint32_t count_run;	/* counter bytes in sequence */
+	unsigned char next_count;
+
+	/* command mix */
+	uint64_t next_hop_ns;
+	uint64_t next_gain_ns;
+	int hop_index;
+	int gain_index;
+	uint32_t freq_target;
+	int32_t frame_gain;	/* gain of the latest frame */
+	int32_t gain_before;
+	latency_t freq_lat;
+	latency_t gain_lat;
+}
+bench_client_t;
+
+static char *addr = "127.0.0.1";
+static int port = 1234;
+static int port_resp = 1;
+static int num_clients = 1;
+static double duration = 10.0;
+static uint32_t samp_rate = 0;
+static uint32_t hops[MAX_HOPS];
+static int num_hops = 0;
+static double hop_rate = 0.0;
+static double gain_rate = 0.0;
+static int all_command = 0;
+static int check_counter = 0;
+static int use_framing = 1;
+
+static bench_client_t *clients;
+static volatile uint64_t stop_ns;
+static volatile int do_exit = 0;
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_tcp_bench, a load generator and benchmark for rtl_tcp\n\n"
+		"Usage:\t[-a server address (default: 127.0.0.1)]\n"
+		"\t[-p server port (default: 1234)]\n"
+		"\t[-r response port for the server CPU time (default: port + 1, 0 = off)]\n"
+		"\t[-m number of clients (default: 1, max: %d)]\n"
+		"\t[-t duration in seconds (default: 10)]\n"
+		"\t[-s sample rate to set [Hz] (default: leave the server's)]\n"
+		"\t[-F frequencies to hop between, comma separated (default: 100M,105M)]\n"
+		"\t[-h frequency hops per second (default: 0 = off)]\n"
+		"\t[-g gain changes per second (default: 0 = off)]\n"
+		"\t[-A every client commands, needs rtl_tcp -C shared (default: the first one)]\n"
+		"\t[-c check the byte counter of the test mode]\n"
+		"\t[-P plain stream, no framing: no drop counts nor latencies]\n"
+		"\t[-o file for the JSON report (default: stdout)]\n",
+		MAX_CLIENTS);
+	exit(1);
+}
+
+#ifdef _WIN32
+BOOL WINAPI
+sighandler(int signum)
+{
+	if (CTRL_C_EVENT == signum) {
+		fprintf(stderr, "Signal caught, finishing the run\n");
+		do_exit = 1;
+		return TRUE;
+	}
+	return FALSE;
+}
+#else
+static void sighandler(int signum)
+{
+	fprintf(stderr, "Signal caught, finishing the run\n");
+	do_exit = 1;
+}
+#endif
+
+static void sleep_ms(int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static int send_command(SOCKET sock, unsigned char cmd, uint32_t param)
+{
+	unsigned char buf[5];
+
+	buf[0] = cmd;
+	param = htonl(param);
+	memcpy(buf + 1, &param, 4);
+	return send(sock, (const char *)buf, sizeof(buf), 0) == sizeof(buf) ? 0 : -1;
+}
+
+static int recv_all(SOCKET sock, unsigned char *buf, int len)
+{
+	int r, got = 0;
+
+	while (got < len) {
+		r = recv(sock, (char *)buf + got, len - got, 0);
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return 0;
+}
+
+static SOCKET connect_to(int to_port)
+{
+	struct sockaddr_in remote;
+#ifdef _WIN32
+	DWORD tv = RECV_TIMEOUT_MS;
+#else
+	struct timeval tv = {0, RECV_TIMEOUT_MS * 1000};
+#endif
+	int one = 1;
+	SOCKET s;
+
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(to_port);
+	remote.sin_addr.s_addr = inet_addr(addr);
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET)
+		return s;
+	if (connect(s, (struct sockaddr *)&remote, sizeof(remote))) {
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+	return s;
+}
+
+static void latency_add(latency_t *l, uint64_t now)
+{
+	if (l->num < MAX_LATENCIES)
+		l->ms[l->num++] = (double)(now - l->sent_ns) / 1e6;
+	l->sent_ns = 0;
+}
+
+static void frame_header(bench_client_t *cl, uint64_t now)
+{
+	const unsigned char *h = cl->hdr;
+	uint32_t seq = get32(h + 4);
+
+	if (memcmp(h, "RTLF", 4)) {
+		fprintf(stderr, "client %d: lost the frame sync\n", cl->id);
+		cl->error = 1;
+		return;
+	}
+	cl->frames++;
+	if (cl->have_seq && seq != cl->next_seq) {
+		cl->dropped += seq - cl->next_seq;
+		cl->count_run = 0;
+	}
+	cl->next_seq = seq + 1;
+	cl->have_seq = 1;
+	if (get32(h + 12) & RTL_TCP_FRAME_LOST) {
+		cl->lost++;
+		cl->count_run = 0;
+	}
+	cl->payload_left = (uint64_t)get32(h + 8) * 2;
+	cl->frame_gain = (int32_t)get32(h + 28);
+
+	if (cl->freq_lat.sent_ns && get32(h + 24) == cl->freq_target)
+		latency_add(&cl->freq_lat, now);
+	if (cl->gain_lat.sent_ns && cl->frame_gain != cl->gain_before)
+		latency_add(&cl->gain_lat, now);
+}
+
+static void check_samples(bench_client_t *cl, const unsigned char *p, uint32_t len)
+{
+	uint32_t i;
+
+	cl->bytes += len;
+	if (!check_counter)
+		return;
+	/* the samples before the test mode is on don't count */
+	for (i = 0; i < len; i++) {
+		if (p[i] == cl->next_count) {
+			cl->count_run++;
+		} else {
+			if (cl->count_run >= COUNTER_LOCK)
+				cl->counter_errors++;
+			cl->count_run = 0;
+		}
+		cl->next_count = p[i] + 1;
+	}
+}
+
+static void parse(bench_client_t *cl, const unsigned char *p, uint32_t len, uint64_t now)
+{
+	uint32_t n;
+
+	if (!cl->framing) {
+		check_samples(cl, p, len);
+		return;
+	}
+	while (len && !cl->error) {
+		if (!cl->payload_left) {
+			n = FRAME_HDR_LEN - cl->hdr_len;
+			if (n > len)
+				n = len;
+			memcpy(cl->hdr + cl->hdr_len, p, n);
+			cl->hdr_len += n;
+			p += n;
+			len -= n;
+			if (cl->hdr_len < FRAME_HDR_LEN)
+				break;
+			cl->hdr_len = 0;
+			frame_header(cl, now);
+			continue;
+		}
+		n = cl->payload_left < len ? (uint32_t)cl->payload_left : len;
+		check_samples(cl, p, n);
+		cl->payload_left -= n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* the next command of the mix, at most one of each kind in flight */
+static void command_mix(bench_client_t *cl, uint64_t now)
+{
+	latency_t *l;
+
+	l = &cl->freq_lat;
+	if (hop_rate > 0 && now >= cl->next_hop_ns) {
+		cl->next_hop_ns += (uint64_t)(1e9 / hop_rate);
+		if (l->sent_ns && now - l->sent_ns > EFFECT_TIMEOUT_NS) {
+			l->timeouts++;
+			l->sent_ns = 0;
+		}
+		if (!l->sent_ns) {
+			cl->hop_index = (cl->hop_index + 1) % num_hops;
+			cl->freq_target = hops[cl->hop_index];
+			/* without framing the effect can't be seen, only the load counts */
+			if (!send_command(cl->sock, SET_FREQUENCY, cl->freq_target) && cl->framing)
+				l->sent_ns = now;
+		}
+	}
+
+	l = &cl->gain_lat;
+	if (gain_rate > 0 && cl->gain_count > 1 && now >= cl->next_gain_ns) {
+		cl->next_gain_ns += (uint64_t)(1e9 / gain_rate);
+		if (l->sent_ns && now - l->sent_ns > EFFECT_TIMEOUT_NS) {
+			l->timeouts++;
+			l->sent_ns = 0;
+		}
+		if (!l->sent_ns) {
+			/* toggle between the lowest and the highest gain */
+			cl->gain_index = cl->gain_index ? 0 : cl->gain_count - 1;
+			cl->gain_before = cl->frame_gain;
+			if (!send_command(cl->sock, SET_TUNER_GAIN_BY_INDEX, cl->gain_index) &&
+			    cl->framing)
+				l->sent_ns = now;
+		}
+	}
+}
+
+static void *client_worker(void *arg)
+{
+	bench_client_t *cl = (bench_client_t *)arg;
+	unsigned char *buf;
+	uint64_t now, start;
+	int r;
+
+	buf = malloc(RX_BUF_LEN);
+	start = stats_time_ns();
+	cl->sock = connect_to(port);
+	if (!buf || cl->sock == INVALID_SOCKET) {
+		fprintf(stderr, "client %d: connecting to %s:%d failed\n", cl->id, addr, port);
+		cl->error = 1;
+		free(buf);
+		return NULL;
+	}
+	if (recv_all(cl->sock, buf, 12)) {
+		fprintf(stderr, "client %d: no dongle info received\n", cl->id);
+		cl->error = 1;
+		goto out;
+	}
+	cl->connect_ms = (double)(stats_time_ns() - start) / 1e6;
+	memcpy(cl->magic, buf, 4);
+	cl->tuner_type = get32(buf + 4);
+	cl->gain_count = get32(buf + 8);
+
+	cl->framing = use_framing && !memcmp(cl->magic, "RTL1", 4);
+	if (cl->framing)
+		send_command(cl->sock, SET_FRAMING, 1);
+	if (cl->commanding) {
+		if (samp_rate)
+			send_command(cl->sock, SET_SAMPLE_RATE, samp_rate);
+		if (check_counter)
+			send_command(cl->sock, SET_TEST_MODE, 1);
+		if (gain_rate > 0)
+			send_command(cl->sock, SET_GAIN_MODE, 1);
+	}
+
+	now = stats_time_ns();
+	cl->next_hop_ns = now;
+	cl->next_gain_ns = now;
+	while (!do_exit && !cl->error) {
+		r = recv(cl->sock, (char *)buf, RX_BUF_LEN, 0);
+		now = stats_time_ns();
+		if (now >= stop_ns)
+			break;
+		if (r == 0 || (r < 0 && now - cl->last_ns > EFFECT_TIMEOUT_NS && cl->last_ns)) {
+			fprintf(stderr, "client %d: stream ended\n", cl->id);
+			cl->error = 1;
+			break;
+		}
+		if (r > 0) {
+			if (!cl->first_ns)
+				cl->first_ns = now;
+			cl->last_ns = now;
+			parse(cl, buf, (uint32_t)r, now);
+		}
+		if (cl->commanding && cl->first_ns)
+			command_mix(cl, now);
+	}
+
+	if (cl->commanding && check_counter)
+		send_command(cl->sock, SET_TEST_MODE, 0);
+out:
+	closesocket(cl->sock);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Fetch a REPORT_STATS frame from the response port, skipping the register
+ * reports. Returns the number of values read, 0 on failure.
+ */
+static int server_stats(SOCKET sock, uint64_t *values)
+{
+	unsigned char buf[4096];
+	int len, i, n;
+
+	if (send_command(sock, REPORT_STATS, 0))
+		return 0;
+	while (1) {
+		if (recv_all(sock, buf, 3))
+			return 0;
+		len = (buf[1] << 8) | buf[2];
+		if (len > (int)sizeof(buf) || recv_all(sock, buf + 3, len))
+			return 0;
+		if (buf[0] == REPORT_STATS && len >= 4)
+			break;
+	}
+	n = buf[3];
+	if (n > STATS_NUM)
+		n = STATS_NUM;
+	if (7 + 8 * n > len + 3)
+		return 0;
+	for (i = 0; i < n; i++)
+		values[i] = get64(buf + 7 + 8 * i);
+	return n;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_latency(FILE *f, const char *name, size_t offset)
+{
+	double *all, sum = 0;
+	uint32_t n = 0, timeouts = 0, i, k;
+	latency_t *l;
+	int c;
+
+	all = malloc(sizeof(double) * MAX_LATENCIES * num_clients);
+	for (c = 0; c < num_clients && all; c++) {
+		l = (latency_t *)((char *)&clients[c] + offset);
+		for (i = 0; i < l->num; i++)
+			all[n++] = l->ms[i];
+		timeouts += l->timeouts;
+	}
+	fprintf(f, "    \"%s\": { \"count\": %u, \"timeouts\": %u", name, n, timeouts);
+	if (n) {
+		qsort(all, n, sizeof(double), cmp_double);
+		for (i = 0; i < n; i++)
+			sum += all[i];
+		fprintf(f, ", \"mean\": %.3f", sum / n);
+		/* nearest rank */
+		k = (n * 50 + 99) / 100;
+		fprintf(f, ", \"p50\": %.3f", all[k ? k - 1 : 0]);
+		k = (n * 90 + 99) / 100;
+		fprintf(f, ", \"p90\": %.3f", all[k ? k - 1 : 0]);
+		k = (n * 99 + 99) / 100;
+		fprintf(f, ", \"p99\": %.3f", all[k ? k - 1 : 0]);
+		fprintf(f, ", \"max\": %.3f", all[n - 1]);
+	}
+	fprintf(f, " }");
+	free(all);
+}
+
+static double client_seconds(bench_client_t *cl)
+{
+	if (!cl->first_ns || cl->last_ns <= cl->first_ns)
+		return 0;
+	return (double)(cl->last_ns - cl->first_ns) / 1e9;
+}
+
+static void report(FILE *f, double elapsed, uint64_t *s0, uint64_t *s1, int have_stats,
+		   uint64_t bench_cpu_us)
+{
+	bench_client_t *cl = NULL;
+	double total = 0, mbs, min = 0, max = 0, cpu;
+	uint64_t dropped = 0, lost = 0, errors = 0;
+	int i, ok = 0;
+
+	for (i = 0; i < num_clients; i++) {
+		if (!clients[i].first_ns)
+			continue;
+		if (!cl)
+			cl = &clients[i];
+		mbs = client_seconds(&clients[i]) > 0 ?
+			clients[i].bytes / client_seconds(&clients[i]) / 1e6 : 0;
+		total += mbs;
+		if (!ok || mbs < min)
+			min = mbs;
+		if (!ok || mbs > max)
+			max = mbs;
+		ok++;
+		dropped += clients[i].dropped;
+		lost += clients[i].lost;
+		errors += clients[i].counter_errors;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"address\": \"%s:%d\",\n", addr, port);
+	fprintf(f, "  \"magic\": \"%s\",\n", cl ? cl->magic : "");
+	fprintf(f, "  \"tuner_type\": %u,\n", cl ? cl->tuner_type : 0);
+	fprintf(f, "  \"gain_count\": %u,\n", cl ? cl->gain_count : 0);
+	fprintf(f, "  \"clients\": %d,\n", num_clients);
+	fprintf(f, "  \"clients_streaming\": %d,\n", ok);
+	fprintf(f, "  \"duration_s\": %.3f,\n", elapsed);
+	fprintf(f, "  \"framing\": %s,\n", cl && cl->framing ? "true" : "false");
+	fprintf(f, "  \"hops_per_s\": %g,\n", hop_rate);
+	fprintf(f, "  \"gain_changes_per_s\": %g,\n", gain_rate);
+	fprintf(f, "  \"throughput\": { \"total_mb_s\": %.3f, \"min_mb_s\": %.3f, "
+		"\"avg_mb_s\": %.3f, \"max_mb_s\": %.3f, \"sample_rate\": %.0f },\n",
+		total, min, ok ? total / ok : 0, max,
+		ok ? total / ok * 1e6 / 2 : 0);
+	fprintf(f, "  \"drops\": { \"transfers\": %llu, \"lost_flags\": %llu, "
+		"\"counter_errors\": %llu },\n",
+		(unsigned long long)dropped, (unsigned long long)lost,
+		(unsigned long long)errors);
+	fprintf(f, "  \"latency_ms\": {\n");
+	print_latency(f, "frequency", offsetof(bench_client_t, freq_lat));
+	fprintf(f, ",\n");
+	print_latency(f, "gain", offsetof(bench_client_t, gain_lat));
+	fprintf(f, "\n  },\n");
+
+	if (have_stats > STATS_CPU_US) {
+		cpu = (double)(s1[STATS_CPU_US] - s0[STATS_CPU_US]) / 1e6;
+		fprintf(f, "  \"server\": { \"cpu_s\": %.3f, \"cpu_percent\": %.2f, "
+			"\"cpu_percent_per_client\": %.2f, \"ring_dropped\": %llu, "
+			"\"client_dropped\": %llu, \"tx_mb\": %.3f },\n",
+			cpu, cpu / elapsed * 100, ok ? cpu / elapsed * 100 / ok : 0,
+			(unsigned long long)(s1[STATS_RING_DROPPED] - s0[STATS_RING_DROPPED]),
+			(unsigned long long)(s1[STATS_CLIENT_DROPPED] - s0[STATS_CLIENT_DROPPED]),
+			(double)(s1[STATS_TX_BYTES] - s0[STATS_TX_BYTES]) / 1e6);
+	} else {
+		fprintf(f, "  \"server\": null,\n");
+	}
+	fprintf(f, "  \"bench_cpu_percent\": %.2f,\n", (double)bench_cpu_us / 1e4 / elapsed);
+
+	fprintf(f, "  \"per_client\": [\n");
+	for (i = 0; i < num_clients; i++) {
+		cl = &clients[i];
+		fprintf(f, "    { \"id\": %d, \"commanding\": %s, \"error\": %s, "
+			"\"connect_ms\": %.3f, \"bytes\": %llu, \"mb_s\": %.3f, \"frames\": %llu, "
+			"\"dropped\": %llu, \"lost_flags\": %llu, \"counter_errors\": %llu }%s\n",
+			cl->id, cl->commanding ? "true" : "false", cl->error ? "true" : "false",
+			cl->connect_ms, (unsigned long long)cl->bytes,
+			client_seconds(cl) > 0 ? cl->bytes / client_seconds(cl) / 1e6 : 0,
+			(unsigned long long)cl->frames, (unsigned long long)cl->dropped,
+			(unsigned long long)cl->lost, (unsigned long long)cl->counter_errors,
+			i + 1 < num_clients ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t s0[STATS_NUM], s1[STATS_NUM];
+	uint64_t start, cpu0;
+	double elapsed;
+	SOCKET resp = INVALID_SOCKET;
+	int opt, i, have_stats = 0;
+	char *out = NULL, *p;
+	FILE *f = stdout;
+	void *status;
+#ifdef _WIN32
+	WSADATA wsd;
+	WSAStartup(MAKEWORD(2,2), &wsd);
+#else
+	struct sigaction sigact, sigign;
+#endif
+
+	while ((opt = getopt(argc, argv, "a:p:r:m:t:s:F:h:g:o:AcP")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			port_resp = atoi(optarg);
+			break;
+		case 'm':
+			num_clients = atoi(optarg);
+			if (num_clients < 1 || num_clients > MAX_CLIENTS)
+				usage();
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 's':
+			samp_rate = (uint32_t)atofs(optarg);
+			break;
+		case 'F':
+			for (p = strtok(optarg, ","); p && num_hops < MAX_HOPS; p = strtok(NULL, ","))
+				hops[num_hops++] = (uint32_t)atofs(p);
+			break;
+		case 'h':
+			hop_rate = atof(optarg);
+			break;
+		case 'g':
+			gain_rate = atof(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'A':
+			all_command = 1;
+			break;
+		case 'c':
+			check_counter = 1;
+			break;
+		case 'P':
+			use_framing = 0;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (duration <= 0)
+		usage();
+	if (!num_hops) {
+		hops[num_hops++] = 100000000;
+		hops[num_hops++] = 105000000;
+	}
+	if (port_resp == 1)
+		port_resp = port + 1;
+
+#ifndef _WIN32
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigign.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGPIPE, &sigign, NULL);
+#else
+	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
+#endif
+
+	if (port_resp) {
+		resp = connect_to(port_resp);
+		if (resp != INVALID_SOCKET)
+			have_stats = server_stats(resp, s0);
+		if (!have_stats)
+			fprintf(stderr, "no statistics from the response port %d, "
+					"the server CPU time is not reported\n", port_resp);
+	}
+
+	clients = calloc(num_clients, sizeof(bench_client_t));
+	if (!clients) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	cpu0 = stats_cpu_us();
+	start = stats_time_ns();
+	stop_ns = start + (uint64_t)(duration * 1e9);
+	for (i = 0; i < num_clients; i++) {
+		clients[i].id = i + 1;
+		clients[i].commanding = all_command || i == 0;
+		pthread_create(&clients[i].thread, NULL, client_worker, &clients[i]);
+	}
+	fprintf(stderr, "%d clients streaming from %s:%d for %g s\n",
+			num_clients, addr, port, duration);
+
+	while (!do_exit && stats_time_ns() < stop_ns)
+		sleep_ms(50);
+	elapsed = (double)(stats_time_ns() - start) / 1e9;
+	if (have_stats && server_stats(resp, s1) < have_stats)
+		have_stats = 0;
+	stop_ns = 0;
+	for (i = 0; i < num_clients; i++)
+		pthread_join(clients[i].thread, &status);
+
+	if (out) {
+		f = fopen(out, "w");
+		if (!f) {
+			fprintf(stderr, "failed to open %s\n", out);
+			f = stdout;
+		}
+	}
+	report(f, elapsed, s0, s1, have_stats, stats_cpu_us() - cpu0);
+	if (f != stdout)
+		fclose(f);
+
+	if (resp != INVALID_SOCKET)
+		closesocket(resp);
+	free(clients);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
@@ -46,6 +46,10 @@
 #define PPM_DURATION			10
 #define PPM_DUMP_TIME			5
 
+#define HOP_CHANNELS			64
+#define HOP_STEP				2000000
+#define HOP_ROUNDS				20
+
 struct time_generic
 /* holds all the platform specific values */
 {
@@ -64,7 +68,8 @@ struct time_generic
 static enum {
 	NO_BENCHMARK,
 	TUNER_BENCHMARK,
-	PPM_BENCHMARK
+	PPM_BENCHMARK,
+	HOP_BENCHMARK
 } test_mode = NO_BENCHMARK;
 
 static int do_exit = 0;
@@ -85,8 +90,11 @@ void usage(void)
 		"\t[-b number of buffers (default: 15, set by library)]\n"
 		"\t[-d device_index or serial (default: 0)]\n"
 		"\t[-l length of single buffer in units of 512 samples (default: 64)]\n"
+		"\t[-L latency in ms, size the buffers from it unless given by -b/-l]\n"
+		"\t[-N with -L: prefer no overruns over low CPU load]\n"
 		"\t[-s samplerate (default: 2048000 Hz)]\n"
 		"\t[-t enable Elonics E4000 tuner benchmark]\n"
+		"\t[-H enable retune benchmark, hops/s with and without hop table]\n"
 		"\t[-p[seconds] enable PPM error measurement (default: 10 seconds)]\n"
 		"\t[-S force sync output (default: async)]\n");
 	exit(1);
@@ -325,6 +333,51 @@ void r82xx_benchmark(void)
 
 }
 
+static double hop_elapsed(struct time_generic *start)
+{
+	struct time_generic now;
+
+	ppm_gettime(&now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void hop_benchmark(uint32_t first)
+{
+	uint32_t freqs[HOP_CHANNELS];
+	struct time_generic start;
+	int i, k, errors;
+	double t;
+
+	for (i = 0; i < HOP_CHANNELS; i++)
+		freqs[i] = first + i * HOP_STEP;
+
+	fprintf(stderr, "Benchmarking retunes over %d channels from %u Hz, %d rounds...\n",
+		HOP_CHANNELS, first, HOP_ROUNDS);
+
+	errors = 0;
+	ppm_gettime(&start);
+	for (k = 0; k < HOP_ROUNDS && !do_exit; k++)
+		for (i = 0; i < HOP_CHANNELS; i++)
+			errors += (rtlsdr_set_center_freq(dev, freqs[i]) != 0);
+	t = hop_elapsed(&start);
+	fprintf(stderr, "rtlsdr_set_center_freq: %.1f hops/s, %d failed\n",
+		k * HOP_CHANNELS / t, errors);
+
+	if (rtlsdr_set_hop_table(dev, freqs, HOP_CHANNELS) < 0)
+		fprintf(stderr, "WARNING: hop table not fully prepared.\n");
+
+	errors = 0;
+	ppm_gettime(&start);
+	for (k = 0; k < HOP_ROUNDS && !do_exit; k++)
+		for (i = 0; i < HOP_CHANNELS; i++)
+			errors += (rtlsdr_hop(dev, i) != 0);
+	t = hop_elapsed(&start);
+	fprintf(stderr, "rtlsdr_hop:             %.1f hops/s, %d failed\n",
+		k * HOP_CHANNELS / t, errors);
+
+	rtlsdr_set_hop_table(dev, NULL, 0);
+}
+
 int main(int argc, char **argv)
 {
 #ifndef _WIN32
@@ -337,11 +390,15 @@ int main(int argc, char **argv)
 	int dev_index = 0;
 	int dev_given = 0;
 	uint32_t buf_len = 64 * 512;
+	int len_given = 0;
+	uint32_t latency_ms = 0;
+	int prefer = RTLSDR_XFER_LOW_CPU;
+	rtlsdr_xfer_info_t xfer;
 	int count;
 	int gains[100];
 	int tuner_type;
 
-	while ((opt = getopt(argc, argv, "d:s:b:O:l:tp::Sh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:b:O:l:L:NtHp::Sh")) != -1) {
 		switch (opt) {
 		case 'b':
 			buf_num = atoi(optarg);
@@ -355,10 +412,20 @@ int main(int argc, char **argv)
 			break;
 		case 'l':
 			buf_len = 512 * atoi(optarg);
+			len_given = 1;
+			break;
+		case 'L':
+			latency_ms = atoi(optarg);
+			break;
+		case 'N':
+			prefer = RTLSDR_XFER_NO_OVERRUN;
 			break;
 		case 't':
 			test_mode = TUNER_BENCHMARK;
 			break;
+		case 'H':
+			test_mode = HOP_BENCHMARK;
+			break;
 		case 'p':
 			test_mode = PPM_BENCHMARK;
 			if (optarg)
@@ -427,6 +494,10 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
+	if (test_mode == HOP_BENCHMARK) {
+		hop_benchmark(MHZ(100));
+		goto exit;
+	}
 
 	/* Enable test mode */
 	r = rtlsdr_set_testmode(dev, 1);
@@ -464,7 +535,16 @@ int main(int argc, char **argv)
 		}
 	} else {
 		fprintf(stderr, "Reading samples in async mode...\n");
+		if (latency_ms) {
+			rtlsdr_set_xfer_policy(dev, latency_ms * 1000, prefer);
+			if (!len_given)
+				buf_len = 0;
+		}
 		r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, buf_len);
+		if (!rtlsdr_get_xfer_info(dev, &xfer))
+			fprintf(stderr, "Transfers: %u x %u bytes, completion jitter "
+					"%u us mean, %u us max\n", xfer.buf_num,
+					xfer.buf_len, xfer.jitter_avg_us, xfer.jitter_max_us);
 	}
 
 	if (do_exit) {
@@ -429,7 +429,8 @@ void *ir_thread_fn(void *arg)
 		printf("IR client accepted!\n");
 
 		while(1) {
-		    ret = rtlsdr_ir_query(dev, buf, sizeof(buf));
+		    /* queued behind retunes and register sampling */
+		    ret = rtlsdr_ctrl_call(dev, RTLSDR_OP_IR_QUERY, 0, buf, sizeof(buf));
 		    if (ret < 0) {
 			printf("rtlsdr_ir_query error %d\n", ret);
 			break;
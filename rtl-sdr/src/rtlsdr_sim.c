@@ -0,0 +1,452 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+#include <pthread.h>
+
+#include "rtlsdr_atomic.h"
+#include "rtlsdr_sim.h"
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+#define SIM_MAX_SIGNALS	8
+#define SIM_SERIAL_LEN	256
+#define SIM_DEMOD_PAGES	16
+#define SIM_DEMOD_ADDR	0x20	/* RTL2832_DEMOD_ADDR */
+
+#define SIM_AUDIO_HZ	1000.0
+#define SIM_FM_DEV	75000.0
+#define SIM_AM_DEPTH	0.5
+
+#define ADSB_FREQ	1090000000
+#define ADSB_PERIOD_US	10000
+#define ADSB_BITS	112
+#define ADSB_LEN_US	(8 + ADSB_BITS)
+/* DF17 identification squitter, valid parity */
+#define ADSB_FRAME	"8D4840D6202CC371C32CE0576098"
+
+enum sim_kind {
+	SIM_TONE,
+	SIM_FM,
+	SIM_AM,
+	SIM_ADSB
+};
+
+struct sim_signal {
+	enum sim_kind kind;
+	int relative;		/* freq is an offset from the center */
+	double freq;		/* Hz */
+	double amp;		/* of full scale */
+	double phase;		/* radians */
+	double audio;		/* phase of the modulating tone */
+};
+
+struct rtlsdr_sim {
+	struct sim_signal sig[SIM_MAX_SIGNALS];
+	int num_sig;
+	double noise;		/* rms, of full scale */
+	int counter;
+	int fast;
+	uint32_t settle_us;
+	uint32_t tune_us;
+	uint64_t rng;
+	uint8_t adsb[ADSB_BITS];
+
+	uint8_t demod[SIM_DEMOD_PAGES][256];
+
+	volatile uint32_t freq;	/* Hz */
+	volatile uint32_t retuned;
+	volatile uint32_t gain;	/* tenth dB */
+	volatile uint32_t manual;
+
+	uint64_t pos;		/* samples generated */
+	uint64_t settle_end;	/* signals are muted up to here */
+	uint8_t count;		/* next byte of the counter */
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static char sim_serials[RTLSDR_SIM_MAX][SIM_SERIAL_LEN];
+
+int rtlsdr_sim_register(const char *serial)
+{
+	int i, r = -1;
+
+	if (!serial || strncmp(serial, RTLSDR_SIM_PREFIX, strlen(RTLSDR_SIM_PREFIX)) ||
+	    strlen(serial) >= SIM_SERIAL_LEN)
+		return -1;
+
+	pthread_mutex_lock(&sim_lock);
+	for (i = 0; i < RTLSDR_SIM_MAX; i++) {
+		if (!sim_serials[i][0] || !strcmp(sim_serials[i], serial)) {
+			strcpy(sim_serials[i], serial);
+			r = RTLSDR_SIM_INDEX + i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return r;
+}
+
+const char *rtlsdr_sim_serial(uint32_t index)
+{
+	const char *serial = NULL;
+
+	if (index < RTLSDR_SIM_INDEX || index >= RTLSDR_SIM_INDEX + RTLSDR_SIM_MAX)
+		return NULL;
+
+	pthread_mutex_lock(&sim_lock);
+	if (sim_serials[index - RTLSDR_SIM_INDEX][0])
+		serial = sim_serials[index - RTLSDR_SIM_INDEX];
+	pthread_mutex_unlock(&sim_lock);
+
+	return serial;
+}
+
+/* "100.1M", "+250k", "-1e3" */
+static double sim_parse_freq(const char *s, char **end, int *relative)
+{
+	double f;
+
+	*relative = (*s == '+' || *s == '-');
+	f = strtod(s, end);
+	switch (**end) {
+	case 'k': case 'K': f *= 1e3; (*end)++; break;
+	case 'M': f *= 1e6; (*end)++; break;
+	case 'G': f *= 1e9; (*end)++; break;
+	}
+	return f;
+}
+
+static double sim_amp(double db)
+{
+	return pow(10.0, db / 20.0);
+}
+
+static int sim_add_signal(rtlsdr_sim_t *sim, enum sim_kind kind, const char *val)
+{
+	struct sim_signal *s;
+	char *end;
+
+	if (sim->num_sig >= SIM_MAX_SIGNALS)
+		return -1;
+
+	s = &sim->sig[sim->num_sig++];
+	memset(s, 0, sizeof(*s));
+	s->kind = kind;
+	s->amp = sim_amp(kind == SIM_ADSB ? -10.0 : -20.0);
+
+	if (kind == SIM_ADSB) {
+		s->freq = ADSB_FREQ;
+		end = (char *)val;
+	} else {
+		if (!val)
+			return -1;
+		s->freq = sim_parse_freq(val, &end, &s->relative);
+	}
+	if (end && *end == '@')
+		s->amp = sim_amp(strtod(end + 1, &end));
+
+	return (end && *end) ? -1 : 0;
+}
+
+static int sim_parse(rtlsdr_sim_t *sim, const char *opts)
+{
+	char buf[SIM_SERIAL_LEN];
+	char *tok, *val, *next;
+	int r = 0;
+
+	strncpy(buf, opts, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = buf; tok && *tok && !r; tok = next) {
+		next = strchr(tok, ',');
+		if (next)
+			*next++ = '\0';
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+
+		if (!strcmp(tok, "tone"))
+			r = sim_add_signal(sim, SIM_TONE, val);
+		else if (!strcmp(tok, "fm"))
+			r = sim_add_signal(sim, SIM_FM, val);
+		else if (!strcmp(tok, "am"))
+			r = sim_add_signal(sim, SIM_AM, val);
+		else if (!strcmp(tok, "adsb"))
+			r = sim_add_signal(sim, SIM_ADSB, val);
+		else if (!strcmp(tok, "noise") && val)
+			sim->noise = sim_amp(atof(val));
+		else if (!strcmp(tok, "counter"))
+			sim->counter = 1;
+		else if (!strcmp(tok, "fast"))
+			sim->fast = 1;
+		else if (!strcmp(tok, "settle") && val)
+			sim->settle_us = (uint32_t)atoi(val);
+		else if (!strcmp(tok, "tune") && val)
+			sim->tune_us = (uint32_t)atoi(val);
+		else if (!strcmp(tok, "seed") && val)
+			sim->rng = strtoull(val, NULL, 0) | 1;
+		else
+			r = -1;
+
+		if (r)
+			fprintf(stderr, "Invalid option of virtual device: %s\n", tok);
+	}
+
+	return r;
+}
+
+rtlsdr_sim_t *rtlsdr_sim_open(const char *serial)
+{
+	rtlsdr_sim_t *sim;
+	const char *opts;
+	unsigned int i, byte;
+
+	if (!serial || strncmp(serial, RTLSDR_SIM_PREFIX, strlen(RTLSDR_SIM_PREFIX)))
+		return NULL;
+	opts = serial + strlen(RTLSDR_SIM_PREFIX);
+
+	sim = calloc(1, sizeof(rtlsdr_sim_t));
+	if (!sim)
+		return NULL;
+
+	sim->noise = sim_amp(-40.0);
+	sim->settle_us = 1000;
+	sim->tune_us = 300;
+	sim->rng = 0x9e3779b97f4a7c15ULL;
+	sim->gain = 300;
+
+	if (!*opts)
+		sim_add_signal(sim, SIM_TONE, "+100k");
+	else if (sim_parse(sim, opts) < 0) {
+		free(sim);
+		return NULL;
+	}
+
+	for (i = 0; i < ADSB_BITS; i++) {
+		sscanf(&ADSB_FRAME[(i / 8) * 2], "%2x", &byte);
+		sim->adsb[i] = (byte >> (7 - i % 8)) & 1;
+	}
+
+	return sim;
+}
+
+void rtlsdr_sim_close(rtlsdr_sim_t *sim)
+{
+	free(sim);
+}
+
+int rtlsdr_sim_control(rtlsdr_sim_t *sim, uint8_t type, uint16_t value,
+		       uint16_t index, unsigned char *data, uint16_t len)
+{
+	uint16_t addr = value >> 8;
+	uint8_t page = index & 0x0f;
+	int in = (type & 0x80) != 0;
+
+	/* only the demod registers are kept, test mode is read from them */
+	if ((value & 0xff) != SIM_DEMOD_ADDR || index >= 0x100 ||
+	    addr + len > 256) {
+		if (in)
+			memset(data, 0, len);
+		return len;
+	}
+
+	if (in)
+		memcpy(data, &sim->demod[page][addr], len);
+	else
+		memcpy(&sim->demod[page][addr], data, len);
+
+	return len;
+}
+
+/* xorshift64*, uniform in [-1, 1) */
+static double sim_uniform(rtlsdr_sim_t *sim)
+{
+	uint64_t x = sim->rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sim->rng = x;
+	return (double)((x * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 52) - 1.0;
+}
+
+/* sum of three uniforms, unit variance */
+static double sim_gauss(rtlsdr_sim_t *sim)
+{
+	return sim_uniform(sim) + sim_uniform(sim) + sim_uniform(sim);
+}
+
+/* on/off keying of a squitter, t in us from its start */
+static int sim_adsb_on(rtlsdr_sim_t *sim, double t)
+{
+	int bit;
+
+	if (t < 8.0)
+		return (t < 0.5) || (t >= 1.0 && t < 1.5) ||
+			(t >= 3.5 && t < 4.0) || (t >= 4.5 && t < 5.0);
+	bit = (int)(t - 8.0);
+	if (bit >= ADSB_BITS)
+		return 0;
+	return ((t - 8.0 - bit) < 0.5) == sim->adsb[bit];
+}
+
+static uint8_t sim_quantize(double v)
+{
+	v = 127.5 + 127.5 * v;
+	if (v < 0.0)
+		return 0;
+	if (v > 255.0)
+		return 255;
+	return (uint8_t)(v + 0.5);
+}
+
+void rtlsdr_sim_read(rtlsdr_sim_t *sim, uint32_t rate, unsigned char *buf, uint32_t len)
+{
+	struct sim_signal *s;
+	double center, off, scale, t, i_acc, q_acc, a;
+	double step[SIM_MAX_SIGNALS], audio_step;
+	int visible[SIM_MAX_SIGNALS];
+	uint32_t n, k;
+	int j, muted;
+
+	if (!rate)
+		rate = 2048000;
+
+	if (rtlsdr_atomic_xchg(&sim->retuned, 0))
+		sim->settle_end = sim->pos + (uint64_t)sim->settle_us * rate / 1000000;
+
+	/* the demod outputs a counter in test mode */
+	if (sim->counter || (sim->demod[0][0x19] & 0x02)) {
+		for (n = 0; n < len; n++) {
+			if (buf)
+				buf[n] = sim->count;
+			sim->count++;
+		}
+		sim->pos += len / 2;
+		return;
+	}
+
+	center = (double)rtlsdr_atomic_load(&sim->freq);
+	scale = rtlsdr_atomic_load(&sim->manual) ?
+		pow(10.0, ((double)(int)rtlsdr_atomic_load(&sim->gain) - 300.0) / 200.0) : 1.0;
+	audio_step = 2.0 * M_PI * SIM_AUDIO_HZ / rate;
+
+	for (j = 0; j < sim->num_sig; j++) {
+		s = &sim->sig[j];
+		off = s->relative ? s->freq : s->freq - center;
+		/* outside of the passband */
+		visible[j] = fabs(off) < rate / 2.0;
+		step[j] = 2.0 * M_PI * off / rate;
+	}
+
+	for (n = 0, k = 0; n + 1 < len; n += 2, k++) {
+		i_acc = sim->noise * sim_gauss(sim);
+		q_acc = sim->noise * sim_gauss(sim);
+		muted = (sim->pos + k) < sim->settle_end;
+
+		for (j = 0; j < sim->num_sig; j++) {
+			s = &sim->sig[j];
+			a = s->amp;
+			switch (s->kind) {
+			case SIM_FM:
+				s->audio += audio_step;
+				s->phase += step[j] + 2.0 * M_PI * SIM_FM_DEV * sin(s->audio) / rate;
+				break;
+			case SIM_AM:
+				s->audio += audio_step;
+				a *= 1.0 + SIM_AM_DEPTH * sin(s->audio);
+				s->phase += step[j];
+				break;
+			case SIM_ADSB:
+				t = (double)((sim->pos + k) % ((uint64_t)rate * ADSB_PERIOD_US / 1000000)) *
+					1e6 / rate;
+				if (t >= ADSB_LEN_US || !sim_adsb_on(sim, t))
+					a = 0.0;
+				s->phase += step[j];
+				break;
+			default:
+				s->phase += step[j];
+				break;
+			}
+			if (s->phase > M_PI || s->phase < -M_PI)
+				s->phase = fmod(s->phase, 2.0 * M_PI);
+			if (s->audio > 2.0 * M_PI)
+				s->audio -= 2.0 * M_PI;
+			if (!visible[j] || muted)
+				continue;
+			i_acc += a * cos(s->phase);
+			q_acc += a * sin(s->phase);
+		}
+
+		if (buf) {
+			buf[n] = sim_quantize(scale * i_acc);
+			buf[n + 1] = sim_quantize(scale * q_acc);
+		}
+	}
+
+	sim->pos += len / 2;
+}
+
+int rtlsdr_sim_realtime(rtlsdr_sim_t *sim)
+{
+	return !sim->fast;
+}
+
+uint32_t rtlsdr_sim_settle_us(rtlsdr_sim_t *sim)
+{
+	return sim->settle_us;
+}
+
+int rtlsdr_sim_set_freq(rtlsdr_sim_t *sim, uint32_t freq)
+{
+	/* the PLL of the tuner is being programmed meanwhile */
+	if (sim->tune_us)
+#ifdef _WIN32
+		Sleep((sim->tune_us + 999) / 1000);
+#else
+		usleep(sim->tune_us);
+#endif
+
+	rtlsdr_atomic_store(&sim->freq, freq);
+	rtlsdr_atomic_store(&sim->retuned, 1);
+	return 0;
+}
+
+int rtlsdr_sim_set_gain(rtlsdr_sim_t *sim, int gain)
+{
+	rtlsdr_atomic_store(&sim->gain, (uint32_t)gain);
+	return 0;
+}
+
+int rtlsdr_sim_set_gain_mode(rtlsdr_sim_t *sim, int manual)
+{
+	rtlsdr_atomic_store(&sim->manual, (uint32_t)manual);
+	return 0;
+}
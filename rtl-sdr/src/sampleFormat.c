@@ -0,0 +1,279 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sampleFormat.h"
+
+#define CONV_HASH	64
+
+const char *sample_format_names[SAMPLE_FORMAT_NUM] = { "CU8", "CS16", "CS8", "CF32" };
+
+struct sample_conv
+{
+	uint32_t seq;
+	int refs;
+	uint32_t len;
+	unsigned char *data;
+	struct sample_conv *hnext;	/* hash chain */
+	struct sample_conv *newer;	/* idle list */
+	struct sample_conv *older;
+};
+
+struct sample_conv_cache
+{
+	int format;
+	uint32_t max_len;
+	uint32_t max_idle;
+	sample_conv_t *hash[CONV_HASH];
+	sample_conv_t *newest;	/* idle entries, newest evicted last */
+	sample_conv_t *oldest;
+	uint32_t num_idle;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+uint32_t sample_format_size(int format)
+{
+	switch (format) {
+	case SAMPLE_FORMAT_CU8:
+	case SAMPLE_FORMAT_CS8:
+		return 1;
+	case SAMPLE_FORMAT_CS16:
+		return 2;
+	case SAMPLE_FORMAT_CF32:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The kernels are simple element wise loops over unsigned char, short and
+ * float arrays, which the compiler vectorizes. Writing the 16 bit and float
+ * values in host byte order matches the little endian wire format on all
+ * platforms rtl_tcp runs on.
+ */
+void sample_format_convert(int format, const unsigned char *in, uint32_t len, void *out)
+{
+	unsigned char *o8 = (unsigned char *)out;
+	int16_t *o16 = (int16_t *)out;
+	float *of = (float *)out;
+	uint32_t k;
+
+	switch (format) {
+	case SAMPLE_FORMAT_CU8:
+		memcpy(out, in, len);
+		break;
+	case SAMPLE_FORMAT_CS8:
+		for (k = 0; k < len; k++)
+			o8[k] = in[k] ^ 0x80;
+		break;
+	case SAMPLE_FORMAT_CS16:
+		for (k = 0; k < len; k++)
+			o16[k] = (int16_t)(in[k] * 256 - 32640);
+		break;
+	case SAMPLE_FORMAT_CF32:
+		for (k = 0; k < len; k++)
+			of[k] = in[k] * (1.0f / 128) - (127.5f / 128);
+		break;
+	}
+}
+
+static int clamp_round(float v, int lo, int hi)
+{
+	int r = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+
+	return r < lo ? lo : (r > hi ? hi : r);
+}
+
+void sample_format_from_float(int format, const float *i, const float *q, uint32_t n, void *out)
+{
+	unsigned char *o8 = (unsigned char *)out;
+	int16_t *o16 = (int16_t *)out;
+	float *of = (float *)out;
+	uint32_t k;
+
+	switch (format) {
+	case SAMPLE_FORMAT_CU8:
+		for (k = 0; k < n; k++) {
+			o8[2 * k] = (unsigned char)clamp_round(i[k] + 127.5f, 0, 255);
+			o8[2 * k + 1] = (unsigned char)clamp_round(q[k] + 127.5f, 0, 255);
+		}
+		break;
+	case SAMPLE_FORMAT_CS8:
+		for (k = 0; k < n; k++) {
+			o8[2 * k] = (unsigned char)clamp_round(i[k], -128, 127);
+			o8[2 * k + 1] = (unsigned char)clamp_round(q[k], -128, 127);
+		}
+		break;
+	case SAMPLE_FORMAT_CS16:
+		for (k = 0; k < n; k++) {
+			o16[2 * k] = (int16_t)clamp_round(i[k] * 256.0f, -32768, 32767);
+			o16[2 * k + 1] = (int16_t)clamp_round(q[k] * 256.0f, -32768, 32767);
+		}
+		break;
+	case SAMPLE_FORMAT_CF32:
+		for (k = 0; k < n; k++) {
+			of[2 * k] = i[k] * (1.0f / 128);
+			of[2 * k + 1] = q[k] * (1.0f / 128);
+		}
+		break;
+	}
+}
+
+sample_conv_cache_t *sample_conv_cache_create(int format, uint32_t max_len, uint32_t max_idle)
+{
+	sample_conv_cache_t *cache;
+
+	if (!sample_format_size(format))
+		return NULL;
+
+	cache = calloc(1, sizeof(sample_conv_cache_t));
+	if (!cache)
+		return NULL;
+
+	cache->format = format;
+	cache->max_len = max_len;
+	cache->max_idle = max_idle;
+	return cache;
+}
+
+static void idle_unlink(sample_conv_cache_t *cache, sample_conv_t *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		cache->newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		cache->oldest = e->newer;
+	e->newer = e->older = NULL;
+	cache->num_idle--;
+}
+
+static void hash_unlink(sample_conv_cache_t *cache, sample_conv_t *e)
+{
+	sample_conv_t **p = &cache->hash[e->seq % CONV_HASH];
+
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+}
+
+static void conv_free(sample_conv_t *e)
+{
+	free(e->data);
+	free(e);
+}
+
+void sample_conv_cache_destroy(sample_conv_cache_t *cache)
+{
+	sample_conv_t *e, *next;
+	uint32_t h;
+
+	if (!cache)
+		return;
+
+	/* referenced entries are owned by the cache as well */
+	for (h = 0; h < CONV_HASH; h++) {
+		for (e = cache->hash[h]; e; e = next) {
+			next = e->hnext;
+			conv_free(e);
+		}
+	}
+	free(cache);
+}
+
+sample_conv_t *sample_conv_get(sample_conv_cache_t *cache, uint32_t seq,
+			       const unsigned char *in, uint32_t len)
+{
+	sample_conv_t *e;
+
+	for (e = cache->hash[seq % CONV_HASH]; e; e = e->hnext) {
+		if (e->seq == seq) {
+			if (!e->refs++)
+				idle_unlink(cache, e);
+			cache->hits++;
+			return e;
+		}
+	}
+
+	if (len > cache->max_len)
+		len = cache->max_len;
+
+	if (cache->num_idle && cache->num_idle >= cache->max_idle) {
+		/* recycle the entry unused for the longest time */
+		e = cache->oldest;
+		idle_unlink(cache, e);
+		hash_unlink(cache, e);
+	} else {
+		e = calloc(1, sizeof(sample_conv_t));
+		if (!e)
+			return NULL;
+		e->data = malloc((size_t)cache->max_len * sample_format_size(cache->format));
+		if (!e->data) {
+			free(e);
+			return NULL;
+		}
+	}
+
+	sample_format_convert(cache->format, in, len, e->data);
+	e->seq = seq;
+	e->refs = 1;
+	e->len = len * sample_format_size(cache->format);
+	e->hnext = cache->hash[seq % CONV_HASH];
+	cache->hash[seq % CONV_HASH] = e;
+	cache->misses++;
+	return e;
+}
+
+unsigned char *sample_conv_data(sample_conv_t *conv, uint32_t *len)
+{
+	*len = conv->len;
+	return conv->data;
+}
+
+void sample_conv_put(sample_conv_cache_t *cache, sample_conv_t *conv)
+{
+	if (--conv->refs)
+		return;
+
+	conv->older = cache->newest;
+	conv->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = conv;
+	else
+		cache->oldest = conv;
+	cache->newest = conv;
+	cache->num_idle++;
+
+	if (cache->num_idle > cache->max_idle) {
+		conv = cache->oldest;
+		idle_unlink(cache, conv);
+		hash_unlink(cache, conv);
+		conv_free(conv);
+	}
+}
+
+void sample_conv_cache_stats(sample_conv_cache_t *cache, uint32_t *hits, uint32_t *misses)
+{
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
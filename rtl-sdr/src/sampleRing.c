@@ -0,0 +1,602 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#else
+#include <winsock2.h>
+#include <malloc.h>
+#endif
+
+#ifdef NEED_PTHREADS_WORKARROUND
+#define HAVE_STRUCT_TIMESPEC
+#endif
+#include <pthread.h>
+
+#include "rtl-sdr.h"
+#include "rtlsdr_atomic.h"
+#include "sampleRing.h"
+#include "convenience/convenience.h"
+
+#define PAD(n)	(RTLSDR_CACHE_LINE - (n) * sizeof(uint32_t))
+
+#define NO_BUF		0xffffffff
+#define DETACHED	0x80000000
+/* odd for valid buffers, so an invalidated stamp (0) never matches */
+#define STAMP(seq)	(((seq) << 1) | 1)
+
+/*
+ * Sequence numbers run freely and wrap at 2^32, slots[seq & mask] holds the
+ * index of the buffer carrying sequence number seq, as long as
+ * head - num_slots <= seq < head.
+ *
+ * The ring owns num_slots + spare buffers. A reader pins a buffer by
+ * incrementing refs and then checking that the stamp still matches the
+ * sequence number it is looking for. The producer first clears the stamp
+ * of the buffer it is about to overwrite and then checks refs: if the
+ * buffer is pinned, it is marked DETACHED and replaced by a spare buffer.
+ * The reader dropping the last reference to a detached buffer returns it
+ * to free_list, which the producer takes over as a whole.
+ *
+ * Buffers pushed with sample_ring_push_ref() are not copied: data points
+ * into the producer's memory and handle is passed to the release callback
+ * once the buffer is overwritten or the last reader unpinned it.
+ */
+struct ring_buf
+{
+	volatile uint32_t refs;
+	volatile uint32_t stamp;
+	uint32_t len;
+	uint32_t next;
+	unsigned char *data;
+	void *handle;
+	sample_ring_meta_t meta;
+};
+
+struct sample_ring_reader
+{
+	sample_ring_t *ring;
+	int in_use;
+	volatile uint32_t cursor;	/* next buffer to claim */
+	volatile uint32_t first;	/* oldest claimed buffer */
+	uint32_t num_pins;
+	uint32_t *pins;
+	volatile uint32_t high_water;
+	volatile uint32_t dropped;
+	volatile uint32_t sent;
+};
+
+struct sample_ring
+{
+	/* producer */
+	volatile uint32_t head;
+	uint32_t spare;
+	uint32_t lost;		/* SAMPLE_RING_LOST for the next buffer */
+	uint8_t pad0[PAD(3)];
+
+	/* buffers handed back by the readers */
+	volatile uint32_t free_list;
+	uint8_t pad1[PAD(1)];
+
+	/* set by sleeping readers */
+	volatile uint32_t waiting;
+	uint8_t pad2[PAD(1)];
+
+	volatile uint32_t dropped;
+	uint32_t num_slots;
+	uint32_t mask;
+	uint32_t num_bufs;
+	uint32_t slot_len;
+	uint32_t stride;
+	uint32_t max_readers;
+	uint32_t max_claim;
+	uint32_t *slots;
+	struct ring_buf *bufs;
+	unsigned char *mem;
+	struct sample_ring_reader *readers;
+	uint32_t *pins;
+
+	sample_ring_notify_cb notify;
+	void *notify_ctx;
+	sample_ring_release_cb release;
+	void *release_ctx;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *aligned_alloc_cl(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, RTLSDR_CACHE_LINE);
+#else
+	void *p = NULL;
+
+	if (posix_memalign(&p, RTLSDR_CACHE_LINE, size))
+		return NULL;
+	return p;
+#endif
+}
+
+static void aligned_free_cl(void *p)
+{
+	if (!p)
+		return;
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+sample_ring_t *sample_ring_create(uint32_t num_slots, uint32_t slot_len,
+				  uint32_t max_readers, uint32_t max_claim)
+{
+	sample_ring_t *ring;
+	uint32_t i, n = 2;
+
+	if (!max_readers)
+		return NULL;
+	if (!max_claim)
+		max_claim = 1;
+
+	while (n < num_slots && n < 0x10000)
+		n <<= 1;
+
+	ring = aligned_alloc_cl(sizeof(sample_ring_t));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(sample_ring_t));
+
+	ring->num_slots = n;
+	ring->mask = n - 1;
+	/* every buffer pinned by a reader needs a spare, plus one in flight */
+	ring->num_bufs = n + max_readers * max_claim + 1;
+	ring->slot_len = slot_len;
+	ring->stride = (slot_len + RTLSDR_CACHE_LINE - 1) & ~(RTLSDR_CACHE_LINE - 1);
+	ring->max_readers = max_readers;
+	ring->max_claim = max_claim;
+
+	ring->slots = calloc(n, sizeof(uint32_t));
+	ring->bufs = calloc(ring->num_bufs, sizeof(struct ring_buf));
+	ring->readers = calloc(max_readers, sizeof(struct sample_ring_reader));
+	ring->pins = calloc(max_readers * max_claim, sizeof(uint32_t));
+	if (slot_len)
+		ring->mem = aligned_alloc_cl((size_t)ring->num_bufs * ring->stride);
+	if (!ring->slots || !ring->bufs || !ring->readers || !ring->pins ||
+			(slot_len && !ring->mem)) {
+		free(ring->slots);
+		free(ring->bufs);
+		free(ring->readers);
+		free(ring->pins);
+		aligned_free_cl(ring->mem);
+		aligned_free_cl(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < max_readers; i++) {
+		ring->readers[i].ring = ring;
+		ring->readers[i].pins = ring->pins + i * max_claim;
+	}
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	sample_ring_reset(ring);
+
+	return ring;
+}
+
+static void release_buf(sample_ring_t *ring, struct ring_buf *b)
+{
+	if (b->handle) {
+		ring->release(b->handle, ring->release_ctx);
+		b->handle = NULL;
+	}
+}
+
+void sample_ring_destroy(sample_ring_t *ring)
+{
+	uint32_t i;
+
+	if (!ring)
+		return;
+
+	for (i = 0; i < ring->num_bufs; i++)
+		release_buf(ring, &ring->bufs[i]);
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	aligned_free_cl(ring->mem);
+	free(ring->pins);
+	free(ring->readers);
+	free(ring->bufs);
+	free(ring->slots);
+	aligned_free_cl(ring);
+}
+
+void sample_ring_reset(sample_ring_t *ring)
+{
+	uint32_t i;
+
+	for (i = 0; i < ring->num_bufs; i++) {
+		release_buf(ring, &ring->bufs[i]);
+		ring->bufs[i].refs = 0;
+		ring->bufs[i].stamp = 0;
+		ring->bufs[i].len = 0;
+		ring->bufs[i].next = (i + 1 < ring->num_bufs) ? i + 1 : NO_BUF;
+		ring->bufs[i].data = ring->mem ? ring->mem + (size_t)i * ring->stride : NULL;
+	}
+	for (i = 0; i < ring->num_slots; i++)
+		ring->slots[i] = i;
+
+	ring->head = 0;
+	ring->spare = ring->num_slots;
+	ring->lost = 0;
+	ring->free_list = NO_BUF;
+	ring->waiting = 0;
+	ring->dropped = 0;
+}
+
+static uint32_t spare_get(sample_ring_t *ring)
+{
+	uint32_t idx;
+
+	if (ring->spare == NO_BUF)
+		ring->spare = rtlsdr_atomic_xchg(&ring->free_list, NO_BUF);
+
+	idx = ring->spare;
+	if (idx != NO_BUF)
+		ring->spare = ring->bufs[idx].next;
+	return idx;
+}
+
+static void spare_put(sample_ring_t *ring, uint32_t idx)
+{
+	ring->bufs[idx].next = ring->spare;
+	ring->spare = idx;
+}
+
+static int push_buf(sample_ring_t *ring, const unsigned char *buf, uint32_t len,
+		    void *handle, const sample_ring_meta_t *meta)
+{
+	uint32_t seq = ring->head;
+	uint32_t slot = seq & ring->mask;
+	uint32_t cur = ring->slots[slot];
+	uint32_t use = cur;
+	uint32_t stamp, refs;
+	struct ring_buf *b = &ring->bufs[cur];
+
+	/* invalidate before looking at refs, see pin_buf() */
+	stamp = rtlsdr_atomic_xchg(&b->stamp, 0);
+	refs = rtlsdr_atomic_load(&b->refs);
+	if (refs) {
+		use = spare_get(ring);
+		if (use == NO_BUF) {
+			/* should not happen with max_claim respected */
+			rtlsdr_atomic_store(&b->stamp, stamp);
+			rtlsdr_atomic_add(&ring->dropped, 1);
+			ring->lost = SAMPLE_RING_LOST;
+			if (handle)
+				ring->release(handle, ring->release_ctx);
+			return -1;
+		}
+		while (refs && !rtlsdr_atomic_cas(&b->refs, refs, refs | DETACHED))
+			refs = rtlsdr_atomic_load(&b->refs);
+		if (!refs) {
+			/* unpinned meanwhile, overwrite it after all */
+			spare_put(ring, use);
+			use = cur;
+		}
+	}
+
+	b = &ring->bufs[use];
+	if (handle) {
+		release_buf(ring, b);
+		b->data = (unsigned char *)buf;
+		b->handle = handle;
+	} else {
+		if (len > ring->slot_len)
+			len = ring->slot_len;
+		memcpy(b->data, buf, len);
+	}
+	b->len = len;
+	if (meta)
+		b->meta = *meta;
+	else
+		memset(&b->meta, 0, sizeof(b->meta));
+	b->meta.flags |= ring->lost;
+	ring->lost = 0;
+	rtlsdr_atomic_store(&b->stamp, STAMP(seq));
+	if (use != cur)
+		rtlsdr_atomic_store(&ring->slots[slot], use);
+	rtlsdr_atomic_store(&ring->head, seq + 1);
+
+	/* only signal if a reader went to sleep */
+	if (rtlsdr_atomic_xchg(&ring->waiting, 0)) {
+		if (ring->notify)
+			ring->notify(ring->notify_ctx);
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	return 0;
+}
+
+int sample_ring_push(sample_ring_t *ring, const unsigned char *buf, uint32_t len,
+		     const sample_ring_meta_t *meta)
+{
+	return push_buf(ring, buf, len, NULL, meta);
+}
+
+int sample_ring_push_ref(sample_ring_t *ring, unsigned char *buf, uint32_t len,
+			 void *handle, const sample_ring_meta_t *meta)
+{
+	return push_buf(ring, buf, len, handle, meta);
+}
+
+static void unpin_buf(sample_ring_t *ring, uint32_t idx)
+{
+	struct ring_buf *b = &ring->bufs[idx];
+	uint32_t head;
+
+	if (rtlsdr_atomic_add(&b->refs, (uint32_t)-1) != DETACHED ||
+			!rtlsdr_atomic_cas(&b->refs, DETACHED, 0))
+		return;
+
+	/* last reference to a buffer the producer has replaced */
+	release_buf(ring, b);
+	do {
+		head = rtlsdr_atomic_load(&ring->free_list);
+		b->next = head;
+	} while (!rtlsdr_atomic_cas(&ring->free_list, head, idx));
+}
+
+static uint32_t pin_buf(sample_ring_t *ring, uint32_t seq)
+{
+	uint32_t idx = rtlsdr_atomic_load(&ring->slots[seq & ring->mask]);
+
+	rtlsdr_atomic_add(&ring->bufs[idx].refs, 1);
+	if (rtlsdr_atomic_load(&ring->bufs[idx].stamp) != STAMP(seq)) {
+		/* overwritten, or being overwritten right now */
+		unpin_buf(ring, idx);
+		return NO_BUF;
+	}
+	return idx;
+}
+
+sample_ring_reader_t *sample_ring_attach(sample_ring_t *ring)
+{
+	sample_ring_reader_t *reader = NULL;
+	uint32_t i;
+
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < ring->max_readers; i++) {
+		if (!ring->readers[i].in_use) {
+			reader = &ring->readers[i];
+			reader->in_use = 1;
+			reader->cursor = rtlsdr_atomic_load(&ring->head);
+			reader->first = reader->cursor;
+			reader->num_pins = 0;
+			reader->high_water = 0;
+			reader->dropped = 0;
+			reader->sent = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return reader;
+}
+
+void sample_ring_detach(sample_ring_reader_t *reader)
+{
+	sample_ring_t *ring = reader->ring;
+
+	sample_ring_release(reader, reader->first + reader->num_pins);
+
+	pthread_mutex_lock(&ring->lock);
+	reader->in_use = 0;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+uint32_t sample_ring_rewind(sample_ring_reader_t *reader, uint32_t n)
+{
+	sample_ring_t *ring = reader->ring;
+	uint32_t head = rtlsdr_atomic_load(&ring->head);
+	uint32_t lag = head - reader->cursor;
+	uint32_t max;
+
+	if (reader->num_pins || reader->sent || reader->dropped || reader->cursor != reader->first)
+		return 0;
+	/* one slot of margin, the producer may be overwriting the oldest one */
+	max = lag + 1 < ring->num_slots ? ring->num_slots - 1 - lag : 0;
+	/* not more than were pushed since the reset */
+	if (head < ring->num_slots && max > reader->cursor)
+		max = reader->cursor;
+	if (n > max)
+		n = max;
+	reader->cursor -= n;
+	reader->first = reader->cursor;
+	return n;
+}
+
+uint32_t sample_ring_claim(sample_ring_reader_t *reader, uint32_t max, uint32_t *first)
+{
+	sample_ring_t *ring = reader->ring;
+	uint32_t head = rtlsdr_atomic_load(&ring->head);
+	uint32_t cursor = reader->cursor;
+	uint32_t lag = head - cursor;
+	uint32_t idx, n = reader->num_pins;
+
+	if (max > ring->max_claim)
+		max = ring->max_claim;
+
+	if (!n) {
+		if (lag > ring->num_slots) {
+			/* overwritten already, skip to the oldest buffer still queued */
+			rtlsdr_atomic_add(&reader->dropped, lag - ring->num_slots);
+			cursor += lag - ring->num_slots;
+			lag = ring->num_slots;
+		}
+		if (lag > reader->high_water)
+			reader->high_water = lag;
+		reader->first = cursor;
+	}
+
+	/* extend the claimed window, it must stay contiguous */
+	while (n < max && cursor != head) {
+		idx = pin_buf(ring, cursor);
+		if (idx == NO_BUF) {
+			if (n)
+				break;
+			rtlsdr_atomic_add(&reader->dropped, 1);
+			reader->first = ++cursor;
+			continue;
+		}
+		reader->pins[n++] = idx;
+		cursor++;
+	}
+
+	reader->cursor = cursor;
+	reader->num_pins = n;
+	*first = reader->first;
+	return n;
+}
+
+unsigned char *sample_ring_slot(sample_ring_reader_t *reader, uint32_t seq, uint32_t *len)
+{
+	sample_ring_t *ring = reader->ring;
+	uint32_t idx = reader->pins[seq - reader->first];
+
+	*len = ring->bufs[idx].len;
+	return ring->bufs[idx].data;
+}
+
+const sample_ring_meta_t *sample_ring_meta(sample_ring_reader_t *reader, uint32_t seq)
+{
+	return &reader->ring->bufs[reader->pins[seq - reader->first]].meta;
+}
+
+void sample_ring_release(sample_ring_reader_t *reader, uint32_t end)
+{
+	uint32_t i, n = end - reader->first;
+
+	if (n > reader->num_pins)
+		n = reader->num_pins;
+
+	for (i = 0; i < n; i++)
+		unpin_buf(reader->ring, reader->pins[i]);
+	for (i = n; i < reader->num_pins; i++)
+		reader->pins[i - n] = reader->pins[i];
+
+	reader->num_pins -= n;
+	reader->first += n;
+	reader->sent += n;
+}
+
+int sample_ring_wait(sample_ring_reader_t *reader, int timeout_ms)
+{
+	sample_ring_t *ring = reader->ring;
+	struct timespec ts;
+	struct timeval tp;
+	int r = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	/* stays set until the next push, other readers may still sleep */
+	rtlsdr_atomic_xchg(&ring->waiting, 1);
+	if (rtlsdr_atomic_load(&ring->head) == reader->cursor) {
+		gettimeofday(&tp, NULL);
+		ts.tv_sec  = tp.tv_sec + timeout_ms / 1000;
+		ts.tv_nsec = tp.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		r = pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+		if (r == ETIMEDOUT && rtlsdr_atomic_load(&ring->head) != reader->cursor)
+			r = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return (r == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+
+void sample_ring_set_notify(sample_ring_t *ring, sample_ring_notify_cb cb, void *ctx)
+{
+	ring->notify = cb;
+	ring->notify_ctx = ctx;
+}
+
+void sample_ring_set_release(sample_ring_t *ring, sample_ring_release_cb cb, void *ctx)
+{
+	ring->release = cb;
+	ring->release_ctx = ctx;
+}
+
+int sample_ring_arm(sample_ring_reader_t *reader)
+{
+	sample_ring_t *ring = reader->ring;
+
+	rtlsdr_atomic_xchg(&ring->waiting, 1);
+	return rtlsdr_atomic_load(&ring->head) != reader->cursor;
+}
+
+void sample_ring_wakeup(sample_ring_t *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+uint32_t sample_ring_head(sample_ring_t *ring)
+{
+	return rtlsdr_atomic_load(&ring->head);
+}
+
+void sample_ring_get_stats(sample_ring_t *ring, sample_ring_stats_t *stats)
+{
+	uint32_t i;
+
+	stats->num_slots = ring->num_slots;
+	stats->readers = 0;
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < ring->max_readers; i++)
+		if (ring->readers[i].in_use)
+			stats->readers++;
+	pthread_mutex_unlock(&ring->lock);
+	stats->pushed = rtlsdr_atomic_load(&ring->head);
+	stats->dropped = rtlsdr_atomic_load(&ring->dropped);
+}
+
+void sample_ring_get_reader_stats(sample_ring_reader_t *reader,
+				  sample_ring_reader_stats_t *stats)
+{
+	sample_ring_t *ring = reader->ring;
+
+	stats->queued = rtlsdr_atomic_load(&ring->head) - reader->first;
+	if (stats->queued > ring->num_slots)
+		stats->queued = ring->num_slots;
+	stats->high_water = reader->high_water;
+	stats->dropped = reader->dropped;
+	stats->sent = reader->sent;
+}
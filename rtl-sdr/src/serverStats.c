@@ -0,0 +1,228 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <sys/resource.h>
+#else
+#include <windows.h>
+#endif
+
+#include "rtl_tcp.h"
+#include "rtlsdr_atomic.h"
+#include "serverStats.h"
+
+typedef struct
+{
+	volatile uint64_t count;
+	volatile uint64_t sum;
+	volatile uint32_t buckets[STATS_BUCKETS];
+}
+stats_hist_t;
+
+static volatile uint64_t values[STATS_NUM];
+static stats_hist_t hists[STATS_HIST_NUM];
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} value_info[STATS_NUM] = {
+	{ "rtl_tcp_usb_transfers_total", "counter", "USB transfers received from the dongle" },
+	{ "rtl_tcp_usb_bytes_total", "counter", "Sample bytes received from the dongle" },
+	{ "rtl_tcp_usb_errors_total", "counter", "Failed USB transfers" },
+	{ "rtl_tcp_ring_dropped_total", "counter", "Buffers lost because all ring buffers were in use" },
+	{ "rtl_tcp_client_dropped_total", "counter", "Buffers skipped by clients lagging behind" },
+	{ "rtl_tcp_tx_bytes_total", "counter", "Bytes sent to sample clients" },
+	{ "rtl_tcp_tx_calls_total", "counter", "Send system calls to sample clients" },
+	{ "rtl_tcp_tx_blocked_total", "counter", "Sends which found the socket buffer full" },
+	{ "rtl_tcp_clients_accepted_total", "counter", "Sample clients accepted" },
+	{ "rtl_tcp_clients", "gauge", "Connected sample clients" },
+	{ "rtl_tcp_queue_depth", "gauge", "Buffers queued for the slowest client" },
+	{ "rtl_tcp_queue_high_water", "gauge", "Maximum queue depth of the connected clients" },
+	{ "rtl_tcp_sample_rate", "gauge", "Sample rate of the dongle in Hz" },
+	{ "rtl_tcp_cpu_microseconds_total", "counter", "CPU time of the server process, user and system" },
+	{ "rtl_tcp_batch_acks_lost_total", "counter", "SET_BATCH acknowledgements dropped, queue full or response client lagging" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} hist_info[STATS_HIST_NUM] = {
+	{ "rtl_tcp_usb_interval_seconds", "Time between completed USB transfers" },
+	{ "rtl_tcp_send_latency_seconds", "Age of the samples when handed to the socket" },
+	{ "rtl_tcp_control_tune_latency_seconds", "Retune and gain commands from submission to completion" },
+	{ "rtl_tcp_control_telemetry_latency_seconds", "Duration of a register sampling, settling included" },
+};
+
+void stats_add(int value, uint64_t n)
+{
+	rtlsdr_atomic_add64(&values[value], n);
+}
+
+void stats_set(int value, uint64_t v)
+{
+	rtlsdr_atomic_store64(&values[value], v);
+}
+
+void stats_observe(int hist, uint64_t us)
+{
+	stats_hist_t *h = &hists[hist];
+	int k;
+
+	for (k = 0; k < STATS_BUCKETS - 1; k++)
+		if (us <= (uint64_t)STATS_BUCKET_US << k)
+			break;
+	/* count first, so a reader taking the buckets first never sees more */
+	rtlsdr_atomic_add64(&h->count, 1);
+	rtlsdr_atomic_add64(&h->sum, us);
+	rtlsdr_atomic_add(&h->buckets[k], 1);
+}
+
+uint64_t stats_time_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+uint64_t stats_cpu_us(void)
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0;
+	/* 100 ns units */
+	return ((((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+		(((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 10;
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+	return p + 4;
+}
+
+static unsigned char *put64(unsigned char *p, uint64_t v)
+{
+	p = put32(p, (uint32_t)(v >> 32));
+	return put32(p, (uint32_t)v);
+}
+
+int stats_frame(unsigned char *buf)
+{
+	unsigned char *p = buf;
+	int i, k;
+
+	*p++ = REPORT_STATS;
+	*p++ = ((STATS_FRAME_LEN - 3) >> 8) & 0xff;
+	*p++ = (STATS_FRAME_LEN - 3) & 0xff;
+	*p++ = STATS_NUM;
+	*p++ = STATS_HIST_NUM;
+	*p++ = STATS_BUCKETS;
+	*p++ = 0;
+	for (i = 0; i < STATS_NUM; i++)
+		p = put64(p, rtlsdr_atomic_load64(&values[i]));
+	for (i = 0; i < STATS_HIST_NUM; i++) {
+		p = put64(p, rtlsdr_atomic_load64(&hists[i].count));
+		p = put64(p, rtlsdr_atomic_load64(&hists[i].sum));
+		for (k = 0; k < STATS_BUCKETS; k++)
+			p = put32(p, rtlsdr_atomic_load(&hists[i].buckets[k]));
+	}
+	return (int)(p - buf);
+}
+
+/*
+ * snprintf appending at *pos; once buf is full only *pos grows, to the
+ * length the whole text needs
+ */
+static void append(char *buf, int len, int *pos, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	if (*pos < len)
+		r = vsnprintf(buf + *pos, len - *pos, fmt, ap);
+	else
+		r = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (r > 0)
+		*pos += r;
+}
+
+int stats_prometheus(char *buf, int len)
+{
+	unsigned long long cum;
+	int i, k, pos = 0;
+
+	if (len > 0)
+		buf[0] = 0;
+
+	for (i = 0; i < STATS_NUM; i++) {
+		append(buf, len, &pos, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+				value_info[i].name, value_info[i].help,
+				value_info[i].name, value_info[i].type, value_info[i].name,
+				(unsigned long long)rtlsdr_atomic_load64(&values[i]));
+	}
+
+	for (i = 0; i < STATS_HIST_NUM; i++) {
+		append(buf, len, &pos, "# HELP %s %s\n# TYPE %s histogram\n",
+				hist_info[i].name, hist_info[i].help, hist_info[i].name);
+		cum = 0;
+		for (k = 0; k < STATS_BUCKETS - 1; k++) {
+			cum += rtlsdr_atomic_load(&hists[i].buckets[k]);
+			append(buf, len, &pos, "%s_bucket{le=\"%g\"} %llu\n", hist_info[i].name,
+					(double)((uint64_t)STATS_BUCKET_US << k) / 1e6, cum);
+		}
+		/* +Inf is the count, read after the buckets */
+		append(buf, len, &pos, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+				hist_info[i].name,
+				(unsigned long long)rtlsdr_atomic_load64(&hists[i].count),
+				hist_info[i].name,
+				(double)rtlsdr_atomic_load64(&hists[i].sum) / 1e6,
+				hist_info[i].name,
+				(unsigned long long)rtlsdr_atomic_load64(&hists[i].count));
+	}
+
+	return pos;
+}
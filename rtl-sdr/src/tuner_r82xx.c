@@ -24,6 +24,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -43,6 +44,12 @@
 
 #define MHZ(x)		((x)*1000*1000)
 
+/* IMR calibration */
+#define IMR_RANGE			9		/* gain and phase codes -9 .. 9 */
+#define IMR_SETTLE_US		6000	/* detector settling after a large change */
+#define IMR_SETTLE_STEP_US	1000
+#define IMR_MAX_READS		4
+
 
 /*
 Reg		Bitmap	Symbol			Description
@@ -562,10 +569,8 @@ int16_t interpolation(int16_t freq, int size, const int16_t *freqs, const int16_
 /*
  * r82xx tuning logic
  */
-static int r82xx_set_mux(struct r82xx_priv *priv, uint32_t freq)
+static const struct r82xx_freq_range *r82xx_get_range(uint32_t freq)
 {
-	const struct r82xx_freq_range *range;
-	int rc;
 	unsigned int i;
 
 	/* Get the proper frequency range */
@@ -574,7 +579,16 @@ static int r82xx_set_mux(struct r82xx_priv *priv, uint32_t freq)
 		if (freq < freq_ranges[i + 1].freq)
 			break;
 	}
-	range = &freq_ranges[i];
+	return &freq_ranges[i];
+}
+
+static int r82xx_set_mux(struct r82xx_priv *priv, uint32_t freq)
+{
+	const struct r82xx_freq_range *range;
+	int rc;
+
+	range = r82xx_get_range(freq);
+	freq = freq / 1000000;
 
 	/* Open Drain */
 	rc = r82xx_write_reg_mask(priv, 0x17, range->open_d, 0x08);
@@ -594,18 +608,18 @@ static int r82xx_set_mux(struct r82xx_priv *priv, uint32_t freq)
 	return rc;
 }
 
-static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
+/*
+ * Reference divider, mixer divider, N (reg 0x14) and SDM of the PLL for
+ * freq, as written by r82xx_set_pll().
+ */
+static int r82xx_calc_pll(struct r82xx_priv *priv, uint32_t freq, uint8_t *refdiv2,
+		uint8_t *div_num, uint8_t *nisi, uint32_t *sdm)
 {
-	int rc, i;
 	uint64_t vco_freq;
 	uint64_t vco_div;
 	uint32_t vco_min = 1770000000;
 	uint32_t pll_ref;
-	uint32_t sdm;
-	uint8_t div_num;
-	uint8_t refdiv2 = 0;
-	uint8_t ni, si, nint, val;
-	uint8_t data[3];
+	uint8_t ni, si, nint;
 
 	if ((freq < 25000000) || (freq > 1900000000)){
 		fprintf(stderr, "[R82XX] No valid PLL values for %u Hz!\n", freq);
@@ -613,35 +627,19 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 	}
 
 	pll_ref = priv->cfg->xtal;
+	*refdiv2 = 0;
 
 	if (priv->cfg->xtal > 24000000) {
 		pll_ref /= 2;
-		refdiv2 = 0x10;
+		*refdiv2 = 0x10;
 	}
-	rc = r82xx_write_reg_mask(priv, 0x10, refdiv2, 0x10);
-	if (rc < 0)
-		return rc;
-
-	/* set pll autotune = 128kHz */
-	rc = r82xx_write_reg_mask(priv, 0x1a, 0x00, 0x0c);
-	if (rc < 0)
-		return rc;
-
-	/* set VCO current = 100 */
-	rc = r82xx_write_reg_mask(priv, 0x12, 0x80, 0xe0);
-	if (rc < 0)
-		return rc;
 
 	/* Calculate divider */
-	for (div_num = 0; div_num < 5; div_num++)
-		if ((freq << (div_num + 1)) >= vco_min)
+	for (*div_num = 0; *div_num < 5; (*div_num)++)
+		if ((freq << (*div_num + 1)) >= vco_min)
 			break;
 
-	rc = r82xx_write_reg_mask(priv, 0x10, div_num << 5, 0xe0);
-	if (rc < 0)
-		return rc;
-
-	vco_freq = (uint64_t)freq << (div_num + 1);
+	vco_freq = (uint64_t)freq << (*div_num + 1);
 
 	/*
 	 * We want to approximate:
@@ -662,21 +660,54 @@ static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
 
 	vco_div = (pll_ref + 65536 * vco_freq) / (2 * pll_ref);
     nint = vco_div / 65536;
-	sdm = vco_div % 65536;
+	*sdm = vco_div % 65536;
     //printf("nint = %d, sdm = %d\n", nint, sdm);
 
 #if 0
 	{
-	  uint8_t mix_div = 1 << (div_num + 1);
-	  uint64_t actual_vco = (uint64_t)2 * pll_ref * nint + (uint64_t)2 * pll_ref * sdm / 65536;
+	  uint8_t mix_div = 1 << (*div_num + 1);
+	  uint64_t actual_vco = (uint64_t)2 * pll_ref * nint + (uint64_t)2 * pll_ref * *sdm / 65536;
 	  fprintf(stderr, "[R82XX] requested %uHz; selected mix_div=%u vco_freq=%llu nint=%u sdm=%u; actual_vco=%llu; tuning error=%+dHz\n",
-		  freq, mix_div, vco_freq, nint, sdm, actual_vco, (int32_t) (actual_vco - vco_freq) / mix_div);
+		  freq, mix_div, vco_freq, nint, *sdm, actual_vco, (int32_t) (actual_vco - vco_freq) / mix_div);
 	}
 #endif
 
 	ni = (nint - 13) / 4;
 	si = nint - 4 * ni - 13;
-	rc = r82xx_write_reg(priv, 0x14, ni + (si << 6));
+	*nisi = ni + (si << 6);
+	return 0;
+}
+
+static int r82xx_set_pll(struct r82xx_priv *priv, uint32_t freq)
+{
+	int rc, i;
+	uint32_t sdm;
+	uint8_t div_num, refdiv2, nisi, val;
+	uint8_t data[3];
+
+	rc = r82xx_calc_pll(priv, freq, &refdiv2, &div_num, &nisi, &sdm);
+	if (rc < 0)
+		return rc;
+
+	rc = r82xx_write_reg_mask(priv, 0x10, refdiv2, 0x10);
+	if (rc < 0)
+		return rc;
+
+	/* set pll autotune = 128kHz */
+	rc = r82xx_write_reg_mask(priv, 0x1a, 0x00, 0x0c);
+	if (rc < 0)
+		return rc;
+
+	/* set VCO current = 100 */
+	rc = r82xx_write_reg_mask(priv, 0x12, 0x80, 0xe0);
+	if (rc < 0)
+		return rc;
+
+	rc = r82xx_write_reg_mask(priv, 0x10, div_num << 5, 0xe0);
+	if (rc < 0)
+		return rc;
+
+	rc = r82xx_write_reg(priv, 0x14, nisi);
 	if (rc < 0)
 		return rc;
 
@@ -876,10 +907,14 @@ static int r82xx_get_signal_strength(struct r82xx_priv *priv, unsigned char* dat
 	int if_gain = 0;
 	uint8_t mixer_gain = (data[3] >> 4) & 0x0f;
 
-	/* set IMR_G */
+	/* set IMR_G and IMR_P */
 	if(priv->imr_done && (mixer_gain != priv->old_gain))
 	{
-		rc = r82xx_write_reg_mask(priv, 0x08, priv->reg8[mixer_gain], 0x3f);
+		uint8_t imr[2];
+
+		imr[0] = (r82xx_read_cache_reg(priv, 0x08) & ~0x3f) | priv->reg8[mixer_gain];
+		imr[1] = (r82xx_read_cache_reg(priv, 0x09) & ~0x3f) | priv->reg9[mixer_gain];
+		rc = r82xx_write(priv, 0x08, imr, 2);
 		if(rc < 0)
 			return rc;
 		priv->old_gain = mixer_gain;
@@ -908,7 +943,7 @@ static int r82xx_get_signal_strength(struct r82xx_priv *priv, unsigned char* dat
 	//switch detektor 3 from mixer to output
 	if(priv->get_signal_strength)
 	{
-		int output, input;
+		int output, input, busy, read_rc;
 		// Mixer gain mode = manual mode
 		rc = r82xx_write_reg_mask(priv, 0x07, mixer_gain, 0x1f);
 		if(rc < 0)
@@ -917,18 +952,22 @@ static int r82xx_get_signal_strength(struct r82xx_priv *priv, unsigned char* dat
 		rc = r82xx_write_reg_mask(priv, 0x1e, 0x80, 0x80);
 		if(rc < 0)
 			return rc;
-		usleep(10000);
-		rc = r82xx_read(priv, data, 2);
-		if (rc < 0)
-			return rc;
+		/* settle with the bus released, retunes and gain changes go first */
+		busy = rtlsdr_i2c_yield(priv->rtl_dev, 10000);
+		read_rc = r82xx_read(priv, data, 2);
 		//sw_pdect = det3
 		rc = r82xx_write_reg_mask(priv, 0x1e, 0, 0x80);
 		if(rc < 0)
 			return rc;
-		// Mixer gain mode = auto mode
+		// Mixer gain mode = auto mode, no control operation restores it
 		rc = r82xx_write_reg_mask(priv, 0x07, 0x10, 0x10);
 		if(rc < 0)
 			return rc;
+		if (read_rc < 0)
+			return read_rc;
+		/* a control operation changed the tuner meanwhile, the level is stale */
+		if (busy)
+			return tuner_gain;
 		output = 1260 - adc[data[1] & 0x3f];
 		input = (output - tuner_gain + 5) / 10;
 		if(priv->old_input != input)
@@ -1035,6 +1074,106 @@ err:
 	return rc;
 }
 
+/*
+ * r82xx fast hop logic: r82xx_prepare_hop() does the arithmetic of
+ * r82xx_set_freq() once, r82xx_hop() then writes the changed part of
+ * registers 0x10-0x1b with one I2C transfer and checks the lock once.
+ */
+static void hop_set(struct r82xx_hop *hop, uint8_t reg, uint8_t val, uint8_t mask)
+{
+	reg -= R82XX_HOP_FIRST;
+	hop->val[reg] = (hop->val[reg] & ~mask) | (val & mask);
+	hop->mask[reg] |= mask;
+}
+
+int r82xx_prepare_hop(struct r82xx_priv *priv, struct r82xx_hop *hop, uint32_t freq)
+{
+	const struct r82xx_freq_range *range;
+	uint32_t lo_freq, sdm;
+	uint8_t div_num, refdiv2, nisi;
+	int rc;
+
+	memset(hop, 0, sizeof(*hop));
+	hop->freq = freq;
+	hop->xtal = priv->cfg->xtal;
+	hop->int_freq = priv->int_freq;
+	hop->sideband = priv->sideband;
+
+	/* r82xx_set_mux() */
+	range = r82xx_get_range(freq);
+	hop_set(hop, 0x17, range->open_d, 0x08);
+	hop_set(hop, 0x1a, range->rf_mux_ploy, 0xc3);
+	hop_set(hop, 0x1b, range->tf_c, 0xff);
+	hop->abs_gain = interpolation(freq / 1000000, ARRAY_SIZE(abs_gains), abs_freqs, abs_gains);
+	hop->input = (freq > MHZ(345)) ? 0x00 : 0x60;
+
+	/* r82xx_set_pll() up to the lock check */
+	if (priv->sideband)
+		lo_freq = freq - priv->int_freq;
+	else
+		lo_freq = freq + priv->int_freq;
+	rc = r82xx_calc_pll(priv, lo_freq, &refdiv2, &div_num, &nisi, &sdm);
+	if (rc < 0)
+		return rc;
+
+	hop_set(hop, 0x10, refdiv2 | (div_num << 5), 0xf0);
+	hop_set(hop, 0x1a, 0x00, 0x0c);	/* pll autotune = 128kHz */
+	hop_set(hop, 0x12, 0x80 | (sdm ? 0x00 : 0x08), 0xe8);	/* VCO current, pw_sdm */
+	hop_set(hop, 0x14, nisi, 0xff);
+	hop_set(hop, 0x15, sdm & 0xff, 0xff);
+	hop_set(hop, 0x16, sdm >> 8, 0xff);
+	return 0;
+}
+
+int r82xx_hop(struct r82xx_priv *priv, const struct r82xx_hop *hop)
+{
+	uint8_t buf[R82XX_HOP_LEN];
+	uint8_t data[3];
+	int rc, i, first = -1, last = -1;
+	uint8_t *regs = &priv->regs[R82XX_HOP_FIRST - REG_SHADOW_START];
+
+	/* prepared for other settings: take the long way */
+	if (hop->xtal != priv->cfg->xtal || hop->int_freq != priv->int_freq ||
+			hop->sideband != priv->sideband)
+		return r82xx_set_freq(priv, hop->freq);
+
+	priv->freq = hop->freq / 1000000;
+	if ((priv->cfg->rafael_chip == CHIP_R828D) && (hop->input != priv->input)) {
+		priv->input = hop->input;
+		rc = r82xx_write_reg_mask(priv, 0x05, hop->input, 0x60);
+		if (rc < 0)
+			return rc;
+	}
+
+	for (i = 0; i < R82XX_HOP_LEN; i++) {
+		buf[i] = (regs[i] & ~hop->mask[i]) | hop->val[i];
+		if (buf[i] != regs[i]) {
+			if (first < 0)
+				first = i;
+			last = i;
+		}
+	}
+	if (first >= 0) {
+		rc = r82xx_write(priv, R82XX_HOP_FIRST + first, &buf[first], last - first + 1);
+		if (rc < 0)
+			return rc;
+	}
+	priv->abs_gain = hop->abs_gain;
+
+	rc = r82xx_read(priv, data, 3);
+	if (rc < 0)
+		return rc;
+	if (!(data[2] & 0x40))
+		/* retry with the VCO current step of r82xx_set_pll() */
+		return r82xx_set_pll(priv, hop->sideband ? hop->freq - hop->int_freq :
+				hop->freq + hop->int_freq);
+
+	priv->has_lock = 1;
+
+	/* set pll autotune = 8kHz */
+	return r82xx_write_reg_mask(priv, 0x1a, 0x08, 0x08);
+}
+
 /*
  * r82xx standby logic
  */
@@ -1082,13 +1221,8 @@ int r82xx_standby(struct r82xx_priv *priv)
 	return rc;
 }
 
-static int r82xx_multi_read(struct r82xx_priv *priv)
+static void r82xx_sleep_us(int us)
 {
-	int rc, i;
-	uint8_t data[2];
-	//uint8_t buf[4];
-	int sum = 0;
-
 #ifdef _WIN32
 	LARGE_INTEGER StartingTime, EndingTime;
 	LARGE_INTEGER Frequency;
@@ -1096,7 +1230,7 @@ static int r82xx_multi_read(struct r82xx_priv *priv)
 
 	QueryPerformanceCounter(&StartingTime);
 	QueryPerformanceFrequency(&Frequency);
-	while(Microseconds < 6000)
+	while(Microseconds < us)
 	{
 		Sleep(0);
 		QueryPerformanceCounter(&EndingTime);
@@ -1104,47 +1238,146 @@ static int r82xx_multi_read(struct r82xx_priv *priv)
 		Microseconds *= 1000000;
 		Microseconds /= Frequency.QuadPart;
 	};
-	//printf("Microseconds %d\n",(int)Microseconds);
 #else
-	usleep(6000);
+	usleep(us);
 #endif
-	for (i = 0; i < 2; i++) {
+}
+
+/* image detector level, twice: read again while the two readings differ */
+static int r82xx_multi_read(struct r82xx_priv *priv, int settle_us)
+{
+	int rc, i;
+	uint8_t data[2];
+	int level[2] = { 0, 0 };
+
+	r82xx_sleep_us(settle_us);
+	for (i = 0; i < IMR_MAX_READS; i++) {
+		if (i >= 2)
+			r82xx_sleep_us(IMR_SETTLE_STEP_US);
 		rc = r82xx_read(priv, data, sizeof(data));
 		if (rc < 0)
 			return rc;
-		data[1] &= 0x3f;
-		sum += data[1];
-		//buf[i] = data[1];
+		level[0] = level[1];
+		level[1] = data[1] & 0x3f;
+		if (i >= 1 && abs(level[1] - level[0]) <= 1)
+			break;
 	}
-	//printf("data[1] = %02x %02x\n", buf[0],buf[1]);
-	return sum;
+	return level[0] + level[1];
+}
+
+/*
+ * IMR search: the image level over the signed IMR gain (reg 0x08) and
+ * phase (reg 0x09) codes has a single minimum. It is bracketed by golden
+ * section searches along gain and then phase, and refined by steps to the
+ * neighbours. Levels are remembered, so no setting is probed twice.
+ */
+typedef int imr_grid_t[2 * IMR_RANGE + 1][2 * IMR_RANGE + 1];
+
+/* register bits of a signed code: [5] selects I or Q, [4:0] the amount */
+static uint8_t imr_bits(int v)
+{
+	return v < 0 ? (0x20 | -v) : v;
 }
 
-static int test_imrg(struct r82xx_priv *priv, int start, int end, int *min)
+static int imr_level(struct r82xx_priv *priv, imr_grid_t grid, int *cur, int a, int p)
 {
-	int i, rc;
-	int reg8 = 0;
+	int *level = &grid[a + IMR_RANGE][p + IMR_RANGE];
+	uint8_t buf[2];
+	int rc, step;
 
-	for(i=start; i<end; i++)
-	{
-		rc = r82xx_write_reg_mask(priv, 0x08, i, 0x3f);
-		if (rc < 0)
-			return rc;
-		rc = r82xx_multi_read(priv);
+	if (*level >= 0)
+		return *level;
+
+	/* both codes with one write, the detector settles faster after small steps */
+	buf[0] = (r82xx_read_cache_reg(priv, 0x08) & ~0x3f) | imr_bits(a);
+	buf[1] = (r82xx_read_cache_reg(priv, 0x09) & ~0x3f) | imr_bits(p);
+	rc = r82xx_write(priv, 0x08, buf, 2);
+	if (rc < 0)
+		return rc;
+
+	step = abs(a - cur[0]) + abs(p - cur[1]);
+	cur[0] = a;
+	cur[1] = p;
+	priv->imr_probes++;
+	rc = r82xx_multi_read(priv, step > 2 ? IMR_SETTLE_US : IMR_SETTLE_STEP_US * (step + 1));
+	if (rc >= 0)
+		*level = rc;
+	return rc;
+}
+
+/*
+ * Golden section search along gain (axis 0) or phase (axis 1), in its
+ * integer form: with Fibonacci spaced points one of the two inner points
+ * is reused in every step. Codes outside the range count as worst.
+ */
+static int imr_line(struct r82xx_priv *priv, imr_grid_t grid, int *cur, int *ap, int axis)
+{
+	static const int fib[] = { 1, 1, 2, 3, 5, 8, 13, 21 };
+	int n = ARRAY_SIZE(fib) - 1;
+	int lo = -(fib[n] / 2);
+	int x[2], f[2], i, best = -1, rc;
+
+	x[0] = ap[0];
+	x[1] = ap[1];
+	for (; fib[n] > 2; n--) {
+		for (i = 0; i < 2; i++) {
+			x[axis] = lo + fib[n - 2 + i];
+			if (x[axis] > IMR_RANGE)
+				f[i] = 0x7fff;
+			else
+				f[i] = imr_level(priv, grid, cur, x[0], x[1]);
+			if (f[i] < 0)
+				return f[i];
+		}
+		if (f[0] > f[1])
+			lo += fib[n - 2];
+	}
+	for (i = lo; i <= lo + fib[n]; i++) {
+		if (i < -IMR_RANGE || i > IMR_RANGE)
+			continue;
+		x[axis] = i;
+		rc = imr_level(priv, grid, cur, x[0], x[1]);
 		if (rc < 0)
 			return rc;
-		if (rc < *min)
-		{
-			*min = rc;
-			reg8 = i;
-			//printf("Reg8=%02x, sum=%d\n", reg8, rc);
+		if (best < 0 || rc < best) {
+			best = rc;
+			ap[axis] = i;
 		}
-		else
-			break;
 	}
-	return reg8;
+	return best;
 }
 
+/* move to the best neighbour while that improves the level */
+static int imr_refine(struct r82xx_priv *priv, imr_grid_t grid, int *cur, int *ap)
+{
+	static const int step[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+	int best, rc, k, a, p, moved = 1;
+
+	best = imr_level(priv, grid, cur, ap[0], ap[1]);
+	while (best >= 0 && moved) {
+		moved = 0;
+		for (k = 0; k < 4; k++) {
+			a = ap[0] + step[k][0];
+			p = ap[1] + step[k][1];
+			if (a < -IMR_RANGE || a > IMR_RANGE || p < -IMR_RANGE || p > IMR_RANGE)
+				continue;
+			rc = imr_level(priv, grid, cur, a, p);
+			if (rc < 0)
+				return rc;
+			if (rc < best) {
+				best = rc;
+				ap[0] = a;
+				ap[1] = p;
+				moved = 1;
+			}
+		}
+	}
+	return best;
+}
+
+/* mixer gains calibrated, the higher codes take the values of the last */
+#define IMR_GAINS	13
+
 static int r82xx_imr(struct r82xx_priv *priv, uint8_t range)
 {
 	uint8_t ring_div[] =	{  48,  32,  24,  16,  12,   8,   6,   4};
@@ -1154,12 +1387,13 @@ static int r82xx_imr(struct r82xx_priv *priv, uint8_t range)
 							//0  0 -3 -5 -5 -8 -8 -3 -5 -5 -8 -8 -8 dB
 	uint8_t ring_att[] =	{ 1, 1, 3, 0, 0, 2, 2, 3, 0, 0, 2, 2, 2 };
 	uint8_t n_ring = 15;
-	int rc, i, min;
+	int rc, i, min, base;
 	uint32_t ring_freq, ring_ref;
-	uint8_t vga;
+	uint8_t vga = 15;
 	uint8_t gain;
+	int ap[2] = { 0, 0 }, cur[2] = { 0, 0 };
+	imr_grid_t grid;
 
-	printf("IMR_G =");
 	if (priv->cfg->xtal > 24000000)
 		ring_ref = priv->cfg->xtal / 2000;
 	else
@@ -1191,7 +1425,9 @@ static int r82xx_imr(struct r82xx_priv *priv, uint8_t range)
 		return rc;
 	//printf("Freq=%dkHz\n", ring_freq - priv->int_freq / 500);
 
-	for(gain=0; gain < 13; gain++)
+	priv->imr_probes = 0;
+	printf("IMR:");
+	for (gain = 0; gain < IMR_GAINS; gain++)
 	{
 		rc = r82xx_write_reg_mask(priv, 0x07, gain, 0x0f);
 		if (rc < 0)
@@ -1211,46 +1447,65 @@ static int r82xx_imr(struct r82xx_priv *priv, uint8_t range)
 			return rc;
 
 		rc = r82xx_write_reg_mask(priv, 0x08, 0, 0x3f);
+		if (rc < 0)
+			goto err;
+		rc = r82xx_write_reg_mask(priv, 0x09, 0, 0x3f);
 		if (rc < 0)
 			goto err;
 
-		/* decrease vga power to let image significant */
-		for(vga=15; vga>0; vga--)
+		/* decrease vga power to let image significant, from the
+		 * setting of the lower mixer gain before, but measure at
+		 * least once when that one ran down to 0 */
+		if (!vga)
+			vga = 1;
+		for(; vga>0; vga--)
 		{
 			rc = r82xx_write_reg_mask(priv, 0x0c, vga, 0x0f);
 			if (rc < 0)
 				goto err;
-			rc = r82xx_multi_read(priv);
+			priv->imr_probes++;
+			rc = r82xx_multi_read(priv, IMR_SETTLE_US);
 			if (rc < 0)
 				goto err;
 			if (rc < 80)
 				break;
 		}
-		min = rc;
+		base = rc;
 		//printf("Mixer=%d, VGA=%d\n", gain, vga);
 
-		rc = test_imrg(priv, 0x02, 0x0a, &min);
-		if(rc==0)
-			rc = test_imrg(priv, 0x22, 0x2a, &min);
-		if(rc==0)
-			rc = test_imrg(priv, 0x01, 0x02, &min);
-		if(rc==0)
-			rc = test_imrg(priv, 0x21, 0x22, &min);
-		if (rc < 0)
+		memset(grid, 0xff, sizeof(grid));
+		grid[IMR_RANGE][IMR_RANGE] = base;
+		cur[0] = cur[1] = 0;
+		if (gain == 0) {
+			rc = imr_line(priv, grid, cur, ap, 0);
+			if (rc >= 0)
+				rc = imr_line(priv, grid, cur, ap, 1);
+			if (rc < 0)
+				goto err;
+		}
+		/*
+		 * the optimum moves little from one mixer gain to the next,
+		 * so the previous one is the start of the steps
+		 */
+		min = imr_refine(priv, grid, cur, ap);
+		if (min < 0) {
+			rc = min;
 			goto err;
-		priv->reg8[gain] = rc;
-		printf(" %02X", rc);
+		}
+		priv->reg8[gain] = imr_bits(ap[0]);
+		priv->reg9[gain] = imr_bits(ap[1]);
+		printf(" %d/%d %d->%d", ap[0], ap[1], base, min);
 	}
-	printf("\n");
-	/*printf("IMR_G = %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n",
-		priv->reg8[0],priv->reg8[1],priv->reg8[2],priv->reg8[3],priv->reg8[4],priv->reg8[5],
-		priv->reg8[6],priv->reg8[7],priv->reg8[8],priv->reg8[9],priv->reg8[10],priv->reg8[11],priv->reg8[12]);*/
+	printf(", %d probes\n", priv->imr_probes);
 
-	for(gain = 13; gain < 16; gain++)
-		priv->reg8[gain] = priv->reg8[12];
+	for (gain = IMR_GAINS; gain < 16; gain++) {
+		priv->reg8[gain] = priv->reg8[IMR_GAINS - 1];
+		priv->reg9[gain] = priv->reg9[IMR_GAINS - 1];
+	}
 	return 0;
 
 err:
+	printf("\n");
 	if (rc < 0)
 		fprintf(stderr, "%s: failed=%d\n", __FUNCTION__, rc);
 	return rc;
@@ -1297,7 +1552,7 @@ static int r82xx_imr_callibrate(struct r82xx_priv *priv)
 	gettimeofday(&tv, NULL);
 	StartTime = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;*/
 	for(i = 0; i < 16; i++)
-		priv->reg8[i] = 0;
+		priv->reg8[i] = priv->reg9[i] = 0;
 
 	/* Initialize registers */
 	rc = r82xx_write(priv, 0x05, r82xx_calib_array, sizeof(r82xx_calib_array));
@@ -1323,6 +1578,33 @@ err:
 	return rc;
 }
 
+/* calibrate again and restore the registers, the caller retunes */
+int r82xx_calibrate_imr(struct r82xx_priv *priv)
+{
+	uint8_t regs[sizeof(r82xx_init_array)];
+	uint8_t reg8[sizeof(priv->reg8)];
+	uint8_t reg9[sizeof(priv->reg9)];
+	uint32_t int_freq = priv->int_freq;
+	int rc, imr_done = priv->imr_done;
+
+	memcpy(regs, priv->regs, sizeof(regs));
+	memcpy(reg8, priv->reg8, sizeof(reg8));
+	memcpy(reg9, priv->reg9, sizeof(reg9));
+
+	rc = r82xx_imr_callibrate(priv);
+	if (rc < 0) {
+		memcpy(priv->reg8, reg8, sizeof(reg8));
+		memcpy(priv->reg9, reg9, sizeof(reg9));
+		priv->imr_done = imr_done;
+	}
+
+	priv->int_freq = int_freq;
+	priv->old_gain = 255;
+	if (r82xx_write(priv, 0x05, regs, sizeof(regs)) < 0 && rc >= 0)
+		rc = -1;
+	return rc;
+}
+
 /*
  * r82xx device init logic
  */
@@ -1330,7 +1612,8 @@ int r82xx_init(struct r82xx_priv *priv)
 {
 	int rc;
 
- 	if(priv->cfg->cal_imr)
+	/* reg8[] may come from a previous init or the caller's cache */
+ 	if(priv->cfg->cal_imr && !priv->imr_done)
  		if ((rc = r82xx_imr_callibrate(priv)) < 0) goto err;
 
 	/* Initialize registers */